@@ -28,6 +28,11 @@ static const TCHAR* LOCAL_SETTINGS_APPDATA_FEEDBACK_CONFIG_FILENAME = _T("feedba
 static const TCHAR* LOCAL_SETTINGS_APPDATA_URL_PROXY_CONFIG_FILENAME = _T("url_proxy.config");
 static const TCHAR* LOCAL_SETTINGS_APPDATA_SERVER_LIST_FILENAME = _T("server_list.dat");
 static const TCHAR* LOCAL_SETTINGS_APPDATA_REMOTE_SERVER_LIST_FILENAME = _T("remote_server_list");
+static const TCHAR* LOCAL_SETTINGS_APPDATA_CONNECT_TIMING_FILENAME = _T("connect_timing.json");
+static const TCHAR* LOCAL_SETTINGS_APPDATA_STATS_SPOOL_FILENAME = _T("stats_spool.dat");
+static const TCHAR* LOCAL_SETTINGS_APPDATA_FEEDBACK_CHECKPOINT_FILENAME = _T("feedback_checkpoint.dat");
+static const TCHAR* LOCAL_SETTINGS_APPDATA_MESSAGE_HISTORY_FILENAME = _T("message_history.journal");
+static const TCHAR* LOCAL_SETTINGS_APPDATA_DIAGNOSTIC_HISTORY_FILENAME = _T("diagnostic_history.journal");
 static const TCHAR* LOCAL_SETTINGS_REGISTRY_KEY = _T("Software\\Psiphon3");
 static const char* LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS = "Servers";
 static const char* LOCAL_SETTINGS_REGISTRY_VALUE_LAST_CONNECTED = "LastConnected";
@@ -46,6 +51,11 @@ static const int SECONDS_BETWEEN_UNSUCCESSFUL_REMOTE_SERVER_LIST_FETCH = 60*5;
 static const int HTTPS_REQUEST_CONNECT_TIMEOUT_MS = 30000;
 static const int HTTPS_REQUEST_SEND_TIMEOUT_MS = 30000;
 static const int HTTPS_REQUEST_RECEIVE_TIMEOUT_MS = 30000;
+static const int HTTPS_SESSION_POOL_IDLE_TTL_MS = 20000;
 static const int TERMINATE_PROCESS_WAIT_MS = 5000;
 static const char* UNTUNNELED_WEB_REQUEST_CAPABILITY = "handshake";
 static const int TEMPORARY_TUNNEL_TIMEOUT_SECONDS = 20;
+static const int URL_PROXY_IDLE_TTL_MS = 60*1000;
+static const int FEEDBACK_UPLOAD_MAX_ATTEMPTS = 10;
+static const int FEEDBACK_UPLOAD_CHECKPOINT_TTL_SECONDS = 60*60*24*3;
+static const int HISTORY_JOURNAL_SEGMENT_BYTES = 256*1024;
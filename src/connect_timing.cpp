@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "config.h"
+#include "utilities.h"
+#include "connect_timing.h"
+
+
+// The persisted format version. Bump it if the bucketing changes, so that
+// incompatible histograms are discarded rather than misread.
+#define CONNECT_TIMING_FORMAT_VERSION       1
+
+// Number of completed attempts kept in the trace file.
+#define MAX_TRACED_ATTEMPTS                 20
+
+// Number of traced attempts included in diagnostics (which are size-sensitive).
+#define MAX_DIAGNOSTIC_ATTEMPTS             5
+
+// Histogram bucketing, in the style of HdrHistogram: values below
+// HISTOGRAM_LINEAR_BUCKETS milliseconds get a bucket each, and each power of
+// two above that is split into 2^HISTOGRAM_SUB_BUCKET_BITS linear sub-buckets.
+// That bounds the relative error of a reported percentile to 12.5% while
+// needing only 176 buckets to cover up to 2^24ms (~4.6 hours).
+#define HISTOGRAM_LINEAR_BUCKETS            16
+#define HISTOGRAM_LINEAR_BITS               4
+#define HISTOGRAM_SUB_BUCKET_BITS           3
+#define HISTOGRAM_SUB_BUCKETS               (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT              24
+#define HISTOGRAM_BUCKET_COUNT              (HISTOGRAM_LINEAR_BUCKETS + (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_LINEAR_BITS) * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_MAX_VALUE                 ((1ULL << HISTOGRAM_MAX_EXPONENT) - 1)
+
+
+static const char* PHASE_NAMES[CONNECT_PHASE_COUNT] =
+{
+    "serverSelection",
+    "writeParameterFiles",
+    "extractExecutable",
+    "spawnProcess",
+    "establishTunnel",
+    "handshake",
+    "vpnDial",
+    "applyProxySettings",
+    "postConnect",
+    "firstProxiedByte",
+    "connectTotal"
+};
+
+
+/******************************************************************************
+ Histogram
+******************************************************************************/
+
+static size_t BucketIndex(ULONGLONG valueMS)
+{
+    if (valueMS < HISTOGRAM_LINEAR_BUCKETS)
+    {
+        return (size_t)valueMS;
+    }
+
+    valueMS = min(valueMS, HISTOGRAM_MAX_VALUE);
+
+    int exponent = 0;
+    for (ULONGLONG v = valueMS; v > 1; v >>= 1)
+    {
+        exponent++;
+    }
+
+    size_t subBucket = (size_t)(valueMS >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return HISTOGRAM_LINEAR_BUCKETS + (exponent - HISTOGRAM_LINEAR_BITS) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+// Returns the largest value that falls in the bucket.
+static ULONGLONG BucketUpperBound(size_t index)
+{
+    if (index < HISTOGRAM_LINEAR_BUCKETS)
+    {
+        return index;
+    }
+
+    size_t offset = index - HISTOGRAM_LINEAR_BUCKETS;
+    int exponent = (int)(offset / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_LINEAR_BITS;
+    ULONGLONG subBucket = offset % HISTOGRAM_SUB_BUCKETS;
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + subBucket + 1) << shift) - 1;
+}
+
+struct PhaseHistogram
+{
+    PhaseHistogram() : buckets(HISTOGRAM_BUCKET_COUNT, 0), count(0), failures(0), sumMS(0), minMS(0), maxMS(0) {}
+
+    void Add(ULONGLONG valueMS)
+    {
+        buckets[BucketIndex(valueMS)]++;
+        minMS = (count == 0) ? valueMS : min(minMS, valueMS);
+        maxMS = max(maxMS, valueMS);
+        sumMS += valueMS;
+        count++;
+    }
+
+    // `percentile` is 1-100.
+    ULONGLONG Percentile(unsigned int percentile) const
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        // Rank of the sample we want, rounded up.
+        ULONGLONG target = (count * percentile + 99) / 100;
+        ULONGLONG cumulative = 0;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            cumulative += buckets[i];
+            if (cumulative >= target)
+            {
+                return min(BucketUpperBound(i), maxMS);
+            }
+        }
+
+        return maxMS;
+    }
+
+    // Buckets are stored sparsely, as most are empty.
+    Json::Value ToJson() const
+    {
+        Json::Value json(Json::objectValue);
+        json["count"] = (Json::UInt64)count;
+        json["failures"] = (Json::UInt64)failures;
+        json["sumMS"] = (Json::UInt64)sumMS;
+        json["minMS"] = (Json::UInt64)minMS;
+        json["maxMS"] = (Json::UInt64)maxMS;
+
+        Json::Value bucketsJson(Json::objectValue);
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (buckets[i] > 0)
+            {
+                bucketsJson[std::to_string(i)] = (Json::UInt64)buckets[i];
+            }
+        }
+        json["buckets"] = bucketsJson;
+
+        return json;
+    }
+
+    void FromJson(const Json::Value& json)
+    {
+        *this = PhaseHistogram();
+
+        count = json.get("count", 0).asUInt64();
+        failures = json.get("failures", 0).asUInt64();
+        sumMS = json.get("sumMS", 0).asUInt64();
+        minMS = json.get("minMS", 0).asUInt64();
+        maxMS = json.get("maxMS", 0).asUInt64();
+
+        const Json::Value& bucketsJson = json["buckets"];
+        if (bucketsJson.isObject())
+        {
+            for (const auto& key : bucketsJson.getMemberNames())
+            {
+                size_t index = strtoul(key.c_str(), NULL, 10);
+                if (index < buckets.size())
+                {
+                    buckets[index] = bucketsJson[key].asUInt64();
+                }
+            }
+        }
+    }
+
+    vector<ULONGLONG> buckets;
+    ULONGLONG count;
+    ULONGLONG failures;
+    ULONGLONG sumMS;
+    ULONGLONG minMS;
+    ULONGLONG maxMS;
+};
+
+
+/******************************************************************************
+ Recorder state
+******************************************************************************/
+
+struct AttemptTrace
+{
+    AttemptTrace() : active(false), startMicroseconds(0), connectedMicroseconds(0), firstProxiedByteRecorded(false), spans(Json::arrayValue) {}
+
+    bool active;
+    string transport;
+    string startTimestamp;
+    ULONGLONG startMicroseconds;
+    ULONGLONG connectedMicroseconds;
+    bool firstProxiedByteRecorded;
+    Json::Value spans;
+};
+
+static HANDLE g_connectTimingMutex = CreateMutex(NULL, FALSE, 0);
+static bool g_connectTimingLoaded = false;
+static PhaseHistogram g_phaseHistograms[CONNECT_PHASE_COUNT];
+static Json::Value g_tracedAttempts(Json::arrayValue);
+static AttemptTrace g_currentAttempt;
+// Set while the current attempt is connected and waiting for its first
+// proxied byte, so that MarkFirstProxiedByte doesn't need the mutex otherwise.
+static atomic<bool> g_firstProxiedBytePending(false);
+
+
+static bool GetConnectTimingFilePath(tstring& o_path)
+{
+    tstring dataDirectory;
+    if (!GetPsiphonDataPath({}, true, dataDirectory))
+    {
+        return false;
+    }
+
+    o_path = filesystem::path(dataDirectory).append(LOCAL_SETTINGS_APPDATA_CONNECT_TIMING_FILENAME).wstring();
+    return true;
+}
+
+// Caller must hold g_connectTimingMutex
+static void LoadPersistedTiming()
+{
+    if (g_connectTimingLoaded)
+    {
+        return;
+    }
+    g_connectTimingLoaded = true;
+
+    tstring path;
+    string data;
+    if (!GetConnectTimingFilePath(path) || !ReadFile(path, data))
+    {
+        // Most likely the first run.
+        return;
+    }
+
+    Json::Value json;
+    Json::Reader reader;
+    if (!reader.parse(data, json) || !json.isObject())
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: persisted connect timing parse failed"), __TFUNCTION__);
+        return;
+    }
+
+    if (json.get("version", 0).asInt() != CONNECT_TIMING_FORMAT_VERSION)
+    {
+        return;
+    }
+
+    try
+    {
+        const Json::Value& phases = json["phases"];
+        for (int i = 0; i < CONNECT_PHASE_COUNT; i++)
+        {
+            if (phases.isMember(PHASE_NAMES[i]))
+            {
+                g_phaseHistograms[i].FromJson(phases[PHASE_NAMES[i]]);
+            }
+        }
+
+        if (json["attempts"].isArray())
+        {
+            g_tracedAttempts = json["attempts"];
+        }
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: persisted connect timing load failed: %S"), __TFUNCTION__, e.what());
+        for (int i = 0; i < CONNECT_PHASE_COUNT; i++)
+        {
+            g_phaseHistograms[i] = PhaseHistogram();
+        }
+        g_tracedAttempts = Json::Value(Json::arrayValue);
+    }
+}
+
+// Caller must hold g_connectTimingMutex
+static Json::Value CurrentAttemptToJson()
+{
+    Json::Value json(Json::objectValue);
+    json["transport"] = g_currentAttempt.transport;
+    json["startTime!!timestamp"] = g_currentAttempt.startTimestamp;
+    json["connected"] = (g_currentAttempt.connectedMicroseconds != 0);
+    json["spans"] = g_currentAttempt.spans;
+    return json;
+}
+
+// Caller must hold g_connectTimingMutex.
+// The current attempt (if any) is included in the trace, so that a process
+// that's killed while connected still leaves a record of how it got there.
+static void PersistTiming()
+{
+    Json::Value json(Json::objectValue);
+    json["version"] = CONNECT_TIMING_FORMAT_VERSION;
+
+    json["phases"] = Json::Value(Json::objectValue);
+    for (int i = 0; i < CONNECT_PHASE_COUNT; i++)
+    {
+        json["phases"][PHASE_NAMES[i]] = g_phaseHistograms[i].ToJson();
+    }
+
+    json["attempts"] = g_tracedAttempts;
+    if (g_currentAttempt.active)
+    {
+        json["attempts"].append(CurrentAttemptToJson());
+    }
+
+    tstring path;
+    if (!GetConnectTimingFilePath(path))
+    {
+        return;
+    }
+
+    Json::FastWriter jsonWriter;
+    if (!WriteFile(path, jsonWriter.write(json)))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: write failed (%d)"), __TFUNCTION__, GetLastError());
+    }
+}
+
+// Caller must hold g_connectTimingMutex
+static void RecordLocked(ConnectPhase phase, ULONGLONG startMicroseconds, ULONGLONG endMicroseconds, bool succeeded)
+{
+    if (!g_currentAttempt.active || phase < 0 || phase >= CONNECT_PHASE_COUNT)
+    {
+        return;
+    }
+
+    ULONGLONG durationMS = (endMicroseconds - startMicroseconds) / 1000;
+
+    if (succeeded)
+    {
+        g_phaseHistograms[phase].Add(durationMS);
+    }
+    else
+    {
+        g_phaseHistograms[phase].failures++;
+    }
+
+    Json::Value span(Json::objectValue);
+    span["phase"] = PHASE_NAMES[phase];
+    span["startMS"] = (Json::UInt64)((startMicroseconds - min(startMicroseconds, g_currentAttempt.startMicroseconds)) / 1000);
+    span["durationMS"] = (Json::UInt64)durationMS;
+    span["succeeded"] = succeeded;
+    g_currentAttempt.spans.append(span);
+}
+
+// Caller must hold g_connectTimingMutex
+static void EndAttemptLocked()
+{
+    if (!g_currentAttempt.active)
+    {
+        return;
+    }
+
+    // Count attempts that never connected against the total.
+    if (g_currentAttempt.connectedMicroseconds == 0)
+    {
+        g_phaseHistograms[CONNECT_PHASE_CONNECT_TOTAL].failures++;
+    }
+
+    g_tracedAttempts.append(CurrentAttemptToJson());
+    while (g_tracedAttempts.size() > MAX_TRACED_ATTEMPTS)
+    {
+        Json::Value removed;
+        g_tracedAttempts.removeIndex(0, &removed);
+    }
+
+    g_currentAttempt = AttemptTrace();
+    g_firstProxiedBytePending = false;
+
+    PersistTiming();
+}
+
+
+/******************************************************************************
+ ConnectTiming
+******************************************************************************/
+
+ULONGLONG ConnectTiming::GetMonotonicMicroseconds()
+{
+    // QueryPerformanceFrequency is fixed at boot, so we only need to query it once.
+    // (static var initialization is thread-safe as of C++11)
+    static const LONGLONG frequency = []() {
+        LARGE_INTEGER f;
+        return QueryPerformanceFrequency(&f) ? f.QuadPart : 0;
+    }();
+
+    LARGE_INTEGER counter;
+    if (frequency == 0 || !QueryPerformanceCounter(&counter))
+    {
+        return GetTickCount64() * 1000;
+    }
+
+    // Split the division to avoid overflowing the multiplication.
+    ULONGLONG seconds = counter.QuadPart / frequency;
+    ULONGLONG remainder = counter.QuadPart % frequency;
+    return seconds * 1000000 + remainder * 1000000 / frequency;
+}
+
+const char* ConnectTiming::PhaseName(ConnectPhase phase)
+{
+    if (phase < 0 || phase >= CONNECT_PHASE_COUNT)
+    {
+        return "unknown";
+    }
+    return PHASE_NAMES[phase];
+}
+
+void ConnectTiming::BeginAttempt(const tstring& transportName)
+{
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    LoadPersistedTiming();
+    EndAttemptLocked();
+
+    g_currentAttempt.active = true;
+    g_currentAttempt.transport = WStringToUTF8(transportName);
+    g_currentAttempt.startTimestamp = WStringToUTF8(GetISO8601DatetimeString());
+    g_currentAttempt.startMicroseconds = GetMonotonicMicroseconds();
+}
+
+void ConnectTiming::MarkConnected()
+{
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    if (!g_currentAttempt.active || g_currentAttempt.connectedMicroseconds != 0)
+    {
+        return;
+    }
+
+    g_currentAttempt.connectedMicroseconds = GetMonotonicMicroseconds();
+    RecordLocked(CONNECT_PHASE_CONNECT_TOTAL, g_currentAttempt.startMicroseconds, g_currentAttempt.connectedMicroseconds, true);
+    g_firstProxiedBytePending = true;
+
+    PersistTiming();
+}
+
+void ConnectTiming::MarkFirstProxiedByte()
+{
+    if (!g_firstProxiedBytePending.exchange(false))
+    {
+        return;
+    }
+
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    if (!g_currentAttempt.active
+        || g_currentAttempt.connectedMicroseconds == 0
+        || g_currentAttempt.firstProxiedByteRecorded)
+    {
+        return;
+    }
+
+    g_currentAttempt.firstProxiedByteRecorded = true;
+    RecordLocked(CONNECT_PHASE_FIRST_PROXIED_BYTE, g_currentAttempt.connectedMicroseconds, GetMonotonicMicroseconds(), true);
+}
+
+void ConnectTiming::EndAttempt()
+{
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    EndAttemptLocked();
+}
+
+void ConnectTiming::Record(ConnectPhase phase, ULONGLONG startMicroseconds, ULONGLONG endMicroseconds, bool succeeded)
+{
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    RecordLocked(phase, startMicroseconds, endMicroseconds, succeeded);
+}
+
+void ConnectTiming::GetDiagnostics(Json::Value& o_json)
+{
+    AutoMUTEX lock(g_connectTimingMutex);
+
+    LoadPersistedTiming();
+
+    o_json = Json::Value(Json::objectValue);
+
+    Json::Value phases(Json::objectValue);
+    for (int i = 0; i < CONNECT_PHASE_COUNT; i++)
+    {
+        const PhaseHistogram& histogram = g_phaseHistograms[i];
+        if (histogram.count == 0 && histogram.failures == 0)
+        {
+            continue;
+        }
+
+        Json::Value phase(Json::objectValue);
+        phase["count"] = (Json::UInt64)histogram.count;
+        phase["failures"] = (Json::UInt64)histogram.failures;
+        phase["minMS"] = (Json::UInt64)histogram.minMS;
+        phase["maxMS"] = (Json::UInt64)histogram.maxMS;
+        phase["meanMS"] = (Json::UInt64)(histogram.count ? histogram.sumMS / histogram.count : 0);
+        phase["p50MS"] = (Json::UInt64)histogram.Percentile(50);
+        phase["p90MS"] = (Json::UInt64)histogram.Percentile(90);
+        phase["p99MS"] = (Json::UInt64)histogram.Percentile(99);
+        phases[PHASE_NAMES[i]] = phase;
+    }
+    o_json["phases"] = phases;
+
+    Json::Value attempts(Json::arrayValue);
+    Json::ArrayIndex first = g_tracedAttempts.size() > MAX_DIAGNOSTIC_ATTEMPTS ? g_tracedAttempts.size() - MAX_DIAGNOSTIC_ATTEMPTS : 0;
+    for (Json::ArrayIndex i = first; i < g_tracedAttempts.size(); i++)
+    {
+        attempts.append(g_tracedAttempts[i]);
+    }
+    if (g_currentAttempt.active)
+    {
+        attempts.append(CurrentAttemptToJson());
+    }
+    o_json["recentAttempts"] = attempts;
+}
+
+
+/******************************************************************************
+ ConnectTimingSpan
+******************************************************************************/
+
+ConnectTimingSpan::ConnectTimingSpan(ConnectPhase phase, bool enabled/*=true*/)
+    : m_phase(phase),
+      m_startMicroseconds(enabled ? ConnectTiming::GetMonotonicMicroseconds() : 0),
+      m_active(enabled)
+{
+}
+
+ConnectTimingSpan::~ConnectTimingSpan()
+{
+    // Not ended explicitly, so we're unwinding from an exception (or an early return).
+    End(false);
+}
+
+void ConnectTimingSpan::End(bool succeeded/*=true*/)
+{
+    if (!m_active)
+    {
+        return;
+    }
+    m_active = false;
+
+    ConnectTiming::Record(m_phase, m_startMicroseconds, ConnectTiming::GetMonotonicMicroseconds(), succeeded);
+}
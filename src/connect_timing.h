@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+The phases of a connection attempt that we time. The names reported in
+diagnostics and the trace file come from ConnectTiming::PhaseName, so the
+order here can change without breaking persisted data.
+*/
+enum ConnectPhase
+{
+    // VPN only; tunnel-core picks servers within CONNECT_PHASE_ESTABLISH_TUNNEL
+    CONNECT_PHASE_SERVER_SELECTION = 0,
+    CONNECT_PHASE_WRITE_PARAMETER_FILES,
+    CONNECT_PHASE_EXTRACT_EXECUTABLE,
+    CONNECT_PHASE_SPAWN_PROCESS,
+    CONNECT_PHASE_ESTABLISH_TUNNEL,
+    CONNECT_PHASE_HANDSHAKE,
+    CONNECT_PHASE_VPN_DIAL,
+    CONNECT_PHASE_APPLY_PROXY_SETTINGS,
+    CONNECT_PHASE_POST_CONNECT,
+    CONNECT_PHASE_FIRST_PROXIED_BYTE,
+    // From the start of the attempt until the transport is connected
+    CONNECT_PHASE_CONNECT_TOTAL,
+    CONNECT_PHASE_COUNT
+};
+
+
+/**
+Times a single phase of the current connection attempt. The span ends when
+End() is called or, failing that, when it goes out of scope -- in which case
+the phase is recorded as failed (i.e., an exception was thrown through it).
+If `enabled` is false, nothing is recorded; this is for code that is shared
+with temporary (e.g., URL proxy) connections, which aren't part of an attempt.
+*/
+class ConnectTimingSpan
+{
+public:
+    ConnectTimingSpan(ConnectPhase phase, bool enabled=true);
+    ~ConnectTimingSpan();
+
+    void End(bool succeeded=true);
+
+private:
+    // not copyable
+    ConnectTimingSpan(const ConnectTimingSpan&);
+    ConnectTimingSpan& operator=(const ConnectTimingSpan&);
+
+    ConnectPhase m_phase;
+    ULONGLONG m_startMicroseconds;
+    bool m_active;
+};
+
+
+namespace ConnectTiming
+{
+    /// Monotonic clock with microsecond resolution. Unlike GetTickCount, it
+    /// doesn't wrap and isn't limited to the ~15ms system timer resolution.
+    ULONGLONG GetMonotonicMicroseconds();
+
+    const char* PhaseName(ConnectPhase phase);
+
+    /// Starts a new connection attempt. Any attempt still in progress is ended.
+    void BeginAttempt(const tstring& transportName);
+
+    /// Records CONNECT_PHASE_CONNECT_TOTAL for the current attempt. Spans may
+    /// continue to be recorded against the attempt until EndAttempt.
+    void MarkConnected();
+
+    /// Records CONNECT_PHASE_FIRST_PROXIED_BYTE (time from MarkConnected) the
+    /// first time it's called for a connected attempt. Other calls don't take
+    /// a lock, so it can be called for every proxied chunk.
+    void MarkFirstProxiedByte();
+
+    /// Ends the current attempt, if any, and persists the histograms and trace.
+    void EndAttempt();
+
+    /// Records a phase duration into the histograms and the current attempt's
+    /// trace. Does nothing if there is no attempt in progress.
+    void Record(ConnectPhase phase, ULONGLONG startMicroseconds, ULONGLONG endMicroseconds, bool succeeded);
+
+    /// Fills `o_json` with per-phase histogram summaries (count, failures,
+    /// min/max/mean and percentiles, in milliseconds) and the recent attempts.
+    void GetDiagnostics(Json::Value& o_json);
+}
@@ -41,7 +41,10 @@
 #include "psicashlib.h"
 #include "psiphon_tunnel_core_utilities.h"
 #include "feedback_upload_worker.h"
+#include "feedback_upload_checkpoint.h"
 #include "worker_thread.h"
+#include "connect_timing.h"
+#include "throughput_meter.h"
 
 
 // Upgrade process posts a Quit message
@@ -305,15 +308,18 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
 
         my_print(NOT_SENSITIVE, true, _T("%s: enter server loop"), __TFUNCTION__);
 
-        // Timer measures tunnel lifetime
-        DWORD tunnelStartTime = 0;
-
         try
         {
             GlobalStopSignal::Instance().CheckSignal(STOP_REASON_ANY_STOP_TUNNEL, true);
 
             manager->SetState(CONNECTION_MANAGER_STATE_STARTING);
 
+            // Time the phases of this attempt. The attempt is ended (and its
+            // trace persisted) when we leave this scope, whether that's due
+            // to a failure to connect or a disconnect.
+            ConnectTiming::BeginAttempt(manager->m_transport->GetTransportDisplayName());
+            auto endConnectTiming = finally([] { ConnectTiming::EndAttempt(); });
+
             // Do we have any usable servers?
             if (!manager->m_transport->ServerWithCapabilitiesExists())
             {
@@ -346,7 +352,8 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
                 throw;
             }
 
-            tunnelStartTime = GetTickCount();
+            ConnectTiming::MarkConnected();
+            ThroughputMeter::Reset();
 
             //
             // The transport connection did a handshake, so its sessionInfo is
@@ -382,7 +389,9 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
             //
 
             my_print(NOT_SENSITIVE, true, _T("%s: transport succeeded; DoPostConnect"), __TFUNCTION__);
+            ConnectTimingSpan postConnectSpan(CONNECT_PHASE_POST_CONNECT);
             manager->DoPostConnect(sessionInfo, !homePageOpened);
+            postConnectSpan.End();
             homePageOpened = true;
 
             //
@@ -394,6 +403,15 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
 
             GlobalStopSignal::Instance().CheckSignal(STOP_REASON_ANY_STOP_TUNNEL, true);
 
+            if (manager->m_transport->IsPreemptiveReconnectPending())
+            {
+                // The transport stopped because its session lifetime expired, and
+                // it's ready to reconnect. This isn't a failure, so don't wait or
+                // fetch the remote server list; reconnect immediately.
+                my_print(NOT_SENSITIVE, true, _T("%s: preemptive reconnect"), __TFUNCTION__);
+                continue;
+            }
+
             // The stop signal has not been set, so this was an unexpected disconnect. Retry.
 
             throw TransportConnection::TryNextServer();
@@ -807,10 +825,10 @@ void ConnectionManager::FetchRemoteServerList()
         HTTPSRequest::Response httpsResponse;
         // NOTE: Not using local proxy
         if (!httpsRequest.MakeRequest(
-                UTF8ToWString(REMOTE_SERVER_LIST_ADDRESS).c_str(),
+                UTF8ToWide(REMOTE_SERVER_LIST_ADDRESS).c_str(),
                 443,
                 "",
-                UTF8ToWString(REMOTE_SERVER_LIST_REQUEST_PATH).c_str(),
+                UTF8ToWide(REMOTE_SERVER_LIST_REQUEST_PATH).c_str(),
                 StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_EXIT),
                 HTTPSRequest::PsiphonProxy::DONT_USE,
                 httpsResponse,
@@ -905,10 +923,10 @@ DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
         HTTPSRequest httpsRequest;
         HTTPSRequest::Response httpsResponse;
         if (!httpsRequest.MakeRequest(
-                UTF8ToWString(UPGRADE_ADDRESS).c_str(),
+                UTF8ToWide(UPGRADE_ADDRESS).c_str(),
                 443,
                 "",
-                UTF8ToWString(UPGRADE_REQUEST_PATH).c_str(),
+                UTF8ToWide(UPGRADE_REQUEST_PATH).c_str(),
                 StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL),
                 HTTPSRequest::PsiphonProxy::USE,
                 httpsResponse,
@@ -1119,31 +1137,90 @@ void ConnectionManager::UpdateCurrentSessionInfo(const SessionInfo& sessionInfo)
     }
 }
 
+// Requests for the feedback thread. Guarded by g_feedbackThreadDataMutex.
 struct FeedbackThreadData
 {
     ConnectionManager* connectionManager;
+    // A send requested by the user, with its feedbackJSON
+    bool sendPending;
     string feedbackJSON;
+    // A retry of the checkpointed upload left by a previous run
+    bool resumePending;
+    // Cleared by the feedback thread when it runs out of requests, after
+    // which it exits without touching this data again.
+    bool threadActive;
 } g_feedbackThreadData;
 
+static HANDLE g_feedbackThreadDataMutex = CreateMutex(NULL, FALSE, 0);
+
 void ConnectionManager::SendFeedback(const string& utf8FeedbackJSON)
 {
+    AutoMUTEX lock(g_feedbackThreadDataMutex);
+
     g_feedbackThreadData.connectionManager = this;
     g_feedbackThreadData.feedbackJSON = utf8FeedbackJSON;
+    g_feedbackThreadData.sendPending = true;
+
+    // This send replaces the checkpoint, so a resume that hasn't started is
+    // dropped. One that's in progress is finished first.
+    g_feedbackThreadData.resumePending = false;
+
+    StartFeedbackThread();
+}
+
+void ConnectionManager::ResumeFeedbackUpload()
+{
+    string diagnosticData;
+    int attempts = 0;
+    if (!FeedbackUploadCheckpoint::Load(diagnosticData, attempts))
+    {
+        return;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: resuming pending feedback upload (%d previous attempts)"), __TFUNCTION__, attempts);
+
+    AutoMUTEX lock(g_feedbackThreadDataMutex);
+
+    g_feedbackThreadData.connectionManager = this;
+    g_feedbackThreadData.resumePending = true;
+
+    StartFeedbackThread();
+}
+
+// Caller must hold g_feedbackThreadDataMutex
+void ConnectionManager::StartFeedbackThread()
+{
+    if (g_feedbackThreadData.threadActive)
+    {
+        // The running thread takes the request when it's done with its current one
+        return;
+    }
+
+    if (m_feedbackThread)
+    {
+        // The previous thread is done with its requests and is exiting
+        WaitForSingleObject(m_feedbackThread, INFINITE);
+        CloseHandle(m_feedbackThread);
+    }
 
-    if (!m_feedbackThread ||
-        WAIT_OBJECT_0 == WaitForSingleObject(m_feedbackThread, 0))
+    g_feedbackThreadData.threadActive = true;
+
+    m_feedbackThread = CreateThread(
+        0,
+        0,
+        ConnectionManager::ConnectionManagerFeedbackThread,
+        (void*)&g_feedbackThreadData, 0, 0);
+    if (!m_feedbackThread)
     {
-        m_feedbackThread = CreateThread(
-            0,
-            0,
-            ConnectionManager::ConnectionManagerFeedbackThread,
-            (void*)&g_feedbackThreadData, 0, 0);
-        if (!m_feedbackThread)
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+        g_feedbackThreadData.threadActive = false;
+        g_feedbackThreadData.resumePending = false;
+        if (g_feedbackThreadData.sendPending)
         {
-            my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+            g_feedbackThreadData.sendPending = false;
             PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
-            return;
         }
+        return;
     }
 }
 
@@ -1153,20 +1230,69 @@ DWORD WINAPI ConnectionManager::ConnectionManagerFeedbackThread(void* object)
 
     FeedbackThreadData* data = (FeedbackThreadData*)object;
 
+    // A user-requested send has been taken from the thread data and its
+    // result hasn't been posted yet.
+    bool sending = false;
+
     try
     {
-        if (data->connectionManager->DoSendFeedback(data->feedbackJSON))
-        {
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_SUCCESS, 0, 0);
-        }
-        else
+        while (true)
         {
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+            ConnectionManager* connectionManager = NULL;
+            bool resume = false;
+            string feedbackJSON;
+            {
+                AutoMUTEX lock(g_feedbackThreadDataMutex);
+
+                connectionManager = data->connectionManager;
+                if (data->sendPending)
+                {
+                    feedbackJSON.swap(data->feedbackJSON);
+                    data->sendPending = false;
+                    sending = true;
+                }
+                else if (data->resumePending)
+                {
+                    resume = true;
+                    data->resumePending = false;
+                }
+                else
+                {
+                    data->threadActive = false;
+                    break;
+                }
+            }
+
+            if (resume)
+            {
+                // The user didn't ask for this in this run, so the result
+                // isn't reported in the UI.
+                string diagnosticData;
+                int attempts = 0;
+                bool success = FeedbackUploadCheckpoint::Load(diagnosticData, attempts)
+                                && connectionManager->DoUploadFeedback(diagnosticData, false);
+                my_print(NOT_SENSITIVE, true, _T("%s: resumed feedback upload %s"), __TFUNCTION__, (success ? _T("succeeded") : _T("failed")));
+            }
+            else
+            {
+                bool success = connectionManager->DoSendFeedback(feedbackJSON);
+                sending = false;
+                PostMessage(g_hWnd, success ? WM_PSIPHON_FEEDBACK_SUCCESS : WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+            }
         }
     }
     catch (StopSignal::StopException&)
     {
-        // just fall through
+        // Remaining requests are dropped. A send the user asked for, whether
+        // in progress or queued, is reported as failed.
+        AutoMUTEX lock(g_feedbackThreadDataMutex);
+        if (sending || data->sendPending)
+        {
+            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
+        }
+        data->sendPending = false;
+        data->resumePending = false;
+        data->threadActive = false;
     }
 
     my_print(NOT_SENSITIVE, true, _T("%s: exit"), __TFUNCTION__);
@@ -1211,92 +1337,134 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
                     surveyJSON,
                     sendDiagnosticInfo);
 
-        unique_ptr<FeedbackUploadWorker> feedbackUpload;
+        // If the upload doesn't complete, it's retried from the checkpoint
+        // the next time the app starts. This replaces any older pending upload.
+        (void)FeedbackUploadCheckpoint::Save(diagnosticData);
+
+        success = DoUploadFeedback(diagnosticData, true);
+    }
+
+    return success;
+}
+
+bool ConnectionManager::DoUploadFeedback(const string& diagnosticData, bool reportProgress)
+{
+    bool success = false;
+
+    unique_ptr<FeedbackUploadWorker> feedbackUpload;
 
-        // Kick off the feedback upload and poll for it to complete. Interrupt
-        // the operation if the VPN is connecting or disconnecting, and retry
-        // when it is connected or disconnected again.
-        // TODO: cancel the upload if the connection state is flapping?
-        while (true) {
+    // Progress is reported in steps, so as not to flood the UI log
+    const unsigned int PROGRESS_STEP_PERCENT = 10;
+    unsigned int reportedProgressPercent = 0;
 
-            bool vpnModeStarted = g_connectionManager.VPNModeStarted();
+    // Kick off the feedback upload and poll for it to complete. Interrupt
+    // the operation if the VPN is connecting or disconnecting, and retry
+    // when it is connected or disconnected again.
+    // TODO: cancel the upload if the connection state is flapping?
+    while (true) {
 
-            if (feedbackUpload == NULL && vpnModeStarted &&
-                (GetState() == CONNECTION_MANAGER_STATE_STOPPED || GetState() == CONNECTION_MANAGER_STATE_CONNECTED))
+        bool vpnModeStarted = g_connectionManager.VPNModeStarted();
+
+        if (feedbackUpload == NULL && vpnModeStarted &&
+            (GetState() == CONNECTION_MANAGER_STATE_STOPPED || GetState() == CONNECTION_MANAGER_STATE_CONNECTED))
+        {
+            if (!FeedbackUploadCheckpoint::RecordAttempt())
             {
-                // Start the upload in VPN mode if the transport is stopped, or
-                // connected. Since all system traffic is being tunneled the
-                // upload will fail when the transport is connecting or
-                // disconnecting.
-
-                // The upstream proxy is provided, but will not be used if the
-                // VPN transport is connected and all system traffic is being
-                // tunneled. I.E. the upstream proxy parameter will be omitted
-                // from the Psiphon config provided to the feedback upload
-                // process if the whole system is tunneled. See WriteParameterFiles.
-                string upstreamProxyAddress = GetUpstreamProxyAddress();
-                StopInfo stopInfo = StopInfo(&GlobalStopSignal::Instance(),
-                    STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_VPN_MODE_STARTED);
-                feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
-                try {
-                    feedbackUpload->StartUpload();
-                }
-                catch (...) {
-                    break;
-                }
+                break;
             }
-            else if (feedbackUpload == NULL && !vpnModeStarted)
+
+            // Start the upload in VPN mode if the transport is stopped, or
+            // connected. Since all system traffic is being tunneled the
+            // upload will fail when the transport is connecting or
+            // disconnecting.
+
+            // The upstream proxy is provided, but will not be used if the
+            // VPN transport is connected and all system traffic is being
+            // tunneled. I.E. the upstream proxy parameter will be omitted
+            // from the Psiphon config provided to the feedback upload
+            // process if the whole system is tunneled. See WriteParameterFiles.
+            string upstreamProxyAddress = GetUpstreamProxyAddress();
+            StopInfo stopInfo = StopInfo(&GlobalStopSignal::Instance(),
+                STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_VPN_MODE_STARTED);
+            feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
+            try {
+                feedbackUpload->StartUpload();
+            }
+            catch (...) {
+                break;
+            }
+        }
+        else if (feedbackUpload == NULL && !vpnModeStarted)
+        {
+            if (!FeedbackUploadCheckpoint::RecordAttempt())
             {
-                StopInfo stopInfo;
-                string upstreamProxyAddress;
+                break;
+            }
 
-                if (GetState() == CONNECTION_MANAGER_STATE_CONNECTED)
-                {
-                    // Use the local proxy exposed by the transport to tunnel
-                    // the feedback upload.
-                    ProxyConfig tunneledProxyConfig = GetTunneledDefaultProxyConfig();
-                    upstreamProxyAddress = WStringToUTF8(tunneledProxyConfig.HTTPHostPortScheme());
-                    stopInfo = StopInfo(&GlobalStopSignal::Instance(),
-                        STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_NONVPN_MODE_CONNECTED);
-                }
-                else
-                {
-                    upstreamProxyAddress = GetUpstreamProxyAddress();
-                    stopInfo = StopInfo(&GlobalStopSignal::Instance(),
-                        STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_NONVPN_MODE_NOT_CONNECTED);
-                }
+            StopInfo stopInfo;
+            string upstreamProxyAddress;
 
-                feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
-                try {
-                    feedbackUpload->StartUpload();
-                }
-                catch (...) {
-                    break;
-                }
+            if (GetState() == CONNECTION_MANAGER_STATE_CONNECTED)
+            {
+                // Use the local proxy exposed by the transport to tunnel
+                // the feedback upload.
+                ProxyConfig tunneledProxyConfig = GetTunneledDefaultProxyConfig();
+                upstreamProxyAddress = WStringToUTF8(tunneledProxyConfig.HTTPHostPortScheme());
+                stopInfo = StopInfo(&GlobalStopSignal::Instance(),
+                    STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_NONVPN_MODE_CONNECTED);
+            }
+            else
+            {
+                upstreamProxyAddress = GetUpstreamProxyAddress();
+                stopInfo = StopInfo(&GlobalStopSignal::Instance(),
+                    STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_NONVPN_MODE_NOT_CONNECTED);
             }
-            else if (feedbackUpload != NULL) {
 
-                // The feedback upload has been started
+            feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
+            try {
+                feedbackUpload->StartUpload();
+            }
+            catch (...) {
+                break;
+            }
+        }
+        else if (feedbackUpload != NULL) {
+
+            // The feedback upload has been started
 
-                if (feedbackUpload->UploadCompleted())
+            if (feedbackUpload->UploadCompleted())
+            {
+                my_print(NOT_SENSITIVE, true, _T("%s: feedback upload completed"), __TFUNCTION__);
+                success = feedbackUpload->UploadSuccessful();
+                if (success)
                 {
-                    my_print(NOT_SENSITIVE, true, _T("%s: feedback upload completed"), __TFUNCTION__);
-                    success = feedbackUpload->UploadSuccessful();
-                    break;
+                    FeedbackUploadCheckpoint::Clear();
                 }
-                else if (feedbackUpload->UploadStopped() || feedbackUpload->IsVPNMode() != vpnModeStarted)
+                break;
+            }
+            else if (feedbackUpload->UploadStopped() || feedbackUpload->IsVPNMode() != vpnModeStarted)
+            {
+                // Worker has been stopped by the stop signal going high or
+                // the transport mode has changed to, or from, VPN mode. In
+                // the latter case, the upload should be stopped and
+                // restarted to reconfigure the stop conditions.
+                my_print(NOT_SENSITIVE, true, _T("%s: feedback upload cancelled, waiting to retry..."), __TFUNCTION__);
+                feedbackUpload = nullptr;
+            }
+            else if (reportProgress)
+            {
+                // A retried upload starts from 0 again, but the reported
+                // progress doesn't go backwards.
+                unsigned int progressPercent = feedbackUpload->UploadProgressPercent();
+                if (progressPercent >= reportedProgressPercent + PROGRESS_STEP_PERCENT)
                 {
-                    // Worker has been stopped by the stop signal going high or
-                    // the transport mode has changed to, or from, VPN mode. In
-                    // the latter case, the upload should be stopped and
-                    // restarted to reconfigure the stop conditions.
-                    my_print(NOT_SENSITIVE, true, _T("%s: feedback upload cancelled, waiting to retry..."), __TFUNCTION__);
-                    feedbackUpload = nullptr;
+                    reportedProgressPercent = progressPercent - progressPercent % PROGRESS_STEP_PERCENT;
+                    PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_PROGRESS, (WPARAM)reportedProgressPercent, 0);
                 }
             }
-
-            Sleep(100);
         }
+
+        Sleep(100);
     }
 
     return success;
@@ -98,9 +98,14 @@ public:
         const std::vector<std::string>& inactiveIDs) override;
 
     // Results in WM_PSIPHON_FEEDBACK_SUCCESS being posted to the main window
-    // on success, WM_PSIPHON_FEEDBACK_FAILED on failure.
+    // on success, WM_PSIPHON_FEEDBACK_FAILED on failure. If a feedback upload
+    // is already in progress, this send is made after it.
     void SendFeedback(const string& utf8FeedbackJSON);
 
+    // Retries the feedback upload left pending by a previous run, if there is
+    // one, in the background. Nothing is posted to the main window.
+    void ResumeFeedbackUpload();
+
 private:
     static DWORD WINAPI ConnectionManagerStartThread(void* object);
     static DWORD WINAPI ConnectionManagerUpgradeThread(void* object);
@@ -126,6 +131,11 @@ private:
 
     // May throw StopSignal::StopException
     bool DoSendFeedback(const string& feedbackJSON);
+    // If reportProgress is true, WM_PSIPHON_FEEDBACK_PROGRESS is posted to the
+    // main window as the upload progresses.
+    // May throw StopSignal::StopException
+    bool DoUploadFeedback(const string& diagnosticData, bool reportProgress);
+    void StartFeedbackThread();
     static DWORD WINAPI ConnectionManagerFeedbackThread(void* object);
 
 private:
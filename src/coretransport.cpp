@@ -33,6 +33,8 @@
 #include "utilities.h"
 #include "authenticated_data_package.h"
 #include "psiphon_tunnel_core_utilities.h"
+#include "connect_timing.h"
+#include "throughput_meter.h"
 
 using namespace std::experimental;
 
@@ -247,11 +249,17 @@ void CoreTransport::TransportConnectHelper()
     in.encodedAuthorizations = encodedAuthorizations;
     in.tempConnectServerEntry = m_tempConnectServerEntry;
 
+    // Temporary and URL proxy connections aren't part of a connection attempt,
+    // so aren't timed.
+    bool timeConnectPhases = !m_tempConnectServerEntry;
+
+    ConnectTimingSpan writeParameterFilesSpan(CONNECT_PHASE_WRITE_PARAMETER_FILES, timeConnectPhases);
     if (!WriteParameterFiles(in, out))
     {
         my_print(NOT_SENSITIVE, true, _T("%s:%d - WriteParameterFiles failed: %d"), __TFUNCTION__, __LINE__, GetLastError());
         throw TransportFailed(false);
     }
+    writeParameterFilesSpan.End();
 
     // Once a new upgrade has been paved, CoreTransport should never restart without the actual application restarting.
     // If there is a pending upgrade, when disconnect/connect is pressed (or a new region is chosen, upstream proxy settings change, etc.)
@@ -281,6 +289,7 @@ void CoreTransport::TransportConnectHelper()
 
     // Wait and poll for first active tunnel (or stop signal)
 
+    ConnectTimingSpan establishTunnelSpan(CONNECT_PHASE_ESTABLISH_TUNNEL, timeConnectPhases);
     while (true)
     {
         // Check that the process is still running and consume output
@@ -301,6 +310,7 @@ void CoreTransport::TransportConnectHelper()
 
         Sleep(100);
     }
+    establishTunnelSpan.End();
 
     m_systemProxySettings->SetSocksProxyPort(m_localSocksProxyPort);
     m_systemProxySettings->SetHttpProxyPort(m_localHttpProxyPort);
@@ -371,6 +381,7 @@ bool CoreTransport::SpawnCoreProcess(const tstring& configFilename, const tstrin
             }
         }
 
+        ConnectTimingSpan extractExecutableSpan(CONNECT_PHASE_EXTRACT_EXECUTABLE, !m_tempConnectServerEntry);
         if (RequestingUrlProxyWithoutTunnel())
         {
             // In RequestingUrlProxyWithoutTunnel mode, we allow for multiple instances
@@ -397,6 +408,8 @@ bool CoreTransport::SpawnCoreProcess(const tstring& configFilename, const tstrin
             }
         }
 
+        extractExecutableSpan.End();
+
         tstringstream commandLineFlags;
         commandLineFlags <<  _T(" --config \"") << configFilename << _T("\"");
 
@@ -405,11 +418,13 @@ bool CoreTransport::SpawnCoreProcess(const tstring& configFilename, const tstrin
             commandLineFlags << _T(" --serverList \"") << serverListFilename << _T("\"");
         }
 
+        ConnectTimingSpan spawnProcessSpan(CONNECT_PHASE_SPAWN_PROCESS, !m_tempConnectServerEntry);
         m_psiphonTunnelCore = make_unique<PsiphonTunnelCore>(this, exePath);
         if (!m_psiphonTunnelCore->SpawnSubprocess(commandLineFlags.str())) {
             my_print(NOT_SENSITIVE, false, _T("%s:%d - SpawnSubprocess failed"), __TFUNCTION__, __LINE__);
             continue;
         }
+        spawnProcessSpan.End();
 
         startSuccess = true;
         break;
@@ -508,6 +523,8 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
     if (noticeType == "Tunnels")
     {
         // This notice is received when tunnels are connected and disconnected.
+        // With a tunnel pool (Settings::TunnelPoolSize) the count may go above
+        // 1; we're connected while any tunnel is.
         int count = data["count"].asInt();
         if (count == 0)
         {
@@ -517,9 +534,9 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
             }
             m_isConnected = false;
         }
-        else if (count == 1)
+        else if (count > 0)
         {
-            if (m_hasEverConnected && m_reconnectStateReceiver)
+            if (!m_isConnected && m_hasEverConnected && m_reconnectStateReceiver)
             {
                 m_reconnectStateReceiver->SetReconnected();
             }
@@ -654,6 +671,17 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
         my_print(NOT_SENSITIVE, true, _T("Traffic rate downstream limit: %S"), speed.c_str());
         // Processing this is left to main.js
     }
+    else if (noticeType == "BytesTransferred")
+    {
+        Json::Int64 sent = data["sent"].asInt64();
+        Json::Int64 received = data["received"].asInt64();
+        if (!m_tempConnectServerEntry && (sent > 0 || received > 0))
+        {
+            ConnectTiming::MarkFirstProxiedByte();
+            // The diagnostic ID identifies the tunnel, for per-tunnel throughput
+            ThroughputMeter::AddBytes(max(sent, 0LL), max(received, 0LL), data["diagnosticID"].asString());
+        }
+    }
 }
 
 
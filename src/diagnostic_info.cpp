@@ -27,7 +27,11 @@
 #include "diagnostic_info.h"
 #include "usersettings.h"
 #include "config.h"
+#include "history_journal.h"
 #include "psicashlib.h"
+#include "connect_timing.h"
+#include "throughput_meter.h"
+#include "https_session_pool.h"
 #include <VersionHelpers.h>
 
 #pragma warning(push, 0)
@@ -36,8 +40,40 @@
 #pragma warning(pop)
 
 
+// How long probe results are reused for before the probe is run again
+#define SYSTEM_INFO_PROBE_TTL_MS            (60*1000)
+#define OS_SECURITY_INFO_PROBE_TTL_MS       (10*60*1000)
+
+// How long GetDiagnosticInfo waits, in total, for probes that are still running
+#define DIAGNOSTIC_PROBES_DEADLINE_MS       (15*1000)
+
+
 HANDLE g_diagnosticHistoryMutex = CreateMutex(NULL, FALSE, 0);
 Json::Value g_diagnosticHistory(Json::arrayValue);
+HistoryJournal g_diagnosticHistoryJournal(LOCAL_SETTINGS_APPDATA_DIAGNOSTIC_HISTORY_FILENAME, HISTORY_JOURNAL_SEGMENT_BYTES);
+
+// Caller must hold g_diagnosticHistoryMutex
+void _JournalDiagnosticInfo(const string& jsonString)
+{
+    g_diagnosticHistoryJournal.Append(jsonString);
+}
+
+void RestoreDiagnosticHistory()
+{
+    AutoMUTEX mutex(g_diagnosticHistoryMutex);
+
+    Json::Value restored(Json::arrayValue);
+    (void)g_diagnosticHistoryJournal.Open([&restored](const Json::Value& record) {
+        restored.append(record);
+    });
+
+    // Anything recorded before now is newer than the restored history
+    for (Json::Value::ArrayIndex i = 0; i < g_diagnosticHistory.size(); i++)
+    {
+        restored.append(g_diagnosticHistory[i]);
+    }
+    g_diagnosticHistory = restored;
+}
 
 
 // This is really just a non-template wrapper around AddDiagnosticInfo, to help
@@ -668,6 +704,146 @@ bool GetSystemInfo(SystemInfo& o_sysInfo)
     return true;
 }
 
+/*
+Runs a slow diagnostic probe (such as WMI queries) in the background and caches
+its result for ttlMS. This lets the probes be started when the app starts,
+without delaying it, and be waited on only if they're still outstanding when
+their results are needed.
+
+The probe runs on a detached thread, so a probe that's still running doesn't
+hold up the probe's destruction, and so process exit. The thread shares
+ownership of the state it writes to.
+*/
+template<typename T>
+class DiagnosticProbe
+{
+public:
+    typedef bool (*ProbeFn)(T& o_result);
+
+    DiagnosticProbe(ProbeFn probeFn, ULONGLONG ttlMS)
+        : m_probeFn(probeFn), m_ttlMS(ttlMS), m_state(make_shared<State>())
+    {
+    }
+
+    // Starts the probe in the background, unless it's already running or
+    // there's an unexpired result.
+    void Start()
+    {
+        AutoMUTEX lock(m_state->mutex);
+        StartLocked();
+    }
+
+    // Gets the result, first waiting up to timeoutMS for the probe if it's
+    // running. If it doesn't finish in time, an expired result is used if
+    // there is one. Returns false if the probe failed (in which case o_result
+    // may be partially filled in) or there's no result yet.
+    bool Get(T& o_result, DWORD timeoutMS)
+    {
+        shared_future<void> pending;
+        {
+            AutoMUTEX lock(m_state->mutex);
+            StartLocked();
+            pending = m_state->pending;
+        }
+
+        if (!pending.valid())
+        {
+            // Nothing to wait for
+        }
+        else if (timeoutMS == INFINITE)
+        {
+            pending.wait();
+        }
+        else if (pending.wait_for(chrono::milliseconds(timeoutMS)) != future_status::ready)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: probe timed out"), __TFUNCTION__);
+        }
+
+        AutoMUTEX lock(m_state->mutex);
+        if (!m_state->hasResult)
+        {
+            return false;
+        }
+        o_result = m_state->result;
+        return m_state->succeeded;
+    }
+
+private:
+    struct State
+    {
+        State() : hasResult(false), succeeded(false), resultTickMS(0)
+        {
+            mutex = CreateMutex(NULL, FALSE, 0);
+        }
+
+        ~State()
+        {
+            CloseHandle(mutex);
+        }
+
+        HANDLE mutex;
+        T result;
+        bool hasResult;
+        bool succeeded;
+        ULONGLONG resultTickMS;
+        // Ready when the running probe finishes. Unlike a future from async,
+        // it doesn't wait for the probe when it's destroyed.
+        shared_future<void> pending;
+    };
+
+    // Caller must hold m_state->mutex
+    void StartLocked()
+    {
+        if (m_state->pending.valid() && m_state->pending.wait_for(chrono::seconds(0)) != future_status::ready)
+        {
+            // Already running
+            return;
+        }
+
+        if (m_state->succeeded && GetTickCount64() - m_state->resultTickMS < m_ttlMS)
+        {
+            return;
+        }
+
+        auto done = make_shared<promise<void>>();
+        m_state->pending = done->get_future().share();
+
+        shared_ptr<State> state = m_state;
+        ProbeFn probeFn = m_probeFn;
+        thread([state, probeFn, done]() {
+            T result;
+            bool success = false;
+            try
+            {
+                success = probeFn(result);
+            }
+            catch (...)
+            {
+            }
+
+            {
+                AutoMUTEX lock(state->mutex);
+                // A failed probe's (partial) result is only better than nothing
+                if (success || !state->succeeded)
+                {
+                    state->result = result;
+                    state->hasResult = true;
+                    state->succeeded = success;
+                    state->resultTickMS = GetTickCount64();
+                }
+            }
+
+            done->set_value();
+        }).detach();
+    }
+
+    ProbeFn m_probeFn;
+    ULONGLONG m_ttlMS;
+    shared_ptr<State> m_state;
+};
+
+static DiagnosticProbe<SystemInfo> g_systemInfoProbe(GetSystemInfo, SYSTEM_INFO_PROBE_TTL_MS);
+
 string GetClientPlatform()
 {
     static string cachedResult;
@@ -676,7 +852,7 @@ string GetClientPlatform()
     }
 
     SystemInfo sysInfo;
-    if (!GetSystemInfo(sysInfo)) {
+    if (!g_systemInfoProbe.Get(sysInfo, INFINITE)) {
         return CLIENT_PLATFORM;
     }
 
@@ -710,7 +886,7 @@ bool GetCountryDialingCode(wstring& o_countryDialingCode)
     o_countryDialingCode.clear();
 
     SystemInfo sysInfo;
-    if (!GetSystemInfo(sysInfo))
+    if (!g_systemInfoProbe.Get(sysInfo, INFINITE))
     {
         return false;
     }
@@ -1074,6 +1250,28 @@ void GetOSSecurityInfo(
 }
 
 
+struct OSSecurityInfo
+{
+    vector<SecurityInfo> antiVirusInfo;
+    vector<SecurityInfo> antiSpywareInfo;
+    vector<SecurityInfo> firewallInfo;
+};
+
+static bool ProbeOSSecurityInfo(OSSecurityInfo& o_securityInfo)
+{
+    GetOSSecurityInfo(o_securityInfo.antiVirusInfo, o_securityInfo.antiSpywareInfo, o_securityInfo.firewallInfo);
+    return true;
+}
+
+static DiagnosticProbe<OSSecurityInfo> g_osSecurityInfoProbe(ProbeOSSecurityInfo, OS_SECURITY_INFO_PROBE_TTL_MS);
+
+// Returns the time remaining until deadlineTickMS, for DiagnosticProbe::Get
+static DWORD RemainingMS(ULONGLONG deadlineTickMS)
+{
+    ULONGLONG nowTickMS = GetTickCount64();
+    return nowTickMS < deadlineTickMS ? (DWORD)(deadlineTickMS - nowTickMS) : 0;
+}
+
 struct StartupDiagnosticInfo {
     bool wininet_success;
     WininetNetworkInfo wininet_info;
@@ -1082,6 +1280,15 @@ struct StartupDiagnosticInfo {
 // NOTE: Not threadsafe
 void DoStartupDiagnosticCollection()
 {
+    // The slow probes are run in the background, so they don't delay startup.
+    // Their results are cached for when they're needed by the first connect
+    // (GetClientPlatform) or by feedback.
+    g_systemInfoProbe.Start();
+    g_osSecurityInfoProbe.Start();
+
+    // This is quick, and must be done before Psiphon makes any network changes,
+    // so it's done synchronously.
+
     // Reset
     g_startupDiagnosticInfo = StartupDiagnosticInfo();
 
@@ -1121,9 +1328,13 @@ void GetDiagnosticInfo(Json::Value& o_json)
     * SystemInformation::OSInfo
     */
 
+    // Feedback waits for any probes that are still running, but only up to
+    // a deadline; any that don't finish in time are reported as empty.
+    ULONGLONG probesDeadlineTickMS = GetTickCount64() + DIAGNOSTIC_PROBES_DEADLINE_MS;
+
     SystemInfo sysInfo;
     // We'll fill in the values even if this call fails.
-    (void)GetSystemInfo(sysInfo);
+    (void)g_systemInfoProbe.Get(sysInfo, RemainingMS(probesDeadlineTickMS));
     Json::Value osInfo = Json::Value(Json::objectValue);
     osInfo["name"] = WStringToUTF8(sysInfo.name);
     osInfo["version"] = WStringToUTF8(sysInfo.version);
@@ -1244,8 +1455,11 @@ void GetDiagnosticInfo(Json::Value& o_json)
 
     Json::Value securityInfo = Json::Value(Json::objectValue);
 
-    vector<SecurityInfo> antiVirusInfo, antiSpywareInfo, firewallInfo;
-    GetOSSecurityInfo(antiVirusInfo, antiSpywareInfo, firewallInfo);
+    OSSecurityInfo osSecurityInfo;
+    (void)g_osSecurityInfoProbe.Get(osSecurityInfo, RemainingMS(probesDeadlineTickMS));
+    vector<SecurityInfo>& antiVirusInfo = osSecurityInfo.antiVirusInfo;
+    vector<SecurityInfo>& antiSpywareInfo = osSecurityInfo.antiSpywareInfo;
+    vector<SecurityInfo>& firewallInfo = osSecurityInfo.firewallInfo;
 
     struct SecurityInfoSet {
         string name;
@@ -1302,6 +1516,30 @@ void GetDiagnosticInfo(Json::Value& o_json)
 
     o_json["SystemInformation"]["Misc"] = miscInfo;
 
+    /*
+     * Connect Timing
+     */
+
+    Json::Value connectTiming;
+    ConnectTiming::GetDiagnostics(connectTiming);
+    o_json["ConnectTiming"] = connectTiming;
+
+    /*
+     * Throughput
+     */
+
+    Json::Value throughput;
+    ThroughputMeter::GetSummary(throughput);
+    o_json["Throughput"] = throughput;
+
+    /*
+     * HTTPS Session Pool
+     */
+
+    Json::Value httpsSessionPool;
+    HTTPSessionPool::GetDiagnostics(httpsSessionPool);
+    o_json["HTTPSessionPool"] = httpsSessionPool;
+
     /*
      * Status History
      */
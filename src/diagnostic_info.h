@@ -22,10 +22,18 @@
 
 /**
 Should be called before Psiphon has attempted to connect or made any system
-network changes.
+network changes. Also starts the slow diagnostic probes (WMI queries, etc.) in
+the background.
 */
 void DoStartupDiagnosticCollection();
 
+/**
+Restores the diagnostic history of previous runs from its journal, and starts
+journaling new entries. Should be called once, early in app startup, by the
+primary instance.
+*/
+void RestoreDiagnosticHistory();
+
 /**
 Returns feedback data encoded as a JSON string. The returned JSON will omit
 diagnostic data if sendDiagnosticInfo is false, i.e. the user did not opt in
@@ -44,6 +52,7 @@ string GenerateFeedbackJSON(
 // template function needs them.)
 extern vector<string> g_diagnosticInfo;
 void _AddDiagnosticInfoHelper(const char* entry);
+void _JournalDiagnosticInfo(const string& jsonString);
 
 
 /**
@@ -76,6 +85,7 @@ void AddDiagnosticInfo(const char* message, const T& entry)
 
     AutoMUTEX mutex(g_diagnosticHistoryMutex);
     g_diagnosticHistory.append(json);
+    _JournalDiagnosticInfo(jsonString);
 }
 
 
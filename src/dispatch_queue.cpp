@@ -37,18 +37,28 @@ dispatch_queue::~dispatch_queue()
     }
 }
 
-bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_queued, const fp_t& op)
+void dispatch_queue::enqueue(queued_op&& qop)
+{
+    // Ahead of any lower priority ops, but behind those of the same priority
+    auto pos = q_.end();
+    while (pos != q_.begin() && (pos - 1)->priority < qop.priority) {
+        --pos;
+    }
+    q_.insert(pos, std::move(qop));
+}
+
+bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_queued, const fp_t& op, int priority)
 {
     std::unique_lock<std::mutex> lock(lock_);
 
     for (const auto& qop : q_) {
         for (const auto& skip : skip_if_op_type_queued) {
-            if (skip == qop.first) {
+            if (skip == qop.op_type) {
                 return false;
             }
         }
     }
-    q_.emplace_back(op_type, op);
+    enqueue(queued_op{ op_type, priority, op });
 
     // Manual unlocking is done before notifying, to avoid waking up
     // the waiting thread only to block again (see notify_one for details)
@@ -58,18 +68,18 @@ bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_qu
     return true;
 }
 
-bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_queued, fp_t&& op)
+bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_queued, fp_t&& op, int priority)
 {
     std::unique_lock<std::mutex> lock(lock_);
 
     for (const auto& qop : q_) {
         for (const auto& skip : skip_if_op_type_queued) {
-            if (skip == qop.first) {
+            if (skip == qop.op_type) {
                 return false;
             }
         }
     }
-    q_.emplace_back(op_type, std::move(op));
+    enqueue(queued_op{ op_type, priority, std::move(op) });
 
     // Manual unlocking is done before notifying, to avoid waking up
     // the waiting thread only to block again (see notify_one for details)
@@ -92,7 +102,7 @@ void dispatch_queue::dispatch_thread_handler(void)
         //after wait, we own the lock
         if (!quit_ && q_.size())
         {
-            auto op = std::move(q_.front().second);
+            auto op = std::move(q_.front().op);
             q_.pop_front();
 
             //unlock now that we're done messing with the queue
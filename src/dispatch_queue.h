@@ -16,10 +16,12 @@ public:
     dispatch_queue(std::string name, size_t thread_cnt = 1);
     ~dispatch_queue();
 
+    // Ops run in order of priority (higher first), and in the order they were
+    // dispatched within a priority.
     // dispatch and copy
-    bool dispatch(int op_type, const vector<int>& skip_if_op_queued, const fp_t& op);
+    bool dispatch(int op_type, const vector<int>& skip_if_op_queued, const fp_t& op, int priority = 0);
     // dispatch and move
-    bool dispatch(int op_type, const vector<int>& skip_if_op_queued, fp_t&& op);
+    bool dispatch(int op_type, const vector<int>& skip_if_op_queued, fp_t&& op, int priority = 0);
 
     // Deleted operations
     dispatch_queue(const dispatch_queue& rhs) = delete;
@@ -31,9 +33,17 @@ private:
     std::string name_;
     std::mutex lock_;
     std::vector<std::thread> threads_;
-    std::deque<std::pair<int, fp_t>> q_;
+    struct queued_op {
+        int op_type;
+        int priority;
+        fp_t op;
+    };
+    std::deque<queued_op> q_;
     std::condition_variable cv_;
     bool quit_ = false;
 
+    // Caller must hold lock_
+    void enqueue(queued_op&& qop);
+
     void dispatch_thread_handler(void);
 };
@@ -35,6 +35,9 @@
 
 using namespace std::experimental;
 
+// The diagnostic data is written to the upload subprocess in chunks of this size
+#define FEEDBACK_UPLOAD_PIPE_CHUNK_BYTES    (64*1024)
+
 // IWorkerThread boilerplate
 
 void FeedbackUpload::StartSendFeedback()
@@ -92,6 +95,7 @@ FeedbackUpload::FeedbackUpload(const string& diagnosticData,
                                const string& upstreamProxyAddress,
                                const StopInfo& stopInfo)
     : m_uploadStatus(FEEDBACK_UPLOAD_STATUS_IN_PROGRESS),
+      m_uploadProgressPercent(0),
       m_diagnosticData(diagnosticData),
       m_stopInfo(stopInfo),
       m_upstreamProxyAddress(upstreamProxyAddress)
@@ -220,20 +224,27 @@ bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, c
         return false;
     }
 
-    // Write diagnostics to stdin of the child process
+    // Write diagnostics to stdin of the child process. This is done in chunks,
+    // continuing from wherever a short write left off, and checking for stop
+    // in between, as the pipe blocks until the child reads the data.
 
-    DWORD totalNumWritten = 0;
+    size_t totalNumWritten = 0;
     while (totalNumWritten < diagnosticData.length()) {
+        if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons)) {
+            my_print(NOT_SENSITIVE, true, _T("%s - stopped while writing diagnostic data"), __TFUNCTION__);
+            return false;
+        }
+
+        DWORD chunkLength = (DWORD)min(diagnosticData.length() - totalNumWritten, (size_t)FEEDBACK_UPLOAD_PIPE_CHUNK_BYTES);
         DWORD numWritten = 0;
-        if (!WriteFile(m_psiphonTunnelCore->ParentInputPipe(), diagnosticData.c_str(), diagnosticData.length(), &numWritten, NULL)) {
+        if (!WriteFile(m_psiphonTunnelCore->ParentInputPipe(), diagnosticData.c_str() + totalNumWritten, chunkLength, &numWritten, NULL)) {
             my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin (%d)"), __TFUNCTION__, GetLastError());
             return false;
         }
 
-        if (numWritten != diagnosticData.length()) {
-            my_print(NOT_SENSITIVE, false, _T("%s - failed to write all diagnostic data to subprocess stdin, wrote %d of %d bytes"), __TFUNCTION__, numWritten, diagnosticData.length());
-        }
         totalNumWritten += numWritten;
+        m_uploadProgressPercent = (unsigned int)(totalNumWritten * 100 / diagnosticData.length());
+        my_print(NOT_SENSITIVE, true, _T("%s - wrote %d of %d bytes of diagnostic data"), __TFUNCTION__, totalNumWritten, diagnosticData.length());
     }
 
     if (!m_psiphonTunnelCore->CloseInputPipes()) {
@@ -325,3 +336,9 @@ DWORD FeedbackUpload::UploadStatus() const
 {
     return m_uploadStatus;
 }
+
+
+unsigned int FeedbackUpload::UploadProgressPercent() const
+{
+    return m_uploadProgressPercent;
+}
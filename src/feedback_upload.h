@@ -96,6 +96,12 @@ public:
     */
     DWORD FeedbackUpload::UploadStatus() const;
 
+    /**
+    How much of the diagnostic data has been handed to the upload subprocess,
+    from 0 to 100.
+    */
+    unsigned int UploadProgressPercent() const;
+
 protected:
     // IWorkerThread implementation
     bool DoStart();
@@ -117,6 +123,7 @@ protected:
 protected:
     tstring m_exePath;
     atomic<DWORD> m_uploadStatus;
+    atomic<unsigned int> m_uploadProgressPercent;
     WorkerThreadSynch m_workerThreadSynch;
     string m_diagnosticData;
     string m_upstreamProxyAddress;
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "config.h"
+#include "utilities.h"
+#include "feedback_upload_checkpoint.h"
+#include <WinCrypt.h>
+
+
+#pragma comment (lib, "crypt32.lib")
+
+
+static HANDLE g_feedbackCheckpointMutex = CreateMutex(NULL, FALSE, 0);
+
+
+static bool GetCheckpointFilePath(tstring& o_path)
+{
+    tstring dataDirectory;
+    if (!GetPsiphonDataPath({}, true, dataDirectory))
+    {
+        return false;
+    }
+
+    o_path = filesystem::path(dataDirectory).append(LOCAL_SETTINGS_APPDATA_FEEDBACK_CHECKPOINT_FILENAME).wstring();
+    return true;
+}
+
+// The checkpoint holds the user's feedback text and diagnostic info, so it's
+// encrypted with DPAPI and can only be read back by the same Windows user.
+static bool ProtectData(const string& plaintext, string& o_ciphertext)
+{
+    DATA_BLOB in = { (DWORD)plaintext.length(), (BYTE*)plaintext.data() };
+    DATA_BLOB out = { 0 };
+    if (!CryptProtectData(&in, NULL, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CryptProtectData failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    auto freeOut = finally([&out] { LocalFree(out.pbData); });
+
+    o_ciphertext.assign((const char*)out.pbData, out.cbData);
+    return true;
+}
+
+static bool UnprotectData(const string& ciphertext, string& o_plaintext)
+{
+    DATA_BLOB in = { (DWORD)ciphertext.length(), (BYTE*)ciphertext.data() };
+    DATA_BLOB out = { 0 };
+    if (!CryptUnprotectData(&in, NULL, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CryptUnprotectData failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    auto freeOut = finally([&out] { SecureZeroMemory(out.pbData, out.cbData); LocalFree(out.pbData); });
+
+    o_plaintext.assign((const char*)out.pbData, out.cbData);
+    return true;
+}
+
+static bool WriteCheckpoint(const tstring& path, const Json::Value& checkpoint)
+{
+    Json::FastWriter jsonWriter;
+    string data;
+    if (!ProtectData(jsonWriter.write(checkpoint), data))
+    {
+        return false;
+    }
+
+    if (!WriteFileAtomically(path, data))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: WriteFileAtomically failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    return true;
+}
+
+// Reads the checkpoint, and removes it if it's unusable. Caller must hold g_feedbackCheckpointMutex.
+static bool ReadCheckpoint(const tstring& path, Json::Value& o_checkpoint)
+{
+    string ciphertext;
+    if (!ReadFile(path, ciphertext))
+    {
+        return false;
+    }
+
+    string data;
+    Json::Reader reader;
+    if (!UnprotectData(ciphertext, data)
+        || !reader.parse(data, o_checkpoint)
+        || !o_checkpoint.isObject()
+        || !o_checkpoint["data"].isString()
+        || !o_checkpoint["attempts"].isInt()
+        || !o_checkpoint["created"].isUInt64())
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: discarding invalid checkpoint"), __TFUNCTION__);
+        (void)DeleteFile(path.c_str());
+        return false;
+    }
+
+    unsigned long long now = (unsigned long long)time(NULL);
+    unsigned long long created = o_checkpoint["created"].asUInt64();
+    if (now < created || now - created > FEEDBACK_UPLOAD_CHECKPOINT_TTL_SECONDS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: discarding expired checkpoint"), __TFUNCTION__);
+        (void)DeleteFile(path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+bool FeedbackUploadCheckpoint::Save(const string& diagnosticData)
+{
+    AutoMUTEX lock(g_feedbackCheckpointMutex);
+
+    tstring path;
+    if (!GetCheckpointFilePath(path))
+    {
+        return false;
+    }
+
+    Json::Value checkpoint;
+    checkpoint["data"] = diagnosticData;
+    checkpoint["attempts"] = 0;
+    checkpoint["created"] = (Json::UInt64)time(NULL);
+
+    return WriteCheckpoint(path, checkpoint);
+}
+
+
+bool FeedbackUploadCheckpoint::Load(string& o_diagnosticData, int& o_attempts)
+{
+    AutoMUTEX lock(g_feedbackCheckpointMutex);
+
+    tstring path;
+    Json::Value checkpoint;
+    if (!GetCheckpointFilePath(path) || !ReadCheckpoint(path, checkpoint))
+    {
+        return false;
+    }
+
+    o_diagnosticData = checkpoint["data"].asString();
+    o_attempts = checkpoint["attempts"].asInt();
+    return true;
+}
+
+
+bool FeedbackUploadCheckpoint::RecordAttempt()
+{
+    AutoMUTEX lock(g_feedbackCheckpointMutex);
+
+    tstring path;
+    Json::Value checkpoint;
+    if (!GetCheckpointFilePath(path) || !ReadCheckpoint(path, checkpoint))
+    {
+        // Without a checkpoint, the attempt is still allowed; it just can't
+        // be resumed if it's interrupted.
+        return true;
+    }
+
+    int attempts = checkpoint["attempts"].asInt() + 1;
+    if (attempts > FEEDBACK_UPLOAD_MAX_ATTEMPTS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: pending upload has used up its attempts"), __TFUNCTION__);
+        (void)DeleteFile(path.c_str());
+        return false;
+    }
+
+    checkpoint["attempts"] = attempts;
+    (void)WriteCheckpoint(path, checkpoint);
+    return true;
+}
+
+
+void FeedbackUploadCheckpoint::Clear()
+{
+    AutoMUTEX lock(g_feedbackCheckpointMutex);
+
+    tstring path;
+    if (GetCheckpointFilePath(path))
+    {
+        (void)DeleteFile(path.c_str());
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+On-disk checkpoint of a pending feedback upload, so that an upload that's
+interrupted -- by a connection state change, a failure, or the app exiting --
+is retried with the same feedback data rather than being lost. The checkpoint
+is dropped once the upload succeeds, after FEEDBACK_UPLOAD_MAX_ATTEMPTS, or
+when it's older than FEEDBACK_UPLOAD_CHECKPOINT_TTL_SECONDS. It's stored
+encrypted for the current Windows user (DPAPI).
+*/
+namespace FeedbackUploadCheckpoint
+{
+    /// Replaces any pending upload with this one. Returns false if it couldn't be stored.
+    bool Save(const string& diagnosticData);
+
+    /// Gets the pending upload and the number of attempts made at it so far.
+    /// Returns false if there isn't one (or it has expired).
+    bool Load(string& o_diagnosticData, int& o_attempts);
+
+    /// Records that another attempt is being made at the pending upload.
+    /// Returns false if the pending upload has used up its attempts, in which
+    /// case it's dropped and shouldn't be attempted.
+    bool RecordAttempt();
+
+    /// Drops the pending upload.
+    void Clear();
+}
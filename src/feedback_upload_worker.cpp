@@ -66,3 +66,9 @@ bool FeedbackUploadWorker::UploadSuccessful() const
 {
     return m_feedbackUpload->UploadStatus() == FEEDBACK_UPLOAD_STATUS_SUCCESS;
 }
+
+
+unsigned int FeedbackUploadWorker::UploadProgressPercent() const
+{
+    return m_feedbackUpload->UploadProgressPercent();
+}
@@ -61,6 +61,11 @@ public:
     */
     bool UploadSuccessful() const;
 
+    /**
+    Returns the upload progress, from 0 to 100.
+    */
+    unsigned int UploadProgressPercent() const;
+
 protected:
     bool m_isVPNMode;
     unique_ptr<FeedbackUpload> m_feedbackUpload;
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "utilities.h"
+#include "history_journal.h"
+
+
+HistoryJournal::HistoryJournal(const TCHAR* filename, size_t segmentBytes)
+    : m_filename(filename),
+      m_segmentBytes(segmentBytes),
+      m_file(INVALID_HANDLE_VALUE),
+      m_mapping(NULL),
+      m_view(NULL),
+      m_offset(0)
+{
+}
+
+
+HistoryJournal::~HistoryJournal()
+{
+    Close();
+}
+
+
+bool HistoryJournal::Open(const function<void(const Json::Value&)>& replay)
+{
+    if (m_view)
+    {
+        return true;
+    }
+
+    tstring dataDirectory;
+    if (!GetPsiphonDataPath({}, true, dataDirectory))
+    {
+        return false;
+    }
+    m_path = filesystem::path(dataDirectory).append(m_filename).wstring();
+
+    string data;
+    if (ReadFile(m_path + _T(".old"), data))
+    {
+        Replay(data.c_str(), data.length(), replay);
+    }
+    if (ReadFile(m_path, data))
+    {
+        Replay(data.c_str(), data.length(), replay);
+    }
+
+    if (!MapSegment(false))
+    {
+        return false;
+    }
+
+    // The segment is zero-filled past the last record
+    m_offset = m_segmentBytes;
+    while (m_offset > 0 && m_view[m_offset - 1] == '\0')
+    {
+        m_offset--;
+    }
+
+    return true;
+}
+
+
+void HistoryJournal::Append(const string& jsonLine)
+{
+    if (!m_view)
+    {
+        return;
+    }
+
+    size_t recordBytes = 1 + jsonLine.length();
+    if (recordBytes > m_segmentBytes)
+    {
+        // Would never fit
+        return;
+    }
+
+    if (m_offset + recordBytes > m_segmentBytes && !RotateSegment())
+    {
+        return;
+    }
+
+    m_view[m_offset] = '\n';
+    memcpy(m_view + m_offset + 1, jsonLine.c_str(), jsonLine.length());
+    m_offset += recordBytes;
+}
+
+
+void HistoryJournal::Close()
+{
+    if (m_view)
+    {
+        (void)FlushViewOfFile(m_view, 0);
+    }
+    UnmapSegment();
+}
+
+
+void HistoryJournal::Replay(const char* data, size_t length, const function<void(const Json::Value&)>& replay)
+{
+    // JSON output has no raw NULs, so the first one is the end of the records
+    const char* end = (const char*)memchr(data, '\0', length);
+    if (end)
+    {
+        length = end - data;
+    }
+
+    Json::Reader reader;
+    size_t pos = 0;
+    while (pos < length)
+    {
+        size_t lineEnd = pos;
+        while (lineEnd < length && data[lineEnd] != '\n')
+        {
+            lineEnd++;
+        }
+
+        if (lineEnd == length)
+        {
+            // Torn record at the end of the segment
+            break;
+        }
+
+        Json::Value record;
+        if (lineEnd > pos && reader.parse(data + pos, data + lineEnd, record, false))
+        {
+            replay(record);
+        }
+
+        pos = lineEnd + 1;
+    }
+}
+
+
+bool HistoryJournal::MapSegment(bool create)
+{
+    m_file = CreateFile(
+        m_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+        NULL, create ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // This extends the file to the segment size, zero-filled, if it's smaller
+    m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, 0, (DWORD)m_segmentBytes, NULL);
+    if (m_mapping)
+    {
+        m_view = (char*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, m_segmentBytes);
+    }
+
+    if (!m_view)
+    {
+        OutputDebugString(_T("HistoryJournal: failed to map segment\n"));
+        UnmapSegment();
+        return false;
+    }
+
+    return true;
+}
+
+
+void HistoryJournal::UnmapSegment()
+{
+    if (m_view)
+    {
+        (void)UnmapViewOfFile(m_view);
+        m_view = NULL;
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+    m_offset = 0;
+}
+
+
+bool HistoryJournal::RotateSegment()
+{
+    UnmapSegment();
+
+    // If the move fails, the full segment is overwritten instead; either way
+    // the journal carries on.
+    if (!MoveFileEx(m_path.c_str(), (m_path + _T(".old")).c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        OutputDebugString(_T("HistoryJournal: failed to rotate segment\n"));
+    }
+
+    return MapSegment(true);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+Append-only, on-disk journal of history records (see MessageHistory and
+DiagnosticHistory), so that the history survives a crash or restart and can
+be included in feedback sent afterwards.
+
+The journal is a pair of fixed-size, memory-mapped segment files: the current
+one, and the one before it. Appending is a copy into the mapped view -- the OS
+writes the pages back, even if the process crashes -- so it costs about the
+same as keeping the record in memory. When the current segment is full, it
+replaces the previous one and a new, empty one is started, which caps the
+journal at two segments.
+
+Each record is one line of JSON, preceded by a newline, so that a torn record
+(from a crash mid-append) is skipped on replay without losing the next one.
+
+A journal isn't internally synchronized: the owning history serializes all
+calls with its own mutex, which it already holds when recording an entry.
+Nothing here may call my_print, as my_print appends to a journal.
+*/
+class HistoryJournal
+{
+public:
+    HistoryJournal(const TCHAR* filename, size_t segmentBytes);
+    ~HistoryJournal();
+
+    /// Opens the journal, calling `replay` with each record in it, oldest
+    /// first, and then readies it for appending. Until it's opened, appends
+    /// are dropped. Returns false if the journal couldn't be opened.
+    bool Open(const function<void(const Json::Value&)>& replay);
+
+    /// Appends a record, which must be the output of Json::FastWriter (a single
+    /// line, ending with a newline).
+    void Append(const string& jsonLine);
+
+    /// Flushes and closes the journal.
+    void Close();
+
+private:
+    void Replay(const char* data, size_t length, const function<void(const Json::Value&)>& replay);
+    bool MapSegment(bool create);
+    void UnmapSegment();
+    bool RotateSegment();
+
+    // not copyable
+    HistoryJournal(const HistoryJournal&);
+    HistoryJournal& operator=(const HistoryJournal&);
+
+    tstring m_filename;
+    size_t m_segmentBytes;
+    tstring m_path;
+    HANDLE m_file;
+    HANDLE m_mapping;
+    char* m_view;
+    size_t m_offset;
+};
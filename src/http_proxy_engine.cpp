@@ -0,0 +1,1631 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+// Windows fd_sets are arrays, and this is their capacity; i.e., the most
+// sockets a single select() can wait on. It must be set before WinSock2.h.
+#define FD_SETSIZE 1024
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#include "logging.h"
+#include "dispatch_queue.h"
+#include "http_proxy_engine.h"
+#include <algorithm>
+#include <list>
+
+
+// Each direction of each connection has a buffer of this size, which request
+// and response headers must fit in.
+#define HTTP_PROXY_BUFFER_BYTES                 (32*1024)
+
+// Idle upstream connections kept for reuse, in total and per origin.
+#define HTTP_PROXY_POOL_MAX_IDLE                64
+#define HTTP_PROXY_POOL_MAX_IDLE_PER_ORIGIN     4
+#define HTTP_PROXY_POOL_IDLE_TIMEOUT_MS         (30*1000)
+
+// Each client connection may have an upstream connection, and the listener
+// and the pool also need room in the fd_sets.
+#define HTTP_PROXY_MAX_CONNECTIONS              ((FD_SETSIZE - 1 - HTTP_PROXY_POOL_MAX_IDLE) / 2)
+
+#define HTTP_PROXY_CONNECT_TIMEOUT_MS           (20*1000)
+
+// Client connections waiting for a request are closed after this long.
+#define HTTP_PROXY_CLIENT_IDLE_TIMEOUT_MS       (2*60*1000)
+
+// How long select() waits. This bounds how long Stop takes. Name resolution
+// happens on the resolver threads, so while any is pending, select() waits for
+// HTTP_PROXY_RESOLVE_POLL_MS instead.
+#define HTTP_PROXY_SELECT_TIMEOUT_MS            250
+#define HTTP_PROXY_RESOLVE_POLL_MS              10
+
+// getaddrinfo blocks, so it's run by a fixed set of threads. Requests beyond
+// the pending limit are failed rather than queued.
+#define HTTP_PROXY_RESOLVER_THREADS             4
+#define HTTP_PROXY_RESOLVE_MAX_PENDING          128
+
+// How often, at most, bytes transferred are reported to the stats sink.
+#define HTTP_PROXY_STATS_INTERVAL_MS            200
+
+
+namespace {
+
+enum FramingType
+{
+    FRAMING_NONE,
+    FRAMING_LENGTH,
+    FRAMING_CHUNKED,
+    FRAMING_UNTIL_CLOSE,
+    FRAMING_TUNNEL
+};
+
+enum ChunkState
+{
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER_LINE_START,
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE
+};
+
+/*
+One direction of a connection. Received bytes stay where they were received
+until they're sent: [start, start+cleared) have been framed and may be sent,
+and [start+cleared, end) are still to be parsed. Headers that are rewritten
+are dropped from the buffer, and the rewritten header is sent from `prefix`.
+*/
+struct Flow
+{
+    vector<char> buffer;
+    size_t start;
+    size_t cleared;
+    size_t end;
+    string prefix;
+    size_t prefixSent;
+
+    bool inHeader;
+    bool done;
+    bool eof;
+    FramingType framing;
+    unsigned long long remaining;
+    ChunkState chunkState;
+
+    Flow()
+        : buffer(HTTP_PROXY_BUFFER_BYTES), start(0), cleared(0), end(0), prefixSent(0),
+          inHeader(true), done(false), eof(false), framing(FRAMING_NONE), remaining(0), chunkState(CHUNK_SIZE)
+    {
+    }
+
+    bool HasPending() const { return prefixSent < prefix.length() || cleared > 0; }
+    size_t Unparsed() const { return end - start - cleared; }
+    const char* UnparsedData() const { return &buffer[start + cleared]; }
+
+    // Only headers need to be contiguous, so only then is unsent data moved
+    // to make room; otherwise the buffer is reused once it's drained.
+    bool HasSpace() const { return end < buffer.size() || (inHeader && start > 0); }
+
+    void ResetFraming()
+    {
+        inHeader = true;
+        done = false;
+        framing = FRAMING_NONE;
+        remaining = 0;
+        chunkState = CHUNK_SIZE;
+    }
+};
+
+struct ResolveJob
+{
+    string host;
+    string port;
+    addrinfo* result;
+    atomic<bool> done;
+    // The connection no longer wants the result, so a queued job is skipped
+    atomic<bool> cancelled;
+
+    ResolveJob(const string& host, const string& port) : host(host), port(port), result(NULL), done(false), cancelled(false) {}
+    ~ResolveJob() { if (result) freeaddrinfo(result); }
+};
+
+enum UpstreamState
+{
+    UPSTREAM_NONE,
+    UPSTREAM_RESOLVING,
+    UPSTREAM_CONNECTING,
+    UPSTREAM_CONNECTED
+};
+
+struct Connection
+{
+    SOCKET client;
+    SOCKET upstream;
+    UpstreamState upstreamState;
+
+    // The current request's origin. "host:port", lowercase; the pool key.
+    string origin;
+    string host;
+    string port;
+
+    shared_ptr<ResolveJob> resolveJob;
+    addrinfo* nextAddress;
+    ULONGLONG connectDeadlineMS;
+
+    Flow request;   // client to upstream
+    Flow response;  // upstream to client
+
+    // A request has been parsed, and its response isn't complete.
+    bool exchange;
+    bool isConnect;
+    bool isHead;
+    // GET, HEAD and OPTIONS can be resent if a reused upstream connection
+    // is closed before any response arrives.
+    bool isIdempotent;
+    bool clientKeepAlive;
+    bool upstreamKeepAlive;
+    bool upstreamReused;
+    // The upstream connection is attached but has no exchange, and may be
+    // reused by the next request, or pooled.
+    bool upstreamIdle;
+    bool upstreamShutdown;
+    bool responseStarted;
+
+    // Send what's pending to the client, then close.
+    bool closing;
+    bool closed;
+    ULONGLONG lastActivityMS;
+
+    Connection(SOCKET client)
+        : client(client), upstream(INVALID_SOCKET), upstreamState(UPSTREAM_NONE),
+          nextAddress(NULL), connectDeadlineMS(0),
+          exchange(false), isConnect(false), isHead(false), isIdempotent(false),
+          clientKeepAlive(false), upstreamKeepAlive(false), upstreamReused(false),
+          upstreamIdle(false), upstreamShutdown(false), responseStarted(false),
+          closing(false), closed(false), lastActivityMS(GetTickCount64())
+    {
+    }
+};
+
+struct PooledUpstream
+{
+    SOCKET socket;
+    ULONGLONG idleSinceMS;
+};
+
+struct EngineState
+{
+    IHttpProxyStatsSink* statsSink;
+    list<unique_ptr<Connection>> connections;
+    multimap<string, PooledUpstream> pool;
+    unsigned long long sentBytes;
+    unsigned long long receivedBytes;
+    // Jobs queued or running on the resolver, including cancelled ones.
+    // Declared before `resolver`, which uses it until its threads are joined.
+    atomic<size_t> pendingResolves;
+    unique_ptr<dispatch_queue> resolver;
+};
+
+struct HttpHeader
+{
+    string firstLine;
+    vector<pair<string, string>> fields;
+};
+
+} // namespace
+
+
+static bool IEquals(const string& a, const char* b)
+{
+    return _stricmp(a.c_str(), b) == 0;
+}
+
+static string ToLower(string s)
+{
+    transform(s.begin(), s.end(), s.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+    return s;
+}
+
+static string Trim(const string& s)
+{
+    size_t first = s.find_first_not_of(" \t");
+    if (first == string::npos)
+    {
+        return string();
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+static int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Returns the length of the header (including the blank line that ends it),
+// or 0 if it's incomplete.
+static size_t FindHeaderEnd(const char* data, size_t length)
+{
+    static const char END[] = "\r\n\r\n";
+    const char* found = search(data, data + length, END, END + 4);
+    return found == data + length ? 0 : (found - data) + 4;
+}
+
+static bool ParseHeader(const char* data, size_t length, HttpHeader& o_header)
+{
+    o_header = HttpHeader();
+
+    static const char CRLF[] = "\r\n";
+    const char* end = data + length;
+    const char* pos = data;
+    bool firstLine = true;
+    while (pos < end)
+    {
+        const char* lineEnd = search(pos, end, CRLF, CRLF + 2);
+        if (lineEnd == end || lineEnd == pos)
+        {
+            break;
+        }
+        string line(pos, lineEnd);
+        pos = lineEnd + 2;
+
+        if (firstLine)
+        {
+            o_header.firstLine = line;
+            firstLine = false;
+        }
+        else if (line[0] == ' ' || line[0] == '\t')
+        {
+            // Obsolete line folding continues the previous field
+            if (o_header.fields.empty())
+            {
+                return false;
+            }
+            o_header.fields.back().second += " " + Trim(line);
+        }
+        else
+        {
+            size_t colon = line.find(':');
+            if (colon == string::npos || colon == 0)
+            {
+                return false;
+            }
+            o_header.fields.push_back(make_pair(line.substr(0, colon), Trim(line.substr(colon + 1))));
+        }
+    }
+
+    return !o_header.firstLine.empty();
+}
+
+static const string* FindField(const HttpHeader& header, const char* name)
+{
+    for (const auto& field : header.fields)
+    {
+        if (IEquals(field.first, name))
+        {
+            return &field.second;
+        }
+    }
+    return NULL;
+}
+
+// True if any `name` field has `token` in its comma-separated value.
+static bool FieldHasToken(const HttpHeader& header, const char* name, const char* token)
+{
+    for (const auto& field : header.fields)
+    {
+        if (!IEquals(field.first, name))
+        {
+            continue;
+        }
+
+        stringstream value(field.second);
+        string item;
+        while (getline(value, item, ','))
+        {
+            if (IEquals(Trim(item), token))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool ParseContentLength(const string& value, unsigned long long& o_length)
+{
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos || value.length() > 18)
+    {
+        return false;
+    }
+    o_length = _strtoui64(value.c_str(), NULL, 10);
+    return true;
+}
+
+// Splits "host:port" or "[v6]:port". The port is left empty if there isn't one.
+static bool SplitHostPort(const string& authority, string& o_host, string& o_port)
+{
+    size_t portColon = string::npos;
+    if (!authority.empty() && authority[0] == '[')
+    {
+        size_t close = authority.find(']');
+        if (close == string::npos)
+        {
+            return false;
+        }
+        o_host = authority.substr(1, close - 1);
+        if (close + 1 < authority.length())
+        {
+            if (authority[close + 1] != ':')
+            {
+                return false;
+            }
+            portColon = close + 1;
+        }
+    }
+    else
+    {
+        portColon = authority.rfind(':');
+        o_host = authority.substr(0, portColon);
+    }
+
+    o_port = portColon == string::npos ? string() : authority.substr(portColon + 1);
+
+    return !o_host.empty()
+        && o_port.find_first_not_of("0123456789") == string::npos
+        && o_port.length() <= 5;
+}
+
+// Parses an absolute "http://" URL, as sent to a proxy, into the authority
+// (without any userinfo), host, port, and the path to send to the origin.
+static bool ParseProxyURL(const string& url, string& o_authority, string& o_host, string& o_port, string& o_path)
+{
+    static const char SCHEME[] = "http://";
+    if (url.length() <= strlen(SCHEME) || !IEquals(url.substr(0, strlen(SCHEME)), SCHEME))
+    {
+        return false;
+    }
+
+    size_t authorityStart = strlen(SCHEME);
+    size_t authorityEnd = url.find_first_of("/?#", authorityStart);
+    if (authorityEnd == string::npos)
+    {
+        authorityEnd = url.length();
+    }
+
+    o_authority = url.substr(authorityStart, authorityEnd - authorityStart);
+    size_t at = o_authority.rfind('@');
+    if (at != string::npos)
+    {
+        o_authority.erase(0, at + 1);
+    }
+
+    if (!SplitHostPort(o_authority, o_host, o_port))
+    {
+        return false;
+    }
+    if (o_port.empty())
+    {
+        o_port = "80";
+    }
+
+    o_path = url.substr(authorityEnd);
+    size_t fragment = o_path.find('#');
+    if (fragment != string::npos)
+    {
+        o_path.erase(fragment);
+    }
+    if (o_path.empty() || o_path[0] != '/')
+    {
+        o_path.insert(0, "/");
+    }
+
+    return true;
+}
+
+static bool IsHopByHopField(const string& name)
+{
+    return IEquals(name, "Connection")
+        || IEquals(name, "Proxy-Connection")
+        || IEquals(name, "Keep-Alive")
+        || IEquals(name, "Proxy-Authorization")
+        || IEquals(name, "TE");
+}
+
+// Rewrites a proxy request header as an origin request header.
+static string RewriteRequestHeader(
+    const HttpHeader& header,
+    const string& method,
+    const string& path,
+    const string& version,
+    const string& authority,
+    bool upgrade)
+{
+    string rewritten = method + " " + path + " " + version + "\r\n";
+
+    // Fields named in Connection are hop-by-hop too (RFC 7230 section 6.1).
+    // An upgrade request's Upgrade field is kept, as the upgrade is passed on,
+    // and so are the framing fields, as the body is relayed as it's framed.
+    vector<string> connectionFields;
+    for (const auto& field : header.fields)
+    {
+        if (!IEquals(field.first, "Connection") && !IEquals(field.first, "Proxy-Connection"))
+        {
+            continue;
+        }
+
+        stringstream value(field.second);
+        string item;
+        while (getline(value, item, ','))
+        {
+            item = Trim(item);
+            if (!item.empty()
+                && !(upgrade && IEquals(item, "Upgrade"))
+                && !IEquals(item, "Transfer-Encoding")
+                && !IEquals(item, "Content-Length"))
+            {
+                connectionFields.push_back(item);
+            }
+        }
+    }
+
+    bool hasHost = false;
+    for (const auto& field : header.fields)
+    {
+        if (IsHopByHopField(field.first)
+            || any_of(connectionFields.begin(), connectionFields.end(),
+                      [&field](const string& name) { return IEquals(field.first, name.c_str()); }))
+        {
+            continue;
+        }
+        hasHost = hasHost || IEquals(field.first, "Host");
+        rewritten += field.first + ": " + field.second + "\r\n";
+    }
+
+    if (!hasHost)
+    {
+        rewritten += "Host: " + authority + "\r\n";
+    }
+
+    if (upgrade)
+    {
+        rewritten += "Connection: Upgrade\r\n";
+    }
+    else if (version != "HTTP/1.1")
+    {
+        // HTTP/1.0 clients may not understand a persistent response, so the
+        // upstream connection isn't kept.
+        rewritten += "Connection: close\r\n";
+    }
+
+    return rewritten + "\r\n";
+}
+
+// Clears as much of the unparsed data as belongs to the current body.
+// Returns true when the body is complete.
+static bool AdvanceBody(Flow& flow)
+{
+    switch (flow.framing)
+    {
+    case FRAMING_NONE:
+        return true;
+
+    case FRAMING_LENGTH:
+    {
+        unsigned long long n = flow.Unparsed();
+        if (n > flow.remaining)
+        {
+            n = flow.remaining;
+        }
+        flow.cleared += (size_t)n;
+        flow.remaining -= n;
+        return flow.remaining == 0;
+    }
+
+    case FRAMING_CHUNKED:
+        // The chunked encoding is relayed as-is; it's only parsed to find
+        // where the body ends.
+        while (flow.chunkState != CHUNK_DONE && flow.Unparsed() > 0)
+        {
+            if (flow.chunkState == CHUNK_DATA)
+            {
+                unsigned long long n = flow.Unparsed();
+                if (n > flow.remaining)
+                {
+                    n = flow.remaining;
+                }
+                flow.cleared += (size_t)n;
+                flow.remaining -= n;
+                if (flow.remaining == 0)
+                {
+                    flow.chunkState = CHUNK_DATA_END;
+                }
+                continue;
+            }
+
+            char c = *flow.UnparsedData();
+            flow.cleared++;
+
+            switch (flow.chunkState)
+            {
+            case CHUNK_SIZE:
+            {
+                int digit = HexDigit(c);
+                if (digit >= 0)
+                {
+                    if (flow.remaining > (~0ULL >> 4))
+                    {
+                        // Not a usable chunk size; relay until the connection closes
+                        flow.framing = FRAMING_UNTIL_CLOSE;
+                        return AdvanceBody(flow);
+                    }
+                    flow.remaining = flow.remaining * 16 + digit;
+                }
+                else if (c == '\n')
+                {
+                    flow.chunkState = flow.remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_LINE_START;
+                }
+                else
+                {
+                    flow.chunkState = CHUNK_EXTENSION;
+                }
+                break;
+            }
+            case CHUNK_EXTENSION:
+                if (c == '\n')
+                {
+                    flow.chunkState = flow.remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_LINE_START;
+                }
+                break;
+            case CHUNK_DATA_END:
+                if (c == '\n')
+                {
+                    flow.chunkState = CHUNK_SIZE;
+                    flow.remaining = 0;
+                }
+                break;
+            case CHUNK_TRAILER_LINE_START:
+                if (c == '\n')
+                {
+                    flow.chunkState = CHUNK_DONE;
+                }
+                else if (c != '\r')
+                {
+                    flow.chunkState = CHUNK_TRAILER_LINE;
+                }
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n')
+                {
+                    flow.chunkState = CHUNK_TRAILER_LINE_START;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        return flow.chunkState == CHUNK_DONE;
+
+    default: // FRAMING_UNTIL_CLOSE, FRAMING_TUNNEL
+        flow.cleared += flow.Unparsed();
+        return false;
+    }
+}
+
+static void SetSocketOptions(SOCKET s)
+{
+    u_long nonBlocking = 1;
+    (void)ioctlsocket(s, FIONBIO, &nonBlocking);
+
+    int noDelay = 1;
+    (void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+}
+
+// Returns the number of bytes received, 0 on EOF, or -1 on error.
+// WSAEWOULDBLOCK is reported as an error, as it's only called when readable.
+static int RecvFlow(SOCKET s, Flow& flow)
+{
+    if (flow.start == flow.end)
+    {
+        flow.start = flow.end = 0;
+    }
+    else if (flow.end == flow.buffer.size() && flow.inHeader && flow.start > 0)
+    {
+        memmove(&flow.buffer[0], &flow.buffer[flow.start], flow.end - flow.start);
+        flow.end -= flow.start;
+        flow.start = 0;
+    }
+
+    int received = recv(s, &flow.buffer[flow.end], (int)(flow.buffer.size() - flow.end), 0);
+    if (received > 0)
+    {
+        flow.end += received;
+    }
+    return received;
+}
+
+// Sends as much of the pending data as the socket will take.
+// Returns false on a socket error.
+static bool SendFlow(SOCKET s, Flow& flow, unsigned long long& io_bytes)
+{
+    while (flow.prefixSent < flow.prefix.length())
+    {
+        int sent = send(s, flow.prefix.data() + flow.prefixSent, (int)(flow.prefix.length() - flow.prefixSent), 0);
+        if (sent == SOCKET_ERROR)
+        {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        flow.prefixSent += sent;
+        io_bytes += sent;
+    }
+
+    while (flow.cleared > 0)
+    {
+        int sent = send(s, &flow.buffer[flow.start], (int)flow.cleared, 0);
+        if (sent == SOCKET_ERROR)
+        {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        flow.start += sent;
+        flow.cleared -= sent;
+        io_bytes += sent;
+    }
+
+    if (flow.start == flow.end)
+    {
+        flow.start = flow.end = 0;
+    }
+
+    return true;
+}
+
+static void CloseUpstream(Connection& conn)
+{
+    if (conn.upstream != INVALID_SOCKET)
+    {
+        closesocket(conn.upstream);
+        conn.upstream = INVALID_SOCKET;
+    }
+    conn.upstreamState = UPSTREAM_NONE;
+    conn.upstreamIdle = false;
+    conn.upstreamShutdown = false;
+    if (conn.resolveJob)
+    {
+        conn.resolveJob->cancelled = true;
+        conn.resolveJob.reset();
+    }
+    conn.nextAddress = NULL;
+}
+
+// Pools the upstream connection if it's idle and there's room; otherwise closes it.
+static void ReleaseUpstream(EngineState& engine, Connection& conn)
+{
+    if (conn.upstreamIdle
+        && engine.pool.size() < HTTP_PROXY_POOL_MAX_IDLE
+        && engine.pool.count(conn.origin) < HTTP_PROXY_POOL_MAX_IDLE_PER_ORIGIN)
+    {
+        PooledUpstream pooled = { conn.upstream, GetTickCount64() };
+        engine.pool.insert(make_pair(conn.origin, pooled));
+        conn.upstream = INVALID_SOCKET;
+    }
+
+    CloseUpstream(conn);
+}
+
+static SOCKET TakePooledUpstream(EngineState& engine, const string& origin)
+{
+    auto it = engine.pool.find(origin);
+    if (it == engine.pool.end())
+    {
+        return INVALID_SOCKET;
+    }
+
+    SOCKET s = it->second.socket;
+    engine.pool.erase(it);
+    return s;
+}
+
+static void CloseConnection(EngineState& engine, Connection& conn)
+{
+    closesocket(conn.client);
+    conn.client = INVALID_SOCKET;
+    ReleaseUpstream(engine, conn);
+    conn.closed = true;
+}
+
+// Ends the exchange with an error response, if none of the response has been
+// sent yet; otherwise the client connection is just closed.
+static void FailRequest(Connection& conn, const char* status)
+{
+    if (!conn.responseStarted && conn.response.prefix.empty())
+    {
+        conn.response.prefix = string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        conn.response.prefixSent = 0;
+    }
+    conn.exchange = false;
+    conn.closing = true;
+    CloseUpstream(conn);
+}
+
+// Starts a non-blocking connect to the next of the resolved addresses.
+// Returns false if there are none left.
+static bool ConnectNextAddress(Connection& conn)
+{
+    while (conn.nextAddress)
+    {
+        addrinfo* address = conn.nextAddress;
+        conn.nextAddress = address->ai_next;
+
+        SOCKET s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (s == INVALID_SOCKET)
+        {
+            continue;
+        }
+        SetSocketOptions(s);
+
+        if (connect(s, address->ai_addr, (int)address->ai_addrlen) == 0
+            || WSAGetLastError() == WSAEWOULDBLOCK)
+        {
+            conn.upstream = s;
+            conn.upstreamState = UPSTREAM_CONNECTING;
+            conn.connectDeadlineMS = GetTickCount64() + HTTP_PROXY_CONNECT_TIMEOUT_MS;
+            return true;
+        }
+
+        closesocket(s);
+    }
+
+    return false;
+}
+
+static void StartResolve(EngineState& engine, Connection& conn)
+{
+    if (engine.pendingResolves >= HTTP_PROXY_RESOLVE_MAX_PENDING)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: too many pending name resolutions"), __TFUNCTION__);
+        FailRequest(conn, "503 Service Unavailable");
+        return;
+    }
+
+    shared_ptr<ResolveJob> job(new ResolveJob(conn.host, conn.port));
+    atomic<size_t>* pendingResolves = &engine.pendingResolves;
+    ++*pendingResolves;
+
+    // The job is run by a resolver thread, and polled for completion
+    (void)engine.resolver->dispatch(0, {}, [job, pendingResolves]() {
+        if (!job->cancelled)
+        {
+            addrinfo hints;
+            ZeroMemory(&hints, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_protocol = IPPROTO_TCP;
+
+            addrinfo* result = NULL;
+            if (getaddrinfo(job->host.c_str(), job->port.c_str(), &hints, &result) == 0)
+            {
+                job->result = result;
+            }
+        }
+        job->done = true;
+        --*pendingResolves;
+    });
+
+    conn.resolveJob = job;
+    conn.upstreamState = UPSTREAM_RESOLVING;
+}
+
+// Attaches an upstream connection to the origin of the request just parsed:
+// the one already attached, a pooled one, or a new one.
+static void StartUpstream(EngineState& engine, Connection& conn)
+{
+    string origin = ToLower(conn.host) + ":" + conn.port;
+
+    if (conn.upstreamIdle)
+    {
+        if (origin == conn.origin && !conn.isConnect)
+        {
+            conn.upstreamIdle = false;
+            conn.upstreamReused = true;
+            return;
+        }
+        ReleaseUpstream(engine, conn);
+    }
+
+    conn.origin = origin;
+    conn.upstreamReused = false;
+
+    // Tunnels are never pooled, so they never reuse pooled connections
+    if (!conn.isConnect)
+    {
+        SOCKET pooled = TakePooledUpstream(engine, origin);
+        if (pooled != INVALID_SOCKET)
+        {
+            conn.upstream = pooled;
+            conn.upstreamState = UPSTREAM_CONNECTED;
+            conn.upstreamReused = true;
+            return;
+        }
+    }
+
+    StartResolve(engine, conn);
+}
+
+// Parses a complete request header, if one has been received, and starts the
+// exchange for it.
+static void ProcessRequestHeader(EngineState& engine, Connection& conn)
+{
+    Flow& request = conn.request;
+    assert(request.cleared == 0);
+
+    // RFC 7230 allows empty lines before the request line
+    while (request.Unparsed() > 0 && (*request.UnparsedData() == '\r' || *request.UnparsedData() == '\n'))
+    {
+        request.start++;
+    }
+
+    size_t headerLength = FindHeaderEnd(request.UnparsedData(), request.Unparsed());
+    if (headerLength == 0)
+    {
+        if (request.Unparsed() == request.buffer.size())
+        {
+            FailRequest(conn, "431 Request Header Fields Too Large");
+        }
+        return;
+    }
+
+    HttpHeader header;
+    bool parsed = ParseHeader(request.UnparsedData(), headerLength, header);
+
+    // The header is dropped from the buffer; a rewritten one is sent instead
+    request.start += headerLength;
+    request.inHeader = false;
+
+    conn.exchange = true;
+    conn.responseStarted = false;
+    conn.response.prefix.clear();
+    conn.response.prefixSent = 0;
+
+    stringstream firstLine(header.firstLine);
+    string method, target, version;
+    if (!parsed
+        || !(firstLine >> method >> target >> version)
+        || version.compare(0, 5, "HTTP/") != 0)
+    {
+        FailRequest(conn, "400 Bad Request");
+        return;
+    }
+
+    conn.isConnect = method == "CONNECT";
+    conn.isHead = method == "HEAD";
+    conn.isIdempotent = conn.isHead || method == "GET" || method == "OPTIONS";
+
+    if (conn.isConnect)
+    {
+        if (!SplitHostPort(target, conn.host, conn.port) || conn.port.empty())
+        {
+            FailRequest(conn, "400 Bad Request");
+            return;
+        }
+
+        if (engine.statsSink)
+        {
+            engine.statsSink->OnHttpsRequest(target);
+        }
+
+        // Anything the client sends after the CONNECT is relayed once connected
+        conn.clientKeepAlive = false;
+        request.prefix.clear();
+        request.prefixSent = 0;
+        request.framing = FRAMING_TUNNEL;
+    }
+    else
+    {
+        string authority, path;
+        if (!ParseProxyURL(target, authority, conn.host, conn.port, path))
+        {
+            FailRequest(conn, "400 Bad Request");
+            return;
+        }
+
+        // Every plain HTTP request is reported, as Polipo did. LocalProxy's
+        // page view regexes decide which of them count, and how.
+        if (engine.statsSink)
+        {
+            engine.statsSink->OnPageView(target);
+        }
+
+        conn.clientKeepAlive = version == "HTTP/1.1"
+            && !FieldHasToken(header, "Connection", "close")
+            && !FieldHasToken(header, "Proxy-Connection", "close");
+
+        const string* contentLength = FindField(header, "Content-Length");
+        if (FieldHasToken(header, "Transfer-Encoding", "chunked"))
+        {
+            request.framing = FRAMING_CHUNKED;
+        }
+        else if (contentLength)
+        {
+            if (!ParseContentLength(*contentLength, request.remaining))
+            {
+                FailRequest(conn, "400 Bad Request");
+                return;
+            }
+            request.framing = request.remaining > 0 ? FRAMING_LENGTH : FRAMING_NONE;
+        }
+        else
+        {
+            request.framing = FRAMING_NONE;
+        }
+
+        request.prefix = RewriteRequestHeader(
+                            header, method, path, version, authority,
+                            FieldHasToken(header, "Connection", "upgrade"));
+        request.prefixSent = 0;
+    }
+
+    request.done = request.framing == FRAMING_NONE;
+
+    StartUpstream(engine, conn);
+}
+
+// Parses the response header(s), if received. Response headers are relayed
+// as-is.
+static void ProcessResponseHeader(Connection& conn)
+{
+    Flow& response = conn.response;
+
+    while (response.inHeader)
+    {
+        size_t headerLength = FindHeaderEnd(response.UnparsedData(), response.Unparsed());
+        if (headerLength == 0)
+        {
+            if (response.Unparsed() == response.buffer.size())
+            {
+                FailRequest(conn, "502 Bad Gateway");
+            }
+            return;
+        }
+
+        HttpHeader header;
+        stringstream statusLine;
+        string version;
+        int status = 0;
+        if (ParseHeader(response.UnparsedData(), headerLength, header))
+        {
+            statusLine.str(header.firstLine);
+            statusLine >> version >> status;
+        }
+        if (version.compare(0, 5, "HTTP/") != 0 || status < 100 || status > 999)
+        {
+            FailRequest(conn, "502 Bad Gateway");
+            return;
+        }
+
+        response.cleared += headerLength;
+        conn.responseStarted = true;
+
+        if (status < 200 && status != 101)
+        {
+            // An interim response; the final one follows
+            continue;
+        }
+
+        response.inHeader = false;
+
+        conn.upstreamKeepAlive = version == "HTTP/1.1"
+            ? !FieldHasToken(header, "Connection", "close")
+            : FieldHasToken(header, "Connection", "keep-alive");
+
+        const string* contentLength = FindField(header, "Content-Length");
+        if (status == 101)
+        {
+            // Switching protocols: from here on, it's a tunnel
+            response.framing = FRAMING_TUNNEL;
+            conn.request.framing = FRAMING_TUNNEL;
+            conn.request.done = false;
+            conn.clientKeepAlive = false;
+            conn.upstreamKeepAlive = false;
+        }
+        else if (conn.isHead || status == 204 || status == 304)
+        {
+            response.framing = FRAMING_NONE;
+        }
+        else if (FieldHasToken(header, "Transfer-Encoding", "chunked"))
+        {
+            response.framing = FRAMING_CHUNKED;
+        }
+        else if (contentLength && ParseContentLength(*contentLength, response.remaining))
+        {
+            response.framing = response.remaining > 0 ? FRAMING_LENGTH : FRAMING_NONE;
+        }
+        else
+        {
+            response.framing = FRAMING_UNTIL_CLOSE;
+            conn.upstreamKeepAlive = false;
+        }
+    }
+}
+
+// Ends the exchange, once the response is complete. Returns true if the
+// client connection is ready for another request.
+static bool CompleteExchange(EngineState& engine, Connection& conn)
+{
+    conn.exchange = false;
+    conn.response.done = true;
+
+    // Anything the origin sent past the end of the response is discarded
+    conn.response.end = conn.response.start + conn.response.cleared;
+
+    bool requestSent = conn.request.done && !conn.request.HasPending();
+
+    if (conn.upstreamKeepAlive && requestSent && conn.upstreamState == UPSTREAM_CONNECTED)
+    {
+        conn.upstreamIdle = true;
+    }
+    else
+    {
+        CloseUpstream(conn);
+    }
+
+    if (!conn.clientKeepAlive || !conn.upstreamKeepAlive || !requestSent)
+    {
+        conn.closing = true;
+        ReleaseUpstream(engine, conn);
+        return false;
+    }
+
+    conn.request.ResetFraming();
+    conn.response.ResetFraming();
+    conn.request.prefix.clear();
+    conn.request.prefixSent = 0;
+    return true;
+}
+
+static void OnUpstreamClosed(EngineState& engine, Connection& conn)
+{
+    bool reused = conn.upstreamReused;
+    CloseUpstream(conn);
+
+    if (!conn.exchange)
+    {
+        return;
+    }
+
+    if (conn.response.inHeader && !conn.responseStarted)
+    {
+        // A pooled connection may be closed by the origin just as it's
+        // reused. If the request is idempotent and can be resent, retry on a
+        // new connection. Otherwise the origin may already have acted on it.
+        if (reused && conn.isIdempotent
+            && conn.request.framing == FRAMING_NONE && conn.response.Unparsed() == 0)
+        {
+            conn.request.prefixSent = 0;
+            conn.upstreamReused = false;
+            StartResolve(engine, conn);
+            return;
+        }
+
+        FailRequest(conn, "502 Bad Gateway");
+        return;
+    }
+
+    if (!conn.response.inHeader && conn.response.framing == FRAMING_UNTIL_CLOSE)
+    {
+        (void)AdvanceBody(conn.response);
+        (void)CompleteExchange(engine, conn);
+        return;
+    }
+
+    // A closed tunnel, or a truncated response: relay what was received, then close
+    conn.closing = true;
+}
+
+// Parses and relays whatever can be, after any I/O on the connection.
+static void PumpConnection(EngineState& engine, Connection& conn)
+{
+    Flow& request = conn.request;
+    Flow& response = conn.response;
+
+    bool again = true;
+    while (again && !conn.closed)
+    {
+        again = false;
+
+        if (!conn.closing && !conn.exchange && request.inHeader && request.Unparsed() > 0)
+        {
+            ProcessRequestHeader(engine, conn);
+        }
+
+        if (!request.inHeader && !request.done && AdvanceBody(request))
+        {
+            request.done = true;
+        }
+
+        if (conn.exchange && response.inHeader)
+        {
+            ProcessResponseHeader(conn);
+        }
+
+        if (conn.exchange && !response.inHeader && AdvanceBody(response))
+        {
+            // A pipelined request may already be buffered
+            again = CompleteExchange(engine, conn) && request.Unparsed() > 0;
+        }
+
+        if (conn.upstreamState == UPSTREAM_CONNECTED && !conn.upstreamShutdown)
+        {
+            if (!SendFlow(conn.upstream, request, engine.sentBytes))
+            {
+                OnUpstreamClosed(engine, conn);
+            }
+            else if (request.eof && !request.HasPending() && request.framing == FRAMING_TUNNEL)
+            {
+                // The client half-closed the tunnel; pass that on
+                shutdown(conn.upstream, SD_SEND);
+                conn.upstreamShutdown = true;
+            }
+        }
+
+        if (!SendFlow(conn.client, response, engine.receivedBytes))
+        {
+            CloseConnection(engine, conn);
+            return;
+        }
+
+        if (conn.closing && !response.HasPending())
+        {
+            CloseConnection(engine, conn);
+            return;
+        }
+    }
+}
+
+static void OnClientReadable(EngineState& engine, Connection& conn)
+{
+    int received = RecvFlow(conn.client, conn.request);
+    if (received > 0)
+    {
+        conn.lastActivityMS = GetTickCount64();
+        return;
+    }
+
+    if (received < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+    {
+        return;
+    }
+
+    conn.request.eof = true;
+
+    // A client may half-close a tunnel and still expect the rest of the
+    // response. Otherwise, a closed client has nothing more to receive.
+    if (received < 0 || conn.request.framing != FRAMING_TUNNEL || conn.closing)
+    {
+        CloseConnection(engine, conn);
+    }
+}
+
+static void OnUpstreamReadable(EngineState& engine, Connection& conn)
+{
+    if (conn.upstreamIdle)
+    {
+        // Idle connections have nothing to say, so the origin has closed it
+        CloseUpstream(conn);
+        return;
+    }
+
+    int received = RecvFlow(conn.upstream, conn.response);
+    if (received > 0)
+    {
+        conn.lastActivityMS = GetTickCount64();
+        return;
+    }
+
+    if (received < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+    {
+        return;
+    }
+
+    conn.response.eof = true;
+    OnUpstreamClosed(engine, conn);
+}
+
+static void OnUpstreamConnectDone(Connection& conn, bool failed)
+{
+    int error = 0;
+    int errorLength = sizeof(error);
+    if (!failed
+        && getsockopt(conn.upstream, SOL_SOCKET, SO_ERROR, (char*)&error, &errorLength) == 0
+        && error == 0)
+    {
+        conn.upstreamState = UPSTREAM_CONNECTED;
+        conn.resolveJob.reset();
+        conn.nextAddress = NULL;
+
+        if (conn.isConnect)
+        {
+            conn.response.prefix = "HTTP/1.1 200 Connection established\r\n\r\n";
+            conn.response.prefixSent = 0;
+            conn.response.inHeader = false;
+            conn.response.framing = FRAMING_TUNNEL;
+            conn.responseStarted = true;
+        }
+        return;
+    }
+
+    closesocket(conn.upstream);
+    conn.upstream = INVALID_SOCKET;
+    if (!ConnectNextAddress(conn))
+    {
+        FailRequest(conn, "502 Bad Gateway");
+    }
+}
+
+static void OnResolveDone(Connection& conn)
+{
+    conn.nextAddress = conn.resolveJob->result;
+    if (!ConnectNextAddress(conn))
+    {
+        my_print(SENSITIVE_FORMAT_ARGS, true, _T("%s: could not connect to %S"), __TFUNCTION__, conn.origin.c_str());
+        FailRequest(conn, "502 Bad Gateway");
+    }
+}
+
+static bool ClientWantsRead(const Connection& conn)
+{
+    const Flow& request = conn.request;
+    return !conn.closing
+        && !request.eof
+        && request.HasSpace()
+        && (request.inHeader ? !conn.exchange : !request.done);
+}
+
+static bool UpstreamWantsRead(const Connection& conn)
+{
+    return conn.upstreamState == UPSTREAM_CONNECTED
+        && (conn.upstreamIdle
+            || (conn.exchange && !conn.response.done && conn.response.HasSpace()));
+}
+
+static void AcceptConnections(EngineState& engine, SOCKET listenSocket)
+{
+    while (engine.connections.size() < HTTP_PROXY_MAX_CONNECTIONS)
+    {
+        SOCKET client = accept(listenSocket, NULL, NULL);
+        if (client == INVALID_SOCKET)
+        {
+            return;
+        }
+        SetSocketOptions(client);
+        engine.connections.push_back(unique_ptr<Connection>(new Connection(client)));
+    }
+}
+
+static void ReportBytesTransferred(EngineState& engine)
+{
+    if (engine.statsSink && (engine.sentBytes > 0 || engine.receivedBytes > 0))
+    {
+        engine.statsSink->OnBytesTransferred(engine.sentBytes, engine.receivedBytes);
+    }
+    engine.sentBytes = 0;
+    engine.receivedBytes = 0;
+}
+
+
+HttpProxyEngine::HttpProxyEngine(IHttpProxyStatsSink* statsSink)
+    : m_statsSink(statsSink),
+      m_listenSocket(INVALID_SOCKET),
+      m_wsaStarted(false),
+      m_stop(false),
+      m_running(false)
+{
+}
+
+HttpProxyEngine::~HttpProxyEngine()
+{
+    Stop();
+}
+
+bool HttpProxyEngine::Start(int port)
+{
+    Stop();
+
+    // Each successful WSAStartup is paired with a WSACleanup: in Stop, or
+    // below if the engine doesn't start.
+    WSADATA wsaData;
+    int wsaError = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (wsaError != 0)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: WSAStartup failed (%d)"), __TFUNCTION__, wsaError);
+        return false;
+    }
+
+    SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket == INVALID_SOCKET)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: socket failed (%d)"), __TFUNCTION__, WSAGetLastError());
+        WSACleanup();
+        return false;
+    }
+
+    // Don't let another process bind the same port
+    int exclusive = 1;
+    (void)setsockopt(listenSocket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive));
+
+    sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((u_short)port);
+
+    u_long nonBlocking = 1;
+    if (bind(listenSocket, (sockaddr*)&address, sizeof(address)) != 0
+        || listen(listenSocket, SOMAXCONN) != 0
+        || ioctlsocket(listenSocket, FIONBIO, &nonBlocking) != 0)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: listen on port %d failed (%d)"), __TFUNCTION__, port, WSAGetLastError());
+        closesocket(listenSocket);
+        WSACleanup();
+        return false;
+    }
+
+    m_listenSocket = listenSocket;
+    m_stop = false;
+    m_running = true;
+
+    try
+    {
+        m_thread = thread([this]() { Run(); });
+    }
+    catch (std::exception&)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: thread creation failed"), __TFUNCTION__);
+        m_running = false;
+        closesocket(listenSocket);
+        m_listenSocket = INVALID_SOCKET;
+        WSACleanup();
+        return false;
+    }
+
+    m_wsaStarted = true;
+
+    return true;
+}
+
+void HttpProxyEngine::Stop()
+{
+    m_stop = true;
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+
+    if (m_listenSocket != INVALID_SOCKET)
+    {
+        closesocket(m_listenSocket);
+        m_listenSocket = INVALID_SOCKET;
+    }
+
+    if (m_wsaStarted)
+    {
+        WSACleanup();
+        m_wsaStarted = false;
+    }
+}
+
+bool HttpProxyEngine::IsRunning() const
+{
+    return m_running;
+}
+
+void HttpProxyEngine::Run()
+{
+    EngineState engine;
+    engine.statsSink = m_statsSink;
+    engine.sentBytes = 0;
+    engine.receivedBytes = 0;
+    engine.pendingResolves = 0;
+
+    try
+    {
+        engine.resolver.reset(new dispatch_queue("HttpProxyEngine resolver", HTTP_PROXY_RESOLVER_THREADS));
+    }
+    catch (std::exception&)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: resolver thread creation failed"), __TFUNCTION__);
+        m_running = false;
+        return;
+    }
+
+    SOCKET listenSocket = (SOCKET)m_listenSocket;
+    ULONGLONG lastStatsReportMS = GetTickCount64();
+
+    while (!m_stop)
+    {
+        fd_set readSet, writeSet, exceptSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_ZERO(&exceptSet);
+
+        bool resolving = false;
+        size_t socketCount = 0;
+        auto watch = [&socketCount](SOCKET s, fd_set& set) {
+            FD_SET(s, &set);
+            socketCount++;
+        };
+
+        if (engine.connections.size() < HTTP_PROXY_MAX_CONNECTIONS)
+        {
+            watch(listenSocket, readSet);
+        }
+
+        for (const auto& conn : engine.connections)
+        {
+            if (ClientWantsRead(*conn))
+            {
+                watch(conn->client, readSet);
+            }
+            if (conn->response.HasPending())
+            {
+                watch(conn->client, writeSet);
+            }
+
+            switch (conn->upstreamState)
+            {
+            case UPSTREAM_RESOLVING:
+                resolving = true;
+                break;
+            case UPSTREAM_CONNECTING:
+                // Windows reports a failed connect in the except set
+                watch(conn->upstream, writeSet);
+                watch(conn->upstream, exceptSet);
+                break;
+            case UPSTREAM_CONNECTED:
+                if (UpstreamWantsRead(*conn))
+                {
+                    watch(conn->upstream, readSet);
+                }
+                if (conn->request.HasPending() && !conn->upstreamShutdown)
+                {
+                    watch(conn->upstream, writeSet);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        // Pooled connections are watched for the origin closing them
+        for (const auto& pooled : engine.pool)
+        {
+            watch(pooled.second.socket, readSet);
+        }
+
+        timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = (resolving ? HTTP_PROXY_RESOLVE_POLL_MS : HTTP_PROXY_SELECT_TIMEOUT_MS) * 1000;
+
+        if (socketCount == 0)
+        {
+            // select() fails when it's given no sockets
+            Sleep(timeout.tv_usec / 1000);
+        }
+        else if (select(0, &readSet, &writeSet, &exceptSet, &timeout) == SOCKET_ERROR)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: select failed (%d)"), __TFUNCTION__, WSAGetLastError());
+            break;
+        }
+
+        ULONGLONG nowMS = GetTickCount64();
+
+        for (auto it = engine.pool.begin(); it != engine.pool.end(); )
+        {
+            if (FD_ISSET(it->second.socket, &readSet)
+                || nowMS >= it->second.idleSinceMS + HTTP_PROXY_POOL_IDLE_TIMEOUT_MS)
+            {
+                closesocket(it->second.socket);
+                it = engine.pool.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        for (const auto& connPtr : engine.connections)
+        {
+            Connection& conn = *connPtr;
+
+            if (conn.upstreamState == UPSTREAM_RESOLVING && conn.resolveJob->done)
+            {
+                OnResolveDone(conn);
+            }
+            else if (conn.upstreamState == UPSTREAM_CONNECTING)
+            {
+                if (FD_ISSET(conn.upstream, &exceptSet))
+                {
+                    OnUpstreamConnectDone(conn, true);
+                }
+                else if (FD_ISSET(conn.upstream, &writeSet))
+                {
+                    OnUpstreamConnectDone(conn, false);
+                }
+                else if (nowMS >= conn.connectDeadlineMS)
+                {
+                    my_print(SENSITIVE_FORMAT_ARGS, true, _T("%s: connect to %S timed out"), __TFUNCTION__, conn.origin.c_str());
+                    FailRequest(conn, "504 Gateway Timeout");
+                }
+            }
+            else if (conn.upstreamState == UPSTREAM_CONNECTED && FD_ISSET(conn.upstream, &readSet))
+            {
+                OnUpstreamReadable(engine, conn);
+            }
+
+            if (!conn.closed && FD_ISSET(conn.client, &readSet))
+            {
+                OnClientReadable(engine, conn);
+            }
+
+            if (!conn.closed)
+            {
+                PumpConnection(engine, conn);
+            }
+
+            if (!conn.closed
+                && !conn.exchange
+                && !conn.response.HasPending()
+                && nowMS >= conn.lastActivityMS + HTTP_PROXY_CLIENT_IDLE_TIMEOUT_MS)
+            {
+                CloseConnection(engine, conn);
+            }
+        }
+
+        engine.connections.remove_if([](const unique_ptr<Connection>& conn) { return conn->closed; });
+
+        if (FD_ISSET(listenSocket, &readSet))
+        {
+            AcceptConnections(engine, listenSocket);
+        }
+
+        if (nowMS - lastStatsReportMS >= HTTP_PROXY_STATS_INTERVAL_MS)
+        {
+            ReportBytesTransferred(engine);
+            lastStatsReportMS = nowMS;
+        }
+    }
+
+    for (const auto& conn : engine.connections)
+    {
+        CloseUpstream(*conn);
+        closesocket(conn->client);
+    }
+    for (const auto& pooled : engine.pool)
+    {
+        closesocket(pooled.second.socket);
+    }
+
+    ReportBytesTransferred(engine);
+
+    // Queued name resolutions are dropped; this waits for any in progress
+    engine.resolver.reset();
+
+    m_running = false;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+Receives the engine's stats as they happen. Called from the engine thread.
+*/
+class IHttpProxyStatsSink
+{
+public:
+    /// A plain HTTP request was made through the proxy. `url` is the absolute
+    /// request URL, as sent by the client. Every request is reported, whatever
+    /// its response, as Polipo's page view markers were.
+    virtual void OnPageView(const string& url) = 0;
+
+    /// A CONNECT request was made through the proxy. `hostAndPort` is the
+    /// request target, as sent by the client.
+    virtual void OnHttpsRequest(const string& hostAndPort) = 0;
+
+    /// Bytes relayed since the last call. Sent is client-to-origin.
+    virtual void OnBytesTransferred(unsigned long long sentBytes, unsigned long long receivedBytes) = 0;
+};
+
+
+/**
+An in-process HTTP proxy, supporting CONNECT and plain HTTP requests, which
+connects directly to origin servers. A single thread services all sockets
+with select(). Relayed bytes are sent from the buffer they were received
+into; only rewritten request headers are copied. Idle keep-alive upstream
+connections are pooled per origin and reused by later requests.
+*/
+class HttpProxyEngine
+{
+public:
+    /// If statsSink is null, no stats are reported.
+    HttpProxyEngine(IHttpProxyStatsSink* statsSink);
+    ~HttpProxyEngine();
+
+    /// Listens on localhost:port and starts the engine thread.
+    /// Returns false (having logged why) if the engine couldn't be started.
+    bool Start(int port);
+
+    /// Stops the engine thread and closes all connections. Blocks until the
+    /// thread exits, which waits for any name resolution in progress.
+    /// Safe to call if not started.
+    void Stop();
+
+    /// False if the engine isn't started, or its thread has failed.
+    bool IsRunning() const;
+
+private:
+    void Run();
+
+    // not copyable
+    HttpProxyEngine(const HttpProxyEngine&);
+    HttpProxyEngine& operator=(const HttpProxyEngine&);
+
+    IHttpProxyStatsSink* m_statsSink;
+    UINT_PTR m_listenSocket; // SOCKET, without pulling in WinSock2.h
+    bool m_wsaStarted;
+    thread m_thread;
+    atomic<bool> m_stop;
+    atomic<bool> m_running;
+};
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "config.h"
+#include "utilities.h"
+#include "https_session_pool.h"
+#include "systemproxysettings.h"
+#include <algorithm>
+#include <tuple>
+
+
+// The maximum number of sessions kept in the pool. Requests beyond this get
+// sessions that are closed when they're done.
+#define HTTPS_SESSION_POOL_MAX_SESSIONS         8
+
+// Caps the concurrent connections a single session makes to its server.
+#define HTTPS_SESSION_MAX_CONNS_PER_SERVER      4
+
+
+// (proxyHost, serverAddress, serverPort, useURLProxy, webServerCertificate)
+typedef tuple<tstring, tstring, int, bool, string> SessionKey;
+
+struct HTTPSessionPool::Session
+{
+    SessionKey key;
+    HINTERNET session;
+    HINTERNET connect;
+    int leaseCount;
+    ULONGLONG idleSinceTickMS;
+    // The GetProxyConfigGeneration when the session was opened
+    unsigned int proxyConfigGeneration;
+    // False if the session isn't (or is no longer) in the pool, in which case
+    // it's closed when its last lease is released.
+    bool pooled;
+
+    Session() : session(NULL), connect(NULL), leaseCount(0), idleSinceTickMS(0), proxyConfigGeneration(0), pooled(false) {}
+};
+
+
+// Guards all of the following
+static HANDLE g_sessionPoolMutex = CreateMutex(NULL, FALSE, 0);
+
+static vector<HTTPSessionPool::Session*> g_pooledSessions;
+
+static unsigned int g_hitCount = 0;
+static unsigned int g_missCount = 0;
+static unsigned int g_overflowCount = 0;
+static unsigned int g_idleEvictionCount = 0;
+static unsigned int g_proxyChangeEvictionCount = 0;
+static unsigned int g_capacityEvictionCount = 0;
+static unsigned int g_discardCount = 0;
+
+
+static void CloseSession(HTTPSessionPool::Session* session)
+{
+    if (session->connect != NULL)
+    {
+        WinHttpCloseHandle(session->connect);
+    }
+    if (session->session != NULL)
+    {
+        WinHttpCloseHandle(session->session);
+    }
+    delete session;
+}
+
+// Caller must hold g_sessionPoolMutex. The session remains open until it's no
+// longer leased.
+static void RemoveFromPoolLocked(HTTPSessionPool::Session* session)
+{
+    g_pooledSessions.erase(
+        remove(g_pooledSessions.begin(), g_pooledSessions.end(), session),
+        g_pooledSessions.end());
+
+    session->pooled = false;
+    if (session->leaseCount == 0)
+    {
+        CloseSession(session);
+    }
+}
+
+// Caller must hold g_sessionPoolMutex
+static void EvictIdleSessionsLocked()
+{
+    ULONGLONG nowTickMS = GetTickCount64();
+
+    // Copy, as evicting modifies g_pooledSessions
+    vector<HTTPSessionPool::Session*> sessions = g_pooledSessions;
+    for (auto session : sessions)
+    {
+        if (session->leaseCount == 0
+            && nowTickMS - session->idleSinceTickMS >= HTTPS_SESSION_POOL_IDLE_TTL_MS)
+        {
+            g_idleEvictionCount++;
+            RemoveFromPoolLocked(session);
+        }
+    }
+}
+
+// Caller must hold g_sessionPoolMutex. Sessions opened before the proxy
+// config last changed have kept-alive connections through the old proxy
+// (e.g., the previous tunnel's local proxy), so they're evicted.
+static void EvictStaleProxyConfigSessionsLocked(unsigned int proxyConfigGeneration)
+{
+    // Copy, as evicting modifies g_pooledSessions
+    vector<HTTPSessionPool::Session*> sessions = g_pooledSessions;
+    for (auto session : sessions)
+    {
+        if (session->proxyConfigGeneration != proxyConfigGeneration)
+        {
+            g_proxyChangeEvictionCount++;
+            RemoveFromPoolLocked(session);
+        }
+    }
+}
+
+// Caller must hold g_sessionPoolMutex. Evicts the least recently used idle
+// session, if there is one. Returns true if a session was evicted.
+static bool EvictLeastRecentlyUsedLocked()
+{
+    HTTPSessionPool::Session* lruSession = NULL;
+    for (auto session : g_pooledSessions)
+    {
+        if (session->leaseCount == 0
+            && (!lruSession || session->idleSinceTickMS < lruSession->idleSinceTickMS))
+        {
+            lruSession = session;
+        }
+    }
+
+    if (!lruSession)
+    {
+        return false;
+    }
+
+    g_capacityEvictionCount++;
+    RemoveFromPoolLocked(lruSession);
+    return true;
+}
+
+// Returns NULL on failure.
+static HTTPSessionPool::Session* OpenSession(const SessionKey& key, unsigned int proxyConfigGeneration, bool silentMode)
+{
+    const tstring& proxyHost = get<0>(key);
+    const tstring& serverAddress = get<1>(key);
+    int serverPort = get<2>(key);
+    bool useURLProxy = get<3>(key);
+
+    unique_ptr<HTTPSessionPool::Session> session(new HTTPSessionPool::Session());
+    session->key = key;
+    session->proxyConfigGeneration = proxyConfigGeneration;
+
+    // Closes the handles if we return early
+    auto closeOnFailure = finally([&session] {
+        if (session)
+        {
+            CloseSession(session.release());
+        }
+    });
+
+    session->session =
+                WinHttpOpen(
+                    _T("Mozilla/4.0 (compatible; MSIE 5.22)"),
+                    proxyHost.length() ? WINHTTP_ACCESS_TYPE_NAMED_PROXY : WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+                    proxyHost.length() ? proxyHost.c_str() : WINHTTP_NO_PROXY_NAME,
+                    WINHTTP_NO_PROXY_BYPASS,
+                    WINHTTP_FLAG_ASYNC);
+
+    if (NULL == session->session)
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpOpen failed (%d)"), GetLastError());
+        return NULL;
+    }
+
+    if (FALSE == WinHttpSetTimeouts(session->session, 0, HTTPS_REQUEST_CONNECT_TIMEOUT_MS,
+                            HTTPS_REQUEST_SEND_TIMEOUT_MS, HTTPS_REQUEST_RECEIVE_TIMEOUT_MS))
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpSetTimeouts failed (%d)"), GetLastError());
+        return NULL;
+    }
+
+    // SSLv3, TLSv1.0, TLSv1.1 all have security flaws that mean that should be avoided.
+    // Some of those flaws (like SSLv3's POODLE http://cve.mitre.org/cgi-bin/cvename.cgi?name=CVE-2014-3566)
+    // require the client side to not try to use them. So we're going to force use of
+    // TLS v1.2. We'll try to remember to update these flags when new TLS versions come
+    // out; we think it's too risky to set all bits except the bad ones (like ~(SSL|TLS1.0|TLS1.1)),
+    // as we might get something we don't want.
+    // When WinHttpSetOption gets flags it doesn't understand -- like WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
+    // on XP and Vista -- it returns FALSE and sets errno to ERROR_INVALID_PARAMETER (87). When
+    // that happens we'll fall back to the URL proxy. That's why we're _not_ going
+    // to set the HTTPS protocol for URL proxy requests (and it's HTTP, not HTTPS).
+    DWORD dwProtocols = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
+    if (!useURLProxy)
+    {
+        if (FALSE == WinHttpSetOption(
+            session->session,
+            WINHTTP_OPTION_SECURE_PROTOCOLS,
+            &dwProtocols,
+            sizeof(DWORD)))
+        {
+            my_print(NOT_SENSITIVE, silentMode, _T("WinHttpSetOption WINHTTP_OPTION_SECURE_PROTOCOLS failed (%d)"), GetLastError());
+            return NULL;
+        }
+    }
+
+    // Not fatal; WinHTTP's default limit applies instead
+    DWORD dwMaxConns = HTTPS_SESSION_MAX_CONNS_PER_SERVER;
+    if (FALSE == WinHttpSetOption(
+        session->session,
+        WINHTTP_OPTION_MAX_CONNS_PER_SERVER,
+        &dwMaxConns,
+        sizeof(DWORD)))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: WinHttpSetOption WINHTTP_OPTION_MAX_CONNS_PER_SERVER failed (%d)"), __TFUNCTION__, GetLastError());
+    }
+
+    session->connect =
+            WinHttpConnect(
+                session->session,
+                serverAddress.c_str(),
+                (INTERNET_PORT)serverPort,
+                0);
+
+    if (NULL == session->connect)
+    {
+        my_print(NOT_SENSITIVE, silentMode, _T("WinHttpConnect failed (%d)"), GetLastError());
+        return NULL;
+    }
+
+    return session.release();
+}
+
+
+// static
+unique_ptr<HTTPSessionPool::Lease> HTTPSessionPool::Acquire(
+    const tstring& proxyHost,
+    const tstring& serverAddress,
+    int serverPort,
+    bool useURLProxy,
+    const string& webServerCertificate,
+    bool fresh,
+    bool silentMode)
+{
+    SessionKey key(proxyHost, serverAddress, serverPort, useURLProxy, webServerCertificate);
+    unsigned int proxyConfigGeneration = GetProxyConfigGeneration();
+
+    {
+        AutoMUTEX lock(g_sessionPoolMutex);
+
+        EvictStaleProxyConfigSessionsLocked(proxyConfigGeneration);
+        EvictIdleSessionsLocked();
+
+        if (!fresh)
+        {
+            for (auto session : g_pooledSessions)
+            {
+                if (session->key == key)
+                {
+                    g_hitCount++;
+                    session->leaseCount++;
+                    return unique_ptr<Lease>(new Lease(session, true));
+                }
+            }
+        }
+
+        g_missCount++;
+    }
+
+    // Opening a session doesn't touch the network, but there's no need to
+    // hold the mutex while doing it.
+    Session* session = OpenSession(key, proxyConfigGeneration, silentMode);
+    if (!session)
+    {
+        return NULL;
+    }
+
+    AutoMUTEX lock(g_sessionPoolMutex);
+
+    session->leaseCount = 1;
+    session->pooled =
+        g_pooledSessions.size() < HTTPS_SESSION_POOL_MAX_SESSIONS
+        || EvictLeastRecentlyUsedLocked();
+
+    if (session->pooled)
+    {
+        g_pooledSessions.push_back(session);
+    }
+    else
+    {
+        // Every pooled session is in use
+        g_overflowCount++;
+    }
+
+    return unique_ptr<Lease>(new Lease(session, false));
+}
+
+
+HTTPSessionPool::Lease::~Lease()
+{
+    AutoMUTEX lock(g_sessionPoolMutex);
+
+    assert(m_session->leaseCount > 0);
+    m_session->leaseCount--;
+    m_session->idleSinceTickMS = GetTickCount64();
+
+    if (m_session->leaseCount == 0 && !m_session->pooled)
+    {
+        CloseSession(m_session);
+    }
+}
+
+
+HINTERNET HTTPSessionPool::Lease::GetConnectHandle() const
+{
+    return m_session->connect;
+}
+
+
+void HTTPSessionPool::Lease::Discard()
+{
+    AutoMUTEX lock(g_sessionPoolMutex);
+
+    if (m_session->pooled)
+    {
+        g_discardCount++;
+        // Not closed here, as we hold a lease
+        RemoveFromPoolLocked(m_session);
+    }
+}
+
+
+// static
+void HTTPSessionPool::Clear()
+{
+    AutoMUTEX lock(g_sessionPoolMutex);
+
+    // Copy, as removing modifies g_pooledSessions
+    vector<Session*> sessions = g_pooledSessions;
+    for (auto session : sessions)
+    {
+        RemoveFromPoolLocked(session);
+    }
+}
+
+
+// static
+void HTTPSessionPool::GetDiagnostics(Json::Value& o_json)
+{
+    AutoMUTEX lock(g_sessionPoolMutex);
+
+    o_json = Json::Value(Json::objectValue);
+    o_json["hits"] = g_hitCount;
+    o_json["misses"] = g_missCount;
+    o_json["overflows"] = g_overflowCount;
+    o_json["idleEvictions"] = g_idleEvictionCount;
+    o_json["proxyChangeEvictions"] = g_proxyChangeEvictionCount;
+    o_json["capacityEvictions"] = g_capacityEvictionCount;
+    o_json["discards"] = g_discardCount;
+    o_json["pooledSessions"] = (Json::UInt)g_pooledSessions.size();
+}
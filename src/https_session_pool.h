@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <Winhttp.h>
+
+
+/**
+WinHTTP sessions kept open across HTTPSRequests, so that requests to the same
+server (PsiCash, status, handshake, etc.) can reuse its connections instead of
+each doing its own TCP and TLS handshakes. Sessions are keyed by everything that
+affects how their connections are made: the proxy, the server, whether the
+request goes via the URL proxy, and the pinned server certificate.
+
+Idle sessions are closed after HTTPS_SESSION_POOL_IDLE_TTL_MS, which is shorter
+than tunnel-core's idle connection timeout, so that kept-alive connections via
+the local proxy are (mostly) not reused after tunnel-core has dropped them.
+Sessions are also closed when the default proxy configs change (see
+GetProxyConfigGeneration), e.g. when a tunnel connects or disconnects.
+*/
+class HTTPSessionPool
+{
+public:
+    struct Session;
+
+    /// Holds a session, which is returned to the pool when the lease is destroyed.
+    /// A session may be leased to multiple concurrent requests.
+    class Lease
+    {
+    public:
+        ~Lease();
+
+        /// The WinHttpConnect handle to open requests on.
+        HINTERNET GetConnectHandle() const;
+
+        /// True if the session has been used for a previous request, in which
+        /// case a failure may be due to a stale kept-alive connection.
+        bool IsReused() const { return m_reused; }
+
+        /// Marks the session to be closed, rather than pooled, once it's no
+        /// longer leased. Called when a request on it fails.
+        void Discard();
+
+    private:
+        friend class HTTPSessionPool;
+        Lease(Session* session, bool reused) : m_session(session), m_reused(reused) {}
+
+        // not copyable
+        Lease(const Lease&);
+        Lease& operator=(const Lease&);
+
+        Session* m_session;
+        bool m_reused;
+    };
+
+    /// Gets a lease on a session for the given server, opening a new one if
+    /// there's no pooled session for it (or if `fresh` is true). An empty
+    /// proxyHost means the default proxy settings. Returns NULL on failure.
+    static unique_ptr<Lease> Acquire(
+        const tstring& proxyHost,
+        const tstring& serverAddress,
+        int serverPort,
+        bool useURLProxy,
+        const string& webServerCertificate,
+        bool fresh,
+        bool silentMode);
+
+    /// Closes all sessions that aren't currently leased. Called when the
+    /// application exits.
+    static void Clear();
+
+    /// Fills `o_json` with the pool's hit, miss and eviction counts.
+    static void GetDiagnostics(Json::Value& o_json);
+};
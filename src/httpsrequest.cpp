@@ -27,9 +27,8 @@
 #include "embeddedvalues.h"
 #include "stopsignal.h"
 #include "systemproxysettings.h"
-#include "transport_connection.h"
-#include "transport_registry.h"
-#include "coretransport.h"
+#include "shared_url_proxy.h"
+#include "https_session_pool.h"
 #include "utilities.h"
 
 
@@ -53,8 +52,24 @@ private:
 };
 
 
+static LPCWSTR DefaultVerb(LPVOID additionalData)
+{
+    return additionalData ? _T("POST") : _T("GET");
+}
+
+static bool IsIdempotentVerb(LPCWSTR httpVerb, LPVOID additionalData)
+{
+    if (!httpVerb)
+    {
+        httpVerb = DefaultVerb(additionalData);
+    }
+
+    return _tcsicmp(httpVerb, _T("GET")) == 0 || _tcsicmp(httpVerb, _T("HEAD")) == 0;
+}
+
+
 HTTPSRequest::HTTPSRequest(bool silentMode/*=false*/)
-    : m_silentMode(silentMode), m_closedEvent(NULL)
+    : m_silentMode(silentMode), m_closedEvent(NULL), m_requestSuccess(false), m_requestSending(false)
 {
     m_mutex = CreateMutex(NULL, FALSE, 0);
 }
@@ -107,6 +122,9 @@ void CALLBACK WinHttpStatusCallback(
         httpRequest->SetClosedEvent();
         break;
     case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+        // From here on, the server may have received (some of) the request.
+        httpRequest->SetRequestSending();
+
         // NOTE: from experimentation, this is really the earliest we can inject our custom server cert validation.
         // As far as we know, this is before any data is sent over the SSL connection, so it's soon enough.
         // E.g., we tried to verify the cert earlier but:
@@ -371,40 +389,29 @@ bool HTTPSRequest::MakeRequest(
         }
         else
         {
-            // We don't have a tunnel, so we'll create an unconnected tunnel-core
-            // instance to use as the direct URL proxy.
+            // We don't have a tunnel, so we'll use the shared unconnected tunnel-core
+            // instance as the direct URL proxy.
 
             try
             {
-                TransportConnection connection;
-
                 // Throws on failure
-                connection.Connect(
-                    stopInfo,
-                    TransportRegistry::New(CORE_TRANSPORT_PROTOCOL_NAME),
-                    NULL, // not receiving reconnection notifications
-                    NULL, // not receiving upgrade paver calls
-                    NULL, // not collecting stats
-                    NULL, // not supplying authorizations
-                    new ServerEntry(), // this empty ServerEntry is the flag for URL proxy mode; we don't need to connect to a specific server
-                    true);// don't apply system proxy settings (or write to the Psiphon proxy settings registry key)
-                          // as another transport might currently be running
+                auto urlProxy = SharedURLProxy::Acquire(stopInfo);
 
                 // NOTE that we will always make "direct" requests since this URL proxy will not establish a tunnel
                 tstringstream urlProxyRequestPath;
                 urlProxyRequestPath << _T("/") << _T("direct") << _T("/") << UrlEncode(URL.str());
 
-                my_print(NOT_SENSITIVE, true, _T("%s:%d - Making direct URL proxy request with temp tunnel-core"), __TFUNCTION__, __LINE__);
+                my_print(NOT_SENSITIVE, true, _T("%s:%d - Making direct URL proxy request with shared tunnel-core"), __TFUNCTION__, __LINE__);
 
                 success = MakeRequestWithURLProxyOption(
-                    _T("127.0.0.1"), connection.GetTransportLocalHttpProxy(),
+                    _T("127.0.0.1"), urlProxy->GetHttpProxyPort(),
                     webServerCertificate, urlProxyRequestPath.str().c_str(),
                     stopInfo, usePsiphonLocalProxy, response,
                     true, // useURLProxy
                     additionalHeaders, additionalData, additionalDataLength, httpVerb);
 
-                // Note that when we leave this scope, the TransportConnection will
-                // clean up the transport connection.
+                // Note that when we leave this scope, the lease is released. The
+                // shared instance is stopped once it has been idle for a while.
             }
             catch (StopSignal::StopException&)
             {
@@ -439,16 +446,6 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     // Throws if signaled
     stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, true);
 
-    DWORD dwFlags = 0;
-
-    if (webServerCertificate.length() > 0)
-    {
-        // We're doing our own validation, so don't choke on cert errors.
-        dwFlags |= SECURITY_FLAG_IGNORE_CERT_CN_INVALID |
-                    SECURITY_FLAG_IGNORE_CERT_DATE_INVALID |
-                    SECURITY_FLAG_IGNORE_UNKNOWN_CA;
-    }
-
     tstring proxyHost;
     if (useURLProxy)
     {
@@ -484,67 +481,74 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     }
     my_print(NOT_SENSITIVE, true, _T("%s: %s; proxy: {use: %d, set: %S}"), __TFUNCTION__, reqType.c_str(), usePsiphonLocalProxy, (proxyHost.length() ? "true" : "false"));
 
-    AutoHINTERNET hSession =
-                WinHttpOpen(
-                    _T("Mozilla/4.0 (compatible; MSIE 5.22)"),
-                    proxyHost.length() ? WINHTTP_ACCESS_TYPE_NAMED_PROXY : WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-                    proxyHost.length() ? proxyHost.c_str() : WINHTTP_NO_PROXY_NAME,
-                    WINHTTP_NO_PROXY_BYPASS,
-                    WINHTTP_FLAG_ASYNC);
-
-    if (NULL == hSession)
+    for (int attempt = 0; ; attempt++)
     {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpOpen failed (%d)"), GetLastError());
-        return false;
-    }
+        // A retry gets a fresh session, rather than another pooled one that
+        // may also have a stale connection.
+        auto session = HTTPSessionPool::Acquire(
+            proxyHost, serverAddress, serverWebPort, useURLProxy, webServerCertificate,
+            attempt > 0, // fresh
+            m_silentMode);
+
+        if (!session)
+        {
+            return false;
+        }
 
-    if (FALSE == WinHttpSetTimeouts(hSession, 0, HTTPS_REQUEST_CONNECT_TIMEOUT_MS,
-                            HTTPS_REQUEST_SEND_TIMEOUT_MS, HTTPS_REQUEST_RECEIVE_TIMEOUT_MS))
-    {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpSetTimeouts failed (%d)"), GetLastError());
-        return false;
-    }
+        if (SendRequest(
+                session->GetConnectHandle(), webServerCertificate, requestPath, stopInfo,
+                useURLProxy, additionalHeaders, additionalData, additionalDataLength, httpVerb,
+                response))
+        {
+            return true;
+        }
 
-    // SSLv3, TLSv1.0, TLSv1.1 all have security flaws that mean that should be avoided.
-    // Some of those flaws (like SSLv3's POODLE http://cve.mitre.org/cgi-bin/cvename.cgi?name=CVE-2014-3566)
-    // require the client side to not try to use them. So we're going to force use of
-    // TLS v1.2. We'll try to remember to update these flags when new TLS versions come
-    // out; we think it's too risky to set all bits except the bad ones (like ~(SSL|TLS1.0|TLS1.1)),
-    // as we might get something we don't want.
-    // When WinHttpSetOption gets flags it doesn't understand -- like WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2
-    // on XP and Vista -- it returns FALSE and sets errno to ERROR_INVALID_PARAMETER (87). When
-    // that happens we'll fall back to the URL proxy. That's why we're _not_ going
-    // to set the HTTPS protocol for URL proxy requests (and it's HTTP, not HTTPS).
-    DWORD dwProtocols = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
-    if (!useURLProxy)
-    {
-        if (FALSE == WinHttpSetOption(
-            hSession,
-            WINHTTP_OPTION_SECURE_PROTOCOLS,
-            &dwProtocols,
-            sizeof(DWORD)))
+        // Don't leave a possibly broken session in the pool
+        session->Discard();
+
+        // A kept-alive connection may have been dropped by the server (or
+        // by tunnel-core) while idle. If the request failed before getting
+        // any response on a reused session, retry it once on a new session.
+        // The server may already have acted on a request that was sent, so
+        // only an idempotent one is repeated after that point.
+        if (attempt > 0
+            || !session->IsReused()
+            || m_response.code != -1
+            || (m_requestSending && !IsIdempotentVerb(httpVerb, additionalData))
+            || stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, false))
         {
-            my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpSetOption WINHTTP_OPTION_SECURE_PROTOCOLS failed (%d)"), GetLastError());
             return false;
         }
+
+        my_print(NOT_SENSITIVE, true, _T("%s: retrying with a new session"), __TFUNCTION__);
     }
+}
 
-    AutoHINTERNET hConnect =
-            WinHttpConnect(
-                hSession,
-                serverAddress,
-                (INTERNET_PORT)serverWebPort,
-                0);
+bool HTTPSRequest::SendRequest(
+        HINTERNET hConnect,
+        const string& webServerCertificate,
+        const TCHAR* requestPath,
+        const StopInfo& stopInfo,
+        bool useURLProxy,
+        LPCWSTR additionalHeaders,
+        LPVOID additionalData,
+        DWORD additionalDataLength,
+        LPCWSTR httpVerb,
+        HTTPSRequest::Response& response)
+{
+    DWORD dwFlags = 0;
 
-    if (NULL == hConnect)
+    if (webServerCertificate.length() > 0)
     {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("WinHttpConnect failed (%d)"), GetLastError());
-        return false;
+        // We're doing our own validation, so don't choke on cert errors.
+        dwFlags |= SECURITY_FLAG_IGNORE_CERT_CN_INVALID |
+                    SECURITY_FLAG_IGNORE_CERT_DATE_INVALID |
+                    SECURITY_FLAG_IGNORE_UNKNOWN_CA;
     }
 
     if (!httpVerb)
     {
-        httpVerb = additionalData ? _T("POST") : _T("GET");
+        httpVerb = DefaultVerb(additionalData);
     }
 
     AutoHINTERNET hRequest =
@@ -602,22 +606,27 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
     // For example, PsiCash's ELB idle connection timeout was 60 seconds. So
     // any repeat PsiCash request made between 30 and 60 seconds of the
     // previous one would result in a hard error (not retried anywhere).
-    // We're going to specify Connection:close in all our requests to avoid
-    // this problem.
-    wstring headers = L"Connection: close\r\n";
+    // We used to specify Connection:close in all our requests to avoid this
+    // problem. Now connections are kept alive so that pooled sessions can
+    // reuse them; pooled sessions are closed after HTTPS_SESSION_POOL_IDLE_TTL_MS
+    // (less than 30 seconds) idle, and MakeRequestWithURLProxyOption retries
+    // once on a new session if a reused one fails (for a non-idempotent
+    // request, only if it failed before being sent).
+    wstring headers;
     if (additionalHeaders)
     {
-        headers += additionalHeaders;
+        headers = additionalHeaders;
     }
 
 
     m_expectedServerCertificate = webServerCertificate;
     m_requestSuccess = false;
+    m_requestSending = false;
     m_response = Response();
 
     if (FALSE == WinHttpSendRequest(
                     hRequest,
-                    headers.c_str(),
+                    headers.length() ? headers.c_str() : WINHTTP_NO_ADDITIONAL_HEADERS,
                     headers.length(),
                     additionalData ? additionalData : WINHTTP_NO_REQUEST_DATA,
                     additionalDataLength,
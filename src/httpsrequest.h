@@ -74,6 +74,7 @@ public:
 private:
     void SetClosedEvent() {SetEvent(m_closedEvent);}
     void SetRequestSuccess() {m_requestSuccess = true;}
+    void SetRequestSending() {m_requestSending = true;}
     bool ValidateServerCert(PCCERT_CONTEXT pCert);
     void ResponseAppendBody(const string& responseData);
     void ResponseSetCode(int code);
@@ -93,6 +94,19 @@ private:
         DWORD additionalDataLength,
         LPCWSTR httpVerb);
 
+    // Makes the request on an open connection handle.
+    bool SendRequest(
+        HINTERNET hConnect,
+        const string& webServerCertificate,
+        const TCHAR* requestPath,
+        const StopInfo& stopInfo,
+        bool useURLProxy,
+        LPCWSTR additionalHeaders,
+        LPVOID additionalData,
+        DWORD additionalDataLength,
+        LPCWSTR httpVerb,
+        HTTPSRequest::Response& response);
+
     friend void CALLBACK WinHttpStatusCallback(
                             HINTERNET hRequest,
                             DWORD_PTR dwContext,
@@ -105,6 +119,7 @@ private:
     HANDLE m_mutex;
     HANDLE m_closedEvent;
     bool m_requestSuccess;
+    bool m_requestSending;
     string m_expectedServerCertificate;
     Response m_response;
 };
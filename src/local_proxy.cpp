@@ -26,27 +26,29 @@
 #include "systemproxysettings.h"
 #include "usersettings.h"
 #include "config.h"
+#include "connect_timing.h"
+#include "stats_spool.h"
+#include "throughput_meter.h"
 #include <Shlwapi.h>
 
 
 #define POLIPO_CONNECTION_TIMEOUT_SECONDS   20
 
+// The most page view (and HTTPS request) entries held in memory, and the most
+// sent in a single status request. Entries beyond this are spooled to disk.
+#define STATS_SEND_MAX_ENTRIES              1000
+#define MAX_PENDING_REQUESTS                10000
+
 
 LocalProxy::LocalProxy(
                 ILocalProxyStatsCollector* statsCollector,
-                LPCSTR serverAddress,
-                SystemProxySettings* systemProxySettings,
-                int parentPort,
-                const tstring& splitTunnelingFilePath)
+                SystemProxySettings* systemProxySettings)
     : m_statsCollector(statsCollector),
       m_systemProxySettings(systemProxySettings),
-      m_parentPort(parentPort),
       m_polipoPipe(NULL),
       m_bytesTransferred(0),
       m_lastStatusSendTimeMS(0),
-      m_splitTunnelingFilePath(splitTunnelingFilePath),
-      m_finalStatsSent(false),
-      m_serverAddress(serverAddress)
+      m_finalStatsSent(false)
 {
     ZeroMemory(&m_polipoProcessInfo, sizeof(m_polipoProcessInfo));
 
@@ -93,6 +95,27 @@ bool LocalProxy::DoStart()
 
     int localHttpProxyPort = Settings::LocalHttpProxyPort();
 
+    // If the built-in engine can't be started, Polipo is used instead.
+    if (!ChooseLocalHttpProxyPort(localHttpProxyPort))
+    {
+        return false;
+    }
+
+    m_engine.reset(new HttpProxyEngine(m_statsCollector ? this : NULL));
+    if (m_engine->Start(localHttpProxyPort))
+    {
+        m_systemProxySettings->SetHttpProxyPort(localHttpProxyPort);
+        m_systemProxySettings->SetHttpsProxyPort(localHttpProxyPort);
+
+        my_print(NOT_SENSITIVE, true, _T("HTTP proxy engine successfully started."));
+        my_print(NOT_SENSITIVE, false, _T("HTTP proxy is running on localhost port %d."), localHttpProxyPort);
+
+        return true;
+    }
+
+    m_engine.reset();
+    my_print(NOT_SENSITIVE, true, _T("%s: HTTP proxy engine failed to start; using Polipo"), __TFUNCTION__);
+
     // See CoreTransport::SpawnCoreProcess for an explanation of the filename logic
     bool startSuccess = false;
     for (int i = -1; i < 5; i++) {
@@ -118,26 +141,10 @@ bool LocalProxy::DoStart()
             continue;
         }
 
-        if (localHttpProxyPort == 0)
-        {
-            // Choose the port automatically
-            localHttpProxyPort = 1024;
-            if (!TestForOpenPort(localHttpProxyPort, 60000, m_stopInfo))
-            {
-                my_print(NOT_SENSITIVE, false, _T("HTTP proxy could not find an available port."));
-                // This is unlikely to be recoverable with more attempts
-                return false;
-            }
-        }
-        else
+        if (!ChooseLocalHttpProxyPort(localHttpProxyPort))
         {
-            // Require the specified port
-            if (!TestForOpenPort(localHttpProxyPort, 0, m_stopInfo))
-            {
-                my_print(NOT_SENSITIVE, false, _T("Port is not available for HTTP proxy to listen on: %d"), localHttpProxyPort);
-                // This is unlikely to be recoverable with more attempts
-                return false;
-            }
+            // This is unlikely to be recoverable with more attempts
+            return false;
         }
 
         if (!StartPolipo(localHttpProxyPort))
@@ -170,6 +177,19 @@ bool LocalProxy::DoStart()
 
 bool LocalProxy::DoPeriodicCheck()
 {
+    if (m_engine)
+    {
+        if (!m_engine->IsRunning())
+        {
+            return false;
+        }
+
+        // We don't care about the return value of ProcessStatsAndStatus
+        (void)ProcessStatsAndStatus(false);
+
+        return true;
+    }
+
     // Check if we've lost the Polipo process
 
     if (m_polipoProcessInfo.hProcess != 0)
@@ -205,7 +225,7 @@ bool LocalProxy::DoPeriodicCheck()
 
 void LocalProxy::StopImminent()
 {
-    if (m_polipoProcessInfo.hProcess != 0)
+    if (m_polipoProcessInfo.hProcess != 0 || m_engine)
     {
         // We are (probably) connected, so send a final stats message
         my_print(NOT_SENSITIVE, true, _T("%s: Stopping cleanly. Sending final stats."), __TFUNCTION__);
@@ -240,6 +260,10 @@ void LocalProxy::Cleanup(bool doStats)
         m_polipoPath.clear();
     });
 
+    // Stopping the engine closes all of its connections. Its thread reports
+    // its last byte counts before it exits.
+    m_engine.reset();
+
     // Give the process an opportunity for graceful shutdown, then terminate
     if (m_polipoProcessInfo.hProcess != 0
         && m_polipoProcessInfo.hProcess != INVALID_HANDLE_VALUE)
@@ -268,29 +292,57 @@ void LocalProxy::Cleanup(bool doStats)
 
     // If we have stats, and we didn't get a chance to send our final stats,
     // we'll try one last time.
-    if (doStats && !m_finalStatsSent && m_statsCollector && m_bytesTransferred > 0)
+    unsigned long long bytesTransferred = 0;
+    {
+        AutoMUTEX lock(m_mutex);
+        bytesTransferred = m_bytesTransferred;
+    }
+    if (doStats && !m_finalStatsSent && m_statsCollector && bytesTransferred > 0)
     {
         my_print(NOT_SENSITIVE, true, _T("%s: Stopped dirtily. Sending final stats."), __TFUNCTION__);
-        if (m_statsCollector->SendStatusMessage(
-                                true, // Note: there's a timeout side-effect when final=false
-                                m_pageViewEntries,
-                                m_httpsRequestEntries,
-                                m_bytesTransferred))
+        if (SendStats(true))
         {
             m_finalStatsSent = true;
             my_print(NOT_SENSITIVE, true, _T("%s: Stopped dirtily. Final stats sent."), __TFUNCTION__);
         }
         else
         {
-            // Not setting m_finalStatsSent to true if SendStatusMessage failed.
-            // This will allow the possibility of trying again a bit later (this
-            // function is called from both DoStop and the destructor).
+            // The unsent stats have been spooled to disk, and will be sent
+            // with a later status request (possibly after a restart).
             my_print(NOT_SENSITIVE, true, _T("%s: Stopped dirtily. Final stats send failed."), __TFUNCTION__);
         }
     }
 }
 
 
+// If io_localHttpProxyPort is 0, chooses an available port; otherwise checks
+// that the specified port is available.
+bool LocalProxy::ChooseLocalHttpProxyPort(int& io_localHttpProxyPort)
+{
+    if (io_localHttpProxyPort == 0)
+    {
+        // Choose the port automatically
+        io_localHttpProxyPort = 1024;
+        if (!TestForOpenPort(io_localHttpProxyPort, 60000, m_stopInfo))
+        {
+            my_print(NOT_SENSITIVE, false, _T("HTTP proxy could not find an available port."));
+            return false;
+        }
+    }
+    else
+    {
+        // Require the specified port
+        if (!TestForOpenPort(io_localHttpProxyPort, 0, m_stopInfo))
+        {
+            my_print(NOT_SENSITIVE, false, _T("Port is not available for HTTP proxy to listen on: %d"), io_localHttpProxyPort);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
 bool LocalProxy::StartPolipo(int localHttpProxyPort)
 {
     // Start polipo, with no disk cache and no web admin interface
@@ -306,25 +358,6 @@ bool LocalProxy::StartPolipo(int localHttpProxyPort)
                       << _T(" disableLocalInterface=true")
                       << _T(" logLevel=1");
 
-    // Use the parent proxy, if one is available for the current transport
-    // also do split tunneling if there is a parent proxy
-    if (m_parentPort > 0)
-    {
-        polipoCommandLine << _T(" socksParentProxy=127.0.0.1:") << m_parentPort;
-        if (m_splitTunnelingFilePath.length() > 0)
-        {
-            polipoCommandLine << _T(" splitTunnelingFile=\"") << m_splitTunnelingFilePath << _T("\"");
-
-            //TODO: the DNS for split tunneling is hardcoded. Make it a part of handshake or
-            //create another tunnel for DNS in the future?
-            polipoCommandLine << _T(" splitTunnelingDnsServer=8.8.8.8");
-        }
-        if(m_serverAddress.length() > 0)
-        {
-            polipoCommandLine << _T(" psiphonServer=") << UTF8ToWString(m_serverAddress);
-        }
-    }
-
     STARTUPINFO polipoStartupInfo;
     ZeroMemory(&polipoStartupInfo, sizeof(polipoStartupInfo));
     polipoStartupInfo.cb = sizeof(polipoStartupInfo);
@@ -447,9 +480,7 @@ bool LocalProxy::ProcessStatsAndStatus(bool final)
     // Stats get sent to the server when a time or size limit has been reached.
 
     const DWORD DEFAULT_SEND_INTERVAL_MS = (5*60*1000); // 5 mins
-    const unsigned int DEFAULT_SEND_MAX_ENTRIES = 1000;  // This is mostly to bound memory usage
     static DWORD s_send_interval_ms = DEFAULT_SEND_INTERVAL_MS;
-    static unsigned int s_send_max_entries = DEFAULT_SEND_MAX_ENTRIES;
 
     DWORD bytes_avail = 0;
 
@@ -458,8 +489,9 @@ bool LocalProxy::ProcessStatsAndStatus(bool final)
     if (m_lastStatusSendTimeMS == 0) m_lastStatusSendTimeMS = GetTickCount();
 
     // ReadFile will block forever if there's no data to read, so we need
-    // to check if there's data available to read first.
-    if (!PeekNamedPipe(m_polipoPipe, NULL, 0, NULL, &bytes_avail, NULL))
+    // to check if there's data available to read first. (There's no pipe
+    // when the built-in engine is used, as it reports stats directly.)
+    if (m_polipoPipe != NULL && !PeekNamedPipe(m_polipoPipe, NULL, 0, NULL, &bytes_avail, NULL))
     {
         my_print(NOT_SENSITIVE, false, _T("%s:%d - PeekNamedPipe failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
         return false;
@@ -483,40 +515,39 @@ bool LocalProxy::ProcessStatsAndStatus(bool final)
         delete[] page_view_buffer;
     }
 
+    ProcessPendingRequests();
+
     // Note: GetTickCount wraps after 49 days; small chance of a shorter timeout
     DWORD now = GetTickCount();
     if (now < m_lastStatusSendTimeMS) m_lastStatusSendTimeMS = 0;
 
+    bool entriesLimitReached = false;
+    {
+        AutoMUTEX lock(m_mutex);
+        entriesLimitReached = m_pageViewEntries.size() >= STATS_SEND_MAX_ENTRIES
+                                || m_httpsRequestEntries.size() >= STATS_SEND_MAX_ENTRIES;
+    }
+
     // If the time or size thresholds have been exceeded, or if we're being
     // forced to, send the stats.
     if (final
         || (m_lastStatusSendTimeMS + s_send_interval_ms) < now
-        || m_pageViewEntries.size() >= s_send_max_entries
-        || m_httpsRequestEntries.size() >= s_send_max_entries)
+        || entriesLimitReached)
     {
         my_print(NOT_SENSITIVE, true, _T("%s: Sending %s stats."), __TFUNCTION__, final ? _T("final") : _T("non-final"));
 
-        if (m_statsCollector->SendStatusMessage(
-                                final, // Note: there's a timeout side-effect when final=false
-                                m_pageViewEntries,
-                                m_httpsRequestEntries,
-                                m_bytesTransferred))
+        if (SendStats(final))
         {
             my_print(NOT_SENSITIVE, true, _T("%s: Stats send success"), __TFUNCTION__);
 
             // Reset thresholds
             s_send_interval_ms = DEFAULT_SEND_INTERVAL_MS;
-            s_send_max_entries = DEFAULT_SEND_MAX_ENTRIES;
 
             // Stats traffic analysis mitigation: add some [non-cryptographic] pseudorandom jitter to the time interval
             unsigned int pseudorandom_bytes;
             rand_s(&pseudorandom_bytes);
             s_send_interval_ms += pseudorandom_bytes % DEFAULT_SEND_INTERVAL_MS;
 
-            // Reset stats
-            m_pageViewEntries.clear();
-            m_httpsRequestEntries.clear();
-            m_bytesTransferred = 0;
             m_lastStatusSendTimeMS = now;
         }
         else
@@ -524,15 +555,148 @@ bool LocalProxy::ProcessStatsAndStatus(bool final)
             my_print(NOT_SENSITIVE, true, _T("%s: Stats send failure"), __TFUNCTION__);
 
             // Status sending failures are fairly common.
-            // We'll back off the thresholds and try again later.
+            // We'll back off the time threshold and try again later. The
+            // unsent stats have been spooled, so memory usage doesn't grow.
             s_send_interval_ms += DEFAULT_SEND_INTERVAL_MS;
-            s_send_max_entries += DEFAULT_SEND_MAX_ENTRIES;
         }
     }
 
     return true;
 }
 
+// Sends the in-memory stats, along with a batch of previously spooled stats
+// if there's room in the request. The in-memory stats are taken at the start,
+// so stats recorded while the request is in flight are kept for the next send.
+// On success, the spooled batch is removed from the spool; on failure, the
+// taken stats are moved to the spool. If they can't be spooled, or an
+// exception is thrown, they're merged back into the in-memory stats.
+// May throw StopSignal::StopException if not `final`.
+bool LocalProxy::SendStats(bool final)
+{
+    map<string, int> unsentPageViewEntries;
+    map<string, int> unsentHttpsRequestEntries;
+    unsigned long long unsentBytesTransferred = 0;
+    {
+        AutoMUTEX lock(m_mutex);
+        unsentPageViewEntries.swap(m_pageViewEntries);
+        unsentHttpsRequestEntries.swap(m_httpsRequestEntries);
+        swap(unsentBytesTransferred, m_bytesTransferred);
+    }
+
+    bool handled = false;
+    auto restoreUnsent = finally([&]() {
+        if (handled)
+        {
+            return;
+        }
+
+        AutoMUTEX lock(m_mutex);
+        for (const auto& it : unsentPageViewEntries)
+        {
+            m_pageViewEntries[it.first] += it.second;
+        }
+        for (const auto& it : unsentHttpsRequestEntries)
+        {
+            m_httpsRequestEntries[it.first] += it.second;
+        }
+        m_bytesTransferred += unsentBytesTransferred;
+    });
+
+    map<string, int> pageViewEntries = unsentPageViewEntries;
+    map<string, int> httpsRequestEntries = unsentHttpsRequestEntries;
+    unsigned long long bytesTransferred = unsentBytesTransferred;
+
+    StatsSpool::Batch spooled;
+    if (StatsSpool::PeekBatch(
+            STATS_SEND_MAX_ENTRIES - min(pageViewEntries.size(), (size_t)STATS_SEND_MAX_ENTRIES),
+            STATS_SEND_MAX_ENTRIES - min(httpsRequestEntries.size(), (size_t)STATS_SEND_MAX_ENTRIES),
+            spooled))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: Including %d spooled page views and %d spooled HTTPS requests"),
+            __TFUNCTION__, spooled.pageViewEntries.size(), spooled.httpsRequestEntries.size());
+
+        for (const auto& it : spooled.pageViewEntries)
+        {
+            pageViewEntries[it.first] += it.second;
+        }
+        for (const auto& it : spooled.httpsRequestEntries)
+        {
+            httpsRequestEntries[it.first] += it.second;
+        }
+        bytesTransferred += spooled.bytesTransferred;
+    }
+
+    bool success = m_statsCollector->SendStatusMessage(
+                                        final, // Note: there's a timeout side-effect when final=false
+                                        pageViewEntries,
+                                        httpsRequestEntries,
+                                        bytesTransferred);
+
+    if (success)
+    {
+        StatsSpool::CommitBatch(spooled);
+        handled = true;
+    }
+    else
+    {
+        // If the spool isn't writable, the stats are kept in memory to be retried.
+        handled = StatsSpool::Append(unsentPageViewEntries, unsentHttpsRequestEntries, unsentBytesTransferred);
+    }
+
+    return success;
+}
+
+// Called on the engine's single I/O thread, so the regex matching is left
+// for ProcessPendingRequests on this thread.
+void LocalProxy::OnPageView(const string& url)
+{
+    std::lock_guard<std::mutex> lock(m_pendingRequestsMutex);
+    if (m_pendingPageViews.size() < MAX_PENDING_REQUESTS)
+    {
+        m_pendingPageViews.push_back(url);
+    }
+}
+
+void LocalProxy::OnHttpsRequest(const string& hostAndPort)
+{
+    std::lock_guard<std::mutex> lock(m_pendingRequestsMutex);
+    if (m_pendingHttpsRequests.size() < MAX_PENDING_REQUESTS)
+    {
+        m_pendingHttpsRequests.push_back(hostAndPort);
+    }
+}
+
+void LocalProxy::ProcessPendingRequests()
+{
+    vector<string> pageViews, httpsRequests;
+    {
+        std::lock_guard<std::mutex> lock(m_pendingRequestsMutex);
+        pageViews.swap(m_pendingPageViews);
+        httpsRequests.swap(m_pendingHttpsRequests);
+    }
+
+    for (const auto& pageView : pageViews)
+    {
+        UpsertPageView(pageView);
+    }
+
+    for (const auto& httpsRequest : httpsRequests)
+    {
+        UpsertHttpsRequest(httpsRequest);
+    }
+}
+
+void LocalProxy::OnBytesTransferred(unsigned long long sentBytes, unsigned long long receivedBytes)
+{
+    {
+        AutoMUTEX lock(m_mutex);
+        m_bytesTransferred += sentBytes + receivedBytes;
+    }
+
+    ConnectTiming::MarkFirstProxiedByte();
+    ThroughputMeter::AddBytes(sentBytes, receivedBytes);
+}
+
 /* Store page view info. Some transformation may be done depending on the
    contents of m_pageViewRegexes.
 */
@@ -701,7 +865,9 @@ void LocalProxy::ParsePolipoStatsBuffer(const char* page_view_buffer)
             long bytes = strtol(string(entry_start, entry_end-entry_start).c_str(), NULL, 10);
             if (bytes > 0)
             {
-                m_bytesTransferred += bytes;
+                // Polipo doesn't report direction. Most proxied traffic is
+                // downstream, so it's counted as received.
+                OnBytesTransferred(0, bytes);
             }
         }
         else if (next == unproxied_start)
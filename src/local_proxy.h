@@ -19,7 +19,9 @@
 
 #pragma once
 
+#include <mutex>
 #include "worker_thread.h"
+#include "http_proxy_engine.h"
 
 class SessionInfo;
 struct RegexReplace;
@@ -38,17 +40,15 @@ public:
 };
 
 
-class LocalProxy : public IWorkerThread
+// Uses the built-in HttpProxyEngine, or Polipo if the engine can't be started.
+class LocalProxy : public IWorkerThread, public IHttpProxyStatsSink
 {
 public:
     // If statsCollector is null, no stats will be collected. (This should only
     // be the case for temporary connections.)
     LocalProxy(
         ILocalProxyStatsCollector* statsCollector,
-        LPCSTR serverAddress,
-        SystemProxySettings* systemProxySettings,
-        int parentPort,
-        const tstring& splitTunnelingFilePath);
+        SystemProxySettings* systemProxySettings);
     virtual ~LocalProxy();
 
     // Sometimes SessionInfo gets updated after the LocalProxy starts (i.e.,
@@ -63,24 +63,31 @@ protected:
     void StopImminent();
     void DoStop(bool cleanly);
 
+    // IHttpProxyStatsSink implementation
+    void OnPageView(const string& url);
+    void OnHttpsRequest(const string& hostAndPort);
+    void OnBytesTransferred(unsigned long long sentBytes, unsigned long long receivedBytes);
+
     void Cleanup(bool doStats);
 
+    bool ChooseLocalHttpProxyPort(int& io_localHttpProxyPort);
     bool StartPolipo(int localHttpProxyPort);
     bool CreatePolipoPipe(HANDLE& o_outputPipe, HANDLE& o_errorPipe);
     bool ProcessStatsAndStatus(bool final);
+    bool SendStats(bool final);
     void UpsertPageView(const string& entry);
     void UpsertHttpsRequest(string entry);
+    void ProcessPendingRequests();
     void ParsePolipoStatsBuffer(const char* page_view_buffer);
 
 private:
     HANDLE m_mutex;
     ILocalProxyStatsCollector* m_statsCollector;
-    int m_parentPort;
     tstring m_polipoPath;
-    tstring m_splitTunnelingFilePath;
     SystemProxySettings* m_systemProxySettings;
     PROCESS_INFORMATION m_polipoProcessInfo;
     HANDLE m_polipoPipe;
+    unique_ptr<HttpProxyEngine> m_engine;
     DWORD m_lastStatusSendTimeMS;
     map<string, int> m_pageViewEntries;
     map<string, int> m_httpsRequestEntries;
@@ -88,7 +95,12 @@ private:
     vector<RegexReplace> m_pageViewRegexes;
     vector<RegexReplace> m_httpsRequestRegexes;
     bool m_finalStatsSent;
-    string m_serverAddress;
+
+    // Page views and HTTPS requests reported by the engine thread, waiting
+    // to be matched against the regexes on this thread.
+    std::mutex m_pendingRequestsMutex;
+    vector<string> m_pendingPageViews;
+    vector<string> m_pendingHttpsRequests;
     map<string, bool> m_reportedUnproxiedDomains;
 };
 
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "utilities.h"
+#include "log_store.h"
+#include <algorithm>
+#include <deque>
+
+
+// When the store is full the oldest entry is dropped for each one added.
+#define LOG_STORE_MAX_ENTRIES       20000
+
+// Caps the size of a single query response.
+#define LOG_STORE_MAX_PAGE_ENTRIES  500
+
+// Priorities 0 (debug) through 2 (high)
+#define LOG_STORE_PRIORITY_LEVELS   3
+
+
+struct LogStoreEntry
+{
+    int priority;
+    unsigned long long timeMS; // milliseconds since the Unix epoch, as JS Date expects
+    string message;
+};
+
+// Guards all of the following
+static HANDLE g_logStoreMutex = CreateMutex(NULL, FALSE, 0);
+
+// Oldest first. g_entries[i] has sequence number g_firstSeq + i.
+static deque<LogStoreEntry> g_entries;
+static unsigned long long g_firstSeq = 1;
+
+// For each priority p, the sequence numbers of the entries of at least p,
+// oldest first. These make a filtered query as cheap as an unfiltered one.
+static deque<unsigned long long> g_prioritySeqs[LOG_STORE_PRIORITY_LEVELS];
+
+
+static int ClampPriority(int priority)
+{
+    return max(0, min(priority, LOG_STORE_PRIORITY_LEVELS - 1));
+}
+
+static unsigned long long NowUnixMS()
+{
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = fileTime.dwLowDateTime;
+    ticks.HighPart = fileTime.dwHighDateTime;
+
+    // FILETIME is in 100ns intervals since 1601-01-01
+    const unsigned long long EPOCH_DIFFERENCE_TICKS = 116444736000000000ULL;
+    return (ticks.QuadPart - EPOCH_DIFFERENCE_TICKS) / 10000;
+}
+
+// Caller must hold g_logStoreMutex
+static unsigned long long GetLastSeqLocked()
+{
+    return g_firstSeq + g_entries.size() - 1;
+}
+
+
+unsigned long long LogStore::Add(int priority, const string& utf8Message)
+{
+    LogStoreEntry entry;
+    entry.priority = ClampPriority(priority);
+    entry.timeMS = NowUnixMS();
+    entry.message = utf8Message;
+
+    AutoMUTEX lock(g_logStoreMutex);
+
+    g_entries.push_back(move(entry));
+    unsigned long long seq = GetLastSeqLocked();
+    for (int p = 0; p <= g_entries.back().priority; p++)
+    {
+        g_prioritySeqs[p].push_back(seq);
+    }
+
+    if (g_entries.size() > LOG_STORE_MAX_ENTRIES)
+    {
+        // The oldest entry is at the front of each index it's in
+        for (int p = 0; p <= g_entries.front().priority; p++)
+        {
+            assert(g_prioritySeqs[p].front() == g_firstSeq);
+            g_prioritySeqs[p].pop_front();
+        }
+        g_entries.pop_front();
+        g_firstSeq++;
+    }
+
+    return seq;
+}
+
+
+unsigned long long LogStore::GetLastSeq()
+{
+    AutoMUTEX lock(g_logStoreMutex);
+    return GetLastSeqLocked();
+}
+
+
+void LogStore::Query(int minPriority, size_t offset, size_t count, unsigned long long sinceSeq, Json::Value& o_page)
+{
+    count = min(count, (size_t)LOG_STORE_MAX_PAGE_ENTRIES);
+
+    AutoMUTEX lock(g_logStoreMutex);
+
+    const deque<unsigned long long>& seqs = g_prioritySeqs[ClampPriority(minPriority)];
+    size_t total = seqs.size();
+
+    // The sequence numbers are ascending, so the newer ones are found by bisection
+    size_t newer = seqs.end() - upper_bound(seqs.begin(), seqs.end(), sinceSeq);
+
+    Json::Value entries(Json::arrayValue);
+    for (size_t i = offset; i < total && i - offset < count; i++)
+    {
+        unsigned long long seq = seqs[total - 1 - i];
+        const LogStoreEntry& entry = g_entries[(size_t)(seq - g_firstSeq)];
+
+        Json::Value row;
+        row["seq"] = (Json::UInt64)seq;
+        row["priority"] = entry.priority;
+        row["time"] = (Json::UInt64)entry.timeMS;
+        row["message"] = entry.message;
+        entries.append(row);
+    }
+
+    o_page["offset"] = (Json::UInt64)offset;
+    o_page["total"] = (Json::UInt64)total;
+    o_page["newer"] = (Json::UInt64)newer;
+    o_page["lastSeq"] = (Json::UInt64)GetLastSeqLocked();
+    o_page["hasDebug"] = g_prioritySeqs[0].size() > g_prioritySeqs[1].size();
+    o_page["entries"] = entries;
+}
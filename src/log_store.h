@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+The store of the entries shown in the UI's log pane. The page doesn't keep the
+log itself; it's told when entries are added and queries for the rows it's
+displaying. Entries have ascending sequence numbers, and the oldest are
+dropped when the store is full.
+Priorities are as for HtmlUI_AddLog: 0 is debug, 1 is normal, 2 is high.
+*/
+namespace LogStore
+{
+    /// Adds an entry, timestamped now. Returns its sequence number.
+    unsigned long long Add(int priority, const string& utf8Message);
+
+    /// The sequence number of the newest entry, or 0 if there are none.
+    unsigned long long GetLastSeq();
+
+    /// Fills `o_page` with up to `count` entries of at least `minPriority`,
+    /// newest first, starting at `offset` in that ordering. The page also has:
+    ///   total: the number of entries of at least `minPriority`
+    ///   newer: how many of those are newer than `sinceSeq`
+    ///   lastSeq: as for GetLastSeq
+    ///   hasDebug: whether there are any debug (priority 0) entries
+    void Query(int minPriority, size_t offset, size_t count, unsigned long long sinceSeq, Json::Value& o_page);
+}
@@ -21,6 +21,8 @@
 #include "utilities.h"
 #include "psiclient.h"
 #include "logging.h"
+#include "config.h"
+#include "history_journal.h"
 
 
 /*
@@ -53,6 +55,7 @@ extern HWND g_hWnd;
 
 vector<MessageHistoryEntry> g_messageHistory;
 HANDLE g_messageHistoryMutex = CreateMutex(NULL, FALSE, 0);
+HistoryJournal g_messageHistoryJournal(LOCAL_SETTINGS_APPDATA_MESSAGE_HISTORY_FILENAME, HISTORY_JOURNAL_SEGMENT_BYTES);
 
 void GetMessageHistory(vector<MessageHistoryEntry>& history)
 {
@@ -60,6 +63,23 @@ void GetMessageHistory(vector<MessageHistoryEntry>& history)
     history = g_messageHistory;
 }
 
+void RestoreMessageHistory()
+{
+    AutoMUTEX mutex(g_messageHistoryMutex);
+
+    vector<MessageHistoryEntry> restored;
+    (void)g_messageHistoryJournal.Open([&restored](const Json::Value& record) {
+        MessageHistoryEntry entry;
+        entry.message = UTF8ToWString(record.get("message", "").asString());
+        entry.timestamp = UTF8ToWString(record.get("timestamp", "").asString());
+        entry.debug = record.get("debug", false).asBool();
+        restored.push_back(entry);
+    });
+
+    // Anything logged before now is newer than the restored history
+    g_messageHistory.insert(g_messageHistory.begin(), restored.begin(), restored.end());
+}
+
 void AddMessageEntryToHistory(
     LogSensitivity sensitivity,
     bool bDebugMessage,
@@ -89,6 +109,13 @@ void AddMessageEntryToHistory(
         entry.timestamp = GetISO8601DatetimeString();
         entry.debug = bDebugMessage;
         g_messageHistory.push_back(entry);
+
+        Json::Value record;
+        record["message"] = WStringToUTF8(entry.message);
+        record["timestamp"] = WStringToUTF8(entry.timestamp);
+        record["debug"] = entry.debug;
+        Json::FastWriter jsonWriter;
+        g_messageHistoryJournal.Append(jsonWriter.write(record));
     }
 }
 
@@ -141,5 +168,5 @@ void my_print(LogSensitivity sensitivity, bool bDebugMessage, const TCHAR* forma
 
 void my_print(LogSensitivity sensitivity, bool bDebugMessage, const string& message)
 {
-    my_print(sensitivity, bDebugMessage, UTF8ToWString(message).c_str());
+    my_print(sensitivity, bDebugMessage, UTF8ToWide(message).c_str());
 }
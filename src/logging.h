@@ -50,3 +50,8 @@ struct MessageHistoryEntry
 };
 
 void GetMessageHistory(vector<MessageHistoryEntry>& history);
+
+/// Restores the message history of previous runs from its journal, and starts
+/// journaling new entries. Should be called once, early in app startup, by the
+/// primary instance.
+void RestoreMessageHistory();
@@ -14,17 +14,36 @@ namespace psicash {
 static constexpr bool TESTING = false;
 static constexpr auto USER_AGENT = "Psiphon-PsiCash-Windows";
 
+// Refreshes requested within this long of each other are made as one. The
+// page asks for them on several triggers (focus, connection state, settings,
+// language) that tend to fire together.
+static constexpr ULONGLONG REFRESH_COALESCE_WINDOW_MS = 250;
+
+// A network request that hasn't been sent this long after it was made (because
+// of the requests ahead of it) is no longer wanted by the user, who will have
+// been shown a spinner for all that time.
+static constexpr ULONGLONG REQUEST_DEADLINE_MS = 30000;
+
+// Queue priorities. A purchase (or account change) shouldn't wait behind
+// refreshes, which can always be made again.
+static constexpr int REQUEST_PRIORITY_REFRESH = 0;
+static constexpr int REQUEST_PRIORITY_USER_ACTION = 1;
+
 psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo);
 
 Lib::Lib()
     : m_requestStopInfo(StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL)),
+      m_refreshQueued(false),
+      m_refreshInFlight(false),
       m_requestQueue("PsiCash request queue", 1) // we specifically only want one worker, for one request at a time
 {
     m_mutex = CreateMutex(nullptr, FALSE, 0);
+    m_userActionQueuedEvent = CreateEvent(nullptr, FALSE, FALSE, 0);
 }
 
 Lib::~Lib() {
     CloseHandle(m_mutex);
+    CloseHandle(m_userActionQueuedEvent);
 }
 
 error::Error Lib::Init(bool forceReset) {
@@ -79,20 +98,112 @@ enum class RequestType : int {
     AccountLogout
 };
 
+bool Lib::RequestExpired(ULONGLONG requestTickMS) const
+{
+    if (GetTickCount64() - requestTickMS > REQUEST_DEADLINE_MS) {
+        return true;
+    }
+
+    // The request requires the tunnel, so don't start it if the tunnel is stopping
+    return m_requestStopInfo.stopSignal->CheckSignal(m_requestStopInfo.stopReasons, false) != 0;
+}
+
 void Lib::RefreshState(
     bool local_only,
     std::function<void(error::Result<RefreshStateResponse>)> callback)
 {
-    // Don't queue this if there is already an outstanding RefreshState
-    auto queued = m_requestQueue.dispatch((int)RequestType::RefreshState, { (int)RequestType::RefreshState }, [=] {
-        callback(PsiCash::RefreshState(local_only, { "speed-boost" }));
-        try { my_print(NOT_SENSITIVE, true, _T("%s: PsiCash state: %S"), __TFUNCTION__, PsiCash::GetDiagnosticInfo(true).dump(-1, ' ', true).c_str()); }
-        catch (...) {}
-    });
+    AutoMUTEX lock(m_mutex);
+
+    // A refresh in flight will do if it's at least as thorough as the one asked for.
+    if (m_refreshInFlight && (local_only || !m_inFlightRefresh.localOnly)) {
+        m_inFlightRefresh.callbacks.push_back(callback);
+        my_print(NOT_SENSITIVE, true, _T("%s: joined in-flight RefreshState"), __TFUNCTION__);
+        return;
+    }
+
+    if (m_refreshQueued) {
+        m_queuedRefresh.localOnly = m_queuedRefresh.localOnly && local_only;
+        m_queuedRefresh.callbacks.push_back(callback);
+        my_print(NOT_SENSITIVE, true, _T("%s: joined queued RefreshState"), __TFUNCTION__);
+        return;
+    }
+
+    m_refreshQueued = true;
+    m_queuedRefresh = RefreshRequest();
+    m_queuedRefresh.localOnly = local_only;
+    m_queuedRefresh.requestTickMS = GetTickCount64();
+    m_queuedRefresh.callbacks.push_back(callback);
+
+    (void)m_requestQueue.dispatch(
+        (int)RequestType::RefreshState,
+        {},
+        [this] { RunQueuedRefreshState(); },
+        REQUEST_PRIORITY_REFRESH);
+}
+
+void Lib::RunQueuedRefreshState()
+{
+    // Any user action queued before now has already run, as it has priority.
+    ResetEvent(m_userActionQueuedEvent);
+
+    // Give the rest of a burst of refresh requests a chance to join this one.
+    // The window starts when the first was made, so this rarely waits the whole time.
+    ULONGLONG requestTickMS;
+    {
+        AutoMUTEX lock(m_mutex);
+        requestTickMS = m_queuedRefresh.requestTickMS;
+    }
+    ULONGLONG elapsedMS = GetTickCount64() - requestTickMS;
+    if (elapsedMS < REFRESH_COALESCE_WINDOW_MS
+        && WaitForSingleObject(m_userActionQueuedEvent, (DWORD)(REFRESH_COALESCE_WINDOW_MS - elapsedMS)) == WAIT_OBJECT_0) {
+        // A purchase or account change was queued while waiting. Put the
+        // refresh (which is still queued, and still accepting callers) back
+        // behind it, rather than holding up the only request thread.
+        my_print(NOT_SENSITIVE, true, _T("%s: deferring RefreshState for a user action"), __TFUNCTION__);
+        (void)m_requestQueue.dispatch(
+            (int)RequestType::RefreshState,
+            {},
+            [this] { RunQueuedRefreshState(); },
+            REQUEST_PRIORITY_REFRESH);
+        return;
+    }
+
+    bool localOnly;
+    {
+        AutoMUTEX lock(m_mutex);
+        m_inFlightRefresh = std::move(m_queuedRefresh);
+        m_queuedRefresh = RefreshRequest();
+        m_refreshQueued = false;
+        m_refreshInFlight = true;
+
+        if (!m_inFlightRefresh.localOnly && RequestExpired(m_inFlightRefresh.requestTickMS)) {
+            // The local state is still worth giving the callers
+            my_print(NOT_SENSITIVE, true, _T("%s: RefreshState expired; refreshing local state only"), __TFUNCTION__);
+            m_inFlightRefresh.localOnly = true;
+        }
+        localOnly = m_inFlightRefresh.localOnly;
+    }
+
+    auto result = PsiCash::RefreshState(localOnly, { "speed-boost" });
 
-    if (!queued) {
-        my_print(NOT_SENSITIVE, true, _T("%s: RefreshState not queued, as another is already queued"), __TFUNCTION__);
+    std::vector<std::function<void(error::Result<RefreshStateResponse>)>> callbacks;
+    {
+        AutoMUTEX lock(m_mutex);
+        callbacks = std::move(m_inFlightRefresh.callbacks);
+        m_inFlightRefresh = RefreshRequest();
+        m_refreshInFlight = false;
     }
+
+    if (callbacks.size() > 1) {
+        my_print(NOT_SENSITIVE, true, _T("%s: RefreshState answered %d requests"), __TFUNCTION__, callbacks.size());
+    }
+
+    for (const auto& callback : callbacks) {
+        callback(result);
+    }
+
+    try { my_print(NOT_SENSITIVE, true, _T("%s: PsiCash state: %S"), __TFUNCTION__, PsiCash::GetDiagnosticInfo(true).dump(-1, ' ', true).c_str()); }
+    catch (...) {}
 }
 
 void Lib::NewExpiringPurchase(
@@ -101,11 +212,18 @@ void Lib::NewExpiringPurchase(
     const int64_t expectedPrice,
     std::function<void(error::Result<NewExpiringPurchaseResponse>)> callback)
 {
+    ULONGLONG requestTickMS = GetTickCount64();
     (void)m_requestQueue.dispatch((int)RequestType::NewExpiringPurchase, {}, [=] {
+        if (RequestExpired(requestTickMS)) {
+            my_print(NOT_SENSITIVE, true, _T("%s: NewExpiringPurchase expired before it was sent"), __TFUNCTION__);
+            callback(error::MakeNoncriticalError("request expired before it was sent"));
+            return;
+        }
         callback(PsiCash::NewExpiringPurchase(transactionClass, distinguisher, expectedPrice));
         try { my_print(NOT_SENSITIVE, true, _T("%s: PsiCash state: %S"), __TFUNCTION__, PsiCash::GetDiagnosticInfo(true).dump(-1, ' ', true).c_str()); }
         catch (...) {}
-    });
+    }, REQUEST_PRIORITY_USER_ACTION);
+    SetEvent(m_userActionQueuedEvent);
 }
 
 void Lib::AccountLogin(
@@ -113,21 +231,30 @@ void Lib::AccountLogin(
     const std::string &utf8_password,
     std::function<void(error::Result<AccountLoginResponse>)> callback)
 {
+    ULONGLONG requestTickMS = GetTickCount64();
     // Don't queue this if there is already an outstanding AccountLogin
     (void)m_requestQueue.dispatch(
         (int)RequestType::AccountLogin,
         {(int)RequestType::AccountLogin},
         [=] {
+            if (RequestExpired(requestTickMS)) {
+                my_print(NOT_SENSITIVE, true, _T("%s: AccountLogin expired before it was sent"), __TFUNCTION__);
+                callback(error::MakeNoncriticalError("request expired before it was sent"));
+                return;
+            }
             callback(PsiCash::AccountLogin(utf8_username, utf8_password));
             try { my_print(NOT_SENSITIVE, true, _T("%s: PsiCash state: %S"), __TFUNCTION__, PsiCash::GetDiagnosticInfo(true).dump(-1, ' ', true).c_str()); }
             catch (...) {}
-        });
+        },
+        REQUEST_PRIORITY_USER_ACTION);
+    SetEvent(m_userActionQueuedEvent);
 }
 
 void Lib::AccountLogout(
     std::function<void(error::Result<AccountLogoutResponse>)> callback)
 {
-    // Don't queue this if there is already an outstanding AccountLogout
+    // Don't queue this if there is already an outstanding AccountLogout.
+    // Logout is mostly local, so it isn't subject to the request deadline.
     (void)m_requestQueue.dispatch(
         (int)RequestType::AccountLogout,
         {(int)RequestType::AccountLogout},
@@ -135,7 +262,9 @@ void Lib::AccountLogout(
             callback(PsiCash::AccountLogout());
             try { my_print(NOT_SENSITIVE, true, _T("%s: PsiCash state: %S"), __TFUNCTION__, PsiCash::GetDiagnosticInfo(true).dump(-1, ' ', true).c_str()); }
             catch (...) {}
-        });
+        },
+        REQUEST_PRIORITY_USER_ACTION);
+    SetEvent(m_userActionQueuedEvent);
 }
 
 // Note that this _requires_ a Psiphon tunnel to be in place.
@@ -171,7 +300,7 @@ psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo) {
         try
         {
             if (!httpsRequest.MakeRequest(
-                    UTF8ToWString(params.hostname).c_str(),
+                    UTF8ToWide(params.hostname).c_str(),
                     params.port,
                     "",         // webServerCertificate
                     requestPath.str().c_str(),
@@ -182,7 +311,7 @@ psicash::MakeHTTPRequestFn GetHTTPReqFn(const StopInfo& stopInfo) {
                     headers.str().empty() ? NULL : headers.str().c_str(),
                     params.body.empty() ? NULL : (LPVOID)params.body.c_str(),
                     params.body.length(),
-                    UTF8ToWString(params.method).c_str()))
+                    UTF8ToWide(params.method).c_str()))
             {
                 result.error = "httpsRequest.MakeRequest failed";
                 return result;
@@ -69,10 +69,34 @@ protected:
     /// If this returns true, the request has been made and requestTask has been moved.
     bool MakeLimitedRequest(std::packaged_task<void()>&& requestTask);
 
+    /// Returns true if a request made at `requestTickMS` should no longer be
+    /// sent, as its deadline has passed or the tunnel has stopped.
+    bool RequestExpired(ULONGLONG requestTickMS) const;
+
+    /// Runs the queued RefreshState. Called on the request queue thread.
+    void RunQueuedRefreshState();
+
 private:
     HANDLE m_mutex;
     const StopInfo m_requestStopInfo;
 
+    /// Signaled when a purchase or account request is queued, to cut short
+    /// the wait for more RefreshState requests to coalesce.
+    HANDLE m_userActionQueuedEvent;
+
+    /// RefreshState requests are coalesced. Callers that arrive while a
+    /// refresh is queued share it, as do callers that arrive while one is in
+    /// flight, if it will do for them. Guarded by m_mutex.
+    struct RefreshRequest {
+        bool localOnly = true;
+        ULONGLONG requestTickMS = 0; // when the first caller asked
+        std::vector<std::function<void(error::Result<RefreshStateResponse>)>> callbacks;
+    };
+    bool m_refreshQueued;
+    RefreshRequest m_queuedRefresh;
+    bool m_refreshInFlight;
+    RefreshRequest m_inFlightRefresh;
+
     dispatch_queue m_requestQueue;
 };
 
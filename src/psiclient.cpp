@@ -33,6 +33,8 @@
 #include "utilities.h"
 #include "limitsingleinstance.h"
 #include "diagnostic_info.h"
+#include "shared_url_proxy.h"
+#include "https_session_pool.h"
 #include "systemproxysettings.h"
 #include "embeddedvalues.h"
 #include "usersettings.h"
@@ -108,12 +110,17 @@ int APIENTRY _tWinMain(
         return FALSE;
     }
 
+    // Only the primary instance (which we now know we are) may use the journals
+    RestoreMessageHistory();
+    RestoreDiagnosticHistory();
+
     HACCEL hAccelTable;
     hAccelTable = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_PSICLIENT));
 
     // If this set of calls gets any longer, we may want to do something generic.
     DoStartupSystemProxyWork();
     DoStartupDiagnosticCollection();
+    g_connectionManager.ResumeFeedbackUpload();
 
     // Main message loop
 
@@ -288,6 +295,9 @@ BOOL InitInstance(HINSTANCE hInstance, LPTSTR lpCmdLine, int nShowCmd)
         return FALSE;
     }
 
+    // The registry reads for this can overlap with the rest of the window setup
+    PrepareHTMLControlBootstrap();
+
     RegisterPsiphonProtocolHandler();
     ProcessCommandLine(lpCmdLine ? lpCmdLine : _T(""));
 
@@ -399,7 +409,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
     case WM_PSIPHON_HTMLUI_BEFORENAVIGATE:
     case WM_PSIPHON_HTMLUI_SETSTATE:
-    case WM_PSIPHON_HTMLUI_ADDLOG:
+    case WM_PSIPHON_HTMLUI_LOGSCHANGED:
+    case WM_PSIPHON_HTMLUI_LOGPAGE:
     case WM_PSIPHON_HTMLUI_ADDNOTICE:
     case WM_PSIPHON_HTMLUI_REFRESHSETTINGS:
     case WM_PSIPHON_HTMLUI_UPDATEDPISCALING:
@@ -481,6 +492,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         my_print(NOT_SENSITIVE, false, _T("Failed to send feedback."));
         break;
 
+    case WM_PSIPHON_FEEDBACK_PROGRESS:
+        my_print(NOT_SENSITIVE, false, _T("Sending feedback... %d%%"), (int)wParam);
+        break;
+
     case WM_ENDSESSION:
         // Stop the tunnel -- particularly to ensure system proxy settings are reverted -- on OS shutdown
         // Note: due to the following bug, the system proxy settings revert may silently fail:
@@ -488,6 +503,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     case WM_DESTROY:
         // Stop transport if running
         g_connectionManager.Stop(STOP_REASON_EXIT);
+        SharedURLProxy::Shutdown();
+        HTTPSessionPool::Clear();
         g_uiIsShutDown = true;
         SaveWindowPlacement();
         PostQuitMessage(0);
@@ -39,6 +39,7 @@ extern ConnectionManager g_connectionManager;
 #define WM_PSIPHON_FEEDBACK_SUCCESS             WM_USER + 101
 #define WM_PSIPHON_FEEDBACK_FAILED              WM_USER + 102
 #define WM_PSIPHON_CREATED                      WM_USER + 103
+#define WM_PSIPHON_FEEDBACK_PROGRESS            WM_USER + 104
 
 
 //==== UI Interaction ==================================================
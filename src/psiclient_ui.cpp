@@ -26,6 +26,7 @@
 #include "embeddedvalues.h"
 #include "utilities.h"
 #include "logging.h"
+#include "log_store.h"
 #include <mCtrl/html.h>
 #include "webbrowser.h"
 #include <algorithm>
@@ -44,6 +45,7 @@ static string g_uiLocale;
 // Forward declarations
 void InitPsiCash();
 bool HandlePsiCashCommand(const string&);
+static void ResetPsiCashStateVersion();
 
 
 //==== Initialization helpers ==================================================
@@ -70,7 +72,9 @@ void CleanupHTMLLib() {
     OleUninitialize();
 }
 
-void CreateHTMLControl(HWND hWndParent, float dpiScaling) {
+// Everything in the bootstrap payload except the DPI scaling, which isn't known
+// until the main window is being created.
+static Json::Value BuildHTMLControlBootstrap() {
     Json::Value initJSON, settingsJSON;
     Settings::ToJson(settingsJSON);
     initJSON["Settings"] = settingsJSON;
@@ -85,18 +89,47 @@ void CreateHTMLControl(HWND hWndParent, float dpiScaling) {
     initJSON["Config"]["NewVersionURL"] = GET_NEW_VERSION_URL;
     initJSON["Config"]["FaqURL"] = FAQ_URL;
     initJSON["Config"]["DataCollectionInfoURL"] = DATA_COLLECTION_INFO_URL;
-    initJSON["Config"]["DpiScaling"] = dpiScaling;
 #if DEBUG_UI
     initJSON["Config"]["Debug"] = true;
 #else
     initJSON["Config"]["Debug"] = false;
 #endif
 
+    return initJSON;
+}
+
+static future<Json::Value> g_htmlControlBootstrap;
+
+void PrepareHTMLControlBootstrap() {
+    if (!g_htmlControlBootstrap.valid()) {
+        g_htmlControlBootstrap = async(launch::async, BuildHTMLControlBootstrap);
+    }
+}
+
+void CreateHTMLControl(HWND hWndParent, float dpiScaling) {
+    PrepareHTMLControlBootstrap();
+    Json::Value initJSON = g_htmlControlBootstrap.get();
+    initJSON["Config"]["DpiScaling"] = dpiScaling;
+
     Json::FastWriter jsonWriter;
-    tstring initJsonString = UTF8ToWString(jsonWriter.write(initJSON).c_str());
-    tstring encodedJson = PercentEncode(initJsonString);
+    string initJsonString = jsonWriter.write(initJSON);
+
+    // The payload is passed as the URL fragment. Rather than percent-encoding
+    // it and having the page decode it, the only character that would be
+    // misinterpreted -- '%' -- is replaced with its JSON escape. That can only
+    // occur inside JSON strings, so the page can JSON.parse the fragment as-is.
+    string escapedJsonString;
+    escapedJsonString.reserve(initJsonString.length());
+    for (char c : initJsonString) {
+        if (c == '%') {
+            escapedJsonString += "\\u0025";
+        }
+        else {
+            escapedJsonString += c;
+        }
+    }
 
-    tstring url = ResourceToUrl(_T("main.html"), NULL, encodedJson.c_str());
+    tstring url = ResourceToUrl(_T("main.html"), NULL, UTF8ToWide(escapedJsonString).c_str());
 
     g_hHtmlCtrl = CreateWindow(
         MC_WC_HTML,
@@ -306,65 +339,137 @@ void SendCommandLineToWnd(HWND hWnd, wchar_t* lpCmdLine) {
 
 //==== String Table helpers ==================================================
 
-static map<string, wstring> g_stringTable;
+// The page sends the string table for a locale in a few batches (as a single
+// URL might be too long), and it's only used once the last batch arrives. The
+// complete table replaces the current one in a single swap, so lookups (which
+// are made from other threads, for instance via the systray) never see a mix of
+// languages.
+struct StringTable
+{
+    string locale;
+    // Sorted by key
+    vector<pair<string, wstring>> entries;
+};
+
+static shared_ptr<const StringTable> g_stringTable;
 
-static void AddStringTableEntry(const string& utf8EntryJson)
+// The table being received from the page. Only touched on the main thread.
+static shared_ptr<StringTable> g_pendingStringTable;
+static int g_pendingStringTableBatches = 0;
+
+static bool StringTableKeyLess(const pair<string, wstring>& entry, const string& key)
+{
+    return entry.first < key;
+}
+
+// Looks up the key in a sorted table
+static const wstring* FindStringTableEntry(const StringTable& table, const string& key)
+{
+    auto iter = lower_bound(table.entries.begin(), table.entries.end(), key, StringTableKeyLess);
+    if (iter == table.entries.end() || iter->first != key)
+    {
+        return NULL;
+    }
+    return &iter->second;
+}
+
+static void SetStringTable(shared_ptr<StringTable> table)
+{
+    auto& entries = table->entries;
+    stable_sort(entries.begin(), entries.end(),
+        [](const pair<string, wstring>& a, const pair<string, wstring>& b) { return a.first < b.first; });
+    // If a key was sent more than once, the last one wins
+    auto last = unique(entries.rbegin(), entries.rend(),
+        [](const pair<string, wstring>& a, const pair<string, wstring>& b) { return a.first == b.first; });
+    entries.erase(entries.begin(), last.base());
+
+    atomic_store(&g_stringTable, shared_ptr<const StringTable>(table));
+
+    if (table->locale != g_uiLocale) {
+        g_uiLocale = table->locale;
+
+        SetUiLocale(UTF8ToWString(g_uiLocale)); // used in feedback
+
+        if (g_psiCashInitializd) {
+            if (auto err = psicash::Lib::_().SetLocale(g_uiLocale)) {
+                // Log and carry on
+                my_print(NOT_SENSITIVE, false, _T("%s: PsiCashLib::SetLocale failed, %hs"), __TFUNCTION__, err.ToString().c_str());
+            }
+        }
+    }
+
+    // As soon as the OS_UNSUPPORTED string is available, do the OS check.
+    const wstring* osUnsupported = FindStringTableEntry(*table, STRING_KEY_OS_UNSUPPORTED);
+    if (osUnsupported) {
+        EnforceOSSupport(g_hWnd, *osUnsupported, FAQ_URL);
+    }
+}
+
+// Takes a batch of the form {locale, batch, batches, strings: {key: string, ...}},
+// where `batch` counts from 0 up to `batches`-1.
+static void AddStringTableBatch(const string& utf8BatchJson)
 {
     Json::Value json;
     Json::Reader reader;
-    bool parsingSuccessful = reader.parse(utf8EntryJson, json);
+    bool parsingSuccessful = reader.parse(utf8BatchJson, json);
     if (!parsingSuccessful)
     {
-        my_print(NOT_SENSITIVE, true, _T("%s:%d: Failed to parse string table entry"), __TFUNCTION__, __LINE__);
+        my_print(NOT_SENSITIVE, true, _T("%s:%d: Failed to parse string table batch"), __TFUNCTION__, __LINE__);
         return;
     }
 
-    string locale, key, narrowStr;
-
     try
     {
-        if (!json.isMember("key") ||
-            !json.isMember("string"))
+        string locale = json.get("locale", "").asString();
+        int batch = json.get("batch", 0).asInt();
+        int batches = json.get("batches", 1).asInt();
+        const Json::Value& strings = json["strings"];
+        if (batch < 0 || batch >= batches || !strings.isObject())
         {
             // The stored values are invalid
             return;
         }
 
-        locale = json.get("locale", "").asString();
-
-        key = json.get("key", "").asString();
-        narrowStr = json.get("string", "").asString();
-        if (key.empty() || narrowStr.empty())
+        if (batch == 0)
+        {
+            // A new table; any incomplete one is superseded
+            g_pendingStringTable = make_shared<StringTable>();
+            g_pendingStringTable->locale = locale;
+            g_pendingStringTableBatches = 0;
+        }
+        else if (!g_pendingStringTable
+                 || g_pendingStringTable->locale != locale
+                 || g_pendingStringTableBatches != batch)
         {
+            my_print(NOT_SENSITIVE, true, _T("%s:%d: Out of sequence string table batch"), __TFUNCTION__, __LINE__);
+            g_pendingStringTable.reset();
             return;
         }
+
+        for (Json::Value::const_iterator it = strings.begin(); it != strings.end(); ++it)
+        {
+            string narrowStr = (*it).asString();
+            if (it.name().empty() || narrowStr.empty())
+            {
+                continue;
+            }
+            g_pendingStringTable->entries.push_back(make_pair(it.name(), UTF8ToWString(narrowStr)));
+        }
+        g_pendingStringTableBatches++;
+
+        if (g_pendingStringTableBatches == batches)
+        {
+            shared_ptr<StringTable> table = g_pendingStringTable;
+            g_pendingStringTable.reset();
+            SetStringTable(table);
+        }
     }
     catch (exception& e)
     {
         my_print(NOT_SENSITIVE, false, _T("%s:%d: JSON parse exception: %S"), __TFUNCTION__, __LINE__, e.what());
+        g_pendingStringTable.reset();
         return;
     }
-
-    auto wideStr = UTF8ToWString(narrowStr);
-    g_stringTable[key] = wideStr;
-
-    if (locale != g_uiLocale) {
-        g_uiLocale = locale;
-
-        SetUiLocale(UTF8ToWString(locale)); // used in feedback
-
-        if (g_psiCashInitializd) {
-            if (auto err = psicash::Lib::_().SetLocale(locale)) {
-                // Log and carry on
-                my_print(NOT_SENSITIVE, false, _T("%s: PsiCashLib::SetLocale failed, %hs"), __TFUNCTION__, err.ToString().c_str());
-            }
-        }
-    }
-
-    // As soon as the OS_UNSUPPORTED string is available, do the OS check.
-    if (key == STRING_KEY_OS_UNSUPPORTED) {
-        EnforceOSSupport(g_hWnd, wideStr, FAQ_URL);
-    }
 }
 
 // Returns true if the string table entry is found, false otherwise.
@@ -372,13 +477,19 @@ bool GetStringTableEntry(const string& key, wstring& o_entry)
 {
     o_entry.clear();
 
-    map<string, wstring>::const_iterator iter = g_stringTable.find(key);
-    if (iter == g_stringTable.end())
+    shared_ptr<const StringTable> table = atomic_load(&g_stringTable);
+    if (!table)
+    {
+        return false;
+    }
+
+    const wstring* entry = FindStringTableEntry(*table, key);
+    if (!entry)
     {
         return false;
     }
 
-    o_entry = iter->second;
+    o_entry = *entry;
 
     return true;
 }
@@ -398,22 +509,65 @@ bool GetStringTableEntry(const string& key, wstring& o_entry)
 // is blocked!
 // So, we're going to PostMessages to ourself whenever possible.
 
+// The log lives in LogStore; the page is only told that it changed, and then
+// queries for the rows it's displaying. While a change notification is
+// pending, further changes don't post another, so a burst of logs costs the
+// page one update.
+static atomic<bool> g_logsChangedPending(false);
+
+static void HtmlUI_LogsChanged()
+{
+    if (!g_logsChangedPending.exchange(true))
+    {
+        PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_LOGSCHANGED, 0, 0);
+    }
+}
+
 void HtmlUI_AddLog(int priority, LPCTSTR message)
 {
+    (void)LogStore::Add(priority, WStringToUTF8(message));
+    HtmlUI_LogsChanged();
+}
+
+static void HtmlUI_LogsChangedHandler()
+{
+    g_logsChangedPending = false;
+
+    if (!g_htmlUiReady)
+    {
+        // The page queries the store when it's ready
+        return;
+    }
+
     Json::Value json;
-    json["priority"] = priority;
-    json["message"] = WStringToUTF8(message);
+    json["lastSeq"] = (Json::UInt64)LogStore::GetLastSeq();
     Json::FastWriter jsonWriter;
-    wstring wJson = UTF8ToWString(jsonWriter.write(json).c_str());
+    wstring wJson = UTF8ToWString(jsonWriter.write(json));
+
+    MC_HMCALLSCRIPTFUNC argStruct = { 0 };
+    argStruct.cbSize = sizeof(MC_HMCALLSCRIPTFUNC);
+    argStruct.cArgs = 1;
+    argStruct.pszArg1 = wJson.c_str();
+    if (!SendMessage(
+        g_hHtmlCtrl, MC_HM_CALLSCRIPTFUNC,
+        (WPARAM)_T("HtmlCtrlInterface_LogsChanged"), (LPARAM)&argStruct))
+    {
+        throw std::exception("UI: HtmlCtrlInterface_LogsChanged not found");
+    }
+}
+
+static void HtmlUI_LogPage(const string& pageJSON)
+{
+    wstring wJson = UTF8ToWString(pageJSON);
 
     size_t bufLen = wJson.length() + 1;
     wchar_t* buf = new wchar_t[bufLen];
     wcsncpy_s(buf, bufLen, wJson.c_str(), bufLen);
     buf[bufLen - 1] = L'\0';
-    PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_ADDLOG, (WPARAM)buf, 0);
+    PostMessage(g_hWnd, WM_PSIPHON_HTMLUI_LOGPAGE, (WPARAM)buf, 0);
 }
 
-static void HtmlUI_AddLogHandler(LPCWSTR json)
+static void HtmlUI_LogPageHandler(LPCWSTR json)
 {
     if (!g_htmlUiReady)
     {
@@ -427,9 +581,9 @@ static void HtmlUI_AddLogHandler(LPCWSTR json)
     argStruct.pszArg1 = json;
     if (!SendMessage(
         g_hHtmlCtrl, MC_HM_CALLSCRIPTFUNC,
-        (WPARAM)_T("HtmlCtrlInterface_AddLog"), (LPARAM)&argStruct))
+        (WPARAM)_T("HtmlCtrlInterface_LogPage"), (LPARAM)&argStruct))
     {
-        throw std::exception("UI: HtmlCtrlInterface_AddLog not found");
+        throw std::exception("UI: HtmlCtrlInterface_LogPage not found");
     }
     delete[] json;
 }
@@ -654,6 +808,10 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
     const size_t appStringTableLen = _tcslen(appStringTable);
     const LPCTSTR appLogCommand = PSIPHON_LINK_PREFIX _T("log?");
     const size_t appLogCommandLen = _tcslen(appLogCommand);
+    const LPCTSTR appAddLogCommand = PSIPHON_LINK_PREFIX _T("addlog?");
+    const size_t appAddLogCommandLen = _tcslen(appAddLogCommand);
+    const LPCTSTR appLogQueryCommand = PSIPHON_LINK_PREFIX _T("logquery?");
+    const size_t appLogQueryCommandLen = _tcslen(appLogQueryCommand);
     const LPCTSTR appStart = PSIPHON_LINK_PREFIX _T("start");
     const LPCTSTR appStop = PSIPHON_LINK_PREFIX _T("stop");
     const LPCTSTR appReconnect = PSIPHON_LINK_PREFIX _T("reconnect?");
@@ -684,16 +842,64 @@ static void HtmlUI_BeforeNavigateHandler(LPCTSTR _url)
     }
     else if (url.find(appStringTable) == 0 && url.length() > appStringTableLen)
     {
-        my_print(NOT_SENSITIVE, true, _T("%s: String table addition requested"), __TFUNCTION__);
+        my_print(NOT_SENSITIVE, true, _T("%s: String table batch received"), __TFUNCTION__);
 
         string stringJSON = uiURLParams(url, appStringTableLen);
-        AddStringTableEntry(stringJSON);
+        AddStringTableBatch(stringJSON);
     }
     else if (url.find(appLogCommand) == 0 && url.length() > appLogCommandLen)
     {
         string log = uiURLParams(url, appLogCommandLen);
         my_print(NOT_SENSITIVE, true, _T("UILog: %S"), log.c_str());
     }
+    // Note that these two mustn't log, as logging would change the log and
+    // prompt the page to query it again.
+    else if (url.find(appAddLogCommand) == 0 && url.length() > appAddLogCommandLen)
+    {
+        // A log entry originating in the page. These are displayed, but not
+        // added to the message history (or so feedback).
+        string stringJSON = uiURLParams(url, appAddLogCommandLen);
+        Json::Value json;
+        Json::Reader reader;
+        if (reader.parse(stringJSON, json) && json.isObject())
+        {
+            (void)LogStore::Add(json.get("priority", 1).asInt(), json.get("message", "").asString());
+            HtmlUI_LogsChanged();
+        }
+    }
+    else if (url.find(appLogQueryCommand) == 0 && url.length() > appLogQueryCommandLen)
+    {
+        string stringJSON = uiURLParams(url, appLogQueryCommandLen);
+        Json::Value query;
+        Json::Reader reader;
+        if (reader.parse(stringJSON, query) && query.isObject())
+        {
+            // The as*() conversions throw on values out of range (e.g.,
+            // negative numbers for unsigned), so invalid values get the defaults.
+            auto getUInt64 = [&query](const char* name) {
+                Json::Value value = query.get(name, 0);
+                return value.isUInt64() ? value.asUInt64() : 0;
+            };
+            Json::Value minPriority = query.get("minPriority", 1);
+            if (!minPriority.isInt())
+            {
+                minPriority = 1;
+            }
+
+            Json::Value page;
+            LogStore::Query(
+                minPriority.asInt(),
+                (size_t)getUInt64("offset"),
+                (size_t)getUInt64("count"),
+                getUInt64("sinceSeq"),
+                page);
+            page["id"] = query.get("id", Json::nullValue);
+            page["minPriority"] = minPriority;
+
+            Json::FastWriter jsonWriter;
+            HtmlUI_LogPage(jsonWriter.write(page));
+        }
+    }
     else if (url == appStart)
     {
         my_print(NOT_SENSITIVE, true, _T("%s: Start requested"), __TFUNCTION__);
@@ -818,7 +1024,7 @@ void UI_SetStateStopped()
     Json::Value json;
     json["state"] = "stopped";
     Json::FastWriter jsonWriter;
-    wstring wJson = UTF8ToWString(jsonWriter.write(json).c_str());
+    wstring wJson = UTF8ToWString(jsonWriter.write(json));
     HtmlUI_SetState(wJson);
 }
 
@@ -830,7 +1036,7 @@ void UI_SetStateStopping()
     Json::Value json;
     json["state"] = "stopping";
     Json::FastWriter jsonWriter;
-    wstring wJson = UTF8ToWString(jsonWriter.write(json).c_str());
+    wstring wJson = UTF8ToWString(jsonWriter.write(json));
     HtmlUI_SetState(wJson);
 }
 
@@ -842,7 +1048,7 @@ void UI_SetStateStarting(const tstring& transportProtocolName)
     json["state"] = "starting";
     json["transport"] = WStringToUTF8(transportProtocolName.c_str());
     Json::FastWriter jsonWriter;
-    wstring wJson = UTF8ToWString(jsonWriter.write(json).c_str());
+    wstring wJson = UTF8ToWString(jsonWriter.write(json));
     HtmlUI_SetState(wJson);
 }
 
@@ -859,7 +1065,7 @@ void UI_SetStateConnected(const tstring& transportProtocolName, int socksPort, i
     json["httpPort"] = httpPort;
     json["httpPortAuto"] = Settings::LocalHttpProxyPort() == 0;
     Json::FastWriter jsonWriter;
-    wstring wJson = UTF8ToWString(jsonWriter.write(json).c_str());
+    wstring wJson = UTF8ToWString(jsonWriter.write(json));
     HtmlUI_SetState(wJson);
 }
 
@@ -938,6 +1144,9 @@ struct PsiCashMessage {
 void InitPsiCash() {
     PsiCashMessage evt(PsiCashMessageType::INIT_DONE, "");
 
+    // The page (re)loaded, so it has no PsiCash state
+    ResetPsiCashStateVersion();
+
     g_psiCashInitializd = false;
     if (auto err = psicash::Lib::_().Init(false)) {
         // Init failed, indicating file corruption or disk access problems.
@@ -977,11 +1186,31 @@ void InitPsiCash() {
     HtmlUI_PsiCashMessage(jsonString);
 }
 
-nlohmann::json MakeRefreshPsiCashPayload() {
+/*
+Refresh payloads are versioned. The first one (after InitPsiCash, or when the
+page asks for it) has the complete state; after that, each has only the
+top-level fields that changed since the previous version, along with that
+version as "base_version". The page applies these to its copy of the state,
+and asks for a complete one if it finds it doesn't have the base version.
+"reconnect_required" isn't state, and is added to whichever payload it applies to.
+*/
+
+// The state most recently sent to the page, for diffing against. Refreshes are
+// made from PsiCash callback threads, so these are guarded.
+static HANDLE g_psiCashStateMutex = CreateMutex(NULL, FALSE, 0);
+static nlohmann::json g_psiCashState;
+static unsigned int g_psiCashStateVersion = 0;
+
+// The next refresh payload will have the complete state.
+static void ResetPsiCashStateVersion() {
+    AutoMUTEX lock(g_psiCashStateMutex);
+    g_psiCashState = nullptr;
+}
+
+static nlohmann::json MakePsiCashState() {
     nlohmann::json res = {
         { "is_account", psicash::Lib::_().IsAccount() },
         { "has_tokens", psicash::Lib::_().HasTokens() },
-        { "has_tokens", psicash::Lib::_().HasTokens() },
         { "balance",  psicash::Lib::_().Balance() },
         { "purchase_prices", psicash::Lib::_().GetPurchasePrices() },
         { "purchases", psicash::Lib::_().GetPurchases() },
@@ -1007,6 +1236,32 @@ nlohmann::json MakeRefreshPsiCashPayload() {
     return res;
 }
 
+nlohmann::json MakeRefreshPsiCashPayload() {
+    nlohmann::json state = MakePsiCashState();
+
+    AutoMUTEX lock(g_psiCashStateMutex);
+
+    nlohmann::json payload;
+    if (g_psiCashState.is_null()) {
+        payload = state;
+    }
+    else {
+        payload = nlohmann::json::object();
+        for (auto it = state.begin(); it != state.end(); ++it) {
+            auto prev = g_psiCashState.find(it.key());
+            if (prev == g_psiCashState.end() || *prev != it.value()) {
+                payload[it.key()] = it.value();
+            }
+        }
+        payload["base_version"] = g_psiCashStateVersion;
+    }
+
+    g_psiCashState = std::move(state);
+    payload["version"] = ++g_psiCashStateVersion;
+
+    return payload;
+}
+
 // Exported function.
 // commandID may be empty if not needed.
 void UI_RefreshPsiCash(const string& commandID, bool reconnect_required)
@@ -1048,6 +1303,12 @@ bool HandlePsiCashCommand(const string& jsonString)
         bool localOnly = g_connectionManager.GetState() != CONNECTION_MANAGER_STATE_CONNECTED;
         my_print(NOT_SENSITIVE, true, _T("%s: PsiCash::RefreshState; local-only: %S; reason: %S"), __TFUNCTION__, (localOnly ? "yes" : "no"), json["reason"].asCString());
 
+        if (json.get("full", false).asBool())
+        {
+            // The page has lost track of the state version
+            ResetPsiCashStateVersion();
+        }
+
         // We're connected, so ask the server for fresh info
         psicash::Lib::_().RefreshState(localOnly, [commandID](psicash::error::Result<psicash::PsiCash::RefreshStateResponse> result)
         {
@@ -1237,8 +1498,11 @@ void HTMLControlWndProc(UINT message, WPARAM wParam, LPARAM lParam) {
     case WM_PSIPHON_HTMLUI_SETSTATE:
         HtmlUI_SetStateHandler((LPCWSTR)wParam);
         break;
-    case WM_PSIPHON_HTMLUI_ADDLOG:
-        HtmlUI_AddLogHandler((LPCWSTR)wParam);
+    case WM_PSIPHON_HTMLUI_LOGSCHANGED:
+        HtmlUI_LogsChangedHandler();
+        break;
+    case WM_PSIPHON_HTMLUI_LOGPAGE:
+        HtmlUI_LogPageHandler((LPCWSTR)wParam);
         break;
     case WM_PSIPHON_HTMLUI_ADDNOTICE:
         HtmlUI_AddNoticeHandler((LPCWSTR)wParam);
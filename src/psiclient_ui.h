@@ -22,12 +22,13 @@
 // HTML control-related windows messages
 #define WM_PSIPHON_HTMLUI_BEFORENAVIGATE    WM_USER + 200
 #define WM_PSIPHON_HTMLUI_SETSTATE          WM_USER + 201
-#define WM_PSIPHON_HTMLUI_ADDLOG            WM_USER + 202
+#define WM_PSIPHON_HTMLUI_LOGSCHANGED       WM_USER + 202
 #define WM_PSIPHON_HTMLUI_ADDNOTICE         WM_USER + 203
 #define WM_PSIPHON_HTMLUI_REFRESHSETTINGS   WM_USER + 204
 #define WM_PSIPHON_HTMLUI_UPDATEDPISCALING  WM_USER + 205
 #define WM_PSIPHON_HTMLUI_DEEPLINK          WM_USER + 206
 #define WM_PSIPHON_HTMLUI_PSICASHMESSAGE    WM_USER + 207
+#define WM_PSIPHON_HTMLUI_LOGPAGE           WM_USER + 208
 
 /// Should be called during app initialization
 void InitHTMLLib();
@@ -35,6 +36,11 @@ void InitHTMLLib();
 /// Should be called during app cleanup
 void CleanupHTMLLib();
 
+/// Starts building the HTML control's bootstrap payload (settings, cookies, config)
+/// in the background, so that it's ready by the time CreateHTMLControl needs it.
+/// Should be called early in app initialization; optional.
+void PrepareHTMLControlBootstrap();
+
 /// Should be called from OnCreate to create the main HTML control
 void CreateHTMLControl(HWND hWndParent, float dpiScaling);
 
@@ -64,6 +70,7 @@ LRESULT HandleNotifyHTMLControl(HWND hWnd, NMHDR* hdr);
 /// Should be called to process the above window messages
 void HTMLControlWndProc(UINT message, WPARAM wParam, LPARAM lParam);
 
+/// Adds the message to the log store (see LogStore) and lets the page know.
 void HtmlUI_AddLog(int priority, LPCTSTR message);
 void UI_UpdateDpiScaling(const std::string& dpiScalingJSON);
 
@@ -96,7 +96,8 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
         Json::Value data = notice["data"];
 
         // Let the UI know about it and decide if something needs to be shown to the user.
-        if (noticeType != "Info")
+        // BytesTransferred is emitted every second and isn't used by the UI.
+        if (noticeType != "Info" && noticeType != "BytesTransferred")
         {
             UI_Notice(line);
         }
@@ -34,6 +34,13 @@
 #include "authenticated_data_package.h"
 #include "psiphon_tunnel_core_utilities.h"
 
+#pragma warning(push, 0)
+#pragma warning(disable: 4244)
+#include "cryptlib.h"
+#include "sha.h"
+#include "filters.h"
+#pragma warning(pop)
+
 using namespace std::experimental;
 
 #define UPGRADE_EXE_NAME                     _T("psiphon3.exe.upgrade")
@@ -63,6 +70,73 @@ string GetUpstreamProxyAddress()
     return upstreamProxyAddress;
 }
 
+/*
+Parameter files are regenerated for every connect, but rarely change from one
+connect to the next, and the server list file can be megabytes. So we remember
+what we last wrote to each file and skip rewriting it if the content is the
+same and the file hasn't been touched since.
+*/
+
+struct WrittenParameterFile
+{
+    string digest;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+};
+
+static HANDLE g_parameterFilesMutex = CreateMutex(NULL, FALSE, 0);
+static map<tstring, WrittenParameterFile> g_writtenParameterFiles;
+
+static string ParameterFileDigest(const char* data, size_t length)
+{
+    string digest;
+    CryptoPP::SHA256 hash;
+    CryptoPP::StringSource(
+        (const byte*)data,
+        length,
+        true,
+        new CryptoPP::HashFilter(hash, new CryptoPP::StringSink(digest)));
+    return digest;
+}
+
+static bool IsParameterFileUnchanged(const tstring& path, const string& digest)
+{
+    AutoMUTEX lock(g_parameterFilesMutex);
+
+    auto written = g_writtenParameterFiles.find(path);
+    if (written == g_writtenParameterFiles.end() || written->second.digest != digest)
+    {
+        return false;
+    }
+
+    // Make sure the file is still the one we wrote
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    return GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attributes)
+        && attributes.nFileSizeHigh == written->second.attributes.nFileSizeHigh
+        && attributes.nFileSizeLow == written->second.attributes.nFileSizeLow
+        && CompareFileTime(&attributes.ftLastWriteTime, &written->second.attributes.ftLastWriteTime) == 0;
+}
+
+static bool WriteParameterFile(const tstring& path, const string& digest, const string& data)
+{
+    AutoMUTEX lock(g_parameterFilesMutex);
+
+    g_writtenParameterFiles.erase(path);
+
+    if (!WriteFileAtomically(path, data))
+    {
+        return false;
+    }
+
+    WrittenParameterFile written;
+    written.digest = digest;
+    if (GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &written.attributes))
+    {
+        g_writtenParameterFiles[path] = written;
+    }
+
+    return true;
+}
+
 bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut& out)
 {
     tstring dataStoreDirectory;
@@ -81,13 +155,19 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
         return false;
     }
 
+    // The embedded JSON arrays are constant, so they're only parsed once
+    static const Json::Value remoteServerListURLs = LoadJSONArray(REMOTE_SERVER_LIST_URLS_JSON);
+    static const Json::Value obfuscatedServerListRootURLs = LoadJSONArray(OBFUSCATED_SERVER_LIST_ROOT_URLS_JSON);
+    static const Json::Value feedbackUploadURLs = LoadJSONArray(FEEDBACK_UPLOAD_URLS_JSON);
+    static const Json::Value upgradeDownloadURLs = LoadJSONArray(UPGRADE_URLS_JSON);
+
     Json::Value config;
     config["ClientPlatform"] = GetClientPlatform();
     config["ClientVersion"] = CLIENT_VERSION;
     config["PropagationChannelId"] = PROPAGATION_CHANNEL_ID;
     config["SponsorId"] = SPONSOR_ID;
-    config["RemoteServerListURLs"] = LoadJSONArray(REMOTE_SERVER_LIST_URLS_JSON);
-    config["ObfuscatedServerListRootURLs"] = LoadJSONArray(OBFUSCATED_SERVER_LIST_ROOT_URLS_JSON);
+    config["RemoteServerListURLs"] = remoteServerListURLs;
+    config["ObfuscatedServerListRootURLs"] = obfuscatedServerListRootURLs;
     config["RemoteServerListSignaturePublicKey"] = REMOTE_SERVER_LIST_SIGNATURE_PUBLIC_KEY;
     config["ServerEntrySignaturePublicKey"] = SERVER_ENTRY_SIGNATURE_PUBLIC_KEY;
     config["DataRootDirectory"] = WStringToUTF8(shortDataStoreDirectory);
@@ -97,6 +177,8 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
     config["EmitDiagnosticNotices"] = true;
     config["EmitDiagnosticNetworkParameters"] = true;
     config["EmitServerAlerts"] = true;
+    // Used to time the first proxied byte of a connection
+    config["EmitBytesTransferred"] = true;
     config["AdditionalParameters"] = ADDITIONAL_PARAMETERS;
 
     // Don't use an upstream proxy when in VPN mode. If the proxy is on a private network,
@@ -133,7 +215,7 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
     config["NetworkID"] = "949F2E962ED7A9165B81E977A3B4758B";
 
     // Feedback
-    config["FeedbackUploadURLs"] = LoadJSONArray(FEEDBACK_UPLOAD_URLS_JSON);
+    config["FeedbackUploadURLs"] = feedbackUploadURLs;
     config["FeedbackEncryptionPublicKey"] = FEEDBACK_ENCRYPTION_PUBLIC_KEY;
     config["EnableFeedbackUpload"] = true;
 
@@ -209,6 +291,15 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
         config["LocalHttpProxyPort"] = localHttpProxyPortSetting;
         config["LocalSocksProxyPort"] = localSocksProxyPortSetting;
 
+        // tunnel-core spreads new connections across the tunnels in its pool.
+        // Only the main tunnel gets a pool; temporary tunnels need just one.
+        unsigned int tunnelPoolSize = Settings::TunnelPoolSize();
+        if (tunnelPoolSize > 1)
+        {
+            my_print(NOT_SENSITIVE, true, _T("Setting TunnelPoolSize to %d"), tunnelPoolSize);
+            config["TunnelPoolSize"] = tunnelPoolSize;
+        }
+
         if (Settings::ExposeLocalProxiesToLAN())
         {
             config["ListenInterface"] = "any";
@@ -229,7 +320,7 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
 
         config["MigrateUpgradeDownloadFilename"] = WStringToUTF8(out.oldClientUpgradeFilename);
         config["UpgradeDownloadClientVersionHeader"] = string("x-amz-meta-psiphon-client-version");
-        config["UpgradeDownloadURLs"] = LoadJSONArray(UPGRADE_URLS_JSON);
+        config["UpgradeDownloadURLs"] = upgradeDownloadURLs;
 
         // We do not want to upgrade if we're running on a legacy version of Windows.
         if (IsOSLegacy())
@@ -249,15 +340,19 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
         out.newClientUpgradeFilename = filesystem::path(shortDataStoreDirectory).append(_T("ca.psiphon.PsiphonTunnel.tunnel-core")).append(_T("upgrade"));
     }
 
-    ostringstream configDataStream;
     Json::FastWriter jsonWriter;
-    configDataStream << jsonWriter.write(config);
+    string configData = jsonWriter.write(config);
 
     auto configPath = filesystem::path(dataStoreDirectory);
     configPath.append(in.configFilename);
     out.configFilePath = configPath;
 
-    if (!WriteFile(out.configFilePath, configDataStream.str()))
+    string configDigest = ParameterFileDigest(configData.c_str(), configData.length());
+    if (IsParameterFileUnchanged(out.configFilePath, configDigest))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s - config file unchanged"), __TFUNCTION__);
+    }
+    else if (!WriteParameterFile(out.configFilePath, configDigest, configData))
     {
         my_print(NOT_SENSITIVE, false, _T("%s - write config file failed (%d)"), __TFUNCTION__, GetLastError());
         return false;
@@ -272,7 +367,14 @@ bool WriteParameterFiles(const WriteParameterFilesIn& in, WriteParameterFilesOut
             .append(LOCAL_SETTINGS_APPDATA_SERVER_LIST_FILENAME);
         out.serverListFilename = serverListPath;
 
-        if (!WriteFile(out.serverListFilename, EMBEDDED_SERVER_LIST))
+        // The embedded server list is constant, so it's only hashed once
+        static const string serverListDigest = ParameterFileDigest(EMBEDDED_SERVER_LIST, strlen(EMBEDDED_SERVER_LIST));
+
+        if (IsParameterFileUnchanged(out.serverListFilename, serverListDigest))
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s - server list file unchanged"), __TFUNCTION__);
+        }
+        else if (!WriteParameterFile(out.serverListFilename, serverListDigest, EMBEDDED_SERVER_LIST))
         {
             my_print(NOT_SENSITIVE, false, _T("%s - write server list file failed (%d)"), __TFUNCTION__, GetLastError());
             return false;
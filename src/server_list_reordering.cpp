@@ -285,7 +285,7 @@ void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo)
             SENSITIVE_LOG,
             true,
             _T("server: %s, responded: %s, response time: %d"),
-            UTF8ToWString((*data)->m_entry.serverAddress).c_str(),
+            UTF8ToWide((*data)->m_entry.serverAddress).c_str(),
             (*data)->m_responded ? L"yes" : L"no",
             (*data)->m_responseTime);
 
@@ -127,7 +127,7 @@ bool ServerRequest::MakeRequest(
         HTTPSRequest::Response httpsResponse;
         bool requestSuccess =
             httpsRequest.MakeRequest(
-                UTF8ToWString(sessionInfo.GetServerAddress()).c_str(),
+                UTF8ToWide(sessionInfo.GetServerAddress()).c_str(),
                 sessionInfo.GetWebPort(),
                 sessionInfo.GetWebServerCertificate(),
                 requestPath,
@@ -166,7 +166,7 @@ bool ServerRequest::MakeRequest(
             HTTPSRequest httpsRequest;
             HTTPSRequest::Response httpsResponse;
             if (httpsRequest.MakeRequest(
-                    UTF8ToWString(sessionInfo.GetServerAddress()).c_str(),
+                    UTF8ToWide(sessionInfo.GetServerAddress()).c_str(),
                     *port_iter,
                     sessionInfo.GetWebServerCertificate(),
                     requestPath,
@@ -226,7 +226,7 @@ bool ServerRequest::MakeRequest(
             HTTPSRequest httpsRequest;
             HTTPSRequest::Response httpsResponse;
             if (httpsRequest.MakeRequest(
-                    UTF8ToWString(sessionInfo.GetServerAddress()).c_str(),
+                    UTF8ToWide(sessionInfo.GetServerAddress()).c_str(),
                     sessionInfo.GetWebPort(),
                     sessionInfo.GetWebServerCertificate(),
                     requestPath,
@@ -303,7 +303,7 @@ bool ServerRequest::ServerHasRequestCapabilities(const ServerEntry& serverEntry)
     // We can make a request if the server supports either direct web requests
     // or tunnelled requests through a tunnel that doesn't need a handshake.
 
-    if (serverEntry.HasCapability("handshake"))
+    if (serverEntry.capabilityFlags & SERVER_CAPABILITY_HANDSHAKE)
     {
         return true;
     }
@@ -26,6 +26,7 @@
 #include "utilities.h"
 #include <algorithm>
 #include <sstream>
+#include <unordered_map>
 
 
 ServerList::ServerList(LPCSTR listName)
@@ -45,76 +46,94 @@ ServerList::~ServerList()
 
 // This function may throw
 size_t ServerList::AddEntriesToList(
-                    const vector<string>& newServerEntryList,
+                    const ServerEntries& newServerEntries,
                     const ServerEntry* serverEntry)
 {
     AutoMUTEX lock(m_mutex);
 
-    size_t entriesAdded = 0;
-
-    if (newServerEntryList.size() < 1 && !serverEntry)
+    if (newServerEntries.size() < 1 && !serverEntry)
     {
-        return entriesAdded;
+        return 0;
     }
 
-    // We're going to loop through the server entries twice -- once to decode
-    // them and once to process them (after adding in serverEntry). This is
-    // not optimally efficient, but the array will never be very large and the
-    // code will be cleaner.
-
-    vector<ServerEntry> decodedServerEntries;
-    vector<string>::const_iterator entryStringIter;
-    for (entryStringIter = newServerEntryList.begin();
-         entryStringIter != newServerEntryList.end();
-         ++entryStringIter)
+    // Shuffle indexes rather than copying the entries, as the batch may be large.
+    vector<size_t> order(newServerEntries.size());
+    for (size_t i = 0; i < order.size(); i++)
     {
-        decodedServerEntries.push_back(ParseServerEntry(*entryStringIter));
+        order[i] = i;
     }
 
-    if (serverEntry) decodedServerEntries.push_back(*serverEntry);
-
     // This list may contain more than one discovered server
     // Randomize this list for load-balancing
-    ShuffleVector(decodedServerEntries.begin(), decodedServerEntries.end());
+    ShuffleVector(order.begin(), order.end());
 
     ServerEntries oldServerEntryList = GetList();
 
-    vector<ServerEntry>::const_iterator decodedEntryIter;
-    for (decodedEntryIter = decodedServerEntries.begin();
-         decodedEntryIter != decodedServerEntries.end(); ++decodedEntryIter)
+    // Maps server address to its position. Positions at or beyond
+    // oldServerEntryList.size() refer to addedServerEntries.
+    unordered_map<string, size_t> knownServers;
+    knownServers.reserve(oldServerEntryList.size() + newServerEntries.size() + 1);
+    for (size_t i = 0; i < oldServerEntryList.size(); i++)
     {
-        // Check if we already know about this server
-        bool alreadyKnown = false;
-        for (ServerEntries::iterator oldServerEntry = oldServerEntryList.begin();
-             oldServerEntry != oldServerEntryList.end(); ++oldServerEntry)
+        knownServers.insert(make_pair(oldServerEntryList[i].serverAddress, i));
+    }
+
+    ServerEntries addedServerEntries;
+
+    // serverEntry is merged last, so that its (presumably fresher) info wins
+    // over that of a discovered entry for the same server.
+    for (size_t i = 0; i <= order.size(); i++)
+    {
+        const ServerEntry* newEntry = NULL;
+        if (i < order.size())
         {
-            if ((*decodedEntryIter).serverAddress == oldServerEntry->serverAddress)
+            newEntry = &newServerEntries[order[i]];
+        }
+        else if (serverEntry)
+        {
+            newEntry = serverEntry;
+        }
+        else
+        {
+            break;
+        }
+
+        auto known = knownServers.find(newEntry->serverAddress);
+        if (known != knownServers.end())
+        {
+            // NOTE: We always update the values for known servers, because we trust the
+            //       discovery mechanisms
+            if (known->second < oldServerEntryList.size())
             {
-                alreadyKnown = true;
-                // NOTE: We always update the values for known servers, because we trust the
-                //       discovery mechanisms
-                oldServerEntry->Copy(*decodedEntryIter);
-                break;
+                oldServerEntryList[known->second].Copy(*newEntry);
+            }
+            else
+            {
+                addedServerEntries[known->second - oldServerEntryList.size()].Copy(*newEntry);
             }
         }
-
-        if (!alreadyKnown)
+        else
         {
-            // Insert the new entry as the second entry, so that the first entry can continue
-            // to be used if it is reachable (unless there are no pre-existing entries).
-            oldServerEntryList.insert(
-                oldServerEntryList.size() == 0 ?
-                    oldServerEntryList.begin() :
-                    oldServerEntryList.begin() + 1,
-                *decodedEntryIter);
-
-            entriesAdded++;
+            knownServers.insert(make_pair(newEntry->serverAddress, oldServerEntryList.size() + addedServerEntries.size()));
+            addedServerEntries.push_back(*newEntry);
         }
     }
 
+    if (addedServerEntries.size() > 0)
+    {
+        // Insert the new entries after the first entry, so that the first entry can continue
+        // to be used if it is reachable (unless there are no pre-existing entries).
+        oldServerEntryList.insert(
+            oldServerEntryList.size() == 0 ?
+                oldServerEntryList.begin() :
+                oldServerEntryList.begin() + 1,
+            addedServerEntries.begin(),
+            addedServerEntries.end());
+    }
+
     WriteListToSystem(oldServerEntryList);
 
-    return entriesAdded;
+    return addedServerEntries.size();
 }
 
 void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront/*=false*/)
@@ -248,6 +267,10 @@ ServerEntries ServerList::GetList()
 
     ServerEntries systemServerEntryList;
 
+    // If nothing is merged into the system list, there's no need to write it
+    // back out (which also means it doesn't need to be read and parsed again).
+    bool writeNeeded = false;
+
     if (!IGNORE_SYSTEM_SERVER_LIST)
     {
         try
@@ -257,8 +280,13 @@ ServerEntries ServerList::GetList()
         catch (std::exception &ex)
         {
             my_print(NOT_SENSITIVE, false, string("Not using corrupt System Server List: ") + ex.what());
+            writeNeeded = true;
         }
     }
+    else
+    {
+        writeNeeded = true;
+    }
 
     // Add embedded list to system list.
     // Cases:
@@ -297,6 +325,7 @@ ServerEntries ServerList::GetList()
                     systemServerEntry->sshObfuscatedKey.length() == 0)
                 {
                     systemServerEntry->Copy(*embeddedServerEntry);
+                    writeNeeded = true;
                 }
 
                 break;
@@ -311,9 +340,16 @@ ServerEntries ServerList::GetList()
                                             systemServerEntryList.begin() + 1 :
                                             systemServerEntryList.begin(),
                                          *embeddedServerEntry);
+            writeNeeded = true;
         }
     }
 
+    if (!writeNeeded)
+    {
+        // This is what GetListFromSystem just read and indexed.
+        return systemServerEntryList;
+    }
+
     // Write this out immediately, so the next time we'll get it from the system
     // (Also so MarkCurrentServerFailed reads the same list we're returning)
     WriteListToSystem(systemServerEntryList);
@@ -327,10 +363,112 @@ ServerEntries ServerList::GetList()
     catch (std::exception &ex)
     {
         my_print(NOT_SENSITIVE, true, string("Just wrote a corrupt System Server List: ") + ex.what());
+        m_cachedEncodedList.clear();
+        IndexList(systemServerEntryList);
         return systemServerEntryList;
     }
 }
 
+ServerEntries ServerList::GetListWithCapability(const string& capability)
+{
+    AutoMUTEX lock(m_mutex);
+
+    // Refreshes m_cachedList and m_capabilityIndex
+    (void)GetList();
+
+    ServerEntries serverEntryList;
+
+    unsigned int flag = ServerEntry::GetCapabilityFlag(capability);
+    if (flag == 0)
+    {
+        // Not interned, so there's no index for it
+        for (ServerEntryIterator it = m_cachedList.begin(); it != m_cachedList.end(); ++it)
+        {
+            if (it->HasCapability(capability))
+            {
+                serverEntryList.push_back(*it);
+            }
+        }
+        return serverEntryList;
+    }
+
+    for (size_t bit = 0; bit < SERVER_CAPABILITY_KNOWN_COUNT; bit++)
+    {
+        if (flag == (1u << bit))
+        {
+            const vector<size_t>& positions = m_capabilityIndex[bit];
+            serverEntryList.reserve(positions.size());
+            for (size_t i = 0; i < positions.size(); i++)
+            {
+                serverEntryList.push_back(m_cachedList[positions[i]]);
+            }
+            break;
+        }
+    }
+
+    return serverEntryList;
+}
+
+ServerEntries ServerList::GetListWithCapabilityFlags(unsigned int flags)
+{
+    AutoMUTEX lock(m_mutex);
+
+    // Refreshes m_cachedList and m_capabilityIndex
+    (void)GetList();
+
+    // An entry with all the flags is in the index for each of them, so only
+    // the shortest of those index lists needs to be checked.
+    const vector<size_t>* positions = NULL;
+    for (size_t bit = 0; bit < SERVER_CAPABILITY_KNOWN_COUNT; bit++)
+    {
+        if ((flags & (1u << bit))
+            && (positions == NULL || m_capabilityIndex[bit].size() < positions->size()))
+        {
+            positions = &m_capabilityIndex[bit];
+        }
+    }
+
+    if (positions == NULL)
+    {
+        // No flags required
+        return m_cachedList;
+    }
+
+    ServerEntries serverEntryList;
+    for (size_t i = 0; i < positions->size(); i++)
+    {
+        if (m_cachedList[(*positions)[i]].HasCapabilityFlags(flags))
+        {
+            serverEntryList.push_back(m_cachedList[(*positions)[i]]);
+        }
+    }
+
+    return serverEntryList;
+}
+
+void ServerList::IndexList(const ServerEntries& serverEntryList)
+{
+    m_cachedList = serverEntryList;
+
+    for (size_t bit = 0; bit < SERVER_CAPABILITY_KNOWN_COUNT; bit++)
+    {
+        m_capabilityIndex[bit].clear();
+    }
+
+    for (size_t i = 0; i < m_cachedList.size(); i++)
+    {
+        unsigned int flags = m_cachedList[i].capabilityFlags;
+        for (size_t bit = 0; flags != 0 && bit < SERVER_CAPABILITY_KNOWN_COUNT; bit++)
+        {
+            if (flags & (1u << bit))
+            {
+                m_capabilityIndex[bit].push_back(i);
+                flags &= ~(1u << bit);
+            }
+        }
+    }
+}
+
 string ServerList::GetListName() const
 {
     return string(LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS) + m_name;
@@ -338,32 +476,63 @@ string ServerList::GetListName() const
 
 ServerEntries ServerList::GetListFromEmbeddedValues()
 {
-    return ParseServerEntries(EMBEDDED_SERVER_LIST);
+    // The embedded list never changes, so it only needs to be parsed once.
+    // (If parsing throws, the initialization will be attempted again next time.)
+    static const ServerEntries embeddedServerEntryList = ParseServerEntries(EMBEDDED_SERVER_LIST);
+    return embeddedServerEntryList;
 }
 
+// Also updates the cached list and capability index. Caller must hold m_mutex.
 ServerEntries ServerList::GetListFromSystem()
 {
-    return GetListFromSystem(GetListName().c_str());
+    string serverEntryListString;
+
+    if (!ReadListStringFromSystem(GetListName().c_str(), serverEntryListString))
+    {
+        serverEntryListString.clear();
+    }
+
+    if (serverEntryListString == m_cachedEncodedList && !m_cachedEncodedList.empty())
+    {
+        return m_cachedList;
+    }
+
+    ServerEntries serverEntryList = ParseServerEntries(serverEntryListString.c_str());
+
+    m_cachedEncodedList = serverEntryListString;
+    IndexList(serverEntryList);
+
+    return serverEntryList;
 }
 
 ServerEntries ServerList::GetListFromSystem(const char* listName)
 {
     string serverEntryListString;
 
+    if (!ReadListStringFromSystem(listName, serverEntryListString))
+    {
+        return ServerEntries();
+    }
+
+    return ParseServerEntries(serverEntryListString.c_str());
+}
+
+bool ServerList::ReadListStringFromSystem(const char* listName, string& o_listString)
+{
     if (!ReadRegistryStringValue(
             listName,
-            serverEntryListString))
+            o_listString))
     {
         // If we're migrating from an old version, there's no m_name qualifier.
         if (!ReadRegistryStringValue(
                 LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS,
-                serverEntryListString))
+                o_listString))
         {
-            return ServerEntries();
+            return false;
         }
     }
 
-    return ParseServerEntries(serverEntryListString.c_str());
+    return true;
 }
 
 // The errors below throw (preventing any Server connection from starting)
@@ -386,6 +555,20 @@ ServerEntries ServerList::ParseServerEntries(const char* serverEntryListString)
     return serverEntryList;
 }
 
+// static
+ServerEntries ServerList::DecodeServerEntries(const vector<string>& encodedServerEntries)
+{
+    ServerEntries serverEntryList;
+    serverEntryList.reserve(encodedServerEntries.size());
+
+    for (size_t i = 0; i < encodedServerEntries.size(); i++)
+    {
+        serverEntryList.push_back(ParseServerEntry(encodedServerEntries[i]));
+    }
+
+    return serverEntryList;
+}
+
 ServerEntry ServerList::ParseServerEntry(const string& serverEntry)
 {
     string line = Dehexlify(serverEntry);
@@ -479,6 +662,7 @@ ServerEntry::ServerEntry(
     this->meekFrontingAddresses = meekFrontingAddresses;
 
     this->capabilities = capabilities;
+    UpdateCapabilityFlags();
 }
 
 void ServerEntry::Copy(const ServerEntry& src)
@@ -635,8 +819,9 @@ void ServerEntry::FromString(const string& str)
                 this->capabilities.push_back(item);
             }
         }
+        UpdateCapabilityFlags();
 
-        if (HasCapability("FRONTED-MEEK") || HasCapability("UNFRONTED-MEEK") || HasCapability("UNFRONTED-MEEK-HTTPS"))
+        if (capabilityFlags & (SERVER_CAPABILITY_FRONTED_MEEK | SERVER_CAPABILITY_UNFRONTED_MEEK | SERVER_CAPABILITY_UNFRONTED_MEEK_HTTPS))
         {
             meekServerPort = json_entry.get("meekServerPort", 0).asInt();
             meekObfuscatedKey = json_entry.get("meekObfuscatedKey", "").asString();
@@ -649,7 +834,7 @@ void ServerEntry::FromString(const string& str)
             meekCookieEncryptionPublicKey = "";
         }
 
-        if (HasCapability("FRONTED-MEEK"))
+        if (capabilityFlags & SERVER_CAPABILITY_FRONTED_MEEK)
         {
             meekFrontingDomain = json_entry.get("meekFrontingDomain", "").asString();
             meekFrontingHost  = json_entry.get("meekFrontingHost", "").asString();
@@ -682,8 +867,54 @@ void ServerEntry::FromString(const string& str)
     }
 }
 
+// The index of each name is the bit position of its ServerCapabilityFlag.
+static const char* INTERNED_CAPABILITIES[SERVER_CAPABILITY_KNOWN_COUNT] = {
+    "handshake",
+    "VPN",
+    "SSH",
+    "OSSH",
+    "FRONTED-MEEK",
+    "FRONTED-MEEK-HTTP",
+    "UNFRONTED-MEEK",
+    "UNFRONTED-MEEK-HTTPS",
+    "UNFRONTED-MEEK-SESSION-TICKET",
+    "QUIC",
+    "FRONTED-MEEK-QUIC",
+    "TAPDANCE",
+    "CONJURE"
+};
+
+// static
+unsigned int ServerEntry::GetCapabilityFlag(const string& capability)
+{
+    for (size_t bit = 0; bit < SERVER_CAPABILITY_KNOWN_COUNT; bit++)
+    {
+        if (capability == INTERNED_CAPABILITIES[bit])
+        {
+            return 1u << bit;
+        }
+    }
+
+    return 0;
+}
+
+void ServerEntry::UpdateCapabilityFlags()
+{
+    capabilityFlags = 0;
+    for (size_t i = 0; i < this->capabilities.size(); i++)
+    {
+        capabilityFlags |= GetCapabilityFlag(this->capabilities[i]);
+    }
+}
+
 bool ServerEntry::HasCapability(const string& capability) const
 {
+    unsigned int flag = GetCapabilityFlag(capability);
+    if (flag != 0)
+    {
+        return (capabilityFlags & flag) != 0;
+    }
+
     for (size_t i = 0; i < this->capabilities.size(); i++)
     {
         if (this->capabilities[i] == capability)
@@ -697,15 +928,15 @@ bool ServerEntry::HasCapability(const string& capability) const
 
 int ServerEntry::GetPreferredReachablityTestPort() const
 {
-    if (HasCapability("OSSH"))
+    if (capabilityFlags & SERVER_CAPABILITY_OSSH)
     {
         return sshObfuscatedPort;
     }
-    else if (HasCapability("SSH"))
+    else if (capabilityFlags & SERVER_CAPABILITY_SSH)
     {
         return sshPort;
     }
-    else if (HasCapability("handshake"))
+    else if (capabilityFlags & SERVER_CAPABILITY_HANDSHAKE)
     {
         return webServerPort;
     }
@@ -23,9 +23,31 @@
 
 using namespace std;
 
+// Capabilities that we know about are interned into a bitmask when a server
+// entry is parsed, so that checking for them doesn't require string compares.
+// Capabilities not in this list still work, via the `capabilities` vector.
+// The values are not persisted, so they can be freely reordered.
+enum ServerCapabilityFlag
+{
+    SERVER_CAPABILITY_HANDSHAKE = 0x0001,
+    SERVER_CAPABILITY_VPN = 0x0002,
+    SERVER_CAPABILITY_SSH = 0x0004,
+    SERVER_CAPABILITY_OSSH = 0x0008,
+    SERVER_CAPABILITY_FRONTED_MEEK = 0x0010,
+    SERVER_CAPABILITY_FRONTED_MEEK_HTTP = 0x0020,
+    SERVER_CAPABILITY_UNFRONTED_MEEK = 0x0040,
+    SERVER_CAPABILITY_UNFRONTED_MEEK_HTTPS = 0x0080,
+    SERVER_CAPABILITY_UNFRONTED_MEEK_SESSION_TICKET = 0x0100,
+    SERVER_CAPABILITY_QUIC = 0x0200,
+    SERVER_CAPABILITY_FRONTED_MEEK_QUIC = 0x0400,
+    SERVER_CAPABILITY_TAPDANCE = 0x0800,
+    SERVER_CAPABILITY_CONJURE = 0x1000,
+    SERVER_CAPABILITY_KNOWN_COUNT = 13
+};
+
 struct ServerEntry
 {
-    ServerEntry() : webServerPort(0), sshPort(0), sshObfuscatedPort(0) {}
+    ServerEntry() : webServerPort(0), sshPort(0), sshObfuscatedPort(0), capabilityFlags(0) {}
     ServerEntry(const ServerEntry& src) { Copy(src); }
     ServerEntry(
         const string& serverAddress, const string& region, int webServerPort,
@@ -45,6 +67,15 @@ struct ServerEntry
     void FromString(const string& str);
 
     bool HasCapability(const string& capability) const;
+    // True if the entry has all of the capabilities in `flags`.
+    bool HasCapabilityFlags(unsigned int flags) const { return (capabilityFlags & flags) == flags; }
+
+    // Returns the ServerCapabilityFlag for the capability string, or 0 if
+    // it's not one that we intern.
+    static unsigned int GetCapabilityFlag(const string& capability);
+
+    // Must be called after `capabilities` is modified.
+    void UpdateCapabilityFlags();
 
     // returns -1 if there's no port
     int GetPreferredReachablityTestPort() const;
@@ -61,6 +92,7 @@ struct ServerEntry
     int sshObfuscatedPort;
     string sshObfuscatedKey;
     vector<string> capabilities;
+    unsigned int capabilityFlags;
     string meekObfuscatedKey;
     int meekServerPort;
     string meekCookieEncryptionPublicKey;
@@ -81,11 +113,23 @@ public:
 
     ServerEntries GetList();
 
+    // Returns the entries (in list order) that have `capability`. Uses the
+    // capability index, so only matching entries are visited, and doesn't
+    // re-parse the list if it hasn't changed since it was last read.
+    ServerEntries GetListWithCapability(const string& capability);
+
+    // Returns the entries (in list order) that have all of the capabilities
+    // in `flags`. Only the entries in the shortest of the flags' index lists
+    // are visited. If `flags` is 0, returns the whole list.
+    ServerEntries GetListWithCapabilityFlags(unsigned int flags);
+
     // serverEntry is optional. It is an extra server entry that should be
     // stored. Typically this is the current server with additional info.
+    // newServerEntries should already be decoded (see DecodeServerEntries),
+    // so that a batch shared by multiple lists is only parsed once.
     // Returns the number of new entries added.
     size_t AddEntriesToList(
-        const vector<string>& newServerEntryList,
+        const ServerEntries& newServerEntries,
         const ServerEntry* serverEntry);
 
     void MarkServersFailed(const ServerEntries& failedServerEntries);
@@ -98,15 +142,28 @@ public:
 
     static ServerEntries GetListFromSystem(const char* listName);
     static string EncodeServerEntries(const ServerEntries& serverEntryList);
+    // Decodes hex-encoded server entry strings, as received from discovery
+    // and remote server lists. Throws if any entry is corrupt.
+    static ServerEntries DecodeServerEntries(const vector<string>& encodedServerEntries);
 
 private:
     string GetListName() const;
     ServerEntries GetListFromEmbeddedValues();
     ServerEntries GetListFromSystem();
+    static bool ReadListStringFromSystem(const char* listName, string& o_listString);
     static ServerEntries ParseServerEntries(const char* serverEntryListString);
     static ServerEntry ParseServerEntry(const string& serverEntry);
     void WriteListToSystem(const ServerEntries& serverEntryList);
+    void IndexList(const ServerEntries& serverEntryList);
 
     HANDLE m_mutex;
     string m_name;
+
+    // The last list read from the system, keyed by its encoded form, so
+    // that an unchanged list doesn't need to be parsed again. Along with it,
+    // for each interned capability, the positions of the entries that have it.
+    // Guarded by m_mutex.
+    string m_cachedEncodedList;
+    ServerEntries m_cachedList;
+    vector<size_t> m_capabilityIndex[SERVER_CAPABILITY_KNOWN_COUNT];
 };
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "config.h"
+#include "shared_url_proxy.h"
+#include "serverlist.h"
+#include "transport.h"
+#include "transport_registry.h"
+#include "transport_connection.h"
+#include "coretransport.h"
+
+
+// How often the reaper thread checks whether the instance is idle (or dead)
+#define URL_PROXY_REAPER_INTERVAL_MS    1000
+
+// How often callers waiting for the instance to start check their stop signal
+#define URL_PROXY_START_POLL_MS         100
+
+// How long Shutdown waits for a start that's in progress to be cancelled
+#define URL_PROXY_START_STOP_TIMEOUT_MS 5000
+
+
+// Guards all of the following
+static HANDLE g_urlProxyMutex = CreateMutex(NULL, FALSE, 0);
+
+// This empty ServerEntry is the flag for URL proxy mode
+static const ServerEntry g_urlProxyServerEntry;
+
+// The instance's own stop signal, as it outlives the callers that start it
+static StopSignal g_urlProxyStopSignal;
+
+static ITransport* g_urlProxyTransport = NULL;
+static TransportConnection* g_urlProxyConnection = NULL;
+static int g_urlProxyHttpPort = 0;
+static int g_urlProxyLeaseCount = 0;
+static ULONGLONG g_urlProxyIdleSinceTickMS = 0;
+static bool g_urlProxyShutDown = false;
+static HANDLE g_urlProxyReaperThread = NULL;
+
+// Set while the start thread is running. The mutex isn't held while the
+// instance starts, so callers wait on g_urlProxyStartDoneEvent instead.
+static bool g_urlProxyStarting = false;
+static HANDLE g_urlProxyStartThread = NULL;
+
+// Manual-reset. Signaled when a start finishes, whether or not it succeeded.
+static HANDLE g_urlProxyStartDoneEvent = CreateEvent(NULL, TRUE, TRUE, 0);
+
+
+// Caller must hold g_urlProxyMutex
+static void StopURLProxyLocked()
+{
+    if (!g_urlProxyConnection)
+    {
+        return;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: stopping shared URL proxy"), __TFUNCTION__);
+
+    g_urlProxyStopSignal.SignalStop(STOP_REASON_CANCEL);
+
+    // The connection must be cleaned up before its transport is deleted
+    delete g_urlProxyConnection;
+    g_urlProxyConnection = NULL;
+    delete g_urlProxyTransport;
+    g_urlProxyTransport = NULL;
+    g_urlProxyHttpPort = 0;
+}
+
+static DWORD WINAPI URLProxyReaperThread(void*)
+{
+    while (true)
+    {
+        Sleep(URL_PROXY_REAPER_INTERVAL_MS);
+
+        AutoMUTEX lock(g_urlProxyMutex);
+
+        if (!g_urlProxyConnection)
+        {
+            // Stopped by Shutdown, or already reaped
+            return 0;
+        }
+
+        if (!g_urlProxyConnection->IsConnected())
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: shared URL proxy exited"), __TFUNCTION__);
+            StopURLProxyLocked();
+            return 0;
+        }
+
+        if (g_urlProxyLeaseCount == 0
+            && GetTickCount64() - g_urlProxyIdleSinceTickMS >= URL_PROXY_IDLE_TTL_MS)
+        {
+            StopURLProxyLocked();
+            return 0;
+        }
+    }
+}
+
+// Starts the instance without holding g_urlProxyMutex, so that other callers,
+// lease releases and Shutdown aren't blocked while tunnel-core starts.
+static DWORD WINAPI URLProxyStartThread(void*)
+{
+    unique_ptr<ITransport> transport(TransportRegistry::New(CORE_TRANSPORT_PROTOCOL_NAME));
+    unique_ptr<TransportConnection> connection(new TransportConnection());
+
+    bool connected = false;
+    try
+    {
+        // Throws on failure
+        connection->Connect(
+            StopInfo(&g_urlProxyStopSignal, STOP_REASON_CANCEL),
+            transport.get(),
+            NULL, // not receiving reconnection notifications
+            NULL, // not receiving upgrade paver calls
+            NULL, // not collecting stats
+            NULL, // not supplying authorizations
+            &g_urlProxyServerEntry,
+            true);// don't apply system proxy settings (or write to the Psiphon proxy settings registry key)
+                  // as another transport might currently be running
+        connected = true;
+    }
+    catch (...)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: failed to start shared URL proxy"), __TFUNCTION__);
+    }
+
+    AutoMUTEX lock(g_urlProxyMutex);
+
+    g_urlProxyStarting = false;
+    auto signalDone = finally([] { SetEvent(g_urlProxyStartDoneEvent); });
+
+    if (!connected || g_urlProxyShutDown)
+    {
+        // The connection is cleaned up before its transport is deleted
+        return 0;
+    }
+
+    g_urlProxyHttpPort = connection->GetTransportLocalHttpProxy();
+    g_urlProxyConnection = connection.release();
+    g_urlProxyTransport = transport.release();
+
+    // If every waiting caller has given up, the instance is still kept for
+    // the idle TTL, rather than being reaped immediately.
+    g_urlProxyIdleSinceTickMS = GetTickCount64();
+
+    // A previous reaper thread will have exited when it stopped the previous instance
+    if (g_urlProxyReaperThread)
+    {
+        CloseHandle(g_urlProxyReaperThread);
+    }
+    g_urlProxyReaperThread = CreateThread(0, 0, URLProxyReaperThread, NULL, 0, 0);
+    if (!g_urlProxyReaperThread)
+    {
+        // Without a reaper, the instance would never be stopped when idle
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+        StopURLProxyLocked();
+    }
+
+    return 0;
+}
+
+// Caller must hold g_urlProxyMutex. Throws on failure.
+static void StartURLProxyLocked()
+{
+    assert(!g_urlProxyConnection && !g_urlProxyStarting);
+
+    my_print(NOT_SENSITIVE, true, _T("%s: starting shared URL proxy"), __TFUNCTION__);
+
+    g_urlProxyStopSignal.ClearStopSignal(STOP_REASON_CANCEL);
+
+    // A previous start thread will have exited when it finished
+    if (g_urlProxyStartThread)
+    {
+        CloseHandle(g_urlProxyStartThread);
+    }
+
+    ResetEvent(g_urlProxyStartDoneEvent);
+    g_urlProxyStarting = true;
+
+    g_urlProxyStartThread = CreateThread(0, 0, URLProxyStartThread, NULL, 0, 0);
+    if (!g_urlProxyStartThread)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
+        g_urlProxyStarting = false;
+        SetEvent(g_urlProxyStartDoneEvent);
+        throw std::exception(__FUNCTION__ ": CreateThread failed");
+    }
+}
+
+
+// static
+unique_ptr<SharedURLProxy::Lease> SharedURLProxy::Acquire(const StopInfo& stopInfo)
+{
+    // Throws if signaled
+    stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, true);
+
+    bool waited = false;
+    while (true)
+    {
+        {
+            AutoMUTEX lock(g_urlProxyMutex);
+
+            if (g_urlProxyShutDown)
+            {
+                throw std::exception(__FUNCTION__ ": shut down");
+            }
+
+            if (g_urlProxyConnection && !g_urlProxyConnection->IsConnected())
+            {
+                // The reaper hasn't noticed yet
+                StopURLProxyLocked();
+            }
+
+            if (g_urlProxyConnection)
+            {
+                if (!waited)
+                {
+                    my_print(NOT_SENSITIVE, true, _T("%s: reusing shared URL proxy"), __TFUNCTION__);
+                }
+
+                g_urlProxyLeaseCount++;
+
+                return unique_ptr<Lease>(new Lease(g_urlProxyHttpPort));
+            }
+
+            if (!g_urlProxyStarting)
+            {
+                if (waited)
+                {
+                    // The start that this caller waited for failed
+                    throw std::exception(__FUNCTION__ ": start failed");
+                }
+
+                // Throws on failure
+                StartURLProxyLocked();
+            }
+        }
+
+        // Callers wait here, without the mutex, while the instance is
+        // starting, and then share it.
+        waited = true;
+        while (WaitForSingleObject(g_urlProxyStartDoneEvent, URL_PROXY_START_POLL_MS) == WAIT_TIMEOUT)
+        {
+            // Throws if signaled. The start continues, for other callers.
+            stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, true);
+        }
+    }
+}
+
+
+SharedURLProxy::Lease::~Lease()
+{
+    AutoMUTEX lock(g_urlProxyMutex);
+
+    assert(g_urlProxyLeaseCount > 0);
+    if (--g_urlProxyLeaseCount == 0)
+    {
+        g_urlProxyIdleSinceTickMS = GetTickCount64();
+    }
+}
+
+
+// static
+void SharedURLProxy::Shutdown()
+{
+    // Cancels an instance that's being started, as well as a running one
+    g_urlProxyStopSignal.SignalStop(STOP_REASON_CANCEL);
+
+    HANDLE reaperThread = NULL;
+    HANDLE startThread = NULL;
+    {
+        AutoMUTEX lock(g_urlProxyMutex);
+
+        g_urlProxyShutDown = true;
+        StopURLProxyLocked();
+
+        reaperThread = g_urlProxyReaperThread;
+        g_urlProxyReaperThread = NULL;
+        startThread = g_urlProxyStartThread;
+        g_urlProxyStartThread = NULL;
+    }
+
+    if (startThread)
+    {
+        // Once cancelled, the start thread discards the instance, as it's shut down
+        (void)WaitForSingleObject(startThread, URL_PROXY_START_STOP_TIMEOUT_MS);
+        CloseHandle(startThread);
+    }
+
+    if (reaperThread)
+    {
+        // With the instance stopped, the reaper exits on its next check
+        (void)WaitForSingleObject(reaperThread, URL_PROXY_REAPER_INTERVAL_MS * 2);
+        CloseHandle(reaperThread);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "stopsignal.h"
+
+
+/**
+A tunnel-core instance running in URL proxy mode (with no tunnel), shared by
+all HTTPSRequests that need one. Starting tunnel-core is expensive, so rather
+than one instance per request, the instance is kept running while it's in use
+and for URL_PROXY_IDLE_TTL_MS after its last use. There is only ever one
+instance, so its datastore is never used by more than one process.
+*/
+class SharedURLProxy
+{
+public:
+    /// Keeps the shared instance running for as long as it's held.
+    class Lease
+    {
+    public:
+        ~Lease();
+
+        /// The local HTTP port of the URL proxy.
+        int GetHttpProxyPort() const { return m_httpProxyPort; }
+
+    private:
+        friend class SharedURLProxy;
+        Lease(int httpProxyPort) : m_httpProxyPort(httpProxyPort) {}
+
+        // not copyable
+        Lease(const Lease&);
+        Lease& operator=(const Lease&);
+
+        int m_httpProxyPort;
+    };
+
+    /// Gets a lease on the shared instance, starting it if it isn't running.
+    /// stopInfo is checked while waiting for the instance to start, but the
+    /// instance itself is only stopped by idleness or Shutdown, as it may be
+    /// shared with other callers.
+    /// Throws StopSignal::StopException if stop was signaled. Otherwise throws
+    /// (as TransportConnection::Connect does) if the instance couldn't be started.
+    static unique_ptr<Lease> Acquire(const StopInfo& stopInfo);
+
+    /// Stops the shared instance, regardless of leases, and prevents it from
+    /// being started again. Called when the application exits.
+    static void Shutdown();
+};
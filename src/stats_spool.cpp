@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "config.h"
+#include "utilities.h"
+#include "stats_spool.h"
+#include <algorithm>
+#include <WinCrypt.h>
+
+
+#pragma comment (lib, "crypt32.lib")
+
+
+// The spool file won't grow past this. Stats are only spooled when sends fail,
+// so in practice it should rarely get near it.
+#define MAX_SPOOL_FILE_BYTES        (256*1024)
+
+// When the spool is compacted, the merged record is trimmed to this size, so
+// that there's room for more appends before it has to be compacted again.
+// (Encryption and encoding add about a third, plus a fixed overhead.)
+#define COMPACTED_SPOOL_BYTES       (MAX_SPOOL_FILE_BYTES/2)
+
+// Rough per-entry JSON overhead, beyond the key itself: quotes, colon, count, comma
+#define SPOOL_ENTRY_OVERHEAD_BYTES  16
+
+
+static HANDLE g_statsSpoolMutex = CreateMutex(NULL, FALSE, 0);
+
+
+static bool GetSpoolFilePath(tstring& o_path)
+{
+    tstring dataDirectory;
+    if (!GetPsiphonDataPath({}, true, dataDirectory))
+    {
+        return false;
+    }
+
+    o_path = filesystem::path(dataDirectory).append(LOCAL_SETTINGS_APPDATA_STATS_SPOOL_FILENAME).wstring();
+    return true;
+}
+
+// Writes (or appends) the data and flushes it to disk before returning.
+static bool WriteSpoolFile(const tstring& path, const string& data, bool append)
+{
+    HANDLE file = CreateFile(
+        path.c_str(), append ? FILE_APPEND_DATA : GENERIC_WRITE, 0,
+        NULL, append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CreateFile failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    auto closeFile = finally([file] { CloseHandle(file); });
+
+    DWORD bytesWritten = 0;
+    if (!WriteFile(file, data.c_str(), data.length(), &bytesWritten, NULL)
+        || bytesWritten != data.length()
+        || !FlushFileBuffers(file))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: write failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+// Replaces the spool with `data`, such that a crash leaves either the old or
+// the new contents. Empty data removes the spool.
+static bool ReplaceSpoolFile(const tstring& path, const string& data)
+{
+    if (data.empty())
+    {
+        return DeleteFile(path.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+
+    tstring tempPath = path + _T(".tmp");
+    if (!WriteSpoolFile(tempPath, data, false))
+    {
+        (void)DeleteFile(tempPath.c_str());
+        return false;
+    }
+
+    if (!MoveFileEx(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: MoveFileEx failed (%d)"), __TFUNCTION__, GetLastError());
+        (void)DeleteFile(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// The spooled page views and HTTPS hosts are browsing history, so records are
+// encrypted for the current user.
+static bool ProtectData(const string& plaintext, string& o_ciphertext)
+{
+    DATA_BLOB in = { (DWORD)plaintext.length(), (BYTE*)plaintext.data() };
+    DATA_BLOB out = { 0 };
+    if (!CryptProtectData(&in, NULL, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CryptProtectData failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    auto freeOut = finally([&out] { LocalFree(out.pbData); });
+
+    o_ciphertext.assign((const char*)out.pbData, out.cbData);
+    return true;
+}
+
+static bool UnprotectData(const string& ciphertext, string& o_plaintext)
+{
+    DATA_BLOB in = { (DWORD)ciphertext.length(), (BYTE*)ciphertext.data() };
+    DATA_BLOB out = { 0 };
+    if (!CryptUnprotectData(&in, NULL, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: CryptUnprotectData failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+    auto freeOut = finally([&out] { SecureZeroMemory(out.pbData, out.cbData); LocalFree(out.pbData); });
+
+    o_plaintext.assign((const char*)out.pbData, out.cbData);
+    return true;
+}
+
+static void MergeCounts(const Json::Value& counts, map<string, int>& io_entries)
+{
+    if (!counts.isObject())
+    {
+        return;
+    }
+
+    for (Json::Value::const_iterator it = counts.begin(); it != counts.end(); ++it)
+    {
+        if ((*it).isInt())
+        {
+            io_entries[it.name()] += (*it).asInt();
+        }
+    }
+}
+
+static Json::Value CountsToJson(const map<string, int>& entries)
+{
+    Json::Value counts(Json::objectValue);
+    for (map<string, int>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        counts[it->first] = it->second;
+    }
+    return counts;
+}
+
+// Each record is an encrypted, base64-encoded JSON object on its own line.
+// It's preceded by a newline, so that a record appended after a torn one
+// isn't lost by being joined to it.
+static bool RecordToLine(
+    const map<string, int>& pageViewEntries,
+    const map<string, int>& httpsRequestEntries,
+    unsigned long long bytesTransferred,
+    string& o_line)
+{
+    Json::Value record;
+    record["b"] = (Json::UInt64)bytesTransferred;
+    record["p"] = CountsToJson(pageViewEntries);
+    record["h"] = CountsToJson(httpsRequestEntries);
+
+    Json::FastWriter jsonWriter;
+    string ciphertext;
+    if (!ProtectData(jsonWriter.write(record), ciphertext))
+    {
+        return false;
+    }
+
+    string encoded = Base64Encode((const unsigned char*)ciphertext.data(), ciphertext.length()).c_str();
+    if (encoded.empty())
+    {
+        return false;
+    }
+
+    o_line = "\n" + encoded + "\n";
+    return true;
+}
+
+// Merges all the complete records in the spool data.
+static void MergeRecords(const string& data, StatsSpool::Batch& io_merged)
+{
+    Json::Reader reader;
+    size_t pos = 0;
+    while (pos < data.length())
+    {
+        size_t end = data.find('\n', pos);
+        if (end == string::npos)
+        {
+            // Torn record at the end of the spool
+            break;
+        }
+
+        string plaintext;
+        if (end > pos
+            && UnprotectData(Base64Decode(data.substr(pos, end - pos)), plaintext))
+        {
+            Json::Value record;
+            if (reader.parse(plaintext, record, false) && record.isObject())
+            {
+                io_merged.bytesTransferred += record.get("b", 0).asUInt64();
+                MergeCounts(record["p"], io_merged.pageViewEntries);
+                MergeCounts(record["h"], io_merged.httpsRequestEntries);
+            }
+        }
+
+        pos = end + 1;
+    }
+}
+
+// Drops the lowest-count entries until the merged record should fit in maxBytes.
+static void TrimMerged(StatsSpool::Batch& io_merged, size_t maxBytes)
+{
+    // (count, (isPageView, key))
+    vector<pair<int, pair<bool, string>>> entries;
+    size_t totalBytes = 0;
+    for (const auto& it : io_merged.pageViewEntries)
+    {
+        entries.push_back(make_pair(it.second, make_pair(true, it.first)));
+        totalBytes += it.first.length() + SPOOL_ENTRY_OVERHEAD_BYTES;
+    }
+    for (const auto& it : io_merged.httpsRequestEntries)
+    {
+        entries.push_back(make_pair(it.second, make_pair(false, it.first)));
+        totalBytes += it.first.length() + SPOOL_ENTRY_OVERHEAD_BYTES;
+    }
+
+    if (totalBytes <= maxBytes)
+    {
+        return;
+    }
+
+    sort(entries.begin(), entries.end());
+
+    size_t dropped = 0;
+    for (size_t i = 0; i < entries.size() && totalBytes > maxBytes; i++)
+    {
+        const string& key = entries[i].second.second;
+        totalBytes -= key.length() + SPOOL_ENTRY_OVERHEAD_BYTES;
+        if (entries[i].second.first)
+        {
+            io_merged.pageViewEntries.erase(key);
+        }
+        else
+        {
+            io_merged.httpsRequestEntries.erase(key);
+        }
+        dropped++;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: dropped %d spooled stats entries"), __TFUNCTION__, dropped);
+}
+
+static bool IsEmpty(const StatsSpool::Batch& batch)
+{
+    return batch.bytesTransferred == 0
+        && batch.pageViewEntries.empty()
+        && batch.httpsRequestEntries.empty();
+}
+
+// Rewrites the spool as a single record. Caller must hold g_statsSpoolMutex.
+static bool RewriteSpool(const tstring& path, StatsSpool::Batch& merged)
+{
+    TrimMerged(merged, COMPACTED_SPOOL_BYTES);
+
+    string data;
+    if (!IsEmpty(merged)
+        && !RecordToLine(merged.pageViewEntries, merged.httpsRequestEntries, merged.bytesTransferred, data))
+    {
+        return false;
+    }
+
+    return ReplaceSpoolFile(path, data);
+}
+
+
+bool StatsSpool::Append(
+    const map<string, int>& pageViewEntries,
+    const map<string, int>& httpsRequestEntries,
+    unsigned long long bytesTransferred)
+{
+    if (bytesTransferred == 0 && pageViewEntries.empty() && httpsRequestEntries.empty())
+    {
+        return true;
+    }
+
+    AutoMUTEX lock(g_statsSpoolMutex);
+
+    tstring path;
+    if (!GetSpoolFilePath(path))
+    {
+        return false;
+    }
+
+    string line;
+    if (!RecordToLine(pageViewEntries, httpsRequestEntries, bytesTransferred, line))
+    {
+        return false;
+    }
+
+    unsigned long long spoolSize = 0;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attributes))
+    {
+        spoolSize = ((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    }
+
+    if (spoolSize + line.length() <= MAX_SPOOL_FILE_BYTES)
+    {
+        return WriteSpoolFile(path, line, true);
+    }
+
+    // The spool is full, so merge everything in it, along with the new
+    // record, into a single record.
+
+    my_print(NOT_SENSITIVE, true, _T("%s: compacting stats spool"), __TFUNCTION__);
+
+    Batch merged;
+    string data;
+    if (ReadFile(path, data))
+    {
+        MergeRecords(data, merged);
+    }
+
+    merged.bytesTransferred += bytesTransferred;
+    for (const auto& it : pageViewEntries)
+    {
+        merged.pageViewEntries[it.first] += it.second;
+    }
+    for (const auto& it : httpsRequestEntries)
+    {
+        merged.httpsRequestEntries[it.first] += it.second;
+    }
+
+    return RewriteSpool(path, merged);
+}
+
+
+bool StatsSpool::PeekBatch(size_t maxPageViewEntries, size_t maxHttpsRequestEntries, Batch& o_batch)
+{
+    o_batch = Batch();
+
+    AutoMUTEX lock(g_statsSpoolMutex);
+
+    tstring path;
+    string data;
+    if (!GetSpoolFilePath(path) || !ReadFile(path, data) || data.empty())
+    {
+        return false;
+    }
+
+    Batch merged;
+    MergeRecords(data, merged);
+
+    o_batch.bytesTransferred = merged.bytesTransferred;
+
+    for (map<string, int>::const_iterator it = merged.pageViewEntries.begin();
+         it != merged.pageViewEntries.end() && o_batch.pageViewEntries.size() < maxPageViewEntries;
+         ++it)
+    {
+        o_batch.pageViewEntries.insert(*it);
+    }
+
+    for (map<string, int>::const_iterator it = merged.httpsRequestEntries.begin();
+         it != merged.httpsRequestEntries.end() && o_batch.httpsRequestEntries.size() < maxHttpsRequestEntries;
+         ++it)
+    {
+        o_batch.httpsRequestEntries.insert(*it);
+    }
+
+    return !IsEmpty(o_batch);
+}
+
+
+void StatsSpool::CommitBatch(const Batch& batch)
+{
+    if (IsEmpty(batch))
+    {
+        return;
+    }
+
+    AutoMUTEX lock(g_statsSpoolMutex);
+
+    tstring path;
+    string data;
+    if (!GetSpoolFilePath(path) || !ReadFile(path, data))
+    {
+        return;
+    }
+
+    // Counts are merged by summing, so subtracting the batch from everything
+    // currently spooled leaves exactly what wasn't sent.
+
+    Batch merged;
+    MergeRecords(data, merged);
+
+    merged.bytesTransferred -= min(merged.bytesTransferred, batch.bytesTransferred);
+
+    for (const auto& it : batch.pageViewEntries)
+    {
+        auto entry = merged.pageViewEntries.find(it.first);
+        if (entry != merged.pageViewEntries.end() && (entry->second -= it.second) <= 0)
+        {
+            merged.pageViewEntries.erase(entry);
+        }
+    }
+
+    for (const auto& it : batch.httpsRequestEntries)
+    {
+        auto entry = merged.httpsRequestEntries.find(it.first);
+        if (entry != merged.httpsRequestEntries.end() && (entry->second -= it.second) <= 0)
+        {
+            merged.httpsRequestEntries.erase(entry);
+        }
+    }
+
+    (void)RewriteSpool(path, merged);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+On-disk spool for status stats that couldn't be sent, so that they survive
+a failed final send or a restart. Records are appended as single lines, each
+a JSON object encrypted with DPAPI for the current user and base64-encoded;
+a torn last line (from a crash mid-append) is ignored when reading. When the
+spool would grow past its size limit, all records are merged into one (and,
+if necessary, the lowest-count entries are dropped).
+*/
+namespace StatsSpool
+{
+    struct Batch
+    {
+        Batch() : bytesTransferred(0) {}
+
+        map<string, int> pageViewEntries;
+        map<string, int> httpsRequestEntries;
+        unsigned long long bytesTransferred;
+    };
+
+    /// Appends the stats to the spool. Returns false if they couldn't be stored.
+    bool Append(
+        const map<string, int>& pageViewEntries,
+        const map<string, int>& httpsRequestEntries,
+        unsigned long long bytesTransferred);
+
+    /// Gets up to the given number of page view and HTTPS request entries from
+    /// the spool, plus all spooled bytes transferred, without removing them.
+    /// Returns false if the spool is empty.
+    bool PeekBatch(size_t maxPageViewEntries, size_t maxHttpsRequestEntries, Batch& o_batch);
+
+    /// Removes a batch from the spool, once it has been sent. Records appended
+    /// since the batch was taken are kept.
+    void CommitBatch(const Batch& batch);
+}
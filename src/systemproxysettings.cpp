@@ -56,6 +56,7 @@ static const TCHAR* SYSTEM_PROXY_SETTINGS_PROXY_BYPASS = _T("<local>;"
 
 bool GetCurrentSystemConnectionsProxyInfo(vector<ConnectionProxy>& o_proxyInfo);
 bool GetCurrentSystemConnectionProxy(tstring connectionName, ConnectionProxy& o_proxyInfo);
+bool SetCurrentSystemConnectionProxy(const ConnectionProxy& setting);
 bool SetCurrentSystemConnectionsProxy(const vector<ConnectionProxy>& connectionsProxies);
 void SetPsiphonProxyForConnections(vector<ConnectionProxy>& io_connectionsProxies,
                                    const tstring& psiphonProxyAddress);
@@ -298,6 +299,20 @@ vector<tstring> GetRasConnectionNames()
 }
 
 
+// Tells every WinINet client to reload its proxy settings. This is a
+// system-wide broadcast, so it should be done once per batch of changes.
+static bool NotifySystemProxySettingsChanged()
+{
+    bool success = (0 != InternetSetOption(NULL, INTERNET_OPTION_SETTINGS_CHANGED, NULL, 0)) &&
+                   (0 != InternetSetOption(NULL, INTERNET_OPTION_REFRESH , NULL, 0));
+    if (!success)
+    {
+        my_print(NOT_SENSITIVE, false, _T("InternetSetOption error: %d"), GetLastError());
+    }
+    return success;
+}
+
+
 bool SetCurrentSystemConnectionProxy(const ConnectionProxy& setting)
 {
     INTERNET_PER_CONN_OPTION_LIST list;
@@ -318,9 +333,8 @@ bool SetCurrentSystemConnectionProxy(const ConnectionProxy& setting)
     list.pOptions[2].dwOption = INTERNET_PER_CONN_PROXY_BYPASS;
     list.pOptions[2].Value.pszValue = const_cast<TCHAR*>(setting.bypass.c_str());
 
-    bool success = (0 != InternetSetOption(0, INTERNET_OPTION_PER_CONNECTION_OPTION, &list, list.dwSize)) &&
-                   (0 != InternetSetOption(NULL, INTERNET_OPTION_SETTINGS_CHANGED, NULL, 0)) &&
-                   (0 != InternetSetOption(NULL, INTERNET_OPTION_REFRESH , NULL, 0));
+    // NOTE: This doesn't notify WinINet clients of the change. See NotifySystemProxySettingsChanged.
+    bool success = (0 != InternetSetOption(0, INTERNET_OPTION_PER_CONNECTION_OPTION, &list, list.dwSize));
 
     if (!success)
     {
@@ -334,20 +348,31 @@ bool SetCurrentSystemConnectionProxy(const ConnectionProxy& setting)
 }
 
 
+// Only the connections whose settings differ from the desired ones are written,
+// and the change is broadcast once, at the end, rather than once per connection.
+// If nothing differs, nothing is written or broadcast.
 bool SetCurrentSystemConnectionsProxy(const vector<ConnectionProxy>& connectionsProxies)
 {
     bool success = true;
+    size_t changedCount = 0;
 
     for (vector<ConnectionProxy>::const_iterator ii = connectionsProxies.begin();
          ii != connectionsProxies.end();
          ++ii)
     {
+        ConnectionProxy current;
+        if (GetCurrentSystemConnectionProxy(ii->name, current) && current == *ii)
+        {
+            continue;
+        }
+
         if (!SetCurrentSystemConnectionProxy(*ii))
         {
             success = false;
             break;
         }
 
+        changedCount++;
 
         // Read back the settings to verify that they have been applied
         ConnectionProxy entry;
@@ -371,6 +396,14 @@ bool SetCurrentSystemConnectionsProxy(const vector<ConnectionProxy>& connections
         }
     }
 
+    // Whatever was written must be broadcast, even if a later write failed
+    if (changedCount > 0 && !NotifySystemProxySettingsChanged())
+    {
+        success = false;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: %d of %d connections changed"), __TFUNCTION__, changedCount, connectionsProxies.size());
+
     return success;
 }
 
@@ -484,26 +517,225 @@ void GetDefaultProxyInfo(const vector<ConnectionProxy>& proxyInfos, ConnectionPr
     }
 }
 
-ProxyConfig GetNativeDefaultProxyConfig()
+static ProxyConfig DefaultProxyConfig(const vector<ConnectionProxy>& proxyInfo)
 {
-    vector<ConnectionProxy> proxyInfo;
-    ReadRegistryProxyInfo(LOCAL_SETTINGS_REGISTRY_VALUE_NATIVE_PROXY_INFO, proxyInfo);
-
     ConnectionProxy undecomposedProxyInfo;
     GetDefaultProxyInfo(proxyInfo, undecomposedProxyInfo);
 
     return ProxyConfig::DecomposeProxyInfo(undecomposedProxyInfo);
 }
 
+
+/*
+The native and tunneled default proxy configs are needed for every HTTPSRequest,
+so rather than reading and parsing them from the registry each time, they're
+kept, already parsed, in an immutable snapshot. The registry values are only
+written by WriteRegistryProxyInfo (i.e., by SystemProxySettings::Apply and
+Revert, and at startup), which replaces the snapshot and bumps its generation.
+Readers take the current snapshot without locking.
+*/
+struct ProxyConfigSnapshot
+{
+    ProxyConfig native;
+    ProxyConfig tunneled;
+    unsigned int generation;
+};
+
+// Serializes replacing the snapshot; readers don't take it
+static HANDLE g_proxyConfigSnapshotMutex = CreateMutex(NULL, FALSE, 0);
+static shared_ptr<const ProxyConfigSnapshot> g_proxyConfigSnapshot;
+
+static shared_ptr<const ProxyConfigSnapshot> GetProxyConfigSnapshot()
+{
+    shared_ptr<const ProxyConfigSnapshot> snapshot = atomic_load(&g_proxyConfigSnapshot);
+    if (snapshot)
+    {
+        return snapshot;
+    }
+
+    // First use, so load from the registry
+    AutoMUTEX lock(g_proxyConfigSnapshotMutex);
+
+    snapshot = atomic_load(&g_proxyConfigSnapshot);
+    if (!snapshot)
+    {
+        vector<ConnectionProxy> nativeProxyInfo, psiphonProxyInfo;
+        ReadRegistryProxyInfo(LOCAL_SETTINGS_REGISTRY_VALUE_NATIVE_PROXY_INFO, nativeProxyInfo);
+        ReadRegistryProxyInfo(LOCAL_SETTINGS_REGISTRY_VALUE_PSIPHON_PROXY_INFO, psiphonProxyInfo);
+
+        shared_ptr<ProxyConfigSnapshot> loaded = make_shared<ProxyConfigSnapshot>();
+        loaded->native = DefaultProxyConfig(nativeProxyInfo);
+        loaded->tunneled = DefaultProxyConfig(psiphonProxyInfo);
+        loaded->generation = 1;
+
+        snapshot = loaded;
+        atomic_store(&g_proxyConfigSnapshot, snapshot);
+    }
+
+    return snapshot;
+}
+
+// Called when the proxy info in the registry value `regKey` has been replaced.
+static void UpdateProxyConfigSnapshot(const char* regKey, const vector<ConnectionProxy>& proxyInfo)
+{
+    AutoMUTEX lock(g_proxyConfigSnapshotMutex);
+
+    shared_ptr<const ProxyConfigSnapshot> current = atomic_load(&g_proxyConfigSnapshot);
+    if (!current)
+    {
+        // Not loaded yet; it will be loaded from the registry, which is up to date
+        return;
+    }
+
+    shared_ptr<ProxyConfigSnapshot> updated = make_shared<ProxyConfigSnapshot>(*current);
+    if (strcmp(regKey, LOCAL_SETTINGS_REGISTRY_VALUE_NATIVE_PROXY_INFO) == 0)
+    {
+        updated->native = DefaultProxyConfig(proxyInfo);
+    }
+    else if (strcmp(regKey, LOCAL_SETTINGS_REGISTRY_VALUE_PSIPHON_PROXY_INFO) == 0)
+    {
+        updated->tunneled = DefaultProxyConfig(proxyInfo);
+    }
+    updated->generation++;
+
+    atomic_store(&g_proxyConfigSnapshot, shared_ptr<const ProxyConfigSnapshot>(updated));
+}
+
+ProxyConfig GetNativeDefaultProxyConfig()
+{
+    return GetProxyConfigSnapshot()->native;
+}
+
 ProxyConfig GetTunneledDefaultProxyConfig()
 {
-    vector<ConnectionProxy> proxyInfo;
-    ReadRegistryProxyInfo(LOCAL_SETTINGS_REGISTRY_VALUE_PSIPHON_PROXY_INFO, proxyInfo);
+    return GetProxyConfigSnapshot()->tunneled;
+}
 
-    ConnectionProxy undecomposedProxyInfo;
-    GetDefaultProxyInfo(proxyInfo, undecomposedProxyInfo);
+unsigned int GetProxyConfigGeneration()
+{
+    return GetProxyConfigSnapshot()->generation;
+}
 
-    return ProxyConfig::DecomposeProxyInfo(undecomposedProxyInfo);
+
+static bool IsWordChar(TCHAR c)
+{
+    return (c >= _T('a') && c <= _T('z')) || (c >= _T('A') && c <= _T('Z')) || (c >= _T('0') && c <= _T('9')) || c == _T('_');
+}
+
+// Returns the placeholder for the kind of host, or NULL if it isn't recognized.
+static const TCHAR* ClassifyProxyHost(const tstring& host)
+{
+    if (host.empty())
+    {
+        return NULL;
+    }
+
+    if (_tcsicmp(host.c_str(), _T("localhost")) == 0 || host == _T("127.0.0.1"))
+    {
+        return _T("[LOCALHOST]");
+    }
+
+    // IPv4 (Note: very rough, but probably good enough): four dot-separated runs of digits
+    int dots = 0;
+    bool ipv4 = true;
+    for (size_t i = 0; i < host.length() && ipv4; i++)
+    {
+        if (host[i] == _T('.'))
+        {
+            // Digits are required on each side of each dot
+            ipv4 = i > 0 && i + 1 < host.length() && host[i - 1] != _T('.') && ++dots <= 3;
+        }
+        else
+        {
+            ipv4 = host[i] >= _T('0') && host[i] <= _T('9');
+        }
+    }
+    if (ipv4 && dots == 3)
+    {
+        return _T("[IPV4]");
+    }
+
+    // IPv6 (Note: also very rough but probably good enough): hex digits and colons in brackets
+    if (host.length() > 2 && host.front() == _T('[') && host.back() == _T(']'))
+    {
+        bool ipv6 = true;
+        for (size_t i = 1; i + 1 < host.length() && ipv6; i++)
+        {
+            ipv6 = _istxdigit(host[i]) || host[i] == _T(':');
+        }
+        return ipv6 ? _T("[IPV6]") : NULL;
+    }
+
+    // Not-fully-qualified or fully-qualified domain name
+    bool hasDot = false;
+    for (size_t i = 0; i < host.length(); i++)
+    {
+        if (host[i] == _T('.'))
+        {
+            hasDot = true;
+        }
+        else if (!IsWordChar(host[i]) && host[i] != _T('-'))
+        {
+            return NULL;
+        }
+    }
+    return hasDot ? _T("[FQDN]") : _T("[NONFQDN]");
+}
+
+// Replaces the host in a proxy string element of the form
+// `[type=][scheme://]host:port` with a placeholder for its kind, giving
+// `[type=][KIND][scheme://]:port`. Elements that don't have that form (for
+// instance, with no port) become "[UNMATCHED]".
+static tstring SanitizeProxyElement(const tstring& elem)
+{
+    size_t pos = 0;
+
+    // Optional "type="
+    size_t wordEnd = 0;
+    while (wordEnd < elem.length() && IsWordChar(elem[wordEnd]))
+    {
+        wordEnd++;
+    }
+    if (wordEnd > 0 && wordEnd < elem.length() && elem[wordEnd] == _T('='))
+    {
+        pos = wordEnd + 1;
+    }
+    tstring type = elem.substr(0, pos);
+
+    // Optional "scheme://"
+    size_t schemeEnd = pos;
+    while (schemeEnd < elem.length() && _istalpha(elem[schemeEnd]) && elem[schemeEnd] < 0x80)
+    {
+        schemeEnd++;
+    }
+    tstring scheme;
+    if (schemeEnd > pos && elem.compare(schemeEnd, 3, _T("://")) == 0)
+    {
+        scheme = elem.substr(pos, schemeEnd + 3 - pos);
+        pos = schemeEnd + 3;
+    }
+
+    // Required ":port"
+    size_t colon = elem.rfind(_T(':'));
+    if (colon == tstring::npos || colon < pos || colon + 1 == elem.length())
+    {
+        return _T("[UNMATCHED]");
+    }
+    for (size_t i = colon + 1; i < elem.length(); i++)
+    {
+        if (elem[i] < _T('0') || elem[i] > _T('9'))
+        {
+            return _T("[UNMATCHED]");
+        }
+    }
+
+    const TCHAR* kind = ClassifyProxyHost(elem.substr(pos, colon - pos));
+    if (!kind)
+    {
+        return _T("[UNMATCHED]");
+    }
+
+    return type + kind + scheme + elem.substr(colon);
 }
 
 /**
@@ -519,27 +751,8 @@ void GetSanitizedOriginalProxyInfo(vector<ConnectionProxy>& o_originalProxyInfo)
     */
 
     // ASSUMPTION: Proxy entries will always have a port number.
-    // There are a number of forms (of interest to us) that a proxy server entry can take:
-    // localhost or 127.0.0.1
-    tregex localhost_regex = tregex(
-                    _T("^([\\w]+=)?([a-z]+:\\/\\/)?(?:(?:localhost)|(?:127\\.0\\.0\\.1))(:[0-9]+)$"),
-                    regex::ECMAScript | regex::icase);
-    // IPv4 (Note: very rough, but probably good enough)
-    tregex ipv4_regex = tregex(
-                    _T("^([\\w]+=)?([a-z]+:\\/\\/)?(?:\\d+\\.\\d+\\.\\d+\\.\\d+)(:[0-9]+)$"),
-                    regex::ECMAScript | regex::icase);
-    // IPv6 (Note: also very rough but probably good enough)
-    tregex ipv6_regex = tregex(
-                    _T("^([\\w]+=)?([a-z]+:\\/\\/)?(?:\\[[a-fA-F0-9:]+\\])(:[0-9]+)$"),
-                    regex::ECMAScript | regex::icase);
-    // not-fully-qualified domain name
-    tregex nonfqdn_regex = tregex(
-                    _T("^([\\w]+=)?([a-z]+:\\/\\/)?(?:[\\w\\-]+)(:[0-9]+)$"),
-                    regex::ECMAScript | regex::icase);
-    // fully qualified domain name
-    tregex fqdn_regex = tregex(
-                    _T("^([\\w]+=)?([a-z]+:\\/\\/)?(?:[\\w\\-\\.]+)(:[0-9]+)$"),
-                    regex::ECMAScript | regex::icase);
+    // See SanitizeProxyElement for the forms (of interest to us) that a proxy
+    // server entry can take.
 
     for (vector<ConnectionProxy>::iterator it = rawOriginalProxyInfo.begin();
          it != rawOriginalProxyInfo.end();
@@ -568,30 +781,7 @@ void GetSanitizedOriginalProxyInfo(vector<ConnectionProxy>& o_originalProxyInfo)
                 ss << _T(";");
             }
 
-            if (regex_match(*elem, localhost_regex))
-            {
-                ss << regex_replace(*elem, localhost_regex, tstring(_T("$1[LOCALHOST]$2$3")));
-            }
-            else if (regex_match(*elem, ipv4_regex))
-            {
-                ss << regex_replace(*elem, ipv4_regex, tstring(_T("$1[IPV4]$2$3")));
-            }
-            else if (regex_match(*elem, ipv6_regex))
-            {
-                ss << regex_replace(*elem, ipv6_regex, tstring(_T("$1[IPV6]$2$3")));
-            }
-            else if (regex_match(*elem, nonfqdn_regex))
-            {
-                ss << regex_replace(*elem, nonfqdn_regex, tstring(_T("$1[NONFQDN]$2$3")));
-            }
-            else if (regex_match(*elem, fqdn_regex))
-            {
-                ss << regex_replace(*elem, fqdn_regex, tstring(_T("$1[FQDN]$2$3")));
-            }
-            else
-            {
-                ss << _T("[UNMATCHED]");
-            }
+            ss << SanitizeProxyElement(*elem);
         }
 
         info.proxy = ss.str();
@@ -802,7 +992,10 @@ void WriteRegistryProxyInfo(const char* regKey, const vector<ConnectionProxy>& p
                                   registryFailureReason))
     {
         my_print(NOT_SENSITIVE, false, _T("%s:%d: WriteRegistryStringValue error: %d, %d"), __TFUNCTION__, __LINE__, registryFailureReason, GetLastError());
+        return;
     }
+
+    UpdateProxyConfigSnapshot(regKey, proxyInfo);
 }
 
 
@@ -141,6 +141,10 @@ private:
 ProxyConfig GetTunneledDefaultProxyConfig();
 /// Get the proxy info for the original default connection.
 ProxyConfig GetNativeDefaultProxyConfig();
+/// Incremented each time either of the above default proxy configs is
+/// replaced. Callers that derive state from them can use it to tell when
+/// that state is stale.
+unsigned int GetProxyConfigGeneration();
 
 
 void DoStartupSystemProxyWork();
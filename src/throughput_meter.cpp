@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "psiclient.h"
+#include "throughput_meter.h"
+#include <algorithm>
+
+
+// The number of one-second slots in the ring; i.e., the window over which
+// percentiles are computed.
+#define THROUGHPUT_RING_SECONDS             300
+
+// How often, at most, the meter is pushed to the UI.
+#define THROUGHPUT_UI_UPDATE_INTERVAL_MS    2000
+
+// The most tunnels metered separately. Pooled tunnels are replaced as they
+// fail, so the least recently active are dropped past this.
+#define THROUGHPUT_MAX_TUNNELS              16
+
+
+struct ThroughputSlot
+{
+    // The second (of GetTickCount64) this slot holds. A slot for a second
+    // that's older than the ring is stale and must be ignored.
+    ULONGLONG second;
+    unsigned long long sentBytes;
+    unsigned long long receivedBytes;
+};
+
+struct TunnelThroughput
+{
+    // The second (of GetTickCount64) the tunnel last transferred bytes in,
+    // and the bytes it transferred in that second and the one before.
+    ULONGLONG second;
+    unsigned long long sentBytes;
+    unsigned long long receivedBytes;
+    unsigned long long previousSentBytes;
+    unsigned long long previousReceivedBytes;
+    unsigned long long totalSentBytes;
+    unsigned long long totalReceivedBytes;
+};
+
+static HANDLE g_throughputMeterMutex = CreateMutex(NULL, FALSE, 0);
+static ThroughputSlot g_ring[THROUGHPUT_RING_SECONDS];
+static ULONGLONG g_resetTickMS = GetTickCount64();
+static ULONGLONG g_activeSeconds = 0;
+static unsigned long long g_peakSentBytes = 0;
+static unsigned long long g_peakReceivedBytes = 0;
+static ULONGLONG g_lastUIUpdateTickMS = 0;
+static map<string, TunnelThroughput> g_tunnels;
+
+
+// Returns the value at the given percentile of the samples, which are sorted in-place.
+static unsigned long long Percentile(vector<unsigned long long>& samples, unsigned int percentile)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+
+    sort(samples.begin(), samples.end());
+
+    // Rank of the sample we want, rounded up.
+    size_t rank = (samples.size() * percentile + 99) / 100;
+    return samples[max(rank, (size_t)1) - 1];
+}
+
+static Json::Value Rates(unsigned long long sentBytes, unsigned long long receivedBytes)
+{
+    Json::Value rates;
+    rates["sent"] = (Json::UInt64)sentBytes;
+    rates["received"] = (Json::UInt64)receivedBytes;
+    return rates;
+}
+
+// Caller must hold g_throughputMeterMutex
+static void AddTunnelBytesLocked(
+    const string& tunnelID, ULONGLONG currentSecond,
+    unsigned long long sentBytes, unsigned long long receivedBytes)
+{
+    if (g_tunnels.find(tunnelID) == g_tunnels.end() && g_tunnels.size() >= THROUGHPUT_MAX_TUNNELS)
+    {
+        auto oldest = min_element(g_tunnels.begin(), g_tunnels.end(),
+            [](const pair<const string, TunnelThroughput>& a, const pair<const string, TunnelThroughput>& b) {
+                return a.second.second < b.second.second;
+            });
+        g_tunnels.erase(oldest);
+    }
+
+    TunnelThroughput& tunnel = g_tunnels[tunnelID];
+    if (tunnel.second != currentSecond)
+    {
+        bool consecutive = (tunnel.second + 1 == currentSecond);
+        tunnel.previousSentBytes = consecutive ? tunnel.sentBytes : 0;
+        tunnel.previousReceivedBytes = consecutive ? tunnel.receivedBytes : 0;
+        tunnel.second = currentSecond;
+        tunnel.sentBytes = 0;
+        tunnel.receivedBytes = 0;
+    }
+
+    tunnel.sentBytes += sentBytes;
+    tunnel.receivedBytes += receivedBytes;
+    tunnel.totalSentBytes += sentBytes;
+    tunnel.totalReceivedBytes += receivedBytes;
+}
+
+// Caller must hold g_throughputMeterMutex
+static void GetSummaryLocked(Json::Value& o_json)
+{
+    ULONGLONG nowTickMS = GetTickCount64();
+    ULONGLONG currentSecond = nowTickMS / 1000;
+
+    // Only completed seconds are used; the current one is still accumulating.
+    vector<unsigned long long> sentSamples, receivedSamples;
+    unsigned long long currentSentBytes = 0, currentReceivedBytes = 0;
+    for (size_t i = 0; i < THROUGHPUT_RING_SECONDS; i++)
+    {
+        const ThroughputSlot& slot = g_ring[i];
+        if ((slot.sentBytes == 0 && slot.receivedBytes == 0)
+            || slot.second >= currentSecond
+            || slot.second + THROUGHPUT_RING_SECONDS < currentSecond)
+        {
+            continue;
+        }
+
+        sentSamples.push_back(slot.sentBytes);
+        receivedSamples.push_back(slot.receivedBytes);
+
+        if (slot.second + 1 == currentSecond)
+        {
+            currentSentBytes = slot.sentBytes;
+            currentReceivedBytes = slot.receivedBytes;
+        }
+    }
+
+    ULONGLONG elapsedSeconds = (nowTickMS - g_resetTickMS) / 1000;
+
+    o_json["current"] = Rates(currentSentBytes, currentReceivedBytes);
+    o_json["peak"] = Rates(g_peakSentBytes, g_peakReceivedBytes);
+    o_json["p50"] = Rates(Percentile(sentSamples, 50), Percentile(receivedSamples, 50));
+    o_json["p90"] = Rates(Percentile(sentSamples, 90), Percentile(receivedSamples, 90));
+    o_json["p99"] = Rates(Percentile(sentSamples, 99), Percentile(receivedSamples, 99));
+    o_json["windowSeconds"] = THROUGHPUT_RING_SECONDS;
+    o_json["activeSeconds"] = (Json::UInt64)g_activeSeconds;
+    o_json["idleSeconds"] = (Json::UInt64)(elapsedSeconds - min(elapsedSeconds, g_activeSeconds));
+
+    // Per-tunnel throughput is only of interest with a tunnel pool
+    if (g_tunnels.size() > 1)
+    {
+        Json::Value tunnels(Json::objectValue);
+        for (const auto& it : g_tunnels)
+        {
+            // As above, the current rate is that of the last completed second
+            const TunnelThroughput& tunnel = it.second;
+            Json::Value json;
+            if (tunnel.second + 1 == currentSecond)
+            {
+                json["current"] = Rates(tunnel.sentBytes, tunnel.receivedBytes);
+            }
+            else if (tunnel.second == currentSecond)
+            {
+                json["current"] = Rates(tunnel.previousSentBytes, tunnel.previousReceivedBytes);
+            }
+            else
+            {
+                json["current"] = Rates(0, 0);
+            }
+            json["total"] = Rates(tunnel.totalSentBytes, tunnel.totalReceivedBytes);
+            tunnels[it.first] = json;
+        }
+        o_json["tunnels"] = tunnels;
+    }
+}
+
+
+void ThroughputMeter::Reset()
+{
+    AutoMUTEX lock(g_throughputMeterMutex);
+
+    ZeroMemory(g_ring, sizeof(g_ring));
+    g_resetTickMS = GetTickCount64();
+    g_activeSeconds = 0;
+    g_peakSentBytes = 0;
+    g_peakReceivedBytes = 0;
+    g_lastUIUpdateTickMS = 0;
+    g_tunnels.clear();
+}
+
+
+void ThroughputMeter::AddBytes(unsigned long long sentBytes, unsigned long long receivedBytes, const string& tunnelID)
+{
+    if (sentBytes == 0 && receivedBytes == 0)
+    {
+        // Seconds with no traffic are idle, and aren't stored.
+        return;
+    }
+
+    Json::Value summary;
+    {
+        AutoMUTEX lock(g_throughputMeterMutex);
+
+        ULONGLONG nowTickMS = GetTickCount64();
+        ULONGLONG currentSecond = nowTickMS / 1000;
+
+        ThroughputSlot& slot = g_ring[currentSecond % THROUGHPUT_RING_SECONDS];
+        if (slot.second != currentSecond)
+        {
+            slot.second = currentSecond;
+            slot.sentBytes = 0;
+            slot.receivedBytes = 0;
+            g_activeSeconds++;
+        }
+
+        slot.sentBytes += sentBytes;
+        slot.receivedBytes += receivedBytes;
+
+        g_peakSentBytes = max(g_peakSentBytes, slot.sentBytes);
+        g_peakReceivedBytes = max(g_peakReceivedBytes, slot.receivedBytes);
+
+        if (!tunnelID.empty())
+        {
+            AddTunnelBytesLocked(tunnelID, currentSecond, sentBytes, receivedBytes);
+        }
+
+        if (nowTickMS - g_lastUIUpdateTickMS < THROUGHPUT_UI_UPDATE_INTERVAL_MS)
+        {
+            return;
+        }
+        g_lastUIUpdateTickMS = nowTickMS;
+
+        GetSummaryLocked(summary);
+    }
+
+    Json::Value notice;
+    notice["noticeType"] = "PsiphonUI::ThroughputMeter";
+    notice["data"] = summary;
+    Json::FastWriter jsonWriter;
+    UI_Notice(jsonWriter.write(notice));
+}
+
+
+void ThroughputMeter::GetSummary(Json::Value& o_json)
+{
+    AutoMUTEX lock(g_throughputMeterMutex);
+
+    o_json = Json::Value(Json::objectValue);
+    GetSummaryLocked(o_json);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+
+/**
+Meters tunnel throughput for the current connection. Byte counts are bucketed
+into one-second slots in a fixed-size ring, from which current, peak and
+percentile rates are derived. Fed by tunnel-core BytesTransferred notices
+and, for VPN, by the local proxy's byte counts. When tunnel-core runs a pool
+of tunnels, the bytes for each tunnel are also totalled separately.
+*/
+namespace ThroughputMeter
+{
+    /// Clears the meter. Called when a new connection is established.
+    void Reset();
+
+    /// Adds bytes transferred to the current second. Periodically pushes the
+    /// meter to the UI (as a "PsiphonUI::ThroughputMeter" notice).
+    /// `tunnelID`, if not empty, identifies the tunnel the bytes went through.
+    void AddBytes(unsigned long long sentBytes, unsigned long long receivedBytes, const string& tunnelID="");
+
+    /// Fills `o_json` with the meter summary. Rates are in bytes per second;
+    /// percentiles are over the active (non-idle) seconds in the ring.
+    /// If bytes were added for more than one tunnel, "tunnels" holds the
+    /// current rate and total bytes for each.
+    void GetSummary(Json::Value& o_json);
+}
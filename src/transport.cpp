@@ -37,7 +37,7 @@
 ITransport::ITransport(LPCTSTR transportProtocolName)
     : m_systemProxySettings(NULL),
       m_tempConnectServerEntry(NULL),
-      m_serverList(WStringToUTF8(transportProtocolName).c_str()),
+      m_serverList(WideToUTF8(transportProtocolName).c_str()),
       m_firstConnectionAttempt(true),
       m_reconnectStateReceiver(NULL),
       m_upgradePaver(NULL),
@@ -48,7 +48,11 @@ ITransport::ITransport(LPCTSTR transportProtocolName)
 
 bool ITransport::ServerWithCapabilitiesExists()
 {
-    ServerEntries entries = m_serverList.GetList();
+    // A server can only support this transport if it has the transport's
+    // required capability flags, so use the list's capability index to skip
+    // the rest. ServerHasCapabilities is still checked for the remainder, as
+    // it may have other requirements (e.g., VPN's pre-tunnel handshake).
+    ServerEntries entries = m_serverList.GetListWithCapabilityFlags(GetRequiredCapabilityFlags());
 
     for (size_t i = 0; i < entries.size(); i++)
     {
@@ -207,7 +211,7 @@ tstring ITransport::GetHandshakeRequestPath(const SessionInfo& sessionInfo)
 }
 
 
-bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
+bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo, bool allowTempTunnel/*=true*/)
 {
     string handshakeResponse;
 
@@ -216,7 +220,11 @@ bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
     // Send list of known server IP addresses (used for stats logging on the server)
 
     // Allow an adhoc tunnel if this is a pre-transport handshake (i.e, for VPN)
-    ServerRequest::ReqLevel reqLevel = preTransport ? ServerRequest::FULL : ServerRequest::ONLY_IF_TRANSPORT;
+    ServerRequest::ReqLevel reqLevel = ServerRequest::ONLY_IF_TRANSPORT;
+    if (preTransport)
+    {
+        reqLevel = allowTempTunnel ? ServerRequest::FULL : ServerRequest::NO_TEMP_TUNNEL;
+    }
 
     if (!ServerRequest::MakeRequest(
                         reqLevel,
@@ -246,9 +254,9 @@ bool ITransport::DoHandshake(bool preTransport, SessionInfo& sessionInfo)
 // static
 size_t ITransport::AddServerEntries(
         LPCTSTR transportProtocolName,
-        const vector<string>& newServerEntryList,
+        const ServerEntries& newServerEntries,
         const ServerEntry* serverEntry)
 {
-    ServerList serverList(WStringToUTF8(transportProtocolName).c_str());
-    return serverList.AddEntriesToList(newServerEntryList, serverEntry);
+    ServerList serverList(WideToUTF8(transportProtocolName).c_str());
+    return serverList.AddEntriesToList(newServerEntries, serverEntry);
 }
@@ -106,9 +106,19 @@ public:
     // such as tunnel-core's support of Speed Boost authorizations.
     virtual bool SupportsAuthorizations() const = 0;
 
+    // Returns true if the transport stopped because its session lifetime
+    // (the handshake's preemptive reconnect lifetime) expired, and it has
+    // prepared to reconnect immediately.
+    virtual bool IsPreemptiveReconnectPending() const { return false; }
+
     // Returns true if at least one server supports this transport.
     virtual bool ServerWithCapabilitiesExists();
 
+    // The ServerCapabilityFlag values that a server must have to support
+    // this transport. Used to narrow the servers that ServerHasCapabilities
+    // is checked against.
+    virtual unsigned int GetRequiredCapabilityFlags() const { return 0; }
+
     // Returns true if the specified server supports this transport.
     virtual bool ServerHasCapabilities(const ServerEntry& entry) const = 0;
 
@@ -145,7 +155,7 @@ public:
 
     static size_t AddServerEntries(
             LPCTSTR transportProtocolName,
-            const vector<string>& newServerEntryList,
+            const ServerEntries& newServerEntries,
             const ServerEntry* serverEntry);
 
     //
@@ -184,7 +194,9 @@ protected:
 
     tstring GetHandshakeRequestPath(const SessionInfo& sessionInfo);
     // May throw StopSignal::StopException
-    bool DoHandshake(bool preTransport, SessionInfo& sessionInfo);
+    // If allowTempTunnel is false, a pre-transport handshake is only attempted
+    // via direct HTTPS.
+    bool DoHandshake(bool preTransport, SessionInfo& sessionInfo, bool allowTempTunnel=true);
 
 protected:
     SessionInfo m_sessionInfo;
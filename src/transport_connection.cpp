@@ -23,6 +23,7 @@
 #include "local_proxy.h"
 #include "transport.h"
 #include "psiclient.h"
+#include "connect_timing.h"
 
 
 TransportConnection::TransportConnection()
@@ -91,10 +92,7 @@ void TransportConnection::Connect(
             // Set up and start the local proxy.
             m_localProxy = new LocalProxy(
                                 statsCollector, 
-                                m_sessionInfo.GetServerAddress().c_str(), 
-                                &m_systemProxySettings,
-                                0, // no parent port
-                                tstring()); // no split tunnel file path
+                                &m_systemProxySettings);
 
             // Launches the local proxy thread and doesn't return until it
             // observes a successful (or not) connection.
@@ -117,10 +115,12 @@ void TransportConnection::Connect(
 
             // Apply the system proxy settings that have been collected by the transport
             // and the local proxy.
+            ConnectTimingSpan applyProxySettingsSpan(CONNECT_PHASE_APPLY_PROXY_SETTINGS, !tempConnectServerEntry);
             if (!m_systemProxySettings.Apply(allowedToSkipProxySettings))
             {
                 throw IWorkerThread::Error("SystemProxySettings::Apply failed");
             }
+            applyProxySettingsSpan.End();
         }
 
         // If the transport did a handshake, there may be updated session info.
@@ -161,6 +161,11 @@ void TransportConnection::Connect(
     }
 }
 
+bool TransportConnection::IsConnected() const
+{
+    return m_transport && m_transport->IsConnected(false);
+}
+
 void TransportConnection::WaitForDisconnect()
 {
     HANDLE waitHandles[2];
@@ -70,6 +70,9 @@ public:
     // Blocks until the transport disconnects.
     void WaitForDisconnect();
 
+    // Returns true if the transport's worker thread is still running.
+    bool IsConnected() const;
+
     // When a connection is made, a handshake is done to get extra information
     // from the server. That info can be retrieved with this function.
     SessionInfo GetUpdatedSessionInfo() const;
@@ -96,11 +96,13 @@ void TransportRegistry::AddServerEntries(
 
     bool discovered = false;
 
+    ServerEntries newServerEntries = ServerList::DecodeServerEntries(newServerEntryList);
+
     for (vector<RegisteredTransport>::const_iterator it = m_registeredTransports.begin();
          it != m_registeredTransports.end();
          ++it)
     {
-        size_t newEntries = it->addServerEntriesFn(it->transportProtocolName.c_str(), newServerEntryList, serverEntry);
+        size_t newEntries = it->addServerEntriesFn(it->transportProtocolName.c_str(), newServerEntries, serverEntry);
 
         if (newEntries > 0)
         {
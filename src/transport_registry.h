@@ -30,7 +30,7 @@ struct ServerEntry;
 //
 
 typedef ITransport* (*TransportFactoryFn)();
-typedef size_t (*AddServerEntriesFn)(LPCTSTR transportProtocolName, const vector<string>& newServerEntryList, const ServerEntry* serverEntry);
+typedef size_t (*AddServerEntriesFn)(LPCTSTR transportProtocolName, const vector<ServerEntry>& newServerEntries, const ServerEntry* serverEntry);
 
 struct RegisteredTransport
 {
@@ -54,6 +54,8 @@ public:
     static void NewAll(vector<shared_ptr<ITransport>>& all_transports);
 
     // Add new server entries to all transports.
+    // The entries are decoded once and shared by all transports' lists.
+    // Throws if any entry is corrupt, in which case no list is modified.
     static void AddServerEntries(
                     const vector<string>& newServerEntryList, 
                     const ServerEntry* serverEntry);
@@ -39,37 +39,207 @@ using namespace std;
 
 typedef basic_stringstream<TCHAR> tstringstream;
 
+// UTF-8 <-> UTF-16 conversion. Strings cross this boundary constantly (logging,
+// UI bridging, request arguments, registry values), and are nearly always
+// pure ASCII, so that case is a plain widening/narrowing copy. Everything else
+// goes through the OS converter, which replaces invalid sequences with U+FFFD.
+
+// Returns the length of the pure-ASCII prefix of the string. Checks a
+// 64-bit word at a time, and then finds the exact position bytewise.
+static size_t ASCIIPrefixLength(const char* s, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(unsigned long long) <= length; i += sizeof(unsigned long long))
+    {
+        unsigned long long word;
+        memcpy(&word, s + i, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+        {
+            break;
+        }
+    }
+    while (i < length && !(s[i] & 0x80))
+    {
+        i++;
+    }
+    return i;
+}
+
+static size_t ASCIIPrefixLength(const wchar_t* s, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(unsigned long long)/sizeof(wchar_t) <= length; i += sizeof(unsigned long long)/sizeof(wchar_t))
+    {
+        unsigned long long word;
+        memcpy(&word, s + i, sizeof(word));
+        if (word & 0xFF80FF80FF80FF80ULL)
+        {
+            break;
+        }
+    }
+    while (i < length && s[i] < 0x80)
+    {
+        i++;
+    }
+    return i;
+}
+
+// Converts into `o_buffer`, which must have room for `length` characters (the
+// UTF-16 form is never longer than the UTF-8). Returns the number of characters
+// written.
+static size_t UTF8ToUTF16(const char* utf8String, size_t length, wchar_t* o_buffer)
+{
+    if (ASCIIPrefixLength(utf8String, length) == length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            o_buffer[i] = (wchar_t)utf8String[i];
+        }
+        return length;
+    }
+
+    return (size_t)MultiByteToWideChar(CP_UTF8, 0, utf8String, (int)length, o_buffer, (int)length);
+}
+
+// As above, in the other direction. `o_buffer` must have room for `length`*3
+// characters, as a UTF-16 character needs at most 3 UTF-8 bytes.
+static size_t UTF16ToUTF8(const wchar_t* wString, size_t length, char* o_buffer)
+{
+    if (ASCIIPrefixLength(wString, length) == length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            o_buffer[i] = (char)wString[i];
+        }
+        return length;
+    }
+
+    return (size_t)WideCharToMultiByte(CP_UTF8, 0, wString, (int)length, o_buffer, (int)length * 3, NULL, NULL);
+}
+
+static string WStringToUTF8(LPCWSTR wString, size_t length)
+{
+    if (ASCIIPrefixLength(wString, length) == length)
+    {
+        return string(wString, wString + length);
+    }
+
+    string result;
+    int resultLength = WideCharToMultiByte(CP_UTF8, 0, wString, (int)length, NULL, 0, NULL, NULL);
+    if (resultLength > 0)
+    {
+        result.resize(resultLength);
+        (void)WideCharToMultiByte(CP_UTF8, 0, wString, (int)length, &result[0], resultLength, NULL, NULL);
+    }
+    return result;
+}
+
 static string WStringToUTF8(LPCWSTR wString)
 {
-    wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    const string utf8_string = converter.to_bytes(wString);
-    return utf8_string;
+    return WStringToUTF8(wString, wcslen(wString));
 }
 
 static string WStringToUTF8(const wstring& wString)
 {
-    return WStringToUTF8(wString.c_str());
+    return WStringToUTF8(wString.c_str(), wString.length());
+}
+
+static wstring UTF8ToWString(LPCSTR utf8String, size_t length)
+{
+    if (ASCIIPrefixLength(utf8String, length) == length)
+    {
+        return wstring(utf8String, utf8String + length);
+    }
+
+    wstring result;
+    int resultLength = MultiByteToWideChar(CP_UTF8, 0, utf8String, (int)length, NULL, 0);
+    if (resultLength > 0)
+    {
+        result.resize(resultLength);
+        (void)MultiByteToWideChar(CP_UTF8, 0, utf8String, (int)length, &result[0], resultLength);
+    }
+    return result;
 }
 
 static wstring UTF8ToWString(LPCSTR utf8String)
 {
-    // There is an issue in VS2015 that messes up codecvt. For a bit of info
-    // and the workaround, see here:
-    // https://social.msdn.microsoft.com/Forums/en-US/8f40dcd8-c67f-4eba-9134-a19b9178e481/vs-2015-rc-linker-stdcodecvt-error?forum=vcgeneral
-    // These two lines are the correct (and currently broken) form:
-    //std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> utf16conv;
-    //std::u16string utf16 = utf16conv.from_bytes(utf8String);
-    // And these two lines are the workaround:
-    std::wstring_convert<std::codecvt_utf8_utf16<__int16>, __int16> utf16conv;
-    basic_string<__int16, char_traits<__int16>, allocator<__int16> > utf16 = utf16conv.from_bytes(utf8String);
-    return wstring(utf16.begin(), utf16.end());
+    return UTF8ToWString(utf8String, strlen(utf8String));
 }
 
 static wstring UTF8ToWString(const string& utf8String)
 {
-    return UTF8ToWString(utf8String.c_str());
+    return UTF8ToWString(utf8String.c_str(), utf8String.length());
 }
 
+/**
+Holds the result of a conversion for the duration of a call, as in
+`SomeAPI(UTF8ToWide(utf8String).c_str())`. Results that fit in the inline
+buffer -- most of them -- don't allocate.
+*/
+template<typename CharT, size_t InlineLength>
+class ConvertedString
+{
+public:
+    const CharT* c_str() const { return m_onHeap ? m_heap.c_str() : m_inline; }
+    size_t length() const { return m_length; }
+
+protected:
+    ConvertedString() : m_length(0), m_onHeap(false) { m_inline[0] = 0; }
+
+    // Returns a buffer with room for `capacity` characters plus a terminator
+    CharT* Reserve(size_t capacity)
+    {
+        m_onHeap = capacity >= InlineLength;
+        if (m_onHeap)
+        {
+            m_heap.resize(capacity);
+            return &m_heap[0];
+        }
+        return m_inline;
+    }
+
+    void SetLength(size_t length)
+    {
+        m_length = length;
+        if (m_onHeap)
+        {
+            m_heap.resize(length);
+        }
+        else
+        {
+            m_inline[length] = 0;
+        }
+    }
+
+private:
+    CharT m_inline[InlineLength];
+    basic_string<CharT> m_heap;
+    size_t m_length;
+    bool m_onHeap;
+};
+
+class UTF8ToWide : public ConvertedString<wchar_t, 128>
+{
+public:
+    UTF8ToWide(const char* utf8String, size_t length)
+    {
+        SetLength(UTF8ToUTF16(utf8String, length, Reserve(length)));
+    }
+    explicit UTF8ToWide(const char* utf8String) : UTF8ToWide(utf8String, strlen(utf8String)) {}
+    explicit UTF8ToWide(const string& utf8String) : UTF8ToWide(utf8String.c_str(), utf8String.length()) {}
+};
+
+class WideToUTF8 : public ConvertedString<char, 256>
+{
+public:
+    WideToUTF8(const wchar_t* wString, size_t length)
+    {
+        SetLength(UTF16ToUTF8(wString, length, Reserve(length * 3)));
+    }
+    explicit WideToUTF8(const wchar_t* wString) : WideToUTF8(wString, wcslen(wString)) {}
+    explicit WideToUTF8(const wstring& wString) : WideToUTF8(wString.c_str(), wString.length()) {}
+};
+
 // This function is used to handle UTF-8 encoded data stored inside of a wstring
 static string WStringToNarrow(const wstring& wString)
 {
@@ -63,6 +63,18 @@
 #define SKIP_AUTO_CONNECT_NAME          "SkipAutoConnect"
 #define SKIP_AUTO_CONNECT_DEFAULT       FALSE
 
+// The number of concurrent tunnels tunnel-core establishes. Connections are
+// spread across them, which helps throughput on high-latency links.
+#define TUNNEL_POOL_SIZE_NAME           "TunnelPoolSize"
+#define TUNNEL_POOL_SIZE_DEFAULT        1
+#define TUNNEL_POOL_SIZE_MAX            8
+
+// When the handshake gives a session lifetime, the VPN transport hangs up and
+// redials when it expires. L2TP/IPsec is system-wide, so traffic isn't
+// tunneled during the redial; this is off unless the user opts in.
+#define VPN_PREEMPTIVE_RECONNECT_NAME    "VPNPreemptiveReconnect"
+#define VPN_PREEMPTIVE_RECONNECT_DEFAULT FALSE
+
 #define SKIP_UPSTREAM_PROXY_NAME        "SSHParentProxySkip"
 #define SKIP_UPSTREAM_PROXY_DEFAULT     FALSE
 
@@ -175,6 +187,8 @@ void Settings::Initialize()
     // This is to help users find and modify them.
     (void)GetSettingDword(SKIP_PROXY_SETTINGS_NAME, SKIP_PROXY_SETTINGS_DEFAULT, true);
     (void)GetSettingDword(SKIP_AUTO_CONNECT_NAME, SKIP_AUTO_CONNECT_DEFAULT, true);
+    (void)GetSettingDword(TUNNEL_POOL_SIZE_NAME, TUNNEL_POOL_SIZE_DEFAULT, true);
+    (void)GetSettingDword(VPN_PREEMPTIVE_RECONNECT_NAME, VPN_PREEMPTIVE_RECONNECT_DEFAULT, true);
 }
 
 void Settings::ToJson(Json::Value& o_json)
@@ -589,6 +603,21 @@ bool Settings::SkipAutoConnect()
     return !!GetSettingDword(SKIP_AUTO_CONNECT_NAME, SKIP_AUTO_CONNECT_DEFAULT);
 }
 
+unsigned int Settings::TunnelPoolSize()
+{
+    DWORD size = GetSettingDword(TUNNEL_POOL_SIZE_NAME, TUNNEL_POOL_SIZE_DEFAULT);
+    if (size < 1 || size > TUNNEL_POOL_SIZE_MAX)
+    {
+        size = TUNNEL_POOL_SIZE_DEFAULT;
+    }
+    return (unsigned int)size;
+}
+
+bool Settings::VPNPreemptiveReconnect()
+{
+    return !!GetSettingDword(VPN_PREEMPTIVE_RECONNECT_NAME, VPN_PREEMPTIVE_RECONNECT_DEFAULT);
+}
+
 /*
 For internal use only
 TODO: Probably shouldn't be in the "usersettings" file
@@ -61,6 +61,10 @@ namespace Settings
 
     bool SkipProxySettings();
     bool SkipAutoConnect();
+    // The number of concurrent tunnels to run in the core transport (1 to 8).
+    unsigned int TunnelPoolSize();
+    // Whether the VPN transport reconnects when its session lifetime expires.
+    bool VPNPreemptiveReconnect();
 
     // These are used by the web UI
     void SetCookies(const string& value);
@@ -437,6 +437,63 @@ bool WriteFile(const tstring& filename, const string& data)
     return true;
 }
 
+bool WriteFileAtomically(const tstring& filename, const string& data)
+{
+    tstring tempFilename = filename + _T(".tmp");
+    if (!WriteFile(tempFilename, data))
+    {
+        (void)DeleteFile(tempFilename.c_str());
+        return false;
+    }
+
+    if (!MoveFileEx(tempFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        auto lastError = GetLastError();
+        (void)DeleteFile(tempFilename.c_str());
+        SetLastError(lastError);
+        my_print(NOT_SENSITIVE, false, _T("%s - MoveFileEx failed (%d)"), __TFUNCTION__, lastError);
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadFile(const tstring& filename, string& o_data)
+{
+    o_data.clear();
+
+    HANDLE file = CreateFile(
+        filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        // Not logged: a missing file is often an expected condition.
+        // Caller can check GetLastError().
+        return false;
+    }
+    auto closeFile = finally([file] { CloseHandle(file); });
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.HighPart != 0)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s - get file size failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    string data(fileSize.LowPart, '\0');
+    DWORD bytesRead = 0;
+    if (fileSize.LowPart > 0
+        && (!ReadFile(file, &data[0], fileSize.LowPart, &bytesRead, NULL)
+            || bytesRead != fileSize.LowPart))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s - read file failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    o_data.swap(data);
+    return true;
+}
+
 // From https://stackoverflow.com/a/6218445/729729
 bool DirectoryExists(LPCTSTR szPath)
 {
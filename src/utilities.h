@@ -39,6 +39,14 @@ bool GetShortPathName(const tstring& path, tstring& o_shortPath);
 
 bool WriteFile(const tstring& filename, const string& data);
 
+// Writes the file via a temp file that's renamed over it, so that readers see
+// either the old or the new contents, never a partial write.
+bool WriteFileAtomically(const tstring& filename, const string& data);
+
+// Reads the whole file into `o_data`. Returns false if the file doesn't exist or
+// can't be read; caller can check GetLastError().
+bool ReadFile(const tstring& filename, string& o_data);
+
 bool DirectoryExists(LPCTSTR szPath);
 
 // Gets a directory that is suitable for storing app data.
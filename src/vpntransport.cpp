@@ -28,13 +28,26 @@
 #include "utilities.h"
 #include "server_request.h"
 #include "diagnostic_info.h"
+#include "connect_timing.h"
+#include "usersettings.h"
 
 
 #define VPN_CONNECTION_TIMEOUT_SECONDS  20
 #define VPN_CONNECTION_NAME             _T("Psiphon3")
 
+// The number of candidate servers that are pre-handshaked concurrently, and
+// how long their PSKs are kept for before they must be pre-handshaked again.
+#define VPN_PRE_HANDSHAKE_CANDIDATES    3
+#define VPN_PRE_HANDSHAKE_TTL_MS        (2*60*1000)
+
+// How long before the session lifetime expires that the next session is
+// pre-handshaked. Must be less than VPN_PRE_HANDSHAKE_TTL_MS.
+#define VPN_PREEMPTIVE_RECONNECT_LEAD_MS    (30*1000)
+
 
 void TweakVPN();
+bool IsTweakVPNRequired();
+void ForgetVPNTweaks();
 void TweakDNS();
 
 
@@ -61,11 +74,19 @@ void VPNTransport::GetFactory(
 VPNTransport::VPNTransport()
     : ITransport(GetTransportProtocolName().c_str()),
       m_state(CONNECTION_STATE_STOPPED),
+      m_stateEnteredTickMS(GetTickCount64()),
       m_stateChangeEvent(INVALID_HANDLE_VALUE),
       m_rasConnection(0),
-      m_lastErrorCode(0)
+      m_rasEnumConnectionCount(0),
+      m_lastErrorCode(0),
+      m_connectedTickMS(0),
+      m_preemptiveReconnectPending(false),
+      m_reconnectingPreemptively(false),
+      m_preemptiveReconnectEnabled(false)
 {
     m_stateChangeEvent = CreateEvent(NULL, FALSE, FALSE, 0);
+    m_stateMutex = CreateMutex(NULL, FALSE, 0);
+    m_preHandshakeMutex = CreateMutex(NULL, FALSE, 0);
 }
 
 VPNTransport::~VPNTransport()
@@ -80,7 +101,17 @@ VPNTransport::~VPNTransport()
     {
         (void)Cleanup();
     }
+
+    // The successor pre-handshake uses this object; it checks the stop signal,
+    // so it won't take long.
+    if (m_successorPreHandshake.valid())
+    {
+        m_successorPreHandshake.wait();
+    }
+
     CloseHandle(m_stateChangeEvent);
+    CloseHandle(m_stateMutex);
+    CloseHandle(m_preHandshakeMutex);
 }
 
 tstring VPNTransport::GetTransportProtocolName() const 
@@ -134,13 +165,23 @@ bool VPNTransport::SupportsAuthorizations() const
     return false;
 }
 
+unsigned int VPNTransport::GetRequiredCapabilityFlags() const
+{
+    return SERVER_CAPABILITY_VPN;
+}
+
 bool VPNTransport::ServerHasCapabilities(const ServerEntry& entry) const
 {
-    // VPN requires a pre-tunnel handshake
+    // Check the cheap capability flag first, as checking for a pre-tunnel
+    // handshake may require instantiating all the other transports.
+    if (!entry.HasCapabilityFlags(GetRequiredCapabilityFlags()))
+    {
+        return false;
+    }
 
-    bool canHandshake = ServerRequest::ServerHasRequestCapabilities(entry);
+    // VPN requires a pre-tunnel handshake
 
-    return canHandshake && entry.HasCapability(WStringToUTF8(GetTransportProtocolName()));
+    return ServerRequest::ServerHasRequestCapabilities(entry);
 }
 
 bool VPNTransport::Cleanup()
@@ -222,6 +263,18 @@ void VPNTransport::TransportConnect()
     // VPN should never be used for a temporary connection
     assert(!m_tempConnectServerEntry);
 
+    // Any successor pre-handshake from the previous connection has finished
+    // (we don't stop for a preemptive reconnect until it has), or will finish
+    // promptly if stop was signaled.
+    if (m_successorPreHandshake.valid())
+    {
+        m_successorPreHandshake.wait();
+        m_successorPreHandshake = future<void>();
+    }
+    m_reconnectingPreemptively = m_preemptiveReconnectPending;
+    m_preemptiveReconnectPending = false;
+    m_preemptiveReconnectEnabled = Settings::VPNPreemptiveReconnect();
+
     if (!m_serverListReorder.IsRunning())
     {
         m_serverListReorder.Start(&m_serverList);
@@ -277,6 +330,7 @@ void VPNTransport::TransportConnectHelper()
     }
 
     ServerEntry serverEntry;
+    ConnectTimingSpan serverSelectionSpan(CONNECT_PHASE_SERVER_SELECTION);
     if (!GetConnectionServerEntry(serverEntry))
     {
         my_print(NOT_SENSITIVE, false, _T("No known servers support this transport type."));
@@ -286,6 +340,7 @@ void VPNTransport::TransportConnectHelper()
         m_stopInfo.stopSignal->SignalStop(STOP_REASON_CANCEL);
         throw Abort();
     }
+    serverSelectionSpan.End();
 
     SessionInfo sessionInfo;
     sessionInfo.Set(serverEntry);
@@ -295,33 +350,72 @@ void VPNTransport::TransportConnectHelper()
     json["ipAddress"] = sessionInfo.GetServerAddress();
     AddDiagnosticInfoJson("ConnectingServer", json);
 
-    // Do pre-handshake
-
-    if (!DoHandshake(
-            true,  // pre-handshake
-            sessionInfo))
-    {
-        MarkServerFailed(sessionInfo.GetServerEntry());
-        throw TransportFailed();
-    }
-
     //
     // Check VPN services and fix if required/possible
     //
-    
+
+    // This is done while pre-handshaking, as neither depends on the other.
+    // Tweaks that have already succeeded in this process aren't redone.
     // Note: we proceed even if the call fails. Testing is inconsistent -- don't
     // always need all tweaks to connect.
-    TweakVPN();
+    future<void> tweakVPN;
+    if (IsTweakVPNRequired())
+    {
+        tweakVPN = async(launch::async, TweakVPN);
+    }
+
+    // Do pre-handshake. If this server was pre-handshaked along with an earlier
+    // candidate, we already have its PSK.
+
+    ConnectTimingSpan handshakeSpan(CONNECT_PHASE_HANDSHAKE);
+    if (!TakePreHandshakedSession(serverEntry, sessionInfo))
+    {
+        PreHandshakeCandidates();
+
+        // If the direct pre-handshake failed, fall back to a full one, which
+        // may use a temporary tunnel.
+        if (!TakePreHandshakedSession(serverEntry, sessionInfo)
+            && !DoHandshake(
+                    true,  // pre-handshake
+                    sessionInfo))
+        {
+            MarkServerFailed(sessionInfo.GetServerEntry());
+            throw TransportFailed();
+        }
+    }
+    handshakeSpan.End();
+
+    // (If the handshake threw, the future's destructor waited for the tweaks.)
+    if (tweakVPN.valid())
+    {
+        tweakVPN.wait();
+    }
 
     //
     // Start VPN connection
     //
 
+    // Right after a preemptive hang-up, the dial may fail because of the
+    // hang-up (e.g., a late state change for the previous connection) rather
+    // than because of the server, so the server isn't marked failed then.
+    auto markDialFailed = [&]() {
+        if (m_reconnectingPreemptively)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: dial failed after preemptive hang-up; not marking server failed"), __TFUNCTION__);
+            return;
+        }
+        MarkServerFailed(sessionInfo.GetServerEntry());
+    };
+
+    ConnectTimingSpan vpnDialSpan(CONNECT_PHASE_VPN_DIAL);
     if (!Establish(
             UTF8ToWString(sessionInfo.GetServerAddress()), 
             UTF8ToWString(sessionInfo.GetPSK())))
     {
-        MarkServerFailed(sessionInfo.GetServerEntry());
+        // The system configuration may have changed since the tweaks were
+        // done, so after a failed dial they're all checked again.
+        ForgetVPNTweaks();
+        markDialFailed();
         throw TransportFailed();
     }
 
@@ -335,7 +429,8 @@ void VPNTransport::TransportConnectHelper()
             CONNECTION_STATE_STARTING, 
             VPN_CONNECTION_TIMEOUT_SECONDS*1000))
     {
-        MarkServerFailed(sessionInfo.GetServerEntry());
+        ForgetVPNTweaks();
+        markDialFailed();
         throw TransportFailed();
     }
     
@@ -343,13 +438,17 @@ void VPNTransport::TransportConnectHelper()
     {
         // Note: WaitForConnectionStateToChangeFrom throws Abort if user
         // cancelled, so if we're here it's a FAILED case.
-        MarkServerFailed(sessionInfo.GetServerEntry());
+        ForgetVPNTweaks();
+        markDialFailed();
         throw TransportFailed();
     }
 
+    vpnDialSpan.End();
+
     // The connection is good.
     MarkServerSucceeded(sessionInfo.GetServerEntry());
     m_sessionInfo = sessionInfo;
+    m_connectedTickMS = GetTickCount64();
 
     //
     // Patch DNS bug on Windowx XP; and flush DNS
@@ -362,12 +461,225 @@ void VPNTransport::TransportConnectHelper()
 }
 
 
+// Pre-handshakes the top few candidate servers concurrently, so that if dialing
+// one fails, the next can be dialed without waiting for its handshake.
+// Only direct HTTPS handshakes are done concurrently: temporary tunnels share
+// the tunnel-core datastore and the local proxy settings, so only one can run
+// at a time.
+void VPNTransport::PreHandshakeCandidates()
+{
+    vector<SessionInfo> candidates;
+    {
+        AutoMUTEX lock(m_preHandshakeMutex);
+
+        ULONGLONG nowTickMS = GetTickCount64();
+        m_preHandshakedSessions.erase(
+            remove_if(
+                m_preHandshakedSessions.begin(),
+                m_preHandshakedSessions.end(),
+                [nowTickMS](const PreHandshakedSession& session) {
+                    return nowTickMS - session.handshakeTickMS >= VPN_PRE_HANDSHAKE_TTL_MS; }),
+            m_preHandshakedSessions.end());
+
+        // The candidates are taken in rank order, as GetConnectionServerEntry does
+        ServerEntries serverEntries = m_serverList.GetListWithCapability(WStringToUTF8(GetTransportProtocolName()));
+        for (ServerEntryIterator it = serverEntries.begin();
+             it != serverEntries.end() && candidates.size() < VPN_PRE_HANDSHAKE_CANDIDATES;
+             ++it)
+        {
+            if (!ServerHasCapabilities(*it)
+                || !(it->capabilityFlags & SERVER_CAPABILITY_HANDSHAKE))
+            {
+                continue;
+            }
+
+            bool alreadyHandshaked = false;
+            for (const auto& session : m_preHandshakedSessions)
+            {
+                if (session.sessionInfo.GetServerAddress() == it->serverAddress)
+                {
+                    alreadyHandshaked = true;
+                    break;
+                }
+            }
+
+            if (!alreadyHandshaked)
+            {
+                SessionInfo candidate;
+                candidate.Set(*it);
+                candidates.push_back(candidate);
+            }
+        }
+    }
+
+    if (candidates.empty())
+    {
+        return;
+    }
+
+    my_print(NOT_SENSITIVE, true, _T("%s: pre-handshaking %d candidates"), __TFUNCTION__, candidates.size());
+
+    vector<future<bool>> results;
+    for (auto& candidate : candidates)
+    {
+        results.push_back(async(launch::async, [this, &candidate]() {
+            try
+            {
+                return DoHandshake(
+                    true,   // pre-handshake
+                    candidate,
+                    false); // no temporary tunnel
+            }
+            catch (...)
+            {
+                // A stop signal is rethrown below
+                return false;
+            }
+        }));
+    }
+
+    // Handshakes check the stop signal, so these return promptly on stop
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        if (results[i].get())
+        {
+            AddPreHandshakedSession(candidates[i]);
+        }
+    }
+
+    // Throws if signaled
+    m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, true);
+}
+
+
+// Gets (and removes, as each PSK is only used once) the pre-handshaked session
+// for the server, if there is an unexpired one.
+bool VPNTransport::TakePreHandshakedSession(const ServerEntry& serverEntry, SessionInfo& o_sessionInfo)
+{
+    AutoMUTEX lock(m_preHandshakeMutex);
+
+    ULONGLONG nowTickMS = GetTickCount64();
+
+    for (auto it = m_preHandshakedSessions.begin(); it != m_preHandshakedSessions.end(); ++it)
+    {
+        if (it->sessionInfo.GetServerAddress() == serverEntry.serverAddress)
+        {
+            bool expired = nowTickMS - it->handshakeTickMS >= VPN_PRE_HANDSHAKE_TTL_MS;
+            if (!expired)
+            {
+                o_sessionInfo = it->sessionInfo;
+            }
+            m_preHandshakedSessions.erase(it);
+            return !expired;
+        }
+    }
+
+    return false;
+}
+
+
+// Replaces any existing pre-handshaked session for the same server.
+void VPNTransport::AddPreHandshakedSession(const SessionInfo& sessionInfo)
+{
+    AutoMUTEX lock(m_preHandshakeMutex);
+
+    m_preHandshakedSessions.erase(
+        remove_if(
+            m_preHandshakedSessions.begin(),
+            m_preHandshakedSessions.end(),
+            [&sessionInfo](const PreHandshakedSession& session) {
+                return session.sessionInfo.GetServerAddress() == sessionInfo.GetServerAddress(); }),
+        m_preHandshakedSessions.end());
+
+    PreHandshakedSession session;
+    session.sessionInfo = sessionInfo;
+    session.handshakeTickMS = GetTickCount64();
+    m_preHandshakedSessions.push_back(session);
+}
+
+
+// Two VPN connections can't be up at once, so rather than making the next
+// connection before breaking the current one, we do everything for it that
+// can be done in advance: shortly before the session lifetime expires, the
+// next session is pre-handshaked (via the current connection). When the
+// lifetime expires, the connection is stopped, and the reconnect only has to
+// dial. Called by DoPeriodicCheck.
+bool VPNTransport::IsPreemptiveReconnectDue()
+{
+    // Hanging up L2TP leaves traffic untunneled until the redial completes,
+    // so it's only done if the user has opted in.
+    if (!m_preemptiveReconnectEnabled)
+    {
+        return false;
+    }
+
+    DWORD lifetimeMilliseconds = m_sessionInfo.GetPreemptiveReconnectLifetimeMilliseconds();
+    if (lifetimeMilliseconds == 0 || lifetimeMilliseconds == MAXDWORD)
+    {
+        // Preemptive reconnect isn't enabled for this session
+        return false;
+    }
+
+    ULONGLONG elapsedMS = GetTickCount64() - m_connectedTickMS;
+    ULONGLONG leadMS = min((ULONGLONG)VPN_PREEMPTIVE_RECONNECT_LEAD_MS, (ULONGLONG)lifetimeMilliseconds / 2);
+
+    if (!m_successorPreHandshake.valid() && elapsedMS + leadMS >= lifetimeMilliseconds)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: pre-handshaking next session"), __TFUNCTION__);
+
+        m_successorPreHandshake = async(launch::async, [this]() {
+            // This is normally the current server, as it was marked succeeded
+            ServerEntry serverEntry;
+            if (!GetConnectionServerEntry(serverEntry))
+            {
+                return;
+            }
+
+            SessionInfo sessionInfo;
+            sessionInfo.Set(serverEntry);
+
+            try
+            {
+                if (DoHandshake(
+                        true,   // pre-handshake
+                        sessionInfo))
+                {
+                    AddPreHandshakedSession(sessionInfo);
+                }
+            }
+            catch (...)
+            {
+                // The reconnect will do a full pre-handshake instead
+            }
+        });
+    }
+
+    if (elapsedMS < lifetimeMilliseconds)
+    {
+        return false;
+    }
+
+    // Keep the current connection until the next session is ready (or its
+    // pre-handshake has failed).
+    return !m_successorPreHandshake.valid()
+        || m_successorPreHandshake.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+
+bool VPNTransport::IsPreemptiveReconnectPending() const
+{
+    return m_preemptiveReconnectPending;
+}
+
+
 bool VPNTransport::GetConnectionServerEntry(ServerEntry& o_serverEntry)
 {
     // Return the first ServerEntry that can be used. This will encourage
     // server affinity (i.e., using the last successful server).
+    // Only entries with the VPN capability are candidates; the list preserves
+    // their order.
 
-    ServerEntries serverEntries = m_serverList.GetList();
+    ServerEntries serverEntries = m_serverList.GetListWithCapability(WStringToUTF8(GetTransportProtocolName()));
 
     for (ServerEntryIterator it = serverEntries.begin();
          it != serverEntries.end();
@@ -389,7 +701,7 @@ size_t VPNTransport::GetConnectionServerEntryCount()
     // Return the first ServerEntry that can be used. This will encourage
     // server affinity (i.e., using the last successful server).
 
-    ServerEntries serverEntries = m_serverList.GetList();
+    ServerEntries serverEntries = m_serverList.GetListWithCapability(WStringToUTF8(GetTransportProtocolName()));
     size_t count = 0;
 
     for (ServerEntryIterator it = serverEntries.begin();
@@ -498,12 +810,12 @@ bool VPNTransport::Establish(const tstring& serverAddress, const tstring& PSK)
     vpnParams.dwCallbackId = (ULONG_PTR)this;
 
     m_rasConnection = 0;
-    SetConnectionState(CONNECTION_STATE_STARTING);
+    SetConnectionState(CONNECTION_STATE_STARTING, true);
     returnCode = RasDial(0, 0, &vpnParams, 2, &(VPNTransport::RasDialCallback), &m_rasConnection);
     if (ERROR_SUCCESS != returnCode)
     {
         my_print(NOT_SENSITIVE, false, _T("RasDial failed (%d)"), returnCode);
-        SetConnectionState(CONNECTION_STATE_FAILED);
+        SetConnectionState(CONNECTION_STATE_FAILED, true);
         SetLastErrorCode(returnCode);
         return false;
     }
@@ -513,13 +825,78 @@ bool VPNTransport::Establish(const tstring& serverAddress, const tstring& PSK)
 
 VPNTransport::ConnectionState VPNTransport::GetConnectionState() const
 {
+    AutoMUTEX lock(m_stateMutex);
     return m_state;
 }
 
-void VPNTransport::SetConnectionState(ConnectionState newState)
+void VPNTransport::SetConnectionState(ConnectionState newState, bool force/*=false*/)
 {
-    m_state = newState;
-    SetEvent(m_stateChangeEvent);
+    Json::Value json;
+    {
+        AutoMUTEX lock(m_stateMutex);
+
+        if (newState == m_state)
+        {
+            // RasDialCallback reports every RAS sub-state of STARTING
+            return;
+        }
+
+        if (!force && !IsValidStateTransition(m_state, newState))
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: ignoring invalid transition (%S -> %S)"),
+                __TFUNCTION__, ConnectionStateName(m_state), ConnectionStateName(newState));
+            return;
+        }
+
+        ULONGLONG nowTickMS = GetTickCount64();
+        json["from"] = ConnectionStateName(m_state);
+        json["to"] = ConnectionStateName(newState);
+        json["elapsedMS"] = (Json::UInt64)(nowTickMS - m_stateEnteredTickMS);
+
+        m_state = newState;
+        m_stateEnteredTickMS = nowTickMS;
+        SetEvent(m_stateChangeEvent);
+    }
+
+    // The time spent in each state, for diagnostics
+    AddDiagnosticInfoJson("VPNConnectionState", json);
+}
+
+// The transitions RasDialCallback may make. Those out of STOPPED and FAILED
+// are made by Establish, so a late callback for a connection that's been hung
+// up or has failed can't move it anywhere.
+// static
+bool VPNTransport::IsValidStateTransition(ConnectionState from, ConnectionState to)
+{
+    switch (from)
+    {
+    case CONNECTION_STATE_STOPPED:
+        return false;
+    case CONNECTION_STATE_STARTING:
+        return to == CONNECTION_STATE_CONNECTED
+            || to == CONNECTION_STATE_FAILED;
+    case CONNECTION_STATE_CONNECTED:
+        return to == CONNECTION_STATE_STOPPED
+            || to == CONNECTION_STATE_FAILED;
+    case CONNECTION_STATE_FAILED:
+        return false;
+    }
+
+    return false;
+}
+
+// static
+const char* VPNTransport::ConnectionStateName(ConnectionState state)
+{
+    switch (state)
+    {
+    case CONNECTION_STATE_STOPPED:      return "stopped";
+    case CONNECTION_STATE_STARTING:     return "starting";
+    case CONNECTION_STATE_CONNECTED:    return "connected";
+    case CONNECTION_STATE_FAILED:       return "failed";
+    }
+
+    return "unknown";
 }
 
 HANDLE VPNTransport::GetStateChangeEvent()
@@ -539,45 +916,57 @@ unsigned int VPNTransport::GetLastErrorCode(void) const
 
 bool VPNTransport::DoPeriodicCheck()
 {
-    return GetConnectionState() == CONNECTION_STATE_CONNECTED;
+    if (GetConnectionState() != CONNECTION_STATE_CONNECTED)
+    {
+        return false;
+    }
+
+    if (IsPreemptiveReconnectDue())
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s session lifetime expired; reconnecting..."), GetTransportDisplayName().c_str());
+        m_preemptiveReconnectPending = true;
+        return false;
+    }
+
+    return true;
 }
 
 bool VPNTransport::WaitForConnectionStateToChangeFrom(ConnectionState state, DWORD timeout)
 {
-    DWORD totalWaitMilliseconds = 0;
+    ULONGLONG deadlineTickMS = GetTickCount64() + timeout;
 
     while (state == GetConnectionState())
     {
-        // Wait for RasDialCallback to set a new state, or timeout (to check cancel/termination)
+        ULONGLONG nowTickMS = GetTickCount64();
+        if (nowTickMS >= deadlineTickMS)
+        {
+            return false;
+        }
 
-        DWORD waitMilliseconds = 100;
+        // Wait for RasDialCallback to set a new state. The stop signal has no
+        // event, so the wait is cut short to check for cancel/termination.
 
-        DWORD result = WaitForSingleObject(GetStateChangeEvent(), waitMilliseconds);
+        DWORD waitMilliseconds = (DWORD)min(deadlineTickMS - nowTickMS, (ULONGLONG)100);
 
-        totalWaitMilliseconds += waitMilliseconds;
+        DWORD result = WaitForSingleObject(GetStateChangeEvent(), waitMilliseconds);
 
-        if (result == WAIT_TIMEOUT)
-        {
-            if (totalWaitMilliseconds >= timeout)
-                return false;
-        }
-        else if (result == WAIT_OBJECT_0)
+        if (result == WAIT_OBJECT_0)
         {
             // State event set, but that doesn't mean that the state actually changed.
             // Let the loop condition check.
             continue;
         }
-        else if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false)) // stop event signalled
-        {
-            // TODO: Maybe this should let CheckSignalStop throw
-            throw Abort();
-        }
-        else
+        else if (result != WAIT_TIMEOUT)
         {
             std::stringstream s;
-            s << __FUNCTION__ << ": WaitForMultipleObjects failed (" << result << ", " << GetLastError() << ")";
+            s << __FUNCTION__ << ": WaitForSingleObject failed (" << result << ", " << GetLastError() << ")";
             throw Error(s.str().c_str());
         }
+        else if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false))
+        {
+            // TODO: Maybe this should let CheckSignalStop throw
+            throw Abort();
+        }
     }
 
     return true;
@@ -616,73 +1005,51 @@ HRASCONN VPNTransport::GetActiveRasConnection()
     // we need to find the rasConnection by name.
 
     HRASCONN rasConnection = 0;
-    RASCONN conn;
-    memset(&conn, 0, sizeof(conn));
-    conn.dwSize = sizeof(conn);
-    LPRASCONN rasConnections = &conn;
-    DWORD bufferSize = sizeof(conn);
-    DWORD connections = 0;
 
-    DWORD returnCode = RasEnumConnections(rasConnections, &bufferSize, &connections);
+    // The buffer is sized by the last enumeration, so the first call usually
+    // succeeds. On Windows XP, we can't call RasEnumConnections with no buffer
+    // because it fails with 632 ERROR_INVALID_SIZE, so there's always at least one.
+    vector<RASCONN> rasConnections(max(m_rasEnumConnectionCount, (DWORD)1));
+    DWORD connections = 0;
+    DWORD returnCode = ERROR_BUFFER_TOO_SMALL;
 
-    // On Windows XP, we can't call RasEnumConnections with rasConnections = 0 because it
-    // fails with 632 ERROR_INVALID_SIZE.  So we set rasConnections to point to a single
-    // RASCONN, and we'll always reallocate, even if there is only one RASCONN and the
-    // first call succeeds.
-    if (ERROR_SUCCESS == returnCode)
+    // A connection may be added between calls, so the buffer may have to grow more than once
+    for (int attempt = 0; attempt < 3 && ERROR_BUFFER_TOO_SMALL == returnCode; attempt++)
     {
-        returnCode = ERROR_BUFFER_TOO_SMALL;
+        memset(&rasConnections[0], 0, rasConnections.size() * sizeof(RASCONN));
+
+        // The first RASCONN structure in the array must contain the RASCONN structure size
+        rasConnections[0].dwSize = sizeof(RASCONN);
+        DWORD bufferSize = (DWORD)(rasConnections.size() * sizeof(RASCONN));
+
+        returnCode = RasEnumConnections(&rasConnections[0], &bufferSize, &connections);
+
+        if (ERROR_BUFFER_TOO_SMALL == returnCode)
+        {
+            // See "A fix to work with older versions of Windows": the required
+            // buffer size may be less than `connections` RASCONNs.
+            size_t count = max((size_t)connections, (bufferSize + sizeof(RASCONN) - 1) / sizeof(RASCONN));
+            rasConnections.resize(max(count, rasConnections.size() + 1));
+        }
     }
 
-    // NOTE: Race condition where a new connection is added between the buffersize check
-    //       and the second call.
-    if (ERROR_BUFFER_TOO_SMALL != returnCode && connections > 0)
+    // If successful, find the one with VPN_CONNECTION_NAME.
+    if (ERROR_SUCCESS != returnCode)
     {
         my_print(NOT_SENSITIVE, false, _T("RasEnumConnections failed (%d)"), returnCode);
+        return rasConnection;
     }
-    else if (ERROR_BUFFER_TOO_SMALL == returnCode && connections > 0)
-    {
-        // See "A fix to work with older versions of Windows"
-        if (bufferSize < (connections * sizeof(RASCONN)))
-        {
-            bufferSize = connections * sizeof(RASCONN);
-        }
 
-        // Allocate the memory needed for the array of RAS structure(s).
-        rasConnections = (LPRASCONN)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, bufferSize);
-        if (!rasConnections)
-        {
-            my_print(NOT_SENSITIVE, false, _T("HeapAlloc failed"));
-            return rasConnection;
-        }
- 
-        // The first RASCONN structure in the array must contain the RASCONN structure size
-        rasConnections[0].dwSize = sizeof(RASCONN);
-        
-        // Call RasEnumConnections to enumerate active connections
-        returnCode = RasEnumConnections(rasConnections, &bufferSize, &connections);
+    m_rasEnumConnectionCount = connections;
 
-        // If successful, find the one with VPN_CONNECTION_NAME.
-        if (ERROR_SUCCESS != returnCode)
-        {
-            my_print(NOT_SENSITIVE, false, _T("RasEnumConnections failed (%d)"), returnCode);
-        }
-        else
+    for (DWORD i = 0; i < connections && i < rasConnections.size(); i++)
+    {
+        if (!_tcscmp(rasConnections[i].szEntryName, VPN_CONNECTION_NAME))
         {
-            for (DWORD i = 0; i < connections; i++)
-            {
-                if (!_tcscmp(rasConnections[i].szEntryName, VPN_CONNECTION_NAME))
-                {
-                    // Entry name is unique and we found it
-                    rasConnection = rasConnections[i].hrasconn;
-                    break;
-                }
-            }
+            // Entry name is unique and we found it
+            rasConnection = rasConnections[i].hrasconn;
+            break;
         }
-
-        //Deallocate memory for the connection buffer
-        HeapFree(GetProcessHeap(), 0, rasConnections);
-        rasConnections = 0;
     }
 
     return rasConnection;
@@ -746,7 +1113,32 @@ void CALLBACK VPNTransport::RasDialCallback(
 
 //==== TweakVPN utility functions =============================================
 
-void FixProhibitIpsec()
+// The tweaks that have succeeded in this process (including those that found
+// nothing to fix), which aren't done again. Guarded by g_vpnTweaksMutex.
+#define VPN_TWEAK_PROHIBIT_IPSEC    0x1
+#define VPN_TWEAK_SERVICES          0x2
+#define VPN_TWEAK_PATCH_DNS         0x4
+
+static HANDLE g_vpnTweaksMutex = CreateMutex(NULL, FALSE, 0);
+static DWORD g_succeededVPNTweaks = 0;
+
+static bool IsVPNTweakDone(DWORD tweak)
+{
+    AutoMUTEX lock(g_vpnTweaksMutex);
+    return (g_succeededVPNTweaks & tweak) == tweak;
+}
+
+static void RecordVPNTweak(DWORD tweak, bool succeeded)
+{
+    AutoMUTEX lock(g_vpnTweaksMutex);
+    if (succeeded)
+    {
+        g_succeededVPNTweaks |= tweak;
+    }
+}
+
+// Returns true if ProhibitIpSec is (now) 0
+bool FixProhibitIpsec()
 {
     // Check for non-default HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Services\RasMan\Parameters\ProhibitIpSec = 1
     // If found, try to set to 0
@@ -755,6 +1147,7 @@ void FixProhibitIpsec()
 
     std::stringstream error;
     HKEY key = 0;
+    bool succeeded = false;
 
     try
     {
@@ -822,6 +1215,8 @@ void FixProhibitIpsec()
                 throw std::exception(error.str().c_str());
             }
         }
+
+        succeeded = true;
     }
     catch(std::exception& ex)
     {
@@ -830,9 +1225,12 @@ void FixProhibitIpsec()
 
     // cleanup
     RegCloseKey(key);
+
+    return succeeded;
 }
 
-void FixVPNServices()
+// Returns true if all of the services are (now) configured and started as required
+bool FixVPNServices()
 {
     // Check for disabled IPSec services and attempt to restore to
     // default (enabled, auto-start) config and start
@@ -863,6 +1261,8 @@ void FixVPNServices()
         {_T("TapiSrv"), SERVICE_DEMAND_START}
     };
 
+    bool succeeded = true;
+
     for (int i = 0; i < sizeof(serviceConfigs)/sizeof(serviceConfig); i++)
     {
         std::stringstream error;
@@ -1010,12 +1410,15 @@ void FixVPNServices()
         catch(std::exception& ex)
         {
             my_print(NOT_SENSITIVE, false, string("Fix VPN Services failed: ") + ex.what());
+            succeeded = false;
         }
 
         // cleanup
         CloseServiceHandle(service); 
         CloseServiceHandle(manager);
     }
+
+    return succeeded;
 }
 
 void TweakVPN()
@@ -1027,8 +1430,27 @@ void TweakVPN()
     // Proceed regardless of FixProhibitIpSec/FixVPNServices success, as we're not sure
     // the fixes are always required.
 
-    FixProhibitIpsec();
-    FixVPNServices();
+    if (!IsVPNTweakDone(VPN_TWEAK_PROHIBIT_IPSEC))
+    {
+        RecordVPNTweak(VPN_TWEAK_PROHIBIT_IPSEC, FixProhibitIpsec());
+    }
+
+    if (!IsVPNTweakDone(VPN_TWEAK_SERVICES))
+    {
+        RecordVPNTweak(VPN_TWEAK_SERVICES, FixVPNServices());
+    }
+}
+
+bool IsTweakVPNRequired()
+{
+    return !IsVPNTweakDone(VPN_TWEAK_PROHIBIT_IPSEC | VPN_TWEAK_SERVICES);
+}
+
+void ForgetVPNTweaks()
+{
+    // The DNS patch is unrelated to dialing, so it isn't forgotten
+    AutoMUTEX lock(g_vpnTweaksMutex);
+    g_succeededVPNTweaks &= ~(VPN_TWEAK_PROHIBIT_IPSEC | VPN_TWEAK_SERVICES);
 }
 
 //==== TweakDNS utility functions =============================================
@@ -1090,7 +1512,8 @@ static const void* memmem(
     return NULL;
 }
 
-static void PatchDNS()
+// Returns true if the fix is (now) applied, or isn't needed
+static bool PatchDNS()
 {
     // Programmatically apply Window XP fix that ensures
     // VPN's DNS server is used (http://support.microsoft.com/kb/311218)
@@ -1106,6 +1529,7 @@ static void PatchDNS()
         std::stringstream error;
         HKEY key = NULL;
         char *buffer = NULL;
+        bool succeeded = false;
 
         try
         {
@@ -1232,6 +1656,8 @@ static void PatchDNS()
                     throw std::exception(error.str().c_str());
                 }
             }
+
+            succeeded = true;
         }
         catch(std::exception& ex)
         {
@@ -1245,7 +1671,11 @@ static void PatchDNS()
         }
 
         RegCloseKey(key);
+
+        return succeeded;
     }
+
+    return true;
 }
 
 typedef BOOL (CALLBACK* DNSFLUSHPROC)();
@@ -1297,9 +1727,13 @@ void TweakDNS()
     // Note: no lock
 
     // Patch tries to fix a bug on XP where the non-VPN's DNS server is still consulted
-    PatchDNS();
+    if (!IsVPNTweakDone(VPN_TWEAK_PATCH_DNS))
+    {
+        RecordVPNTweak(VPN_TWEAK_PATCH_DNS, PatchDNS());
+    }
 
     // Flush is to clear cached lookups from non-VPN DNS
     // Note: this only affects system cache, not application caches (e.g., browsers)
+    // Unlike the patch, this is needed for every connection.
     FlushDNS();
 }
@@ -31,6 +31,10 @@ class SessionInfo;
 
 class VPNTransport: public ITransport
 {
+    // The states of the RAS connection. Establish moves to STARTING (or to
+    // FAILED, if RasDial fails), whatever the current state, and
+    // RasDialCallback drives the rest. Only the callback transitions allowed
+    // by IsValidStateTransition are made.
     enum ConnectionState
     {
         CONNECTION_STATE_STOPPED = 0,
@@ -59,6 +63,8 @@ public:
     virtual bool IsWholeSystemTunneled() const;
     virtual bool SupportsAuthorizations() const override;
     virtual bool ServerHasCapabilities(const ServerEntry& entry) const;
+    virtual unsigned int GetRequiredCapabilityFlags() const;
+    virtual bool IsPreemptiveReconnectPending() const override;
 
     virtual bool Cleanup();
 
@@ -68,10 +74,17 @@ protected:
     virtual bool DoPeriodicCheck();
     
     void TransportConnectHelper();
+    void PreHandshakeCandidates();
+    bool TakePreHandshakedSession(const ServerEntry& serverEntry, SessionInfo& o_sessionInfo);
+    void AddPreHandshakedSession(const SessionInfo& sessionInfo);
+    bool IsPreemptiveReconnectDue();
     bool GetConnectionServerEntry(ServerEntry& o_serverEntry);
     size_t GetConnectionServerEntryCount();
     ConnectionState GetConnectionState() const;
-    void SetConnectionState(ConnectionState newState);
+    // If force is set, the transition table isn't checked. Only Establish does this.
+    void SetConnectionState(ConnectionState newState, bool force=false);
+    static bool IsValidStateTransition(ConnectionState from, ConnectionState to);
+    static const char* ConnectionStateName(ConnectionState state);
     HANDLE GetStateChangeEvent();
     void SetLastErrorCode(unsigned int lastErrorCode);
     unsigned int GetLastErrorCode() const;
@@ -89,10 +102,36 @@ protected:
                             DWORD);
 
 private:
+    // m_state and m_stateEnteredTickMS are guarded by m_stateMutex, as
+    // RasDialCallback runs on a RAS thread.
     ConnectionState m_state;
+    ULONGLONG m_stateEnteredTickMS;
+    HANDLE m_stateMutex;
     HANDLE m_stateChangeEvent;
     HRASCONN m_rasConnection;
+    // The number of RAS connections last enumerated, to size the next enumeration
+    DWORD m_rasEnumConnectionCount;
     unsigned int m_lastErrorCode;
     tstring m_pppIPAddress;
     ServerListReorder m_serverListReorder;
+
+    // Servers that have been pre-handshaked (and so have a PSK) but not yet
+    // dialed. Guarded by m_preHandshakeMutex, as the successor pre-handshake
+    // adds to it while connected.
+    struct PreHandshakedSession
+    {
+        SessionInfo sessionInfo;
+        ULONGLONG handshakeTickMS;
+    };
+    HANDLE m_preHandshakeMutex;
+    vector<PreHandshakedSession> m_preHandshakedSessions;
+
+    // Preemptive reconnect state for the current connection
+    ULONGLONG m_connectedTickMS;
+    future<void> m_successorPreHandshake;
+    bool m_preemptiveReconnectPending;
+    // The current connect attempt follows a preemptive hang-up
+    bool m_reconnectingPreemptively;
+    // The VPNPreemptiveReconnect setting, read once per connection
+    bool m_preemptiveReconnectEnabled;
 };
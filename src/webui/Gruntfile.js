@@ -192,9 +192,19 @@ module.exports = function(grunt) {
         for (var key in translation) {
           translation[key] = translation[key].message;
         }
+        // Each translation table is stored as a JSON string rather than an object
+        // literal. Scanning a string literal is much cheaper for the script engine
+        // than building the objects, so only the tables that are actually used
+        // (the active locale and the fallback) pay the parsing cost, at runtime.
+        // See I18n.getTranslation.
+        // '<%' is escaped because htmlmin keeps everything from a '<%' to the next
+        // '%>' verbatim, and a broken template in one translation (a missing '%>')
+        // would otherwise splice raw text across strings with different quoting.
+        var translationJSON = JSON.stringify(translation).replace(/<%/g, '\\u003c%');
+        grunt.log.debug('Translation size: ' + localeCode + ': ' + translationJSON.length);
         locales[localeCode] = {
           name: localeNames[localeCode],
-          translation: translation
+          translationJSON: translationJSON
         };
       });
 
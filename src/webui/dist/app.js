@@ -44,7 +44,14 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     var uriHash = location.hash;
 
     if (uriHash && uriHash.length > 1) {
-      g_initObj = JSON.parse(decodeURIComponent(uriHash.slice(1)));
+      // The application passes the JSON as-is (with '%' JSON-escaped), but fall
+      // back to decoding in case the fragment was percent-encoded along the way.
+      try {
+        g_initObj = JSON.parse(uriHash.slice(1));
+      } catch (e) {
+        g_initObj = JSON.parse(decodeURIComponent(uriHash.slice(1)));
+      }
+
       IS_BROWSER = false;
     } // For browser debugging
 
@@ -1438,50 +1445,222 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
   }
   /* LOGS **********************************************************************/
 
+  /*
+  The log itself is kept by the C code (LogStore), newest first. We're told when
+  it changes, and we query it for the rows that are scrolled into view (plus some
+  overscan), so only those are in the DOM. The rows are kept to a single line
+  each, so that a row's offset in the log gives its position in the pane.
+  */
+  // Rows rendered above and below those that are visible, so that modest
+  // scrolling doesn't show blank space while the next page is fetched.
+
+
+  var LOG_OVERSCAN_ROWS = 20; // Until a row has been rendered and measured
+
+  var LOG_DEFAULT_ROW_HEIGHT_PX = 29; // If a query gets no response in this time, it's assumed lost.
 
+  var LOG_QUERY_TIMEOUT_MS = 2000;
+  var g_logView = {
+    minPriority: 1,
+    rowHeight: 0,
+    total: 0,
+    lastSeq: 0,
+    page: {
+      offset: 0,
+      count: 0
+    },
+    queryID: 0,
+    queryTime: 0,
+    queryAgain: false
+  };
   $(function () {
     $('#show-debug-logs').click(showDebugLogsClicked); // Set the initial show-debug state
 
     var show = $('#show-debug-logs').prop('checked');
-    $('.log-messages').toggleClass('showing-priority-0', show).toggleClass('hiding-priority-0', !show);
+    setShowDebugLogs(show);
+    $('#logs-pane').on('scroll', function () {
+      if (!logViewCoversVisibleRows()) {
+        queryLogView();
+      }
+    });
+    $('a[href="#logs-pane"][data-toggle="tab"]').on('shown', queryLogView);
+    $('.js-main-height').on('resize', queryLogView);
+    $window.on(UI_READY_EVENT, queryLogView);
   });
 
   function showDebugLogsClicked() {
     /*jshint validthis:true */
-    var show = $(this).prop('checked'); // We use both a showing and a hiding class to try to deal with IE7's CSS insanity.
+    setShowDebugLogs($(this).prop('checked'));
+    $('#logs-pane').scrollTop(0);
+    queryLogView();
+  }
 
+  function setShowDebugLogs(show) {
+    // We use both a showing and a hiding class to try to deal with IE7's CSS insanity.
     $('.log-messages').toggleClass('showing-priority-0', show).toggleClass('hiding-priority-0', !show);
-  } // Expects obj to be of the form {priority: 0|1|2, message: string}
+    g_logView.minPriority = show ? 0 : 1;
+  } // Expects obj to be of the form {priority: 0|1|2, message: string}.
+  // The entry goes into the C code's log store, and we're told when it's there.
 
 
   function addLog(obj) {
-    $('.log-messages .placeholder').remove();
-    $('.log-messages').loadTemplate($("#log-template"), {
-      timestamp: new Date().toLocaleTimeString(),
-      message: obj.message,
-      priority: 'priority-' + obj.priority
-    }, {
-      prepend: true
-    }); // The "Show Debug Logs" checkbox is hidden until we actually get a debug
+    HtmlCtrlInterface_AddLogEntry({
+      priority: obj.priority,
+      message: obj.message
+    });
+  }
+
+  function logRowHeight() {
+    return g_logView.rowHeight || LOG_DEFAULT_ROW_HEIGHT_PX;
+  } // Returns the range of rows, by offset in the log, that are scrolled into view.
+
+
+  function visibleLogRows() {
+    var $pane = $('#logs-pane');
+    var viewportTop = $('.log-viewport')[0].offsetTop;
+    var rowHeight = logRowHeight();
+    var first = Math.floor(Math.max(0, $pane.scrollTop() - viewportTop) / rowHeight);
+    return {
+      first: first,
+      count: Math.ceil($pane.innerHeight() / rowHeight) + 1
+    };
+  }
+
+  function logViewCoversVisibleRows() {
+    var visible = visibleLogRows();
+    var page = g_logView.page;
+    var last = Math.min(visible.first + visible.count, g_logView.total);
+    return visible.first >= page.offset && last <= page.offset + page.count;
+  } // Query the log store for the visible rows. Only one query is in flight at a
+  // time; if the view changes meanwhile, it's queried again when the response arrives.
+
+
+  function queryLogView() {
+    if (g_logView.queryTime && Date.now() - g_logView.queryTime < LOG_QUERY_TIMEOUT_MS) {
+      g_logView.queryAgain = true;
+      return;
+    }
+
+    var visible = visibleLogRows();
+    var offset = Math.max(0, visible.first - LOG_OVERSCAN_ROWS);
+    g_logView.queryID += 1;
+    g_logView.queryTime = Date.now();
+    g_logView.queryAgain = false;
+    HtmlCtrlInterface_QueryLogs({
+      id: g_logView.queryID,
+      minPriority: g_logView.minPriority,
+      offset: offset,
+      count: visible.first - offset + visible.count + LOG_OVERSCAN_ROWS,
+      sinceSeq: g_logView.lastSeq
+    });
+  } // Render a page of the log, as returned by the C code's LogStore::Query.
+
+
+  function renderLogPage(page) {
+    var $pane = $('#logs-pane');
+    var $viewport = $('.log-viewport');
+    var $table = $('.log-messages');
+    var sameFilter = page.minPriority === g_logView.minPriority; // The "Show Debug Logs" checkbox is hidden until we actually get a debug
     // message.
 
-    if (obj.priority < 1) {
+    if (page.hasDebug) {
       $('#logs-pane .invisible').removeClass('invisible');
-    } // Record the priorities we've seen.
-    // We'll keep them in a (fake) Set.
+    }
 
+    if (!sameFilter) {
+      // The filter changed while the query was in flight
+      g_logView.queryAgain = true;
+      return;
+    } // If the user has scrolled down into the log, keep the rows they're looking
+    // at in place as newer ones are added above them. The page was fetched with
+    // the old offsets, so it has to be fetched again.
 
-    addLog.priorities = addLog.priorities || {};
-    addLog.priorities[obj.priority] = true; // Don't allow the log messages list to grow forever!
-    // We'll set a limit for each priority. (Arbitrarily. May need to revisit.)
 
-    var MAX_LOGS_PER_PRIORITY = 200;
+    var scrolledDown = $pane.scrollTop() > $viewport[0].offsetTop;
 
-    var priorities = _.keys(addLog.priorities);
+    if (scrolledDown && page.newer > 0 && g_logView.lastSeq > 0) {
+      g_logView.total = page.total;
+      g_logView.lastSeq = page.lastSeq;
+      $viewport.height(page.total * logRowHeight());
+      $pane.scrollTop($pane.scrollTop() + page.newer * logRowHeight());
+      g_logView.queryAgain = true;
+      return;
+    }
+
+    g_logView.total = page.total;
+    g_logView.lastSeq = page.lastSeq;
+    var tbody = document.createElement('tbody');
+
+    if (page.total === 0) {
+      $(tbody).append($('<tr class="placeholder">').append($('<td colspan="2" data-i18n="logs#placeholder">').text(i18n.t('logs#placeholder'))));
+    }
 
-    for (var i = 0; i < priorities.length; i++) {
-      $('.log-messages .priority-' + priorities[i]).slice(MAX_LOGS_PER_PRIORITY).remove();
+    for (var i = 0; i < page.entries.length; i++) {
+      var entry = page.entries[i];
+      $(tbody).append($('<tr>').addClass('priority-' + entry.priority).append($('<td class="timestamp">').text(new Date(entry.time).toLocaleTimeString()), $('<td class="message">').text(entry.message).attr('title', entry.message)));
     }
+
+    $table.empty().append(tbody);
+
+    if (!g_logView.rowHeight && page.entries.length > 0) {
+      g_logView.rowHeight = $table.find('tr').first().outerHeight() || LOG_DEFAULT_ROW_HEIGHT_PX;
+    }
+
+    g_logView.page = {
+      offset: page.offset,
+      count: page.entries.length
+    };
+    $table.css('top', page.offset * logRowHeight());
+    $viewport.height(Math.max(page.total, 1) * logRowHeight());
+
+    if (!logViewCoversVisibleRows()) {
+      // The view scrolled, or the row height was just measured
+      g_logView.queryAgain = true;
+    }
+  } // In browser mode there's no C code, so the log store is mimicked here.
+
+
+  var g_browserLogStore = {
+    entries: [],
+    lastSeq: 0
+  };
+
+  function browserLogStoreAdd(entry) {
+    g_browserLogStore.lastSeq += 1;
+    g_browserLogStore.entries.push({
+      seq: g_browserLogStore.lastSeq,
+      priority: entry.priority,
+      time: Date.now(),
+      message: entry.message
+    });
+    nextTick(function () {
+      HtmlCtrlInterface_LogsChanged({
+        lastSeq: g_browserLogStore.lastSeq
+      });
+    });
+  }
+
+  function browserLogStoreQuery(query) {
+    var matching = _.filter(g_browserLogStore.entries, function (entry) {
+      return entry.priority >= query.minPriority;
+    }).reverse();
+
+    nextTick(function () {
+      HtmlCtrlInterface_LogPage({
+        id: query.id,
+        minPriority: query.minPriority,
+        offset: query.offset,
+        total: matching.length,
+        newer: _.filter(matching, function (entry) {
+          return entry.seq > query.sinceSeq;
+        }).length,
+        lastSeq: g_browserLogStore.lastSeq,
+        hasDebug: _.some(g_browserLogStore.entries, function (entry) {
+          return entry.priority < 1;
+        }),
+        entries: matching.slice(query.offset, query.offset + query.count)
+      });
+    });
   } // Used for temporary debugging messages.
 
 
@@ -1593,7 +1772,7 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     //
     // Iterate through the English keys, since we know it will be complete.
 
-    var translation = window.PSIPHON.LOCALES.en.translation;
+    var translation = i18n.getTranslation('en');
     var appBackendStringTable = {};
 
     for (var key in translation) {
@@ -1606,7 +1785,7 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
       }
     }
 
-    HtmlCtrlInterface_AddStringTableItem(locale, appBackendStringTable);
+    HtmlCtrlInterface_SetStringTable(locale, appBackendStringTable);
   }
 
   function populateLocales() {
@@ -2046,11 +2225,41 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     }
   };
   PsiCashStore.set('uiState', PsiCashUIState.NSF_BALANCE);
+  /**
+   * Refresh data from the C code is versioned. The first we get is complete, and
+   * after that we only get the fields that changed since `base_version`, which
+   * we apply to our copy (g_PsiCashData).
+   * @param {!object} data Complete or delta refresh data
+   * @returns {?PsiCashRefreshData} The complete data, or null if the delta
+   *    couldn't be applied; a complete refresh will have been requested.
+   */
+
+  function resolvePsiCashRefreshData(data) {
+    if (!data.base_version) {
+      // Complete
+      return data;
+    }
+
+    if (!g_PsiCashData || g_PsiCashData.version !== data.base_version) {
+      HtmlCtrlInterface_Log('PsiCash: refresh data base version mismatch; requesting full refresh');
+      var command = new PsiCashCommandRefresh('version-mismatch');
+      command.full = true;
+      HtmlCtrlInterface_PsiCashCommand(command);
+      return null;
+    } // reconnect_required applies only to the message it came in
+
+
+    var resolved = _.extend(_.omit(g_PsiCashData, 'reconnect_required'), data);
+
+    delete resolved.base_version;
+    return resolved;
+  }
   /**
    * Called from refreshPsiCash and on an interval to update the PsiCash UI.
    * @param {?PsiCashRefreshData} psicashData Will be undefined when called on a timer.
    */
 
+
   function psiCashUIUpdater(psicashData) {
     // This must be set by any code below that queues up another call to this function via
     // setTimeout. This is to prevent building up a flood of redundant calls.
@@ -2062,6 +2271,18 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
 
     var oldPsiCashData = g_PsiCashData;
 
+    if (psicashData) {
+      var resolvedPsiCashData = resolvePsiCashRefreshData(psicashData);
+
+      if (!resolvedPsiCashData && psicashData.reconnect_required) {
+        // The state will be refreshed, but this won't be repeated
+        HtmlCtrlInterface_Log('PsiCash::RefreshState indicates reconnect required');
+        HtmlCtrlInterface_ReconnectTunnel(true);
+      }
+
+      psicashData = resolvedPsiCashData;
+    }
+
     if (psicashData) {
       if (g_PsiCashData) {
         // For later diagnostics, log if psicashData values changed
@@ -3075,13 +3296,41 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
       }, 1000);
     });
   }
+  /**
+   * Called periodically with the backend's throughput meter summary while
+   * traffic is flowing. Rates are in bytes per second.
+   */
+
+
+  function updateThroughputMeter(meter) {
+    var formatRate = function formatRate(bytesPerSecond) {
+      if (bytesPerSecond >= 1024 * 1024) {
+        return (bytesPerSecond / (1024 * 1024)).toFixed(1) + ' MB';
+      }
+
+      return (bytesPerSecond / 1024).toFixed(1) + ' KB';
+    };
+
+    var throughputTemplate = i18n.t('connection#throughput-template');
+    $('.js-throughput-meter').text(_.template(throughputTemplate)({
+      down: formatRate(meter.current.received),
+      up: formatRate(meter.current.sent),
+      peak: formatRate(meter.peak.received)
+    })).removeClass('hidden');
+  }
+
+  $window.on(CONNECTED_STATE_CHANGE_EVENT, function () {
+    if (g_lastState !== 'connected') {
+      // The meter is reset by the backend for each connection
+      $('.js-throughput-meter').addClass('hidden').text('');
+    }
+  });
   /**
    * Called when tunnel core indicates that there was an attempt to access a
    * port disallowed by the current traffic rules. We will show an alert to
    * encourage the user to buy Speed Boost.
    */
 
-
   function handleDisallowedTrafficNotice() {
     // RETIRE PSICASH
     // Without PsiCash, there is no way to mitigate disallowed traffic.
@@ -3682,7 +3931,7 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     }); // Wire up AddLog
 
     $('#debug-log a').click(function () {
-      HtmlCtrlInterface_AddLog({
+      addLog({
         message: $('#debug-log input').val(),
         priority: parseInt($('#debug-log select').val())
       });
@@ -4106,14 +4355,37 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     }
   }
   /* Calls from C code to JS code. */
-  // Add new status message.
+  // The log store has changed; its newest entry is `lastSeq`.
 
 
-  function HtmlCtrlInterface_AddLog(jsonArgs) {
+  function HtmlCtrlInterface_LogsChanged(jsonArgs) {
     nextTick(function () {
       // Allow object as input to assist with debugging
       var args = _.isObject(jsonArgs) ? jsonArgs : JSON.parse(jsonArgs);
-      addLog(args);
+
+      if (args.lastSeq !== g_logView.lastSeq) {
+        queryLogView();
+      }
+    });
+  } // A page of the log, in response to HtmlCtrlInterface_QueryLogs.
+
+
+  function HtmlCtrlInterface_LogPage(jsonArgs) {
+    nextTick(function () {
+      // Allow object as input to assist with debugging
+      var page = _.isObject(jsonArgs) ? jsonArgs : JSON.parse(jsonArgs);
+
+      if (page.id !== g_logView.queryID) {
+        // A response to a query that was given up on
+        return;
+      }
+
+      g_logView.queryTime = 0;
+      renderLogPage(page);
+
+      if (g_logView.queryAgain) {
+        queryLogView();
+      }
     });
   } // Add new notice. This may be interpreted and acted upon.
 
@@ -4155,6 +4427,8 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
             data: args.data
           })
         });
+      } else if (args.noticeType === 'PsiphonUI::ThroughputMeter') {
+        updateThroughputMeter(args.data);
       } else if (args.noticeType === 'PsiphonUI::URLCopiedToClipboard') {
         displayCornerAlert($('#alert-url-copied-to-clipboard'));
       } else if (args.noticeType === 'PsiphonUI::FileError') {
@@ -4305,30 +4579,51 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
       commandAppOperation('ready');
       $window.trigger(UI_READY_EVENT);
     });
-  } // Give the C code a string table entry in the appropriate language.
+  } // Give the C code the string table in the appropriate language.
   // `locale` is the locale for this string table.
-  // The `stringtable` can and should be a full set of key:string mappings, but
-  // the strings will be sent to the C code one at a time, to prevent URL size
-  // overflow.
+  // The `stringtable` should be a full set of key:string mappings. To prevent
+  // URL size overflow, it's sent in as few batches as fit within
+  // STRING_TABLE_BATCH_MAX_BYTES (of UTF-8, before base64 encoding; a single
+  // longer string gets a batch to itself, as before). The C code only switches
+  // to the new table once it has all of them.
+
 
+  var STRING_TABLE_BATCH_MAX_BYTES = 1024;
+
+  function HtmlCtrlInterface_SetStringTable(locale, stringtable) {
+    var batches = [{}];
+    var batchBytes = 0;
 
-  function HtmlCtrlInterface_AddStringTableItem(locale, stringtable) {
     for (var key in stringtable) {
       if (!stringtable.hasOwnProperty(key)) {
         continue;
+      } // Rough (it ignores JSON quoting), but only needs to keep the URL short of the limit
+
+
+      var entryBytes = unescape(encodeURIComponent(key + stringtable[key])).length;
+
+      if (batchBytes > 0 && batchBytes + entryBytes > STRING_TABLE_BATCH_MAX_BYTES) {
+        batches.push({});
+        batchBytes = 0;
       }
 
-      var item = {
+      batches[batches.length - 1][key] = stringtable[key];
+      batchBytes += entryBytes;
+    } // These are sent in order, as the timeouts for each fire in order
+
+
+    for (var i = 0; i < batches.length; i++) {
+      sendStringTableBatch({
         locale: locale,
-        key: key,
-        string: stringtable[key]
-      };
-      sendStringTableItem(item);
+        batch: i,
+        batches: batches.length,
+        strings: batches[i]
+      });
     }
 
-    function sendStringTableItem(itemObj) {
+    function sendStringTableBatch(batchObj) {
       nextTick(function () {
-        commandAppOperation('stringtable', itemObj);
+        commandAppOperation('stringtable', batchObj);
       });
     }
   }
@@ -4342,6 +4637,38 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
     nextTick(function () {
       commandAppOperation('log', msg);
     });
+  }
+  /**
+   * Add an entry to the log store. These are displayed but not, unlike
+   * HtmlCtrlInterface_Log, added to diagnostic info.
+   * @param {{priority: number, message: string}} entry
+   */
+
+
+  function HtmlCtrlInterface_AddLogEntry(entry) {
+    nextTick(function () {
+      if (IS_BROWSER) {
+        browserLogStoreAdd(entry);
+      } else {
+        commandAppOperation('addlog', entry);
+      }
+    });
+  }
+  /**
+   * Query the log store for a page of entries. The response comes via
+   * HtmlCtrlInterface_LogPage.
+   * @param {{id: number, minPriority: number, offset: number, count: number, sinceSeq: number}} query
+   */
+
+
+  function HtmlCtrlInterface_QueryLogs(query) {
+    nextTick(function () {
+      if (IS_BROWSER) {
+        browserLogStoreQuery(query);
+      } else {
+        commandAppOperation('logquery', query);
+      }
+    });
   } // Connection should start.
 
 
@@ -4476,8 +4803,9 @@ function _defineProperty(obj, key, value) { if (key in obj) { Object.definePrope
   // so we'll need to directly expose our exports.
 
 
-  window.HtmlCtrlInterface_AddLog = HtmlCtrlInterface_AddLog; // @ts-ignore
+  window.HtmlCtrlInterface_LogsChanged = HtmlCtrlInterface_LogsChanged; // @ts-ignore
 
+  window.HtmlCtrlInterface_LogPage = HtmlCtrlInterface_LogPage;
   window.HtmlCtrlInterface_SetState = HtmlCtrlInterface_SetState;
   window.HtmlCtrlInterface_AddNotice = HtmlCtrlInterface_AddNotice;
   window.HtmlCtrlInterface_RefreshSettings = HtmlCtrlInterface_RefreshSettings;
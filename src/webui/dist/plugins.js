@@ -598,7 +598,9 @@ function I18n() {
   /**
    * Initializes this object.
    * @param {Object} translations The set of translations available to us.
-   *    Must be of the form `{en: {translation:{key1:"string1",key2:"string2",...}}, ...}
+   *    Must be of the form `{en: {translation:{key1:"string1",key2:"string2",...}}, ...}`,
+   *    or have the translation as yet-unparsed JSON: `{en: {translationJSON:"{...}"}, ...}`.
+   *    The latter is parsed only when the locale is first used.
    * @param {string} fallbackLocale The locale to use if a string key is missing from a translation,
    *    or if `setLocale` is passed a locale that it can't find a match for.
    */
@@ -613,6 +615,24 @@ function I18n() {
     this.fallbackLocale = fallbackLocale;
     this.currentLocale = this.fallbackLocale;
   };
+  /**
+   * Returns the translation table (key to string) for `locale`, which must exactly
+   * match a locale in the translations. The table is parsed on first use.
+   * @param {string} locale
+   * @returns {Object}
+   */
+
+
+  this.getTranslation = function (locale) {
+    var entry = this.translations[locale];
+
+    if (!entry.translation) {
+      entry.translation = JSON.parse(entry.translationJSON);
+      delete entry.translationJSON;
+    }
+
+    return entry.translation;
+  };
   /**
    * Sets the current locale of this object to a best match of `locale`. If UI l10n
    * update is also desired, `localizeUI` should be called after this.
@@ -676,7 +696,7 @@ function I18n() {
 
 
   this.t = function (key) {
-    var translation = this.translations[this.currentLocale].translation[key] || this.translations[this.fallbackLocale].translation[key];
+    var translation = this.getTranslation(this.currentLocale)[key] || this.getTranslation(this.fallbackLocale)[key];
 
     if (!translation) {
       throw new Error("failed to find translation for key '".concat(key, "' and locale '").concat(this.currentLocale, "'"));
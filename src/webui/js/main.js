@@ -42,7 +42,14 @@
   (function() {
     var uriHash = location.hash;
     if (uriHash && uriHash.length > 1) {
-      g_initObj = JSON.parse(decodeURIComponent(uriHash.slice(1)));
+      // The application passes the JSON as-is (with '%' JSON-escaped), but fall
+      // back to decoding in case the fragment was percent-encoded along the way.
+      try {
+        g_initObj = JSON.parse(uriHash.slice(1));
+      }
+      catch (e) {
+        g_initObj = JSON.parse(decodeURIComponent(uriHash.slice(1)));
+      }
       IS_BROWSER = false;
     }
 
@@ -1617,60 +1624,213 @@
 
   /* LOGS **********************************************************************/
 
+  /*
+  The log itself is kept by the C code (LogStore), newest first. We're told when
+  it changes, and we query it for the rows that are scrolled into view (plus some
+  overscan), so only those are in the DOM. The rows are kept to a single line
+  each, so that a row's offset in the log gives its position in the pane.
+  */
+
+  // Rows rendered above and below those that are visible, so that modest
+  // scrolling doesn't show blank space while the next page is fetched.
+  const LOG_OVERSCAN_ROWS = 20;
+  // Until a row has been rendered and measured
+  const LOG_DEFAULT_ROW_HEIGHT_PX = 29;
+  // If a query gets no response in this time, it's assumed lost.
+  const LOG_QUERY_TIMEOUT_MS = 2000;
+
+  const g_logView = {
+    minPriority: 1,     // 0 when showing debug logs
+    rowHeight: 0,       // measured from a rendered row
+    total: 0,           // entries matching minPriority
+    lastSeq: 0,         // the newest entry the view has been updated with
+    page: {offset: 0, count: 0},  // the rows currently rendered
+    queryID: 0,
+    queryTime: 0,       // when the in-flight query was sent; 0 if none
+    queryAgain: false   // the view changed while a query was in flight
+  };
+
   $(function() {
     $('#show-debug-logs').click(showDebugLogsClicked);
 
     // Set the initial show-debug state
     var show = $('#show-debug-logs').prop('checked');
-    $('.log-messages')
-      .toggleClass('showing-priority-0', show)
-      .toggleClass('hiding-priority-0', !show);
+    setShowDebugLogs(show);
+
+    $('#logs-pane').on('scroll', function() {
+      if (!logViewCoversVisibleRows()) {
+        queryLogView();
+      }
+    });
+    $('a[href="#logs-pane"][data-toggle="tab"]').on('shown', queryLogView);
+    $('.js-main-height').on('resize', queryLogView);
+    $window.on(UI_READY_EVENT, queryLogView);
   });
 
   function showDebugLogsClicked() {
     /*jshint validthis:true */
-    var show = $(this).prop('checked');
+    setShowDebugLogs($(this).prop('checked'));
+    $('#logs-pane').scrollTop(0);
+    queryLogView();
+  }
+
+  function setShowDebugLogs(show) {
     // We use both a showing and a hiding class to try to deal with IE7's CSS insanity.
     $('.log-messages')
       .toggleClass('showing-priority-0', show)
       .toggleClass('hiding-priority-0', !show);
+    g_logView.minPriority = show ? 0 : 1;
   }
 
-  // Expects obj to be of the form {priority: 0|1|2, message: string}
+  // Expects obj to be of the form {priority: 0|1|2, message: string}.
+  // The entry goes into the C code's log store, and we're told when it's there.
   function addLog(obj) {
-    $('.log-messages .placeholder').remove();
+    HtmlCtrlInterface_AddLogEntry({priority: obj.priority, message: obj.message});
+  }
 
-    $('.log-messages').loadTemplate(
-      $("#log-template"),
-      {
-        timestamp: new Date().toLocaleTimeString(),
-        message: obj.message,
-        priority: 'priority-' + obj.priority
-      },
-      {
-        prepend:true
-      });
+  function logRowHeight() {
+    return g_logView.rowHeight || LOG_DEFAULT_ROW_HEIGHT_PX;
+  }
+
+  // Returns the range of rows, by offset in the log, that are scrolled into view.
+  function visibleLogRows() {
+    const $pane = $('#logs-pane');
+    const viewportTop = $('.log-viewport')[0].offsetTop;
+    const rowHeight = logRowHeight();
+    const first = Math.floor(Math.max(0, $pane.scrollTop() - viewportTop) / rowHeight);
+    return {
+      first: first,
+      count: Math.ceil($pane.innerHeight() / rowHeight) + 1
+    };
+  }
+
+  function logViewCoversVisibleRows() {
+    const visible = visibleLogRows();
+    const page = g_logView.page;
+    const last = Math.min(visible.first + visible.count, g_logView.total);
+    return visible.first >= page.offset && last <= page.offset + page.count;
+  }
+
+  // Query the log store for the visible rows. Only one query is in flight at a
+  // time; if the view changes meanwhile, it's queried again when the response arrives.
+  function queryLogView() {
+    if (g_logView.queryTime && Date.now() - g_logView.queryTime < LOG_QUERY_TIMEOUT_MS) {
+      g_logView.queryAgain = true;
+      return;
+    }
+
+    const visible = visibleLogRows();
+    const offset = Math.max(0, visible.first - LOG_OVERSCAN_ROWS);
+
+    g_logView.queryID += 1;
+    g_logView.queryTime = Date.now();
+    g_logView.queryAgain = false;
+
+    HtmlCtrlInterface_QueryLogs({
+      id: g_logView.queryID,
+      minPriority: g_logView.minPriority,
+      offset: offset,
+      count: visible.first - offset + visible.count + LOG_OVERSCAN_ROWS,
+      sinceSeq: g_logView.lastSeq
+    });
+  }
+
+  // Render a page of the log, as returned by the C code's LogStore::Query.
+  function renderLogPage(page) {
+    const $pane = $('#logs-pane');
+    const $viewport = $('.log-viewport');
+    const $table = $('.log-messages');
+    const sameFilter = (page.minPriority === g_logView.minPriority);
 
     // The "Show Debug Logs" checkbox is hidden until we actually get a debug
     // message.
-    if (obj.priority < 1) {
+    if (page.hasDebug) {
       $('#logs-pane .invisible').removeClass('invisible');
     }
 
-    // Record the priorities we've seen.
-    // We'll keep them in a (fake) Set.
-    addLog.priorities = addLog.priorities || {};
-    addLog.priorities[obj.priority] = true;
+    if (!sameFilter) {
+      // The filter changed while the query was in flight
+      g_logView.queryAgain = true;
+      return;
+    }
+
+    // If the user has scrolled down into the log, keep the rows they're looking
+    // at in place as newer ones are added above them. The page was fetched with
+    // the old offsets, so it has to be fetched again.
+    const scrolledDown = $pane.scrollTop() > $viewport[0].offsetTop;
+    if (scrolledDown && page.newer > 0 && g_logView.lastSeq > 0) {
+      g_logView.total = page.total;
+      g_logView.lastSeq = page.lastSeq;
+      $viewport.height(page.total * logRowHeight());
+      $pane.scrollTop($pane.scrollTop() + page.newer * logRowHeight());
+      g_logView.queryAgain = true;
+      return;
+    }
+
+    g_logView.total = page.total;
+    g_logView.lastSeq = page.lastSeq;
+
+    const tbody = document.createElement('tbody');
+    if (page.total === 0) {
+      $(tbody).append($('<tr class="placeholder">').append(
+        $('<td colspan="2" data-i18n="logs#placeholder">').text(i18n.t('logs#placeholder'))));
+    }
+    for (let i = 0; i < page.entries.length; i++) {
+      const entry = page.entries[i];
+      $(tbody).append($('<tr>').addClass('priority-' + entry.priority).append(
+        $('<td class="timestamp">').text(new Date(entry.time).toLocaleTimeString()),
+        $('<td class="message">').text(entry.message).attr('title', entry.message)));
+    }
+    $table.empty().append(tbody);
+
+    if (!g_logView.rowHeight && page.entries.length > 0) {
+      g_logView.rowHeight = $table.find('tr').first().outerHeight() || LOG_DEFAULT_ROW_HEIGHT_PX;
+    }
+
+    g_logView.page = {offset: page.offset, count: page.entries.length};
+    $table.css('top', page.offset * logRowHeight());
+    $viewport.height(Math.max(page.total, 1) * logRowHeight());
 
-    // Don't allow the log messages list to grow forever!
-    // We'll set a limit for each priority. (Arbitrarily. May need to revisit.)
-    var MAX_LOGS_PER_PRIORITY = 200;
-    var priorities = _.keys(addLog.priorities);
-    for (var i = 0; i < priorities.length; i++) {
-      $('.log-messages .priority-'+priorities[i]).slice(MAX_LOGS_PER_PRIORITY).remove();
+    if (!logViewCoversVisibleRows()) {
+      // The view scrolled, or the row height was just measured
+      g_logView.queryAgain = true;
     }
   }
 
+  // In browser mode there's no C code, so the log store is mimicked here.
+  const g_browserLogStore = {entries: [], lastSeq: 0};
+
+  function browserLogStoreAdd(entry) {
+    g_browserLogStore.lastSeq += 1;
+    g_browserLogStore.entries.push({
+      seq: g_browserLogStore.lastSeq,
+      priority: entry.priority,
+      time: Date.now(),
+      message: entry.message
+    });
+    nextTick(function() {
+      HtmlCtrlInterface_LogsChanged({lastSeq: g_browserLogStore.lastSeq});
+    });
+  }
+
+  function browserLogStoreQuery(query) {
+    const matching = _.filter(g_browserLogStore.entries, function(entry) {
+      return entry.priority >= query.minPriority;
+    }).reverse();
+    nextTick(function() {
+      HtmlCtrlInterface_LogPage({
+        id: query.id,
+        minPriority: query.minPriority,
+        offset: query.offset,
+        total: matching.length,
+        newer: _.filter(matching, function(entry) { return entry.seq > query.sinceSeq; }).length,
+        lastSeq: g_browserLogStore.lastSeq,
+        hasDebug: _.some(g_browserLogStore.entries, function(entry) { return entry.priority < 1; }),
+        entries: matching.slice(query.offset, query.offset + query.count)
+      });
+    });
+  }
+
   // Used for temporary debugging messages.
   function DEBUG_LOG() {
     debugLogHelper(window.console.log, Array.prototype.slice.call(arguments));
@@ -1794,7 +1954,7 @@
     //
 
     // Iterate through the English keys, since we know it will be complete.
-    var translation = window.PSIPHON.LOCALES.en.translation;
+    var translation = i18n.getTranslation('en');
     var appBackendStringTable = {};
     for (var key in translation) {
       if (!translation.hasOwnProperty(key)) {
@@ -1806,7 +1966,7 @@
       }
     }
 
-    HtmlCtrlInterface_AddStringTableItem(locale, appBackendStringTable);
+    HtmlCtrlInterface_SetStringTable(locale, appBackendStringTable);
   }
 
   function populateLocales() {
@@ -2245,6 +2405,34 @@
   };
   PsiCashStore.set('uiState', PsiCashUIState.NSF_BALANCE);
 
+  /**
+   * Refresh data from the C code is versioned. The first we get is complete, and
+   * after that we only get the fields that changed since `base_version`, which
+   * we apply to our copy (g_PsiCashData).
+   * @param {!object} data Complete or delta refresh data
+   * @returns {?PsiCashRefreshData} The complete data, or null if the delta
+   *    couldn't be applied; a complete refresh will have been requested.
+   */
+  function resolvePsiCashRefreshData(data) {
+    if (!data.base_version) {
+      // Complete
+      return data;
+    }
+
+    if (!g_PsiCashData || g_PsiCashData.version !== data.base_version) {
+      HtmlCtrlInterface_Log('PsiCash: refresh data base version mismatch; requesting full refresh');
+      const command = new PsiCashCommandRefresh('version-mismatch');
+      command.full = true;
+      HtmlCtrlInterface_PsiCashCommand(command);
+      return null;
+    }
+
+    // reconnect_required applies only to the message it came in
+    const resolved = _.extend(_.omit(g_PsiCashData, 'reconnect_required'), data);
+    delete resolved.base_version;
+    return resolved;
+  }
+
   /**
    * Called from refreshPsiCash and on an interval to update the PsiCash UI.
    * @param {?PsiCashRefreshData} psicashData Will be undefined when called on a timer.
@@ -2260,6 +2448,16 @@
     // reference the previous state. Note that this may be null.
     const oldPsiCashData = g_PsiCashData;
 
+    if (psicashData) {
+      const resolvedPsiCashData = resolvePsiCashRefreshData(psicashData);
+      if (!resolvedPsiCashData && psicashData.reconnect_required) {
+        // The state will be refreshed, but this won't be repeated
+        HtmlCtrlInterface_Log('PsiCash::RefreshState indicates reconnect required');
+        HtmlCtrlInterface_ReconnectTunnel(/*suppressHomePage=*/true);
+      }
+      psicashData = resolvedPsiCashData;
+    }
+
     if (psicashData) {
       if (g_PsiCashData) {
         // For later diagnostics, log if psicashData values changed
@@ -3388,6 +3586,34 @@
     });
   }
 
+  /**
+   * Called periodically with the backend's throughput meter summary while
+   * traffic is flowing. Rates are in bytes per second.
+   */
+  function updateThroughputMeter(meter) {
+    const formatRate = (bytesPerSecond) => {
+      if (bytesPerSecond >= 1024 * 1024) {
+        return (bytesPerSecond / (1024 * 1024)).toFixed(1) + ' MB';
+      }
+      return (bytesPerSecond / 1024).toFixed(1) + ' KB';
+    };
+
+    const throughputTemplate = i18n.t('connection#throughput-template');
+    $('.js-throughput-meter')
+      .text(_.template(throughputTemplate)({
+        down: formatRate(meter.current.received),
+        up: formatRate(meter.current.sent),
+        peak: formatRate(meter.peak.received)
+      }))
+      .removeClass('hidden');
+  }
+  $window.on(CONNECTED_STATE_CHANGE_EVENT, () => {
+    if (g_lastState !== 'connected') {
+      // The meter is reset by the backend for each connection
+      $('.js-throughput-meter').addClass('hidden').text('');
+    }
+  });
+
   /**
    * Called when tunnel core indicates that there was an attempt to access a
    * port disallowed by the current traffic rules. We will show an alert to
@@ -4011,7 +4237,7 @@
 
     // Wire up AddLog
     $('#debug-log a').click(function() {
-      HtmlCtrlInterface_AddLog({
+      addLog({
         message: $('#debug-log input').val(),
         priority: parseInt($('#debug-log select').val())
       });
@@ -4434,12 +4660,33 @@
 
   /* Calls from C code to JS code. */
 
-  // Add new status message.
-  function HtmlCtrlInterface_AddLog(jsonArgs) {
+  // The log store has changed; its newest entry is `lastSeq`.
+  function HtmlCtrlInterface_LogsChanged(jsonArgs) {
     nextTick(function() {
       // Allow object as input to assist with debugging
       const args = _.isObject(jsonArgs) ? jsonArgs : JSON.parse(jsonArgs);
-      addLog(args);
+      if (args.lastSeq !== g_logView.lastSeq) {
+        queryLogView();
+      }
+    });
+  }
+
+  // A page of the log, in response to HtmlCtrlInterface_QueryLogs.
+  function HtmlCtrlInterface_LogPage(jsonArgs) {
+    nextTick(function() {
+      // Allow object as input to assist with debugging
+      const page = _.isObject(jsonArgs) ? jsonArgs : JSON.parse(jsonArgs);
+      if (page.id !== g_logView.queryID) {
+        // A response to a query that was given up on
+        return;
+      }
+
+      g_logView.queryTime = 0;
+      renderLogPage(page);
+
+      if (g_logView.queryAgain) {
+        queryLogView();
+      }
     });
   }
 
@@ -4489,6 +4736,9 @@
           message: _.template(setProxyWarningTemplate)({data: args.data})
         });
       }
+      else if (args.noticeType === 'PsiphonUI::ThroughputMeter') {
+        updateThroughputMeter(args.data);
+      }
       else if (args.noticeType === 'PsiphonUI::URLCopiedToClipboard') {
         displayCornerAlert($('#alert-url-copied-to-clipboard'));
       }
@@ -4656,28 +4906,45 @@
     });
   }
 
-  // Give the C code a string table entry in the appropriate language.
+  // Give the C code the string table in the appropriate language.
   // `locale` is the locale for this string table.
-  // The `stringtable` can and should be a full set of key:string mappings, but
-  // the strings will be sent to the C code one at a time, to prevent URL size
-  // overflow.
-  function HtmlCtrlInterface_AddStringTableItem(locale, stringtable) {
+  // The `stringtable` should be a full set of key:string mappings. To prevent
+  // URL size overflow, it's sent in as few batches as fit within
+  // STRING_TABLE_BATCH_MAX_BYTES (of UTF-8, before base64 encoding; a single
+  // longer string gets a batch to itself, as before). The C code only switches
+  // to the new table once it has all of them.
+  const STRING_TABLE_BATCH_MAX_BYTES = 1024;
+  function HtmlCtrlInterface_SetStringTable(locale, stringtable) {
+    var batches = [{}];
+    var batchBytes = 0;
     for (var key in stringtable) {
       if (!stringtable.hasOwnProperty(key)) {
         continue;
       }
 
-      var item = {
+      // Rough (it ignores JSON quoting), but only needs to keep the URL short of the limit
+      var entryBytes = unescape(encodeURIComponent(key + stringtable[key])).length;
+      if (batchBytes > 0 && batchBytes + entryBytes > STRING_TABLE_BATCH_MAX_BYTES) {
+        batches.push({});
+        batchBytes = 0;
+      }
+      batches[batches.length - 1][key] = stringtable[key];
+      batchBytes += entryBytes;
+    }
+
+    // These are sent in order, as the timeouts for each fire in order
+    for (var i = 0; i < batches.length; i++) {
+      sendStringTableBatch({
         locale: locale,
-        key: key,
-        string: stringtable[key]
-      };
-      sendStringTableItem(item);
+        batch: i,
+        batches: batches.length,
+        strings: batches[i]
+      });
     }
 
-    function sendStringTableItem(itemObj) {
+    function sendStringTableBatch(batchObj) {
       nextTick(function() {
-        commandAppOperation('stringtable', itemObj);
+        commandAppOperation('stringtable', batchObj);
       });
     }
   }
@@ -4692,6 +4959,38 @@
     });
   }
 
+  /**
+   * Add an entry to the log store. These are displayed but not, unlike
+   * HtmlCtrlInterface_Log, added to diagnostic info.
+   * @param {{priority: number, message: string}} entry
+   */
+  function HtmlCtrlInterface_AddLogEntry(entry) {
+    nextTick(function() {
+      if (IS_BROWSER) {
+        browserLogStoreAdd(entry);
+      }
+      else {
+        commandAppOperation('addlog', entry);
+      }
+    });
+  }
+
+  /**
+   * Query the log store for a page of entries. The response comes via
+   * HtmlCtrlInterface_LogPage.
+   * @param {{id: number, minPriority: number, offset: number, count: number, sinceSeq: number}} query
+   */
+  function HtmlCtrlInterface_QueryLogs(query) {
+    nextTick(function() {
+      if (IS_BROWSER) {
+        browserLogStoreQuery(query);
+      }
+      else {
+        commandAppOperation('logquery', query);
+      }
+    });
+  }
+
   // Connection should start.
   function HtmlCtrlInterface_StartTunnel() {
     // Prevent duplicate state change attempts
@@ -4821,7 +5120,8 @@
   // The C interface code is unable to access functions that are members of objects,
   // so we'll need to directly expose our exports.
 
-  window.HtmlCtrlInterface_AddLog = HtmlCtrlInterface_AddLog; // @ts-ignore
+  window.HtmlCtrlInterface_LogsChanged = HtmlCtrlInterface_LogsChanged; // @ts-ignore
+  window.HtmlCtrlInterface_LogPage = HtmlCtrlInterface_LogPage;
   window.HtmlCtrlInterface_SetState = HtmlCtrlInterface_SetState;
   window.HtmlCtrlInterface_AddNotice = HtmlCtrlInterface_AddNotice;
   window.HtmlCtrlInterface_RefreshSettings = HtmlCtrlInterface_RefreshSettings;